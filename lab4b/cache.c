@@ -0,0 +1,314 @@
+/* On-disk cache of the outputs of kplc */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "reader.h"
+#include "executable.h"
+#include "cache.h"
+
+// The running compiler, hashed so that a rebuilt kplc never reuses the outputs of another
+#define COMPILER_FILE "/proc/self/exe"
+
+#define STATS_FILE "stats"
+#define LOCK_FILE "lock"
+#define TEMP_PREFIX "tmp."
+#define ENTRY_SUFFIX ".kx"
+#define COPY_BUFFER_SIZE 65536
+
+struct CacheEntry_ {
+  char name[CACHE_KEY_LEN + 8];
+  long size;
+  struct timespec lastUse;
+};
+
+typedef struct CacheEntry_ CacheEntry;
+
+static char* cacheDirectory = NULL;
+static long cacheMaxSize = DEFAULT_CACHE_SIZE;
+static unsigned long long compilerHash;
+
+static void makePath(char* buffer, int size, char* name) {
+  snprintf(buffer, size, "%s/%s", cacheDirectory, name);
+}
+
+static void makeEntryPath(char* buffer, int size, char* key) {
+  snprintf(buffer, size, "%s/%s%s", cacheDirectory, key, ENTRY_SUFFIX);
+}
+
+/* Every process that updates the statistics or evicts entries holds
+ * the lock file; readers and writers of entries never block.
+ */
+static int lockCache(void) {
+  char path[FILENAME_MAX];
+  int fd;
+
+  makePath(path, sizeof(path), LOCK_FILE);
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return -1;
+  if (flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void unlockCache(int fd) {
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+static void loadStats(CacheStats* stats) {
+  char path[FILENAME_MAX];
+  FILE* f;
+
+  stats->hits = stats->misses = stats->evictions = 0;
+  makePath(path, sizeof(path), STATS_FILE);
+  f = fopen(path, "r");
+  if (f == NULL) return;
+  if (fscanf(f, "%ld %ld %ld", &(stats->hits), &(stats->misses), &(stats->evictions)) != 3)
+    stats->hits = stats->misses = stats->evictions = 0;
+  fclose(f);
+}
+
+static void updateStats(int hits, int misses, int evictions) {
+  char path[FILENAME_MAX];
+  CacheStats stats;
+  FILE* f;
+  int lock;
+
+  lock = lockCache();
+  if (lock < 0) return;
+  loadStats(&stats);
+  stats.hits += hits;
+  stats.misses += misses;
+  stats.evictions += evictions;
+  makePath(path, sizeof(path), STATS_FILE);
+  f = fopen(path, "w");
+  if (f != NULL) {
+    fprintf(f, "%ld %ld %ld\n", stats.hits, stats.misses, stats.evictions);
+    fclose(f);
+  }
+  unlockCache(lock);
+}
+
+static int copyFile(int from, int to) {
+  char buffer[COPY_BUFFER_SIZE];
+  ssize_t n, written, w;
+
+  while ((n = read(from, buffer, sizeof(buffer))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    for (written = 0; written < n; written += w) {
+      w = write(to, buffer + written, n - written);
+      if (w < 0) {
+	if (errno == EINTR) w = 0;
+	else return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Copies a file to a temporary name in the directory of destination and
+ * renames it into place, so that nobody ever sees a partial file.
+ */
+static int publishFile(char* source, char* destination, char* directory) {
+  char temp[FILENAME_MAX];
+  int from, to;
+  int ok;
+
+  snprintf(temp, sizeof(temp), "%s/" TEMP_PREFIX "XXXXXX", directory);
+  from = open(source, O_RDONLY);
+  if (from < 0) return 0;
+  to = mkstemp(temp);
+  if (to < 0) {
+    close(from);
+    return 0;
+  }
+  ok = copyFile(from, to);
+  close(from);
+  fchmod(to, 0644);
+  if (close(to) != 0) ok = 0;
+  if (ok && (rename(temp, destination) == 0)) return 1;
+  unlink(temp);
+  return 0;
+}
+
+static int compareLastUse(const void* a, const void* b) {
+  const CacheEntry* x = (const CacheEntry*) a;
+  const CacheEntry* y = (const CacheEntry*) b;
+
+  if (x->lastUse.tv_sec != y->lastUse.tv_sec)
+    return (x->lastUse.tv_sec < y->lastUse.tv_sec) ? -1 : 1;
+  if (x->lastUse.tv_nsec != y->lastUse.tv_nsec)
+    return (x->lastUse.tv_nsec < y->lastUse.tv_nsec) ? -1 : 1;
+  return 0;
+}
+
+/* Removes the least recently used entries until the cache fits in its
+ * budget. A hit refreshes the modification time of its entry.
+ */
+static int evict(void) {
+  char path[FILENAME_MAX];
+  CacheEntry* entries = NULL;
+  int entryCount = 0, maxEntryCount = 0;
+  struct dirent* dirEntry;
+  struct stat st;
+  long total = 0;
+  int evictions = 0;
+  int len, i;
+  DIR* dir;
+
+  dir = opendir(cacheDirectory);
+  if (dir == NULL) return 0;
+  while ((dirEntry = readdir(dir)) != NULL) {
+    len = strlen(dirEntry->d_name);
+    if ((len <= (int) strlen(ENTRY_SUFFIX)) || (len >= (int) sizeof(entries->name)) ||
+	(strcmp(dirEntry->d_name + len - strlen(ENTRY_SUFFIX), ENTRY_SUFFIX) != 0))
+      continue;
+    makePath(path, sizeof(path), dirEntry->d_name);
+    if (stat(path, &st) != 0) continue;
+
+    if (entryCount >= maxEntryCount) {
+      maxEntryCount = (maxEntryCount > 0) ? 2 * maxEntryCount : 64;
+      entries = (CacheEntry*) realloc(entries, maxEntryCount * sizeof(CacheEntry));
+    }
+    strcpy(entries[entryCount].name, dirEntry->d_name);
+    entries[entryCount].size = st.st_size;
+    entries[entryCount].lastUse = st.st_mtim;
+    total += st.st_size;
+    entryCount ++;
+  }
+  closedir(dir);
+
+  if (total > cacheMaxSize) {
+    qsort(entries, entryCount, sizeof(CacheEntry), compareLastUse);
+    for (i = 0; (i < entryCount) && (total > cacheMaxSize); i ++) {
+      makePath(path, sizeof(path), entries[i].name);
+      if (unlink(path) == 0) {
+	total -= entries[i].size;
+	evictions ++;
+      }
+    }
+  }
+  free(entries);
+  return evictions;
+}
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+static unsigned long long hashBytes(unsigned long long hash, unsigned char* bytes, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i ++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/* FNV-1a over the content of a file, whose size goes to *size */
+static int hashFile(char* fileName, unsigned long long* hash, long* size) {
+  unsigned char buffer[COPY_BUFFER_SIZE];
+  size_t n;
+  FILE* f;
+
+  f = fopen(fileName, "rb");
+  if (f == NULL) return IO_ERROR;
+  *hash = FNV_OFFSET;
+  *size = 0;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    *hash = hashBytes(*hash, buffer, n);
+    *size += n;
+  }
+  fclose(f);
+  return IO_SUCCESS;
+}
+
+/* Without the compiler to hash, nothing is cached */
+int openCache(char* directory, long maxSize) {
+  struct stat st;
+  long size;
+
+  if (hashFile(COMPILER_FILE, &compilerHash, &size) == IO_ERROR) return IO_ERROR;
+  if ((mkdir(directory, 0755) != 0) && (errno != EEXIST)) return IO_ERROR;
+  if ((stat(directory, &st) != 0) || !S_ISDIR(st.st_mode)) return IO_ERROR;
+  cacheDirectory = directory;
+  if (maxSize > 0) cacheMaxSize = maxSize;
+  return IO_SUCCESS;
+}
+
+int computeCacheKey(char* sourceFile, char* options, char* key) {
+  // The source, then the compiler and the options
+  unsigned long long hash;
+  char version[40];
+  long size;
+
+  if (hashFile(sourceFile, &hash, &size) == IO_ERROR) return IO_ERROR;
+  snprintf(version, sizeof(version), "|%016llx|%d|", compilerHash, EXECUTABLE_VERSION);
+  hash = hashBytes(hash, (unsigned char*) version, strlen(version));
+  hash = hashBytes(hash, (unsigned char*) options, strlen(options));
+
+  snprintf(key, CACHE_KEY_LEN, "%016llx-%lx", hash, size);
+  return IO_SUCCESS;
+}
+
+int fetchCached(char* key, char* outputFile) {
+  char path[FILENAME_MAX];
+  char directory[FILENAME_MAX];
+  char* slash;
+
+  makeEntryPath(path, sizeof(path), key);
+  strncpy(directory, outputFile, sizeof(directory) - 1);
+  directory[sizeof(directory) - 1] = '\0';
+  slash = strrchr(directory, '/');
+  if (slash == NULL) strcpy(directory, ".");
+  else *slash = '\0';
+
+  // A copy rather than a hard link: rewriting the output must not touch the entry
+  if (!publishFile(path, outputFile, directory)) {
+    updateStats(0, 1, 0);
+    return 0;
+  }
+  utimes(path, NULL);
+  updateStats(1, 0, 0);
+  return 1;
+}
+
+int storeCached(char* key, char* outputFile) {
+  char path[FILENAME_MAX];
+  int lock;
+  int evictions;
+  int ok;
+
+  makeEntryPath(path, sizeof(path), key);
+  ok = publishFile(outputFile, path, cacheDirectory);
+
+  lock = lockCache();
+  if (lock < 0) return ok;
+  evictions = evict();
+  unlockCache(lock);
+  if (evictions > 0) updateStats(0, 0, evictions);
+  return ok;
+}
+
+int readCacheStats(CacheStats* stats) {
+  int lock = lockCache();
+
+  if (lock < 0) return IO_ERROR;
+  loadStats(stats);
+  unlockCache(lock);
+  return IO_SUCCESS;
+}
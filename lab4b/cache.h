@@ -0,0 +1,28 @@
+/* On-disk cache of the outputs of kplc */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+/* On-disk cache of compiled units. An entry is named after a hash of the
+ * source bytes, the kplc binary and the options that change the
+ * output, so a hit can be copied without compiling anything.
+ */
+
+#define CACHE_KEY_LEN 40
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+
+struct CacheStats_ {
+  long hits;
+  long misses;
+  long evictions;
+};
+
+typedef struct CacheStats_ CacheStats;
+
+int openCache(char* directory, long maxSize);
+int computeCacheKey(char* sourceFile, char* options, char* key);
+int fetchCached(char* key, char* outputFile);
+int storeCached(char* key, char* outputFile);
+int readCacheStats(CacheStats* stats);
+
+#endif
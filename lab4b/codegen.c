@@ -5,221 +5,1234 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "reader.h"
 #include "codegen.h"  
+#include "semantics.h"
+#include "verifier.h"
+#include "optimizer.h"
+#include "ir.h"
+#include "lower.h"
+#include "loopopt.h"
 
-#define CODE_SIZE 10000
-extern SymTab* symtab;
+#define INITIAL_CODE_SIZE 1024
+#define INITIAL_TABLE_SIZE 64
 
-extern Object* readiFunction;
-extern Object* readcFunction;
-extern Object* writeiProcedure;
-extern Object* writecProcedure;
-extern Object* writelnProcedure;
+// Arrays whose address the LA instructions load, for the IR
+struct ArrayAccess_ {
+  CodeAddress address;
+  ArrayExtent extent;
+};
 
-CodeBlock* codeBlock;
+// Calls the subprogram being compiled makes to itself, then the tail
+// calls of the subprograms compiled so far
+struct SelfCall_ {
+  CodeAddress reserve;     // INT that reserves the frame header
+  CodeAddress call;
+  CodeAddress result;      // LA of the result the value is stored to, or -1
+  CodeAddress body;        // first statement of the caller, once a tail call
+};
 
-void genVariableAddress(Object* var) {
+// Calls the unit makes, the edges of its call graph. A call needs no
+// static link when its callee never reads it.
+struct Call_ {
+  CodeAddress address;     // of the CALL
+  CodeAddress caller;      // entry of the calling subprogram
+  CodeAddress callee;      // entry of the callee, DC_VALUE for an import
+  int import;              // index in the import table, or -1
+  Scope* callerScope;      // valid while the unit is compiled
+  Scope* calleeScope;
+  int needsLink;
+};
+
+static void addRelocation(CompilerContext* context, CodeAddress address, enum RelocationKind kind, int symbol) {
+  if (context->relocationCount >= context->maxRelocationCount) {
+    context->maxRelocationCount *= 2;
+    context->relocationTable = (Relocation*) realloc(context->relocationTable, context->maxRelocationCount * sizeof(Relocation));
+  }
+  context->relocationTable[context->relocationCount].address = address;
+  context->relocationTable[context->relocationCount].kind = kind;
+  context->relocationTable[context->relocationCount].symbol = symbol;
+  context->relocationCount ++;
+}
+
+static void fillLinkSymbol(LinkSymbol* symbol, Object* obj) {
+  memset(symbol, 0, sizeof(LinkSymbol));
+  strncpy(symbol->name, obj->name, MAX_SYMBOL_LEN - 1);
+  symbol->kind = obj->kind;
+  if (obj->kind == OBJ_FUNCTION) {
+    symbol->paramCount = obj->funcAttrs->paramCount;
+    symbol->address = obj->funcAttrs->codeAddress;
+  } else {
+    symbol->paramCount = obj->procAttrs->paramCount;
+    symbol->address = obj->procAttrs->codeAddress;
+  }
+}
+
+/* Index of an external subprogram in the import table, every unit
+ * imports a name once however many times it is called.
+ */
+static int addImport(CompilerContext* context, Object* obj) {
+  int i;
+
+  for (i = 0; i < context->importCount; i ++)
+    if (strncmp(context->importTable[i].name, obj->name, MAX_SYMBOL_LEN - 1) == 0) return i;
+
+  if (context->importCount >= context->maxImportCount) {
+    context->maxImportCount *= 2;
+    context->importTable = (LinkSymbol*) realloc(context->importTable, context->maxImportCount * sizeof(LinkSymbol));
+  }
+  fillLinkSymbol(context->importTable + context->importCount, obj);
+  context->importTable[context->importCount].address = DC_VALUE;
+  return context->importCount ++;
+}
+
+static void addExport(CompilerContext* context, Object* obj) {
+  if (context->exportCount >= context->maxExportCount) {
+    context->maxExportCount *= 2;
+    context->exportTable = (LinkSymbol*) realloc(context->exportTable, context->maxExportCount * sizeof(LinkSymbol));
+  }
+  fillLinkSymbol(context->exportTable + context->exportCount, obj);
+  context->exportCount ++;
+}
+
+static int isGlobalScope(CompilerContext* context, Scope* scope) {
+  return scope == PROGRAM_SCOPE(context->symtab->program);
+}
+
+int computeNestedLevel(CompilerContext* context, Scope* scope) {
   int level = 0;
+  Scope* tmp = context->symtab->currentScope;
+
+  while (tmp != scope) {
+    tmp = tmp->outer;
+    level ++;
+  }
+  return level;
+}
+
+static CodeAddress entryOf(Object* subprogram) {
+  switch (subprogram->kind) {
+  case OBJ_PROGRAM: return subprogram->progAttrs->codeAddress;
+  case OBJ_FUNCTION: return subprogram->funcAttrs->codeAddress;
+  default: return subprogram->procAttrs->codeAddress;
+  }
+}
+
+/* Records the call about to be emitted */
+static void addCall(CompilerContext* context, Object* callee, Scope* scope, int isExternal) {
+  struct Call_* call;
+
+  if (context->callCount >= context->maxCallCount) {
+    context->maxCallCount *= 2;
+    context->callTable = (struct Call_*) realloc(context->callTable, context->maxCallCount * sizeof(struct Call_));
+  }
+  call = context->callTable + context->callCount ++;
+  call->address = context->codeBlock->codeSize;
+  call->caller = entryOf(context->symtab->currentScope->owner);
+  call->callee = isExternal ? DC_VALUE : entryOf(callee);
+  call->import = isExternal ? addImport(context, callee) : -1;
+  call->callerScope = context->symtab->currentScope;
+  call->calleeScope = scope;
+  call->needsLink = 1;
+}
+
+void genVariableAddress(CompilerContext* context, Object* var) {
+  int level = computeNestedLevel(context, VARIABLE_SCOPE(var));
   int offset = VARIABLE_OFFSET(var);
-  genLA(level, offset);
+
+  markStaticLinks(context->symtab->currentScope, VARIABLE_SCOPE(var));
+  // Globals of every unit share the program frame once linked
+  if (isGlobalScope(context, VARIABLE_SCOPE(var)))
+    addRelocation(context, context->codeBlock->codeSize, RELOC_GLOBAL, 0);
+  genLA(context, level, offset);
 }
 
-void genVariableValue(Object* var) {
-  int level = 0;
+void genVariableValue(CompilerContext* context, Object* var) {
+  int level = computeNestedLevel(context, VARIABLE_SCOPE(var));
   int offset = VARIABLE_OFFSET(var);
-  genLV(level, offset);
+
+  markStaticLinks(context->symtab->currentScope, VARIABLE_SCOPE(var));
+  if (isGlobalScope(context, VARIABLE_SCOPE(var)))
+    addRelocation(context, context->codeBlock->codeSize, RELOC_GLOBAL, 0);
+  genLV(context, level, offset);
 }
 
-void genParameterValue(Object* param) {
-  int level = 0;
+void genParameterAddress(CompilerContext* context, Object* param) {
+  int level = computeNestedLevel(context, PARAMETER_SCOPE(param));
+  int offset = PARAMETER_OFFSET(param);
+
+  markStaticLinks(context->symtab->currentScope, PARAMETER_SCOPE(param));
+  // A reference parameter already holds the address of its argument
+  if (param->paramAttrs->kind == PARAM_REFERENCE)
+    genLV(context, level, offset);
+  else genLA(context, level, offset);
+}
+
+void genParameterValue(CompilerContext* context, Object* param) {
+  int level = computeNestedLevel(context, PARAMETER_SCOPE(param));
   int offset = PARAMETER_OFFSET(param);
-  genLV(level, offset);
+
+  markStaticLinks(context->symtab->currentScope, PARAMETER_SCOPE(param));
+  genLV(context, level, offset);
+}
+
+void genReturnValueAddress(CompilerContext* context, Object* func) {
+  int level = computeNestedLevel(context, FUNCTION_SCOPE(func));
+
+  markStaticLinks(context->symtab->currentScope, FUNCTION_SCOPE(func));
+  genLA(context, level, RETURN_VALUE_OFFSET);
+}
+
+void genReturnValueValue(CompilerContext* context, Object* func) {
+  int level = computeNestedLevel(context, FUNCTION_SCOPE(func));
+
+  markStaticLinks(context->symtab->currentScope, FUNCTION_SCOPE(func));
+  genLV(context, level, RETURN_VALUE_OFFSET);
+}
+
+void genProcedureCall(CompilerContext* context, Object* proc) {
+  // The static link of the callee is the frame of its enclosing scope
+  int level = computeNestedLevel(context, PROCEDURE_SCOPE(proc)->outer);
+
+  addCall(context, proc, PROCEDURE_SCOPE(proc), proc->procAttrs->isExternal);
+  if (proc->procAttrs->isExternal) {
+    markStaticLinks(context->symtab->currentScope, PROCEDURE_SCOPE(proc)->outer);
+    addRelocation(context, context->codeBlock->codeSize, RELOC_IMPORT, addImport(context, proc));
+  } else addRelocation(context, context->codeBlock->codeSize, RELOC_CODE, 0);
+  genCALL(context, level, proc->procAttrs->codeAddress);
+}
+
+void genFunctionCall(CompilerContext* context, Object* func) {
+  int level = computeNestedLevel(context, FUNCTION_SCOPE(func)->outer);
+
+  addCall(context, func, FUNCTION_SCOPE(func), func->funcAttrs->isExternal);
+  if (func->funcAttrs->isExternal) {
+    markStaticLinks(context->symtab->currentScope, FUNCTION_SCOPE(func)->outer);
+    addRelocation(context, context->codeBlock->codeSize, RELOC_IMPORT, addImport(context, func));
+  } else addRelocation(context, context->codeBlock->codeSize, RELOC_CODE, 0);
+  genCALL(context, level, func->funcAttrs->codeAddress);
+}
+
+void genScopeFrame(CompilerContext* context, Scope* scope) {
+  // The linker grows the program frame to hold the globals of every unit
+  if (scope->owner->kind == OBJ_PROGRAM)
+    addRelocation(context, context->codeBlock->codeSize, RELOC_FRAME_SIZE, 0);
+  genINT(context, scope->frameSize);
+  context->bodyAddress = context->codeBlock->codeSize;
+}
+
+/* Records the call just emitted, the subprogram calls itself */
+void addSelfCall(CompilerContext* context, CodeAddress reserve) {
+  if (context->selfCallCount >= context->maxSelfCallCount) {
+    context->maxSelfCallCount *= 2;
+    context->selfCallTable = (struct SelfCall_*) realloc(context->selfCallTable, context->maxSelfCallCount * sizeof(struct SelfCall_));
+  }
+  context->selfCallTable[context->selfCallCount].reserve = reserve;
+  context->selfCallTable[context->selfCallCount].call = context->codeBlock->codeSize - 1;
+  context->selfCallTable[context->selfCallCount].result = -1;
+  context->selfCallCount ++;
+}
+
+/* The ST just emitted stores to the result loaded at the given address:
+ * when its value comes straight from a call to the function itself,
+ * the next run of the body may write the result instead.
+ */
+void addResultStore(CompilerContext* context, CodeAddress result) {
+  struct SelfCall_* last;
+
+  if (context->selfCallCount == context->tailCallCount) return;
+  last = context->selfCallTable + context->selfCallCount - 1;
+  if ((last->reserve == result + 1) && (last->call == context->codeBlock->codeSize - 2))
+    last->result = result;
+}
+
+/* Once the whole unit is compiled: a call to a subprogram that uses its
+ * static link reads the links of the frames on the way to the callee's
+ * enclosing frame, which may make the caller use its own, and so on.
+ * Imports are marked as they are called.
+ */
+void resolveStaticLinks(CompilerContext* context) {
+  struct Call_* call;
+  int changed, i;
+
+  do {
+    changed = 0;
+    for (i = 0; i < context->callCount; i ++) {
+      call = context->callTable + i;
+      if ((call->import < 0) && call->calleeScope->usesStaticLink)
+	changed += markStaticLinks(call->callerScope, call->calleeScope->outer);
+    }
+  } while (changed > 0);
+
+  for (i = 0; i < context->callCount; i ++) {
+    call = context->callTable + i;
+    call->needsLink = (call->import >= 0) || call->calleeScope->usesStaticLink;
+    call->callerScope = call->calleeScope = NULL;
+  }
+}
+
+/* Calls that pass a static link the callee never reads become CALLN.
+ * Only done when optimizing, a debugger may follow the links of any frame.
+ */
+static void elideStaticLinks(CompilerContext* context) {
+  Instruction* inst;
+  int i;
+
+  for (i = 0; i < context->callCount; i ++) {
+    inst = context->codeBlock->code + context->callTable[i].address;
+    if (context->callTable[i].needsLink || (inst->op != OP_CALL)) continue;
+    inst->op = OP_CALLN;
+    inst->p = DC_VALUE;
+  }
+}
+
+/* Keeps the calls a subprogram makes to itself right before it returns
+ * once its EP or EF is emitted, applyTailCalls turns them into TC.
+ */
+void genTailCalls(CompilerContext* context) {
+  Instruction* code = context->codeBlock->code;
+  CodeAddress exit = context->codeBlock->codeSize - 1;
+  struct SelfCall_* self;
+  CodeAddress next;
+  int i, hops;
+
+  for (i = context->tailCallCount; i < context->selfCallCount; i ++) {
+    self = context->selfCallTable + i;
+    next = self->call + 1;
+    if (code[exit].op == OP_EF) {
+      if (self->result < 0) continue;
+      next ++;
+    }
+    for (hops = 0; (code[next].op == OP_J) && (hops < context->codeBlock->codeSize); hops ++)
+      next = code[next].q;
+    if (next != exit) continue;
+
+    self->body = context->bodyAddress;
+    context->selfCallTable[context->tailCallCount ++] = *self;
+  }
+  context->selfCallCount = context->tailCallCount;
+}
+
+/* No header is reserved for the callee of a tail call, the arguments
+ * replace the parameters and the body starts again in the same frame,
+ * so the recursion runs in constant space at every optimization level.
+ */
+void applyTailCalls(CompilerContext* context) {
+  Instruction* code = context->codeBlock->code;
+  struct SelfCall_* self;
+  int i;
+
+  for (i = 0; i < context->tailCallCount; i ++) {
+    self = context->selfCallTable + i;
+    // The frame exists already: neither its header nor the address of
+    // the result is pushed, only the arguments are
+    code[self->reserve].q = 0;
+    if (self->result >= 0) {
+      code[self->result].op = OP_INT;
+      code[self->result].p = DC_VALUE;
+      code[self->result].q = 0;
+    }
+    code[self->call - 1].q -= RESERVED_WORDS;
+    code[self->call].op = OP_TC;
+    code[self->call].p = code[self->call - 1].q;
+    code[self->call].q = self->body;
+  }
+}
+
+int isPredefinedFunction(CompilerContext* context, Object* func) {
+  return ((func == context->symtab->readiFunction) || (func == context->symtab->readcFunction));
+}
+
+int isPredefinedProcedure(CompilerContext* context, Object* proc) {
+  return ((proc == context->symtab->writeiProcedure) || (proc == context->symtab->writecProcedure) || (proc == context->symtab->writelnProcedure));
+}
+
+void genPredefinedProcedureCall(CompilerContext* context, Object* proc) {
+  if (proc == context->symtab->writeiProcedure)
+    genWRI(context);
+  else if (proc == context->symtab->writecProcedure)
+    genWRC(context);
+  else if (proc == context->symtab->writelnProcedure)
+    genWLN(context);
+}
+
+void genPredefinedFunctionCall(CompilerContext* context, Object* func) {
+  if (func == context->symtab->readiFunction)
+    genRI(context);
+  else if (func == context->symtab->readcFunction)
+    genRC(context);
+}
+
+/* Whether the last n instructions load constants and no jump can land
+ * between them and the operator that consumes them.
+ */
+static int constantOperands(CompilerContext* context, int n) {
+  CodeAddress address = context->codeBlock->codeSize - n;
+  int i;
+
+  if ((address < 0) || (address < context->foldBarrier)) return 0;
+  for (i = address; i < context->codeBlock->codeSize; i ++)
+    if (context->codeBlock->code[i].op != OP_LC) return 0;
+  return 1;
+}
+
+/* Replaces LC a LC b op by LC (a op b). Arithmetic wraps like the VM's. */
+static int foldBinary(CompilerContext* context, enum OpCode op) {
+  Instruction* left;
+  Instruction* right;
+  unsigned int a, b;
+  WORD result;
+
+  if (!constantOperands(context, 2)) return 0;
+  left = context->codeBlock->code + context->codeBlock->codeSize - 2;
+  right = left + 1;
+  a = (unsigned int) left->q;
+  b = (unsigned int) right->q;
+  switch (op) {
+  case OP_AD: result = (WORD) (a + b); break;
+  case OP_SB: result = (WORD) (a - b); break;
+  case OP_ML: result = (WORD) (a * b); break;
+  case OP_DV:
+    // Leave the division by zero to be reported at run time
+    if ((right->q == 0) || ((right->q == -1) && (left->q == (WORD) 0x80000000u))) return 0;
+    result = left->q / right->q;
+    break;
+  case OP_EQ: result = left->q == right->q; break;
+  case OP_NE: result = left->q != right->q; break;
+  case OP_GT: result = left->q > right->q; break;
+  case OP_GE: result = left->q >= right->q; break;
+  case OP_LT: result = left->q < right->q; break;
+  case OP_LE: result = left->q <= right->q; break;
+  default: return 0;
+  }
+  left->q = result;
+  context->codeBlock->codeSize --;
+  return 1;
+}
+
+int isConstantCode(CompilerContext* context, CodeAddress start, WORD* value) {
+  if ((context->codeBlock->codeSize != start + 1) || (context->codeBlock->code[start].op != OP_LC)) return 0;
+  *value = context->codeBlock->code[start].q;
+  return 1;
+}
+
+/* Whether the code from start to the end of the buffer only does
+ * arithmetic on constants and variables other than the one whose address
+ * the instruction at variable loads. Its value then stays the same when
+ * that variable changes.
+ */
+int isIndependentCode(CompilerContext* context, CodeAddress variable, CodeAddress start) {
+  Instruction* var = context->codeBlock->code + variable;
+  Instruction* inst;
+  CodeAddress pc;
+
+  if (var->op != OP_LA) return 0;
+  for (pc = start; pc < context->codeBlock->codeSize; pc ++) {
+    inst = context->codeBlock->code + pc;
+    switch (inst->op) {
+    case OP_LV:
+      if ((inst->p == var->p) && (inst->q == var->q)) return 0;
+      break;
+    case OP_LC: case OP_AD: case OP_SB: case OP_ML: case OP_DV: case OP_NEG:
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Emits the code from start to end again, with the relocations of the
+ * globals it loads
+ */
+void genCopy(CompilerContext* context, CodeAddress start, CodeAddress end) {
+  CodeAddress pc;
+  int i = context->relocationCount;
+
+  // The relocations are recorded in the order of the code
+  while ((i > 0) && (context->relocationTable[i - 1].address >= start)) i --;
+  for (pc = start; pc < end; pc ++) {
+    for (; (i < context->relocationCount) && (context->relocationTable[i].address == pc); i ++)
+      if (context->relocationTable[i].kind == RELOC_GLOBAL)
+	addRelocation(context, context->codeBlock->codeSize, RELOC_GLOBAL, 0);
+    emitCode(context->codeBlock, context->codeBlock->code[pc].op, context->codeBlock->code[pc].p, context->codeBlock->code[pc].q);
+  }
+}
+
+/* Whether the code from start loads the address of a word of the
+ * current frame, which a call reusing the frame would overwrite
+ */
+int isFrameAddress(CompilerContext* context, CodeAddress start) {
+  return (context->codeBlock->code[start].op == OP_LA) && (context->codeBlock->code[start].p == 0);
+}
+
+CodeMark markCode(CompilerContext* context) {
+  CodeMark mark;
+
+  mark.codeSize = getCurrentCodeAddress(context);
+  mark.lineCount = context->lineCount;
+  mark.lineNo = (context->lineCount > 0) ? context->lineTable[context->lineCount - 1].lineNo : 0;
+  mark.relocationCount = context->relocationCount;
+  mark.importCount = context->importCount;
+  mark.arrayCount = context->arrayCount;
+  mark.selfCallCount = context->selfCallCount;
+  mark.callCount = context->callCount;
+  return mark;
+}
+
+/* Drops the code emitted since the mark along with its debug and link entries */
+void discardCode(CompilerContext* context, CodeMark mark) {
+  context->codeBlock->codeSize = mark.codeSize;
+  context->lineCount = mark.lineCount;
+  if (context->lineCount > 0) context->lineTable[context->lineCount - 1].lineNo = mark.lineNo;
+  context->relocationCount = mark.relocationCount;
+  context->importCount = mark.importCount;
+  context->arrayCount = mark.arrayCount;
+  context->selfCallCount = mark.selfCallCount;
+  context->callCount = mark.callCount;
+}
+
+void genLA(CompilerContext* context, int level, int offset) {
+  emitLA(context->codeBlock, level, offset);
+}
+
+void genLV(CompilerContext* context, int level, int offset) {
+  emitLV(context->codeBlock, level, offset);
+}
+
+void genLC(CompilerContext* context, WORD constant) {
+  emitLC(context->codeBlock, constant);
+}
+
+void genLI(CompilerContext* context) {
+  emitLI(context->codeBlock);
+}
+
+void genINT(CompilerContext* context, int delta) {
+  emitINT(context->codeBlock,delta);
+}
+
+void genDCT(CompilerContext* context, int delta) {
+  emitDCT(context->codeBlock,delta);
+}
+
+CodeAddress genJ(CompilerContext* context, CodeAddress label) {
+  CodeAddress addr = context->codeBlock->codeSize;
+  addRelocation(context, addr, RELOC_CODE, 0);
+  emitJ(context->codeBlock,label);
+  return addr;
 }
 
-void genFunctionCall(Object* func) {
-  genHL();
+CodeAddress genFJ(CompilerContext* context, CodeAddress label) {
+  CodeAddress addr = context->codeBlock->codeSize;
+  addRelocation(context, addr, RELOC_CODE, 0);
+  emitFJ(context->codeBlock, label);
+  return addr;
 }
 
-int isPredefinedFunction(Object* func) {
-  return ((func == readiFunction) || (func == readcFunction));
+CodeAddress genFORINIT(CompilerContext* context, CodeAddress label) {
+  CodeAddress addr = context->codeBlock->codeSize;
+  addRelocation(context, addr, RELOC_CODE, 0);
+  emitFORINIT(context->codeBlock, label);
+  return addr;
 }
 
-int isPredefinedProcedure(Object* proc) {
-  return ((proc == writeiProcedure) || (proc == writecProcedure) || (proc == writelnProcedure));
+void genFORSTEP(CompilerContext* context, CodeAddress label) {
+  addRelocation(context, context->codeBlock->codeSize, RELOC_CODE, 0);
+  emitFORSTEP(context->codeBlock, label);
 }
 
-void genPredefinedProcedureCall(Object* proc) {
-  if (proc == writeiProcedure)
-    genWRI();
-  else if (proc == writecProcedure)
-    genWRC();
-  else if (proc == writelnProcedure)
-    genWLN();
+void genHL(CompilerContext* context) {
+  emitHL(context->codeBlock);
 }
 
-void genPredefinedFunctionCall(Object* func) {
-  if (func == readiFunction)
-    genRI();
-  else if (func == readcFunction)
-    genRC();
+void genST(CompilerContext* context) {
+  emitST(context->codeBlock);
 }
 
-void genLA(int level, int offset) {
-  emitLA(codeBlock, level, offset);
+void genCALL(CompilerContext* context, int level, CodeAddress label) {
+  emitCALL(context->codeBlock, level, label);
 }
 
-void genLV(int level, int offset) {
-  emitLV(codeBlock, level, offset);
+void genEP(CompilerContext* context) {
+  emitEP(context->codeBlock);
 }
 
-void genLC(WORD constant) {
-  emitLC(codeBlock, constant);
+void genEF(CompilerContext* context) {
+  emitEF(context->codeBlock);
 }
 
-void genLI(void) {
-  emitLI(codeBlock);
+void genRC(CompilerContext* context) {
+  emitRC(context->codeBlock);
 }
 
-void genINT(int delta) {
-  emitINT(codeBlock,delta);
+void genRI(CompilerContext* context) {
+  emitRI(context->codeBlock);
 }
 
-void genDCT(int delta) {
-  emitDCT(codeBlock,delta);
+void genWRC(CompilerContext* context) {
+  emitWRC(context->codeBlock);
 }
 
-Instruction* genJ(CodeAddress label) {
-  Instruction* inst = codeBlock->code + codeBlock->codeSize;
-  emitJ(codeBlock,label);
-  return inst;
+void genWRI(CompilerContext* context) {
+  emitWRI(context->codeBlock);
 }
 
-Instruction* genFJ(CodeAddress label) {
-  Instruction* inst = codeBlock->code + codeBlock->codeSize;
-  emitFJ(codeBlock, label);
-  return inst;
+void genWLN(CompilerContext* context) {
+  emitWLN(context->codeBlock);
 }
 
-void genHL(void) {
-  emitHL(codeBlock);
+void genAD(CompilerContext* context) {
+  if (!foldBinary(context, OP_AD)) emitAD(context->codeBlock);
 }
 
-void genST(void) {
-  emitST(codeBlock);
+/* Records the array the LA at the given address points to */
+void addArrayAccess(CompilerContext* context, CodeAddress address, int size) {
+  if (context->arrayCount >= context->maxArrayCount) {
+    context->maxArrayCount *= 2;
+    context->arrayTable = (struct ArrayAccess_*) realloc(context->arrayTable, context->maxArrayCount * sizeof(struct ArrayAccess_));
+  }
+  context->arrayTable[context->arrayCount].address = address;
+  context->arrayTable[context->arrayCount].extent.first = context->codeBlock->code[address].q;
+  context->arrayTable[context->arrayCount].extent.size = size;
+  context->arrayCount ++;
 }
 
-void genCALL(int level, CodeAddress label) {
-  emitCALL(codeBlock, level, label);
+/* Adds the index on top of the stack, scaled by the element size */
+void genIX(CompilerContext* context, int stride) {
+  if (stride == 1) genAD(context);
+  else emitIX(context->codeBlock, stride);
+}
+
+/* Moves the address loaded at the given instruction by a constant
+ * offset. Indices only add to it, so the offset goes into the LA itself.
+ */
+void genAddressOffset(CompilerContext* context, CodeAddress address, int offset) {
+  if (offset == 0) return;
+  if (context->codeBlock->code[address].op == OP_LA)
+    context->codeBlock->code[address].q += offset;
+  else {
+    genLC(context, offset);
+    genAD(context);
+  }
 }
 
-void genEP(void) {
-  emitEP(codeBlock);
+void genSB(CompilerContext* context) {
+  if (!foldBinary(context, OP_SB)) emitSB(context->codeBlock);
 }
 
-void genEF(void) {
-  emitEF(codeBlock);
+void genML(CompilerContext* context) {
+  if (!foldBinary(context, OP_ML)) emitML(context->codeBlock);
 }
 
-void genRC(void) {
-  emitRC(codeBlock);
+void genDV(CompilerContext* context) {
+  if (!foldBinary(context, OP_DV)) emitDV(context->codeBlock);
 }
 
-void genRI(void) {
-  emitRI(codeBlock);
+void genNEG(CompilerContext* context) {
+  Instruction* operand;
+
+  if (constantOperands(context, 1)) {
+    operand = context->codeBlock->code + context->codeBlock->codeSize - 1;
+    operand->q = (WORD) (- (unsigned int) operand->q);
+  } else emitNEG(context->codeBlock);
 }
 
-void genWRC(void) {
-  emitWRC(codeBlock);
+void genCV(CompilerContext* context) {
+  emitCV(context->codeBlock);
 }
 
-void genWRI(void) {
-  emitWRI(codeBlock);
+void genEQ(CompilerContext* context) {
+  if (!foldBinary(context, OP_EQ)) emitEQ(context->codeBlock);
 }
 
-void genWLN(void) {
-  emitWLN(codeBlock);
+void genNE(CompilerContext* context) {
+  if (!foldBinary(context, OP_NE)) emitNE(context->codeBlock);
 }
 
-void genAD(void) {
-  emitAD(codeBlock);
+void genGT(CompilerContext* context) {
+  if (!foldBinary(context, OP_GT)) emitGT(context->codeBlock);
 }
 
-void genSB(void) {
-  emitSB(codeBlock);
+void genGE(CompilerContext* context) {
+  if (!foldBinary(context, OP_GE)) emitGE(context->codeBlock);
 }
 
-void genML(void) {
-  emitML(codeBlock);
+void genLT(CompilerContext* context) {
+  if (!foldBinary(context, OP_LT)) emitLT(context->codeBlock);
 }
 
-void genDV(void) {
-  emitDV(codeBlock);
+void genLE(CompilerContext* context) {
+  if (!foldBinary(context, OP_LE)) emitLE(context->codeBlock);
 }
 
-void genNEG(void) {
-  emitNEG(codeBlock);
+// Jumps are patched through their code address: the buffer may move as it grows
+void updateJ(CompilerContext* context, CodeAddress jmp, CodeAddress label) {
+  context->codeBlock->code[jmp].q = label;
 }
 
-void genCV(void) {
-  emitCV(codeBlock);
+void updateFJ(CompilerContext* context, CodeAddress jmp, CodeAddress label) {
+  context->codeBlock->code[jmp].q = label;
 }
 
-void genEQ(void) {
-  emitEQ(codeBlock);
+void updateFORINIT(CompilerContext* context, CodeAddress jmp, CodeAddress label) {
+  context->codeBlock->code[jmp].q = label;
 }
 
-void genNE(void) {
-  emitNE(codeBlock);
+CodeAddress getCurrentCodeAddress(CompilerContext* context) {
+  // The caller may be about to make this address a jump target
+  context->foldBarrier = context->codeBlock->codeSize;
+  return context->codeBlock->codeSize;
 }
 
-void genGT(void) {
-  emitGT(codeBlock);
+
+void addLineNumber(CompilerContext* context, int lineNo) {
+  CodeAddress address = getCurrentCodeAddress(context);
+
+  // Several lines may start at the same address when they emit no code
+  if ((context->lineCount > 0) && (context->lineTable[context->lineCount - 1].address == address)) {
+    context->lineTable[context->lineCount - 1].lineNo = lineNo;
+    return;
+  }
+  if (context->lineCount >= context->maxLineCount) {
+    context->maxLineCount *= 2;
+    context->lineTable = (LineEntry*) realloc(context->lineTable, context->maxLineCount * sizeof(LineEntry));
+  }
+  context->lineTable[context->lineCount].address = address;
+  context->lineTable[context->lineCount].lineNo = lineNo;
+  context->lineCount ++;
 }
 
-void genGE(void) {
-  emitGE(codeBlock);
+void addSymbol(CompilerContext* context, Object* obj) {
+  SymbolEntry* symbol;
+
+  if (context->symbolCount >= context->maxSymbolCount) {
+    context->maxSymbolCount *= 2;
+    context->symbolTable = (SymbolEntry*) realloc(context->symbolTable, context->maxSymbolCount * sizeof(SymbolEntry));
+    context->symbolEnds = (CodeAddress*) realloc(context->symbolEnds, context->maxSymbolCount * sizeof(CodeAddress));
+  }
+  symbol = context->symbolTable + context->symbolCount;
+  memset(symbol, 0, sizeof(SymbolEntry));
+  strncpy(symbol->name, obj->name, MAX_SYMBOL_LEN - 1);
+  symbol->kind = obj->kind;
+  switch (obj->kind) {
+  case OBJ_PROGRAM:
+    symbol->address = obj->progAttrs->codeAddress;
+    context->entryPoint = symbol->address;
+    break;
+  case OBJ_FUNCTION:
+    symbol->address = obj->funcAttrs->codeAddress;
+    if (isGlobalScope(context, FUNCTION_SCOPE(obj)->outer)) addExport(context, obj);
+    break;
+  case OBJ_PROCEDURE:
+    symbol->address = obj->procAttrs->codeAddress;
+    if (isGlobalScope(context, PROCEDURE_SCOPE(obj)->outer)) addExport(context, obj);
+    break;
+  default:
+    return;
+  }
+  context->symbolEnds[context->symbolCount] = symbol->address;
+  context->symbolCount ++;
 }
 
-void genLT(void) {
-  emitLT(codeBlock);
+static int symbolAt(CompilerContext* context, CodeAddress address) {
+  int i;
+
+  for (i = 0; i < context->symbolCount; i ++)
+    if (context->symbolTable[i].address == address) return i;
+  return -1;
 }
 
-void genLE(void) {
-  emitLE(codeBlock);
+void closeSymbol(CompilerContext* context, Object* obj) {
+  int i = symbolAt(context, entryOf(obj));
+
+  if (i >= 0) context->symbolEnds[i] = context->codeBlock->codeSize;
 }
 
-void updateJ(Instruction* jmp, CodeAddress label) {
-  jmp->q = label;
+void addConstant(CompilerContext* context, Object* obj) {
+  ConstantEntry* constant;
+  ConstantValue* value = obj->constAttrs->value;
+
+  if (context->constantCount >= context->maxConstantCount) {
+    context->maxConstantCount *= 2;
+    context->constantTable = (ConstantEntry*) realloc(context->constantTable, context->maxConstantCount * sizeof(ConstantEntry));
+  }
+  constant = context->constantTable + context->constantCount;
+  memset(constant, 0, sizeof(ConstantEntry));
+  strncpy(constant->name, obj->name, MAX_SYMBOL_LEN - 1);
+  constant->type = value->type;
+  constant->value = (value->type == TP_INT) ? value->intValue : value->charValue;
+  context->constantCount ++;
 }
 
-void updateFJ(Instruction* jmp, CodeAddress label) {
-  jmp->q = label;
+void initCodeBuffer(CompilerContext* context) {
+  context->codeBlock = createCodeBlock(INITIAL_CODE_SIZE);
+  context->foldBarrier = 0;
+
+  context->entryPoint = 0;
+  context->lineCount = context->symbolCount = context->constantCount = 0;
+  context->maxLineCount = context->maxSymbolCount = context->maxConstantCount = INITIAL_TABLE_SIZE;
+  context->lineTable = (LineEntry*) malloc(context->maxLineCount * sizeof(LineEntry));
+  context->symbolTable = (SymbolEntry*) malloc(context->maxSymbolCount * sizeof(SymbolEntry));
+  context->symbolEnds = (CodeAddress*) malloc(context->maxSymbolCount * sizeof(CodeAddress));
+  context->constantTable = (ConstantEntry*) malloc(context->maxConstantCount * sizeof(ConstantEntry));
+
+  context->exportCount = context->importCount = context->relocationCount = 0;
+  context->maxExportCount = context->maxImportCount = context->maxRelocationCount = INITIAL_TABLE_SIZE;
+  context->exportTable = (LinkSymbol*) malloc(context->maxExportCount * sizeof(LinkSymbol));
+  context->importTable = (LinkSymbol*) malloc(context->maxImportCount * sizeof(LinkSymbol));
+  context->relocationTable = (Relocation*) malloc(context->maxRelocationCount * sizeof(Relocation));
+
+  context->arrayCount = 0;
+  context->maxArrayCount = INITIAL_TABLE_SIZE;
+  context->arrayTable = (struct ArrayAccess_*) malloc(context->maxArrayCount * sizeof(struct ArrayAccess_));
+
+  context->selfCallCount = context->tailCallCount = 0;
+  context->maxSelfCallCount = INITIAL_TABLE_SIZE;
+  context->selfCallTable = (struct SelfCall_*) malloc(context->maxSelfCallCount * sizeof(struct SelfCall_));
+
+  context->callCount = 0;
+  context->maxCallCount = INITIAL_TABLE_SIZE;
+  context->callTable = (struct Call_*) malloc(context->maxCallCount * sizeof(struct Call_));
 }
 
-CodeAddress getCurrentCodeAddress(void) {
-  return codeBlock->codeSize;
+void printCodeBuffer(CompilerContext* context) {
+  printCodeBlock(context->codeBlock);
 }
 
+void cleanCodeBuffer(CompilerContext* context) {
+  freeCodeBlock(context->codeBlock);
+  free(context->lineTable);
+  free(context->symbolTable);
+  free(context->symbolEnds);
+  free(context->constantTable);
+  free(context->exportTable);
+  free(context->importTable);
+  free(context->relocationTable);
+  free(context->arrayTable);
+  free(context->selfCallTable);
+  free(context->callTable);
+  context->profile = NULL;
+}
 
-void initCodeBuffer(void) {
-  codeBlock = createCodeBlock(CODE_SIZE);
+int hasUnresolvedImports(CompilerContext* context) {
+  return context->importCount > 0;
 }
 
-void printCodeBuffer(void) {
-  printCodeBlock(codeBlock);
+/* Marks the symbols reachable through calls from the entry point, and
+ * from the exports when other units may call them.
+ */
+static char* findReachableSymbols(CompilerContext* context, int keepExports) {
+  char* reachable = (char*) calloc(context->symbolCount + 1, sizeof(char));
+  int* callers = (int*) malloc((context->callCount + 1) * sizeof(int));
+  int* callees = (int*) malloc((context->callCount + 1) * sizeof(int));
+  int changed, i;
+
+  for (i = 0; i < context->callCount; i ++) {
+    callers[i] = symbolAt(context, context->callTable[i].caller);
+    callees[i] = (context->callTable[i].import < 0) ? symbolAt(context, context->callTable[i].callee) : -1;
+  }
+  i = symbolAt(context, context->entryPoint);
+  if (i >= 0) reachable[i] = 1;
+  for (i = 0; (i < context->exportCount) && keepExports; i ++)
+    if (symbolAt(context, context->exportTable[i].address) >= 0) reachable[symbolAt(context, context->exportTable[i].address)] = 1;
+
+  do {
+    changed = 0;
+    for (i = 0; i < context->callCount; i ++)
+      if ((callers[i] >= 0) && (callees[i] >= 0) && reachable[callers[i]] && !reachable[callees[i]]) {
+	reachable[callees[i]] = 1;
+	changed = 1;
+      }
+  } while (changed);
+
+  free(callers);
+  free(callees);
+  return reachable;
 }
 
-void cleanCodeBuffer(void) {
-  freeCodeBlock(codeBlock);
+void printCallGraph(CompilerContext* context, int keepExports) {
+  char* reachable = findReachableSymbols(context, keepExports);
+  struct Call_* call;
+  int i, j, k, n, seen;
+
+  for (i = 0; i < context->symbolCount; i ++) {
+    printf("%s%s", context->symbolTable[i].name, reachable[i] ? "" : " (unreachable)");
+    for (j = 0, n = 0; j < context->callCount; j ++) {
+      call = context->callTable + j;
+      if (call->caller != context->symbolTable[i].address) continue;
+      // Each callee is listed once, at its first call
+      for (k = 0, seen = 0; (k < j) && !seen; k ++)
+	seen = (context->callTable[k].caller == call->caller) && (context->callTable[k].callee == call->callee)
+	  && (context->callTable[k].import == call->import);
+      if (seen) continue;
+      printf(n ++ == 0 ? " -> " : ", ");
+      if (call->import >= 0) printf("%s (EXTERNAL)", context->importTable[call->import].name);
+      else printf("%s", context->symbolTable[symbolAt(context, call->callee)].name);
+    }
+    printf("\n");
+  }
+  free(reachable);
 }
 
-int serialize(char* fileName) {
+/* Drops the code of the subprograms no call reaches, with the debug and
+ * link information that refers to it. Returns the number of subprograms
+ * removed.
+ */
+int removeUnreachableCode(CompilerContext* context, int keepExports) {
+  char* reachable = findReachableSymbols(context, keepExports);
+  char* dead = (char*) calloc(context->codeBlock->codeSize + 1, sizeof(char));
+  CodeAddress* addressMap;
+  int* importMap;
+  Instruction* inst;
+  Relocation* reloc;
+  CodeAddress a;
+  int removed = 0;
+  int i, n;
+
+  for (i = 0; i < context->symbolCount; i ++) {
+    if (reachable[i]) continue;
+    for (a = context->symbolTable[i].address; a < context->symbolEnds[i]; a ++) dead[a] = 1;
+    removed ++;
+  }
+  free(reachable);
+  if (removed == 0) {
+    free(dead);
+    return 0;
+  }
+
+  addressMap = (CodeAddress*) malloc((context->codeBlock->codeSize + 1) * sizeof(CodeAddress));
+  for (a = 0, n = 0; a < context->codeBlock->codeSize; a ++) {
+    addressMap[a] = n;
+    if (!dead[a]) context->codeBlock->code[n ++] = context->codeBlock->code[a];
+  }
+  addressMap[a] = n;
+  context->codeBlock->codeSize = n;
+
+  // Only the imports the remaining code calls are kept
+  importMap = (int*) malloc((context->importCount + 1) * sizeof(int));
+  for (i = 0; i < context->importCount; i ++) importMap[i] = -1;
+  for (i = 0, n = 0; i < context->relocationCount; i ++) {
+    reloc = context->relocationTable + i;
+    if (dead[reloc->address]) continue;
+    reloc->address = addressMap[reloc->address];
+    inst = context->codeBlock->code + reloc->address;
+    if (reloc->kind == RELOC_CODE) inst->q = addressMap[inst->q];
+    else if (reloc->kind == RELOC_IMPORT) importMap[reloc->symbol] = 0;
+    context->relocationTable[n ++] = *reloc;
+  }
+  context->relocationCount = n;
+  for (i = 0, n = 0; i < context->importCount; i ++) {
+    if (importMap[i] < 0) continue;
+    importMap[i] = n;
+    context->importTable[n ++] = context->importTable[i];
+  }
+  context->importCount = n;
+  for (i = 0; i < context->relocationCount; i ++)
+    if (context->relocationTable[i].kind == RELOC_IMPORT)
+      context->relocationTable[i].symbol = importMap[context->relocationTable[i].symbol];
+
+  context->entryPoint = addressMap[context->entryPoint];
+  for (i = 0, n = 0; i < context->symbolCount; i ++) {
+    if (dead[context->symbolTable[i].address]) continue;
+    context->symbolTable[n] = context->symbolTable[i];
+    context->symbolTable[n].address = addressMap[context->symbolTable[i].address];
+    context->symbolEnds[n ++] = addressMap[context->symbolEnds[i]];
+  }
+  context->symbolCount = n;
+  for (i = 0, n = 0; i < context->exportCount; i ++) {
+    if (dead[context->exportTable[i].address]) continue;
+    context->exportTable[n] = context->exportTable[i];
+    context->exportTable[n ++].address = addressMap[context->exportTable[i].address];
+  }
+  context->exportCount = n;
+
+  for (i = 0, n = 0; i < context->lineCount; i ++) {
+    if (dead[context->lineTable[i].address]) continue;
+    context->lineTable[i].address = addressMap[context->lineTable[i].address];
+    if ((n > 0) && (context->lineTable[n - 1].address == context->lineTable[i].address)) n --;
+    context->lineTable[n ++] = context->lineTable[i];
+  }
+  context->lineCount = n;
+
+  for (i = 0, n = 0; i < context->arrayCount; i ++) {
+    if (dead[context->arrayTable[i].address]) continue;
+    context->arrayTable[n] = context->arrayTable[i];
+    context->arrayTable[n ++].address = addressMap[context->arrayTable[i].address];
+  }
+  context->arrayCount = n;
+  for (i = 0, n = 0; i < context->callCount; i ++) {
+    if (dead[context->callTable[i].address]) continue;
+    context->callTable[n] = context->callTable[i];
+    context->callTable[n].address = addressMap[context->callTable[i].address];
+    context->callTable[n].caller = addressMap[context->callTable[i].caller];
+    if (context->callTable[i].import < 0) context->callTable[n].callee = addressMap[context->callTable[i].callee];
+    else context->callTable[n].import = importMap[context->callTable[i].import];
+    n ++;
+  }
+  context->callCount = n;
+  for (i = 0, n = 0; i < context->tailCallCount; i ++) {
+    struct SelfCall_* self = context->selfCallTable + i;
+    if (dead[self->call]) continue;
+    context->selfCallTable[n].reserve = addressMap[self->reserve];
+    context->selfCallTable[n].call = addressMap[self->call];
+    context->selfCallTable[n].result = (self->result >= 0) ? addressMap[self->result] : -1;
+    context->selfCallTable[n ++].body = addressMap[self->body];
+  }
+  context->tailCallCount = context->selfCallCount = n;
+
+  free(importMap);
+  free(addressMap);
+  free(dead);
+  return removed;
+}
+
+/* The entry point and every subprogram, the code reached from outside */
+static CodeAddress* collectEntries(CompilerContext* context, int* entryCount) {
+  CodeAddress* entries = (CodeAddress*) malloc((context->symbolCount + 1) * sizeof(CodeAddress));
+  int i;
+
+  *entryCount = 0;
+  entries[(*entryCount) ++] = context->entryPoint;
+  for (i = 0; i < context->symbolCount; i ++)
+    entries[(*entryCount) ++] = context->symbolTable[i].address;
+  return entries;
+}
+
+static IrProgram* liftCodeBuffer(CompilerContext* context) {
+  IrProgram* program;
+  CodeAddress* entries;
+  int* relocs = (int*) malloc((context->codeBlock->codeSize + 1) * sizeof(int));
+  int* symbols = (int*) malloc((context->codeBlock->codeSize + 1) * sizeof(int));
+  int* importResults = (int*) malloc((context->importCount + 1) * sizeof(int));
+  ArrayExtent* arrays = (ArrayExtent*) calloc(context->codeBlock->codeSize + 1, sizeof(ArrayExtent));
+  int entryCount, i;
+
+  for (i = 0; i < context->codeBlock->codeSize; i ++) {
+    relocs[i] = NO_RELOCATION;
+    symbols[i] = 0;
+  }
+  for (i = 0; i < context->arrayCount; i ++)
+    arrays[context->arrayTable[i].address] = context->arrayTable[i].extent;
+  for (i = 0; i < context->relocationCount; i ++) {
+    relocs[context->relocationTable[i].address] = context->relocationTable[i].kind;
+    symbols[context->relocationTable[i].address] = context->relocationTable[i].symbol;
+  }
+  for (i = 0; i < context->importCount; i ++)
+    importResults[i] = context->importTable[i].kind == OBJ_FUNCTION;
+
+  entries = collectEntries(context, &entryCount);
+  program = buildIr(context->codeBlock, entries, entryCount, relocs, symbols, importResults, arrays, context->profile);
+  if (program != NULL) {
+    // A value kept in a temporary costs the stack code an LA, an ST and an LV
+    numberValues(program, 4);
+    optimizeLoops(program);
+  }
+  free(entries);
+  free(arrays);
+  free(relocs);
+  free(symbols);
+  free(importResults);
+  return program;
+}
+
+static int lineAt(CompilerContext* context, CodeAddress address) {
+  int low = 0, high = context->lineCount - 1, mid;
+  int lineNo = 0;
+
+  while (low <= high) {
+    mid = (low + high) / 2;
+    if (context->lineTable[mid].address <= address) {
+      lineNo = context->lineTable[mid].lineNo;
+      low = mid + 1;
+    } else high = mid - 1;
+  }
+  return lineNo;
+}
+
+/* Replaces the code buffer with the code generated back from its SSA form.
+ * The code is left alone when it can not be lifted or the new code does
+ * not verify; code calling imports is only checked once it is linked.
+ */
+static void rewriteThroughIr(CompilerContext* context) {
+  IrProgram* program = liftCodeBuffer(context);
+  LoweredCode lowered;
+  VerifyResult verifyResult;
+  CodeAddress* entryMap;
+  LineEntry* lines;
+  int ok, lineNo, i, n;
+
+  if (program == NULL) return;
+  entryMap = (CodeAddress*) malloc((context->codeBlock->codeSize + 1) * sizeof(CodeAddress));
+  ok = lowerIr(program, context->codeBlock, context->relocationTable, context->relocationCount, &lowered, entryMap)
+    && (entryMap[context->entryPoint] >= 0);
+  freeIr(program);
+  for (i = 0; (i < context->symbolCount) && ok; i ++)
+    ok = entryMap[context->symbolTable[i].address] >= 0;
+  if (ok && (context->importCount == 0)) {
+    ok = verifyCode(lowered.codeBlock, entryMap[context->entryPoint], &verifyResult);
+    freeVerifyResult(&verifyResult);
+  }
+  if (!ok) {
+    freeLoweredCode(&lowered);
+    free(entryMap);
+    return;
+  }
+
+  context->entryPoint = entryMap[context->entryPoint];
+  for (i = 0; i < context->symbolCount; i ++)
+    context->symbolTable[i].address = entryMap[context->symbolTable[i].address];
+  for (i = 0; i < context->exportCount; i ++)
+    context->exportTable[i].address = entryMap[context->exportTable[i].address];
+
+  // A new line starts wherever the source line of the code changes
+  lines = (LineEntry*) malloc(context->maxLineCount * sizeof(LineEntry));
+  for (i = 0, n = 0; i < lowered.codeBlock->codeSize; i ++) {
+    lineNo = lineAt(context, lowered.origins[i]);
+    if ((n > 0) && (lines[n - 1].lineNo == lineNo)) continue;
+    if (n >= context->maxLineCount) {
+      context->maxLineCount *= 2;
+      lines = (LineEntry*) realloc(lines, context->maxLineCount * sizeof(LineEntry));
+    }
+    lines[n].address = i;
+    lines[n ++].lineNo = lineNo;
+  }
+  free(context->lineTable);
+  context->lineTable = lines;
+  context->lineCount = n;
+
+  free(context->relocationTable);
+  context->relocationTable = lowered.relocations;
+  context->relocationCount = lowered.relocationCount;
+  context->maxRelocationCount = (lowered.maxRelocationCount > 0) ? lowered.maxRelocationCount : INITIAL_TABLE_SIZE;
+  if (context->relocationTable == NULL)
+    context->relocationTable = (Relocation*) malloc(context->maxRelocationCount * sizeof(Relocation));
+
+  // The array table refers to the old code
+  context->arrayCount = 0;
+  freeCodeBlock(context->codeBlock);
+  context->codeBlock = lowered.codeBlock;
+  free(lowered.origins);
+  free(entryMap);
+}
+
+void printCodeIr(CompilerContext* context) {
+  IrProgram* program = liftCodeBuffer(context);
+
+  if (program == NULL) {
+    printf("kplc: the code can not be put in SSA form.\n");
+    return;
+  }
+  printIr(program);
+  freeIr(program);
+}
+
+/* The IR of the code buffer is inlined and laid out by the counts of the
+ * profile from now on. Returns 0, and does not use it, when the profile
+ * was recorded on other code.
+ */
+int useProfile(CompilerContext* context, Profile* codeProfile) {
+  if (!isProfileOf(codeProfile, context->codeBlock)) return 0;
+  context->profile = codeProfile;
+  return 1;
+}
+
+/* Runs the optimizer over the code buffer and moves the debug and link
+ * tables along with the code, returns the number of instructions removed.
+ */
+int optimizeCodeBuffer(CompilerContext* context, int level) {
+  CodeAddress* addressMap;
+  CodeAddress* entries;
+  int entryCount;
+  int sourceSize = context->codeBlock->codeSize;
+  int i, n;
+
+  elideStaticLinks(context);
+  if (level >= 2) rewriteThroughIr(context);
+
+  // Exported subprograms may be entered from other units
+  entries = collectEntries(context, &entryCount);
+  addressMap = (CodeAddress*) malloc((context->codeBlock->codeSize + 1) * sizeof(CodeAddress));
+
+  optimizeCode(context->codeBlock, entries, entryCount, level, addressMap);
+
+  context->entryPoint = addressMap[context->entryPoint];
+  for (i = 0; i < context->symbolCount; i ++)
+    context->symbolTable[i].address = addressMap[context->symbolTable[i].address];
+  for (i = 0; i < context->exportCount; i ++)
+    context->exportTable[i].address = addressMap[context->exportTable[i].address];
+
+  // Lines whose code disappeared collapse onto the next line
+  for (i = 0, n = 0; i < context->lineCount; i ++) {
+    context->lineTable[i].address = addressMap[context->lineTable[i].address];
+    if ((n > 0) && (context->lineTable[n - 1].address == context->lineTable[i].address)) n --;
+    context->lineTable[n ++] = context->lineTable[i];
+  }
+  context->lineCount = n;
+
+  // A removed instruction maps to the same address as its successor
+  for (i = 0, n = 0; i < context->relocationCount; i ++) {
+    CodeAddress address = context->relocationTable[i].address;
+    if (addressMap[address] == addressMap[address + 1]) continue;
+    context->relocationTable[n] = context->relocationTable[i];
+    context->relocationTable[n ++].address = addressMap[address];
+  }
+  context->relocationCount = n;
+
+  free(entries);
+  free(addressMap);
+  return sourceSize - context->codeBlock->codeSize;
+}
+
+static int writeImage(char* fileName, Executable* exe, enum CodeEncoding encoding) {
   FILE* f;
+  int ok;
 
   f = fopen(fileName, "wb");
   if (f == NULL) return IO_ERROR;
-  saveCode(codeBlock, f);
-  fclose(f);
-  return IO_SUCCESS;
-}
\ No newline at end of file
+  ok = saveExecutable(exe, encoding, f);
+  if (fclose(f) != 0) ok = 0;
+  return ok ? IO_SUCCESS : IO_ERROR;
+}
+
+static void fillExecutable(CompilerContext* context, Executable* exe) {
+  memset(exe, 0, sizeof(Executable));
+  exe->codeBlock = context->codeBlock;
+  exe->entryPoint = context->entryPoint;
+  exe->lines = context->lineTable;
+  exe->lineCount = context->lineCount;
+  exe->symbols = context->symbolTable;
+  exe->symbolCount = context->symbolCount;
+  exe->constants = context->constantTable;
+  exe->constantCount = context->constantCount;
+}
+
+int serialize(CompilerContext* context, char* fileName, enum CodeEncoding encoding) {
+  Executable exe;
+  VerifyResult verifyResult;
+
+  fillExecutable(context, &exe);
+  // Record the stack the program needs when it is known statically
+  exe.stackSize = 0;
+  if (verifyCode(context->codeBlock, context->entryPoint, &verifyResult) && (verifyResult.maxStackSize != UNBOUNDED_STACK))
+    exe.stackSize = verifyResult.maxStackSize;
+  freeVerifyResult(&verifyResult);
+  return writeImage(fileName, &exe, encoding);
+}
+
+int serializeObject(CompilerContext* context, char* fileName, enum CodeEncoding encoding) {
+  Executable exe;
+
+  // Stack needs are only known once the units are linked
+  fillExecutable(context, &exe);
+  exe.isObject = 1;
+  exe.exports = context->exportTable;
+  exe.exportCount = context->exportCount;
+  exe.imports = context->importTable;
+  exe.importCount = context->importCount;
+  exe.relocations = context->relocationTable;
+  exe.relocationCount = context->relocationCount;
+  return writeImage(fileName, &exe, encoding);
+}
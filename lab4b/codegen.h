@@ -9,14 +9,17 @@
 
 #include "symtab.h"
 #include "instructions.h"
+#include "executable.h"
+#include "profile.h"
+#include "context.h"
 
 #define RESERVED_WORDS 4
 
-#define PROCEDURE_PARAM_COUNT(proc) (proc->procAttrs->numOfParams)
+#define PROCEDURE_PARAM_COUNT(proc) (proc->procAttrs->paramCount)
 #define PROCEDURE_SCOPE(proc) (proc->procAttrs->scope)
 #define PROCEDURE_FRAME_SIZE(proc) (proc->procAttrs->scope->frameSize)
 
-#define FUNCTION_PARAM_COUNT(func) (func->funcAttrs->numOfParams)
+#define FUNCTION_PARAM_COUNT(func) (func->funcAttrs->paramCount)
 #define FUNCTION_SCOPE(func) (func->funcAttrs->scope)
 #define FUNCTION_FRAME_SIZE(func) (func->funcAttrs->scope->frameSize)
 
@@ -34,54 +37,107 @@
 #define RETURN_ADDRESS_OFFSET 2
 #define STATIC_LINK_OFFSET 3
 
-void genVariableAddress(Object* var);
-void genVariableValue(Object* var);
-
-void genPredefinedProcedureCall(Object* proc);
-void genPredefinedFunctionCall(Object* func);
-
-void genLA(int level, int offset);
-void genLV(int level, int offset);
-void genLC(WORD constant);
-void genLI(void);
-void genINT(int delta);
-void genDCT(int delta);
-Instruction* genJ(CodeAddress label);
-Instruction* genFJ(CodeAddress label);
-void genHL(void);
-void genST(void);
-void genCALL(int level, CodeAddress label);
-void genEP(void);
-void genEF(void);
-void genRC(void);
-void genRI(void);
-void genWRC(void);
-void genWRI(void);
-void genWLN(void);
-void genAD(void);
-void genSB(void);
-void genML(void);
-void genDV(void);
-void genNEG(void);
-void genCV(void);
-void genEQ(void);
-void genNE(void);
-void genGT(void);
-void genGE(void);
-void genLT(void);
-void genLE(void);
-
-void updateJ(Instruction* jmp, CodeAddress label);
-void updateFJ(Instruction* jmp, CodeAddress label);
-
-CodeAddress getCurrentCodeAddress(void);
-int isPredefinedProcedure(Object* proc);
-int isPredefinedFunction(Object* func);
-
-void initCodeBuffer(void);
-void printCodeBuffer(void);
-void cleanCodeBuffer(void);
-
-int serialize(char* fileName);
+/* Saved state of the code buffer, to drop code that turned out to be dead */
+struct CodeMark_ {
+  CodeAddress codeSize;
+  int lineCount;
+  int lineNo;
+  int relocationCount;
+  int importCount;
+  int arrayCount;
+  int selfCallCount;
+  int callCount;
+};
+
+typedef struct CodeMark_ CodeMark;
+
+int computeNestedLevel(CompilerContext* context, Scope* scope);
+
+void genVariableAddress(CompilerContext* context, Object* var);
+void genVariableValue(CompilerContext* context, Object* var);
+void genParameterAddress(CompilerContext* context, Object* param);
+void genParameterValue(CompilerContext* context, Object* param);
+void genReturnValueAddress(CompilerContext* context, Object* func);
+void genReturnValueValue(CompilerContext* context, Object* func);
+
+void genProcedureCall(CompilerContext* context, Object* proc);
+void genFunctionCall(CompilerContext* context, Object* func);
+void genScopeFrame(CompilerContext* context, Scope* scope);
+void addSelfCall(CompilerContext* context, CodeAddress reserve);
+void addResultStore(CompilerContext* context, CodeAddress result);
+void genTailCalls(CompilerContext* context);
+void resolveStaticLinks(CompilerContext* context);
+
+void genPredefinedProcedureCall(CompilerContext* context, Object* proc);
+void genPredefinedFunctionCall(CompilerContext* context, Object* func);
+
+void genLA(CompilerContext* context, int level, int offset);
+void genLV(CompilerContext* context, int level, int offset);
+void genLC(CompilerContext* context, WORD constant);
+void genLI(CompilerContext* context);
+void genINT(CompilerContext* context, int delta);
+void genDCT(CompilerContext* context, int delta);
+CodeAddress genJ(CompilerContext* context, CodeAddress label);
+CodeAddress genFJ(CompilerContext* context, CodeAddress label);
+CodeAddress genFORINIT(CompilerContext* context, CodeAddress label);
+void genFORSTEP(CompilerContext* context, CodeAddress label);
+void genHL(CompilerContext* context);
+void genST(CompilerContext* context);
+void genCALL(CompilerContext* context, int level, CodeAddress label);
+void genEP(CompilerContext* context);
+void genEF(CompilerContext* context);
+void genRC(CompilerContext* context);
+void genRI(CompilerContext* context);
+void genWRC(CompilerContext* context);
+void genWRI(CompilerContext* context);
+void genWLN(CompilerContext* context);
+void genAD(CompilerContext* context);
+void genIX(CompilerContext* context, int stride);
+void addArrayAccess(CompilerContext* context, CodeAddress address, int size);
+void genAddressOffset(CompilerContext* context, CodeAddress address, int offset);
+void genSB(CompilerContext* context);
+void genML(CompilerContext* context);
+void genDV(CompilerContext* context);
+void genNEG(CompilerContext* context);
+void genCV(CompilerContext* context);
+void genEQ(CompilerContext* context);
+void genNE(CompilerContext* context);
+void genGT(CompilerContext* context);
+void genGE(CompilerContext* context);
+void genLT(CompilerContext* context);
+void genLE(CompilerContext* context);
+
+void updateJ(CompilerContext* context, CodeAddress jmp, CodeAddress label);
+void updateFJ(CompilerContext* context, CodeAddress jmp, CodeAddress label);
+void updateFORINIT(CompilerContext* context, CodeAddress jmp, CodeAddress label);
+
+CodeAddress getCurrentCodeAddress(CompilerContext* context);
+int isConstantCode(CompilerContext* context, CodeAddress start, WORD* value);
+int isFrameAddress(CompilerContext* context, CodeAddress start);
+int isIndependentCode(CompilerContext* context, CodeAddress variable, CodeAddress start);
+void genCopy(CompilerContext* context, CodeAddress start, CodeAddress end);
+CodeMark markCode(CompilerContext* context);
+void discardCode(CompilerContext* context, CodeMark mark);
+int isPredefinedProcedure(CompilerContext* context, Object* proc);
+int isPredefinedFunction(CompilerContext* context, Object* func);
+
+void addLineNumber(CompilerContext* context, int lineNo);
+void addSymbol(CompilerContext* context, Object* obj);
+void addConstant(CompilerContext* context, Object* obj);
+void closeSymbol(CompilerContext* context, Object* obj);
+
+void initCodeBuffer(CompilerContext* context);
+void printCodeBuffer(CompilerContext* context);
+void cleanCodeBuffer(CompilerContext* context);
+
+void printCallGraph(CompilerContext* context, int keepExports);
+int removeUnreachableCode(CompilerContext* context, int keepExports);
+void applyTailCalls(CompilerContext* context);
+int useProfile(CompilerContext* context, Profile* profile);
+int optimizeCodeBuffer(CompilerContext* context, int level);
+void printCodeIr(CompilerContext* context);
+int hasUnresolvedImports(CompilerContext* context);
+int serialize(CompilerContext* context, char* fileName, enum CodeEncoding encoding);
+int serializeObject(CompilerContext* context, char* fileName, enum CodeEncoding encoding);
 
 #endif
@@ -0,0 +1,12 @@
+/* State of the compilation of one source */
+
+#include <stdlib.h>
+#include "context.h"
+
+CompilerContext* createCompilerContext(void) {
+  return (CompilerContext*) calloc(1, sizeof(CompilerContext));
+}
+
+void freeCompilerContext(CompilerContext* context) {
+  free(context);
+}
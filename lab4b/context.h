@@ -0,0 +1,88 @@
+/* State of the compilation of one source */
+
+#ifndef __CONTEXT_H__
+#define __CONTEXT_H__
+
+#include <stdio.h>
+#include "token.h"
+#include "symtab.h"
+#include "instructions.h"
+#include "executable.h"
+#include "profile.h"
+
+// Later errors are counted but not kept
+#define MAX_DIAGNOSTICS 100
+
+struct Diagnostic_ {
+  int lineNo;
+  int colNo;
+  char *message;
+  TokenType tokenType;    // of a missing token, or TK_NONE
+};
+
+typedef struct Diagnostic_ Diagnostic;
+
+/* The state of the compilation of one source, from the characters read to
+ * the code generated. The reader, scanner, parser, semantic checks and code
+ * generator keep no state of their own, so sources can be compiled one
+ * after the other, or side by side, each with its own context.
+ */
+struct CompilerContext_ {
+  // Reader
+  FILE* inputStream;
+  int lineNo, colNo;
+  int currentChar;
+
+  // Parser
+  Token* currentToken;
+  Token* lookAhead;
+
+  // Errors, reported at the end of the compilation
+  Diagnostic diagnostics[MAX_DIAGNOSTICS];
+  int diagnosticCount;
+  int errorCount;
+  int panicMode;
+
+  SymTab* symtab;
+  SymTab* predefined;          // shared by the contexts of a batch, or NULL
+
+  // Code generator, the tables of private types are defined in codegen.c
+  CodeBlock* codeBlock;
+  CodeAddress foldBarrier;     // code below it may be the target of a jump, it is never folded
+
+  // Debug information written next to the code
+  CodeAddress entryPoint;
+  LineEntry* lineTable;
+  int lineCount, maxLineCount;
+  SymbolEntry* symbolTable;
+  int symbolCount, maxSymbolCount;
+  CodeAddress* symbolEnds;     // end of the code of each symbol, nested subprograms included
+  ConstantEntry* constantTable;
+  int constantCount, maxConstantCount;
+
+  // Link information, written only to object files
+  LinkSymbol* exportTable;
+  int exportCount, maxExportCount;
+  LinkSymbol* importTable;
+  int importCount, maxImportCount;
+  Relocation* relocationTable;
+  int relocationCount, maxRelocationCount;
+
+  struct ArrayAccess_* arrayTable;
+  int arrayCount, maxArrayCount;
+  struct SelfCall_* selfCallTable;
+  int selfCallCount, maxSelfCallCount;
+  int tailCallCount;           // the first entries of selfCallTable, see genTailCalls
+  CodeAddress bodyAddress;     // first statement of the innermost subprogram being compiled
+  struct Call_* callTable;
+  int callCount, maxCallCount;
+
+  Profile* profile;
+};
+
+typedef struct CompilerContext_ CompilerContext;
+
+CompilerContext* createCompilerContext(void);
+void freeCompilerContext(CompilerContext* context);
+
+#endif
@@ -25,6 +25,9 @@ void printType(Type* type) {
     printType(type->elementType);
     printf(")");
     break;
+  case TP_POISON:
+    printf("Poison");
+    break;
   }
 }
 
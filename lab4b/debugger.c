@@ -0,0 +1,98 @@
+/* Interactive debugger of kplrun */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "debugger.h"
+
+#define MAX_COMMAND_LEN 100
+
+extern WORD* stack;
+extern int stackSize;
+extern int t;
+extern int b;
+extern CodeAddress pc;
+
+void printDebugHelp(void) {
+  printf("  s          : execute one instruction\n");
+  printf("  c          : continue to the next breakpoint\n");
+  printf("  b address  : set a breakpoint\n");
+  printf("  d address  : delete a breakpoint\n");
+  printf("  i          : show registers and current instruction\n");
+  printf("  t [n]      : show the n top words of the stack\n");
+  printf("  x address  : show one stack word\n");
+  printf("  q          : quit\n");
+}
+
+void printCurrentInstruction(Executable* exe) {
+  SymbolEntry* symbol = findSymbol(exe, pc);
+  int lineNo = findLineNo(exe, pc);
+
+  printf("%d:  ", pc);
+  printInstruction(getInstruction(pc));
+  if (symbol != NULL) printf("\t[%s", symbol->name);
+  if (lineNo > 0) printf(", line %d", lineNo);
+  if (symbol != NULL) printf("]");
+  printf("\n");
+}
+
+void printStackTop(int n) {
+  int i;
+  for (i = t; (i >= 0) && (i > t - n); i --)
+    printf("  s[%d] = %d\n", i, stack[i]);
+}
+
+/* Interactive loop entered whenever the VM stops at a breakpoint.
+ * Returns the final program state.
+ */
+int debug(int ps, Executable* exe) {
+  char command[MAX_COMMAND_LEN];
+  int arg;
+
+  while (ps == PS_BREAKPOINT || ps == PS_ACTIVE) {
+    printCurrentInstruction(exe);
+    printf("(kpldbg) ");
+    fflush(stdout);
+    if (fgets(command, MAX_COMMAND_LEN, stdin) == NULL)
+      return PS_DONE;
+
+    switch (command[0]) {
+    case 's':
+      ps = step();
+      if (ps == PS_ACTIVE) ps = PS_BREAKPOINT;
+      break;
+    case 'c':
+      ps = resume();
+      break;
+    case 'b':
+      if ((sscanf(command + 1, "%d", &arg) != 1) || !setBreakpoint(arg))
+	printf("Can\'t set breakpoint!\n");
+      break;
+    case 'd':
+      if ((sscanf(command + 1, "%d", &arg) != 1) || !clearBreakpoint(arg))
+	printf("No such breakpoint!\n");
+      break;
+    case 'i':
+      printf("  pc = %d, b = %d, t = %d\n", pc, b, t);
+      break;
+    case 't':
+      if (sscanf(command + 1, "%d", &arg) != 1) arg = 1;
+      printStackTop(arg);
+      break;
+    case 'x':
+      if ((sscanf(command + 1, "%d", &arg) == 1) && (arg >= 0) && (arg < stackSize))
+	printf("  s[%d] = %d\n", arg, stack[arg]);
+      else printf("Invalid stack address!\n");
+      break;
+    case 'q':
+      return PS_DONE;
+    case '\n':
+      break;
+    default:
+      printDebugHelp();
+      break;
+    }
+  }
+  return ps;
+}
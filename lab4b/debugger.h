@@ -0,0 +1,10 @@
+/* Interactive debugger of kplrun */
+
+#ifndef __DEBUGGER_H__
+#define __DEBUGGER_H__
+
+#include "executable.h"
+
+int debug(int ps, Executable* exe);
+
+#endif
@@ -8,14 +8,14 @@
 #include <stdlib.h>
 #include "error.h"
 
-#define NUM_OF_ERRORS 29
+#define NUM_OF_ERRORS 30
 
 struct ErrorMessage {
   ErrorCode errorCode;
   char *message;
 };
 
-struct ErrorMessage errors[29] = {
+struct ErrorMessage errors[30] = {
   {ERR_END_OF_COMMENT, "End of comment expected."},
   {ERR_IDENT_TOO_LONG, "Identifier too long."},
   {ERR_INVALID_CONSTANT_CHAR, "Invalid char constant."},
@@ -44,21 +44,73 @@ struct ErrorMessage errors[29] = {
   {ERR_UNDECLARED_PROCEDURE, "Undeclared procedure."},
   {ERR_DUPLICATE_IDENT, "Duplicate identifier."},
   {ERR_TYPE_INCONSISTENCY, "Type inconsistency"},
-  {ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY, "The number of arguments and the number of parameters are inconsistent."}
+  {ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY, "The number of arguments and the number of parameters are inconsistent."},
+  {ERR_INVALID_EXTERNAL, "External subprograms must be declared at program level."}
 };
 
-void error(ErrorCode err, int lineNo, int colNo) {
+/* Errors are kept until the end of the compilation. After one, the parser
+ * is in panic mode: it skips tokens up to one it can resume at, and the
+ * errors found on the way, caused by the first one, are not reported.
+ */
+static void addDiagnostic(CompilerContext* context, int lineNo, int colNo, char *message, TokenType tokenType) {
+  if (context->panicMode) return;
+  context->panicMode = 1;
+  if (context->diagnosticCount < MAX_DIAGNOSTICS) {
+    context->diagnostics[context->diagnosticCount].lineNo = lineNo;
+    context->diagnostics[context->diagnosticCount].colNo = colNo;
+    context->diagnostics[context->diagnosticCount].message = message;
+    context->diagnostics[context->diagnosticCount].tokenType = tokenType;
+    context->diagnosticCount ++;
+  }
+  context->errorCount ++;
+}
+
+void error(CompilerContext* context, ErrorCode err, int lineNo, int colNo) {
   int i;
   for (i = 0 ; i < NUM_OF_ERRORS; i ++) 
     if (errors[i].errorCode == err) {
-      printf("%d-%d:%s\n", lineNo, colNo, errors[i].message);
-      exit(0);
+      addDiagnostic(context, lineNo, colNo, errors[i].message, TK_NONE);
+      return;
     }
 }
 
-void missingToken(TokenType tokenType, int lineNo, int colNo) {
-  printf("%d-%d:Missing %s\n", lineNo, colNo, tokenToString(tokenType));
-  exit(0);
+void missingToken(CompilerContext* context, TokenType tokenType, int lineNo, int colNo) {
+  addDiagnostic(context, lineNo, colNo, NULL, tokenType);
+}
+
+int isPanicMode(CompilerContext* context) {
+  return context->panicMode;
+}
+
+void leavePanicMode(CompilerContext* context) {
+  context->panicMode = 0;
+}
+
+static int isBefore(Diagnostic* x, Diagnostic* y) {
+  return (x->lineNo < y->lineNo) || ((x->lineNo == y->lineNo) && (x->colNo < y->colNo));
+}
+
+/* The scanner runs a token ahead of the parser, so the errors are put in
+ * the order of the source first; they are nearly sorted already
+ */
+int reportErrors(CompilerContext* context) {
+  Diagnostic diagnostic;
+  int i, j;
+
+  for (i = 1; i < context->diagnosticCount; i ++) {
+    diagnostic = context->diagnostics[i];
+    for (j = i; (j > 0) && isBefore(&diagnostic, context->diagnostics + j - 1); j --)
+      context->diagnostics[j] = context->diagnostics[j - 1];
+    context->diagnostics[j] = diagnostic;
+  }
+  for (i = 0; i < context->diagnosticCount; i ++)
+    if (context->diagnostics[i].message != NULL)
+      printf("%d-%d:%s\n", context->diagnostics[i].lineNo, context->diagnostics[i].colNo, context->diagnostics[i].message);
+    else printf("%d-%d:Missing %s\n", context->diagnostics[i].lineNo, context->diagnostics[i].colNo,
+		tokenToString(context->diagnostics[i].tokenType));
+  if (context->errorCount > context->diagnosticCount)
+    printf("%d more errors.\n", context->errorCount - context->diagnosticCount);
+  return context->errorCount;
 }
 
 void assert(char *msg) {
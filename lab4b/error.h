@@ -7,6 +7,7 @@
 #ifndef __ERROR_H__
 #define __ERROR_H__
 #include "token.h"
+#include "context.h"
 
 typedef enum {
   ERR_END_OF_COMMENT,
@@ -37,11 +38,20 @@ typedef enum {
   ERR_UNDECLARED_PROCEDURE,
   ERR_DUPLICATE_IDENT,
   ERR_TYPE_INCONSISTENCY,
-  ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY
+  ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY,
+  ERR_INVALID_EXTERNAL
 } ErrorCode;
 
-void error(ErrorCode err, int lineNo, int colNo);
-void missingToken(TokenType tokenType, int lineNo, int colNo);
+void error(CompilerContext* context, ErrorCode err, int lineNo, int colNo);
+void missingToken(CompilerContext* context, TokenType tokenType, int lineNo, int colNo);
+
+/* Errors are reported together once the source is parsed. An error puts
+ * the parser in panic mode, where the errors it causes further on are
+ * not reported, until a token is matched again.
+ */
+int isPanicMode(CompilerContext* context);
+void leavePanicMode(CompilerContext* context);
+int reportErrors(CompilerContext* context);
 void assert(char *msg);
 
 #endif
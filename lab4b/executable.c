@@ -0,0 +1,257 @@
+/* Executable and object files of kplc, kplrun and kpl-ld */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "executable.h"
+
+static unsigned int computeChecksum(unsigned char* data, size_t size) {
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < size; i ++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int align(int offset, int alignment) {
+  return ((offset + alignment - 1) / alignment) * alignment;
+}
+
+int saveExecutable(Executable* exe, enum CodeEncoding encoding, FILE* f) {
+  ExecutableHeader* header;
+  SectionHeader layout[NUM_OF_SECTIONS];
+  void* contents[NUM_OF_SECTIONS];
+  unsigned char* image;
+  int sectionCount = 0;
+  int offset;
+  int size;
+  int written;
+  int i;
+
+#define ADD_SECTION(sectionKind, data, entryCount, entrySize) \
+  layout[sectionCount].kind = sectionKind; \
+  layout[sectionCount].encoding = CODE_RAW; \
+  layout[sectionCount].size = (entryCount) * (entrySize); \
+  layout[sectionCount].count = entryCount; \
+  contents[sectionCount ++] = data;
+
+  ADD_SECTION(SECTION_CONSTANTS, exe->constants, exe->constantCount, sizeof(ConstantEntry));
+  ADD_SECTION(SECTION_LINES, exe->lines, exe->lineCount, sizeof(LineEntry));
+  ADD_SECTION(SECTION_SYMBOLS, exe->symbols, exe->symbolCount, sizeof(SymbolEntry));
+  if (exe->isObject) {
+    ADD_SECTION(SECTION_EXPORTS, exe->exports, exe->exportCount, sizeof(LinkSymbol));
+    ADD_SECTION(SECTION_IMPORTS, exe->imports, exe->importCount, sizeof(LinkSymbol));
+    ADD_SECTION(SECTION_RELOCATIONS, exe->relocations, exe->relocationCount, sizeof(Relocation));
+  }
+  // The code section goes last so that page-aligning it only pads once
+  ADD_SECTION(SECTION_CODE, NULL, exe->codeBlock->codeSize, sizeof(Instruction));
+  layout[sectionCount - 1].encoding = encoding;
+  if (encoding == CODE_COMPACT)
+    layout[sectionCount - 1].size = saveCode(exe->codeBlock, NULL);
+#undef ADD_SECTION
+
+  offset = sizeof(ExecutableHeader) + sectionCount * sizeof(SectionHeader);
+  for (i = 0; i < sectionCount; i ++) {
+    if ((layout[i].kind == SECTION_CODE) && (encoding == CODE_RAW))
+      offset = align(offset, CODE_ALIGNMENT);
+    else offset = align(offset, sizeof(WORD));
+    layout[i].offset = offset;
+    offset += layout[i].size;
+  }
+  size = offset;
+
+  image = (unsigned char*) calloc(size, 1);
+  if (image == NULL) return 0;
+
+  header = (ExecutableHeader*) image;
+  memcpy(header->magic, exe->isObject ? OBJECT_MAGIC : EXECUTABLE_MAGIC, 4);
+  header->version = EXECUTABLE_VERSION;
+  header->entryPoint = exe->entryPoint;
+  header->stackSize = exe->stackSize;
+  header->sectionCount = sectionCount;
+  memcpy(image + sizeof(ExecutableHeader), layout, sectionCount * sizeof(SectionHeader));
+
+  for (i = 0; i < sectionCount; i ++) {
+    if (layout[i].kind != SECTION_CODE) {
+      if (layout[i].size > 0)
+	memcpy(image + layout[i].offset, contents[i], layout[i].size);
+    } else if (encoding == CODE_RAW)
+      memcpy(image + layout[i].offset, exe->codeBlock->code, layout[i].size);
+    else saveCode(exe->codeBlock, image + layout[i].offset);
+  }
+
+  header->checksum = computeChecksum(image + sizeof(ExecutableHeader), size - sizeof(ExecutableHeader));
+
+  written = fwrite(image, 1, size, f);
+  free(image);
+  return written == size;
+}
+
+static SectionHeader* findSection(SectionHeader* sections, int count, enum SectionKind kind) {
+  int i;
+  for (i = 0; i < count; i ++)
+    if (sections[i].kind == kind) return sections + i;
+  return NULL;
+}
+
+static int checkSection(SectionHeader* section, size_t imageSize, size_t entrySize) {
+  if ((section->offset < 0) || (section->size < 0) || (section->count < 0)) return 0;
+  if ((section->offset % sizeof(WORD)) != 0) return 0;
+  if ((size_t) section->offset + section->size > imageSize) return 0;
+  if ((entrySize > 0) && ((size_t) section->size != section->count * entrySize)) return 0;
+  return 1;
+}
+
+static int loadCodeSection(Executable* exe, unsigned char* image, SectionHeader* section, size_t imageSize) {
+  CodeBlock* codeBlock;
+
+  if (section->encoding == CODE_RAW) {
+    // Execute straight from the mapping
+    if (!checkSection(section, imageSize, sizeof(Instruction))) return 0;
+    codeBlock = (CodeBlock*) malloc(sizeof(CodeBlock));
+    if (codeBlock == NULL) return 0;
+    codeBlock->code = (Instruction*) (image + section->offset);
+    codeBlock->codeSize = section->count;
+    codeBlock->maxSize = section->count;
+    exe->mappedCode = 1;
+  } else if (section->encoding == CODE_COMPACT) {
+    // Every encoded instruction takes at least one byte
+    if (!checkSection(section, imageSize, 0) || (section->count > section->size)) return 0;
+    codeBlock = createCodeBlock(section->count);
+    if (!loadCode(codeBlock, image + section->offset, section->size)
+	|| (codeBlock->codeSize != section->count)) {
+      freeCodeBlock(codeBlock);
+      return 0;
+    }
+    exe->mappedCode = 0;
+  } else return 0;
+
+  exe->codeBlock = codeBlock;
+  return 1;
+}
+
+/* Points table at the entries of an optional section of the image */
+static int loadTable(unsigned char* image, size_t imageSize, SectionHeader* sections, int sectionCount,
+		     enum SectionKind kind, size_t entrySize, void** table, int* count) {
+  SectionHeader* section = findSection(sections, sectionCount, kind);
+
+  *table = NULL;
+  *count = 0;
+  if (section == NULL) return 1;
+  if (!checkSection(section, imageSize, entrySize)) return 0;
+  *table = image + section->offset;
+  *count = section->count;
+  return 1;
+}
+
+static int loadImage(Executable* exe, unsigned char* image, size_t imageSize, char* magic) {
+  ExecutableHeader* header = (ExecutableHeader*) image;
+  SectionHeader* sections;
+  SectionHeader* section;
+
+  if (imageSize < sizeof(ExecutableHeader)) return 0;
+  if (memcmp(header->magic, magic, 4) != 0) return 0;
+  if (header->version != EXECUTABLE_VERSION) return 0;
+  if ((header->sectionCount <= 0) ||
+      (imageSize < sizeof(ExecutableHeader) + header->sectionCount * sizeof(SectionHeader)))
+    return 0;
+  if (header->checksum != computeChecksum(image + sizeof(ExecutableHeader), imageSize - sizeof(ExecutableHeader)))
+    return 0;
+
+  sections = (SectionHeader*) (image + sizeof(ExecutableHeader));
+
+  section = findSection(sections, header->sectionCount, SECTION_CODE);
+  if ((section == NULL) || !loadCodeSection(exe, image, section, imageSize)) return 0;
+
+  exe->entryPoint = header->entryPoint;
+  exe->stackSize = header->stackSize;
+  if ((exe->entryPoint < 0) || (exe->entryPoint >= exe->codeBlock->codeSize)) return 0;
+
+  return loadTable(image, imageSize, sections, header->sectionCount, SECTION_CONSTANTS,
+		   sizeof(ConstantEntry), (void**) &(exe->constants), &(exe->constantCount))
+    && loadTable(image, imageSize, sections, header->sectionCount, SECTION_LINES,
+		 sizeof(LineEntry), (void**) &(exe->lines), &(exe->lineCount))
+    && loadTable(image, imageSize, sections, header->sectionCount, SECTION_SYMBOLS,
+		 sizeof(SymbolEntry), (void**) &(exe->symbols), &(exe->symbolCount))
+    && loadTable(image, imageSize, sections, header->sectionCount, SECTION_EXPORTS,
+		 sizeof(LinkSymbol), (void**) &(exe->exports), &(exe->exportCount))
+    && loadTable(image, imageSize, sections, header->sectionCount, SECTION_IMPORTS,
+		 sizeof(LinkSymbol), (void**) &(exe->imports), &(exe->importCount))
+    && loadTable(image, imageSize, sections, header->sectionCount, SECTION_RELOCATIONS,
+		 sizeof(Relocation), (void**) &(exe->relocations), &(exe->relocationCount));
+}
+
+static Executable* openImage(char* fileName, char* magic) {
+  Executable* exe;
+  struct stat st;
+  int fd;
+
+  fd = open(fileName, O_RDONLY);
+  if (fd < 0) return NULL;
+  if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+    close(fd);
+    return NULL;
+  }
+
+  exe = (Executable*) calloc(1, sizeof(Executable));
+  exe->imageSize = st.st_size;
+  exe->image = mmap(NULL, exe->imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (exe->image == MAP_FAILED) {
+    free(exe);
+    return NULL;
+  }
+
+  if (!loadImage(exe, (unsigned char*) exe->image, exe->imageSize, magic)) {
+    closeExecutable(exe);
+    return NULL;
+  }
+  exe->isObject = (strcmp(magic, OBJECT_MAGIC) == 0);
+  return exe;
+}
+
+Executable* loadExecutable(char* fileName) {
+  return openImage(fileName, EXECUTABLE_MAGIC);
+}
+
+Executable* loadObject(char* fileName) {
+  return openImage(fileName, OBJECT_MAGIC);
+}
+
+void closeExecutable(Executable* exe) {
+  if (exe->codeBlock != NULL) {
+    if (exe->mappedCode) free(exe->codeBlock);
+    else freeCodeBlock(exe->codeBlock);
+  }
+  munmap(exe->image, exe->imageSize);
+  free(exe);
+}
+
+int findLineNo(Executable* exe, CodeAddress address) {
+  int i;
+  int lineNo = 0;
+
+  // Entries are in code order
+  for (i = 0; (i < exe->lineCount) && (exe->lines[i].address <= address); i ++)
+    lineNo = exe->lines[i].lineNo;
+  return lineNo;
+}
+
+SymbolEntry* findSymbol(Executable* exe, CodeAddress address) {
+  SymbolEntry* symbol = NULL;
+  int i;
+
+  for (i = 0; i < exe->symbolCount; i ++)
+    if ((exe->symbols[i].address <= address) &&
+	((symbol == NULL) || (exe->symbols[i].address > symbol->address)))
+      symbol = exe->symbols + i;
+  return symbol;
+}
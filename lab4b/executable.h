@@ -0,0 +1,139 @@
+/* Executable and object files of kplc, kplrun and kpl-ld */
+
+#ifndef __EXECUTABLE_H__
+#define __EXECUTABLE_H__
+
+#include <stdio.h>
+#include "instructions.h"
+
+/* Executable and object file layout:
+ *   ExecutableHeader
+ *   SectionHeader[sectionCount]
+ *   sections, each 4-byte aligned; a raw code section is page aligned so
+ *   that the runner can map it and execute it in place.
+ * The checksum covers every byte that follows the header.
+ */
+
+#define EXECUTABLE_MAGIC "KPLX"
+#define OBJECT_MAGIC "KPLO"
+#define EXECUTABLE_VERSION 1
+#define CODE_ALIGNMENT 4096
+#define MAX_SYMBOL_LEN 16
+
+enum SectionKind {
+  SECTION_CODE,
+  SECTION_CONSTANTS,
+  SECTION_LINES,
+  SECTION_SYMBOLS,
+  // Object files only
+  SECTION_EXPORTS,
+  SECTION_IMPORTS,
+  SECTION_RELOCATIONS,
+  NUM_OF_SECTIONS
+};
+
+enum RelocationKind {
+  RELOC_CODE,        // q is a code address in the unit
+  RELOC_IMPORT,      // q is the address of imports[symbol]
+  RELOC_GLOBAL,      // q is the offset of a program-level variable
+  RELOC_FRAME_SIZE   // q is the size of the program frame
+};
+
+enum CodeEncoding {
+  CODE_RAW,       // array of Instruction
+  CODE_COMPACT    // variable-length encoding, see saveCode
+};
+
+struct ExecutableHeader_ {
+  char magic[4];
+  WORD version;
+  CodeAddress entryPoint;
+  WORD stackSize;              // words needed by the program, 0 if unknown
+  WORD sectionCount;
+  unsigned int checksum;
+};
+
+struct SectionHeader_ {
+  WORD kind;
+  WORD encoding;
+  WORD offset;
+  WORD size;                   // in bytes
+  WORD count;                  // number of entries
+};
+
+struct LineEntry_ {
+  CodeAddress address;         // first instruction of the source line
+  WORD lineNo;
+};
+
+struct SymbolEntry_ {
+  char name[MAX_SYMBOL_LEN];
+  WORD kind;                   // enum ObjectKind of the subprogram
+  CodeAddress address;
+};
+
+struct ConstantEntry_ {
+  char name[MAX_SYMBOL_LEN];
+  WORD type;                   // enum TypeClass
+  WORD value;
+};
+
+struct LinkSymbol_ {
+  char name[MAX_SYMBOL_LEN];
+  WORD kind;                   // OBJ_FUNCTION or OBJ_PROCEDURE
+  WORD paramCount;
+  CodeAddress address;         // unused for imports
+};
+
+struct Relocation_ {
+  CodeAddress address;         // instruction whose q is patched
+  WORD kind;
+  WORD symbol;                 // import index for RELOC_IMPORT
+};
+
+typedef struct ExecutableHeader_ ExecutableHeader;
+typedef struct SectionHeader_ SectionHeader;
+typedef struct LineEntry_ LineEntry;
+typedef struct SymbolEntry_ SymbolEntry;
+typedef struct ConstantEntry_ ConstantEntry;
+typedef struct LinkSymbol_ LinkSymbol;
+typedef struct Relocation_ Relocation;
+
+struct Executable_ {
+  CodeBlock* codeBlock;
+  CodeAddress entryPoint;
+  int stackSize;
+
+  LineEntry* lines;
+  int lineCount;
+  SymbolEntry* symbols;
+  int symbolCount;
+  ConstantEntry* constants;
+  int constantCount;
+
+  // Object files only
+  int isObject;
+  LinkSymbol* exports;
+  int exportCount;
+  LinkSymbol* imports;
+  int importCount;
+  Relocation* relocations;
+  int relocationCount;
+
+  // Set when the executable was loaded from a file
+  void* image;
+  size_t imageSize;
+  int mappedCode;
+};
+
+typedef struct Executable_ Executable;
+
+int saveExecutable(Executable* exe, enum CodeEncoding encoding, FILE* f);
+Executable* loadExecutable(char* fileName);
+Executable* loadObject(char* fileName);
+void closeExecutable(Executable* exe);
+
+int findLineNo(Executable* exe, CodeAddress address);
+SymbolEntry* findSymbol(Executable* exe, CodeAddress address);
+
+#endif
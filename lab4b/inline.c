@@ -0,0 +1,474 @@
+/* Inlining of small subprograms in the IR */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "executable.h"
+#include "inline.h"
+
+// Larger callees are called as they are
+#define MAX_INLINE_SIZE 40
+// Calls a profile finds hot take callees this much larger
+#define MAX_HOT_INLINE_SIZE (4 * MAX_INLINE_SIZE)
+// Callers stop growing there
+#define MAX_CALLER_SIZE 20000
+// The promotion of slots keeps a definition per block and slot
+#define MAX_INLINE_DEFS (4 * 1024 * 1024)
+
+#define WHITE 0
+#define GREY 1
+#define BLACK 2
+
+static __thread IrProgram* program;
+static __thread char* recursive;      // per function, on a cycle of calls
+
+static int findFunction(CodeAddress entry) {
+  int i;
+
+  for (i = 0; i < program->functionCount; i ++)
+    if (program->functions[i].entry == entry) return i;
+  return -1;
+}
+
+/* The function a call goes to, -1 for an imported subprogram */
+static int calleeOf(IrInstr* call) {
+  if (call->reloc == RELOC_IMPORT) return -1;
+  return findFunction(call->q);
+}
+
+static int liveSize(IrFunction* function) {
+  int i, size = 0;
+
+  for (i = 0; i < function->instrCount; i ++)
+    if (!function->instrs[i].dead) size ++;
+  return size;
+}
+
+/******************************************************************/
+/* Call graph */
+
+/* Whether target is reached by the calls of f */
+static int reaches(int f, int target, char* visited) {
+  IrFunction* function = program->functions + f;
+  IrInstr* instr;
+  int i, callee;
+
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = function->instrs + i;
+    if (instr->dead || (instr->op != IR_CALL)) continue;
+    callee = calleeOf(instr);
+    if (callee < 0) continue;
+    if (callee == target) return 1;
+    if (visited[callee]) continue;
+    visited[callee] = 1;
+    if (reaches(callee, target, visited)) return 1;
+  }
+  return 0;
+}
+
+static void findRecursiveFunctions(void) {
+  char* visited = (char*) malloc(program->functionCount + 1);
+  int f;
+
+  for (f = 0; f < program->functionCount; f ++) {
+    memset(visited, 0, program->functionCount + 1);
+    recursive[f] = reaches(f, f, visited);
+  }
+  free(visited);
+}
+
+/* Callees come before their callers, so that what is inlined has its own
+ * calls inlined already
+ */
+static void orderBottomUp(int f, char* colors, int* order, int* count) {
+  IrFunction* function = program->functions + f;
+  IrInstr* instr;
+  int i, callee;
+
+  colors[f] = GREY;
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = function->instrs + i;
+    if (instr->dead || (instr->op != IR_CALL)) continue;
+    callee = calleeOf(instr);
+    if ((callee >= 0) && (colors[callee] == WHITE)) orderBottomUp(callee, colors, order, count);
+  }
+  colors[f] = BLACK;
+  order[(*count) ++] = f;
+}
+
+/******************************************************************/
+
+/* Largest callee worth inlining at a call. With a profile, calls that
+ * never ran are left alone and hot ones take larger callees.
+ */
+static int inlineLimit(IrInstr* call) {
+  if (program->profile == NULL) return MAX_INLINE_SIZE;
+  if (isHot(program->profile, call->origin)) return MAX_HOT_INLINE_SIZE;
+  if (profileCount(program->profile, call->origin) == 0) return 0;
+  return MAX_INLINE_SIZE;
+}
+
+/* The callee only reaches its own frame through the slots the code
+ * generator gives to variables, and only the frames around its caller
+ * through static links.
+ */
+static int canInline(IrFunction* caller, IrInstr* call, int c) {
+  IrFunction* callee;
+  IrInstr* instr;
+  int i;
+
+  if ((c < 0) || recursive[c]) return 0;
+  callee = program->functions + c;
+  if (callee->isProgram || (callee == caller)) return 0;
+  if ((call->argCount > callee->frameSize - 4) || (liveSize(callee) > inlineLimit(call))) return 0;
+  if (caller->instrCount + callee->instrCount > MAX_CALLER_SIZE) return 0;
+  if ((size_t) (caller->blockCount + callee->blockCount + 1) *
+      (caller->inlineBase + callee->frameSize) > MAX_INLINE_DEFS)
+    return 0;
+
+  for (i = 0; i < callee->instrCount; i ++) {
+    instr = callee->instrs + i;
+    if (instr->dead) continue;
+    switch (instr->op) {
+    case IR_CALL:
+      // Its nested subprograms would need its frame
+      if (instr->p == 0) return 0;
+      if ((instr->p > 0) && (call->p == NO_STATIC_LINK)) return 0;
+      break;
+    case IR_ADDR:
+    case IR_LOAD:
+      if ((instr->p == 0) && (instr->q != 0) && ((instr->q < 4) || (instr->q >= callee->frameSize)))
+	return 0;
+      // Called without a static link, it has no outer frames to reach
+      if ((instr->p > 0) && (call->p == NO_STATIC_LINK)) return 0;
+      break;
+    case IR_HALT:
+      return 0;
+    default:
+      break;
+    }
+  }
+  return 1;
+}
+
+/* Slot of the caller a slot of the callee is moved to: the result goes
+ * first, the header words are dropped
+ */
+static WORD mapSlot(int base, WORD slot) {
+  return (slot == 0) ? base : base + slot - 3;
+}
+
+static void addPred(IrBlock* block, int pred) {
+  if (block->predCount >= block->maxPredCount) {
+    block->maxPredCount = (block->maxPredCount > 0) ? 2 * block->maxPredCount : 2;
+    block->preds = (int*) realloc(block->preds, block->maxPredCount * sizeof(int));
+  }
+  block->preds[block->predCount ++] = pred;
+}
+
+/* Places the blocks first .. last right after block site */
+static void moveBlocks(IrFunction* function, int site, int first, int last) {
+  int* newIndex = (int*) malloc(function->blockCount * sizeof(int));
+  IrBlock* blocks = (IrBlock*) malloc(function->blockCount * sizeof(IrBlock));
+  IrBlock* block;
+  int count = last - first + 1;
+  int b, i;
+
+  for (b = 0; b < function->blockCount; b ++) {
+    if (b <= site) newIndex[b] = b;
+    else if (b < first) newIndex[b] = b + count;
+    else newIndex[b] = site + 1 + b - first;
+  }
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    for (i = 0; i < block->predCount; i ++) block->preds[i] = newIndex[block->preds[i]];
+    for (i = 0; i < block->succCount; i ++) block->succs[i] = newIndex[block->succs[i]];
+    blocks[newIndex[b]] = *block;
+  }
+  for (i = 0; i < function->instrCount; i ++)
+    function->instrs[i].block = newIndex[function->instrs[i].block];
+
+  free(function->blocks);
+  function->blocks = blocks;
+  free(newIndex);
+}
+
+/* Whether the callee never takes the address of a slot, so that its
+ * value stays the one it has on entry
+ */
+static int isReadOnly(IrFunction* callee, WORD slot) {
+  IrInstr* instr;
+  int i;
+
+  for (i = 0; i < callee->instrCount; i ++) {
+    instr = callee->instrs + i;
+    if (!instr->dead && (instr->op == IR_ADDR) && (instr->p == 0) && (instr->q == slot)) return 0;
+  }
+  return 1;
+}
+
+/* Copies the blocks of the callee into the blocks of the caller from
+ * first on, with its returns jumping to block rest. Loads of a parameter
+ * k become args[k] unless that is NO_VALUE.
+ */
+static void copyBody(IrFunction* caller, IrFunction* callee, WORD level, int base,
+		     int* args, int argCount, int first, int rest) {
+  int* values = (int*) malloc((callee->instrCount + 1) * sizeof(int));
+  char* copied = (char*) calloc(callee->instrCount + 1, 1);
+  IrInstr* instr;
+  IrInstr* copy;
+  IrBlock* from;
+  IrBlock* to;
+  int b, i, v;
+
+  for (v = 0; v < callee->instrCount; v ++) {
+    instr = callee->instrs + v;
+    values[v] = NO_VALUE;
+    if (instr->dead || (instr->op == IR_FRAME)) continue;
+    if ((instr->op == IR_LOAD) && (instr->p == 0) && (instr->q >= 4) && (instr->q - 4 < argCount) &&
+	(args[instr->q - 4] != NO_VALUE)) {
+      values[v] = args[instr->q - 4];
+      continue;
+    }
+    copied[v] = 1;
+    values[v] = newInstr(caller, (instr->op == IR_RETURN) ? IR_JUMP : instr->op,
+			 first + instr->block, instr->origin);
+    copy = caller->instrs + values[v];
+    copy->p = instr->p;
+    copy->q = instr->q;
+    copy->hasResult = instr->hasResult;
+    copy->reloc = instr->reloc;
+    copy->symbol = instr->symbol;
+    copy->array = instr->array;
+    if ((instr->op == IR_ADDR) || (instr->op == IR_LOAD)) {
+      if (instr->p == 0) {
+	copy->q = mapSlot(base, instr->q);
+	if (instr->array.size > 0) copy->array.first = mapSlot(base, instr->array.first);
+      } else copy->p = level + instr->p - 1;
+    } else if ((instr->op == IR_CALL) && (instr->p != NO_STATIC_LINK)) copy->p = level + instr->p - 1;
+  }
+  for (v = 0; v < callee->instrCount; v ++) {
+    if (!copied[v]) continue;
+    for (i = 0; i < callee->instrs[v].argCount; i ++)
+      addArg(caller, values[v], values[resolveValue(callee, callee->instrs[v].args[i])]);
+  }
+
+  for (b = 0; b < callee->blockCount; b ++) {
+    from = callee->blocks + b;
+    to = caller->blocks + first + b;
+    to->start = from->start;
+    to->depthIn = from->depthIn;
+    to->phis = (int*) malloc((from->phiCount + 1) * sizeof(int));
+    to->maxPhiCount = from->phiCount + 1;
+    for (i = 0; i < from->phiCount; i ++)
+      if (copied[from->phis[i]]) to->phis[to->phiCount ++] = values[from->phis[i]];
+    for (i = 0; i < from->instrCount; i ++)
+      if (copied[from->instrs[i]]) appendInstr(caller, first + b, values[from->instrs[i]]);
+    for (i = 0; i < from->predCount; i ++) addPred(to, first + from->preds[i]);
+    for (i = 0; i < from->succCount; i ++) to->succs[i] = first + from->succs[i];
+    to->succCount = from->succCount;
+
+    // Returning goes on with the code after the call
+    if (from->succCount == 0) {
+      to->succs[to->succCount ++] = rest;
+      addPred(caller->blocks + rest, first + b);
+      caller->instrs[to->instrs[to->instrCount - 1]].p = 0;
+    }
+  }
+  free(values);
+  free(copied);
+}
+
+/* Splits the block of the call: the code before it passes the arguments
+ * and jumps to the copy of the callee, the code after it moves to a block
+ * the copy returns to.
+ */
+static void inlineCall(IrFunction* caller, int call, IrFunction* callee) {
+  int base = caller->inlineBase;
+  int site = caller->instrs[call].block;
+  CodeAddress origin = caller->instrs[call].origin;
+  WORD level = caller->instrs[call].p;
+  int first = caller->blockCount;
+  int rest = first + callee->blockCount;
+  IrBlock* block;
+  IrBlock* tail;
+  int* args;
+  int argCount, position, value, address, jump, i, k, succ;
+
+  caller->blocks = (IrBlock*) realloc(caller->blocks, (rest + 1) * sizeof(IrBlock));
+  memset(caller->blocks + first, 0, (callee->blockCount + 1) * sizeof(IrBlock));
+  caller->blockCount = rest + 1;
+
+  // The code after the call
+  block = caller->blocks + site;
+  tail = caller->blocks + rest;
+  for (position = 0; block->instrs[position] != call; position ++) ;
+  tail->start = origin;
+  if (caller->instrs[call].hasResult) {
+    value = newInstr(caller, IR_LOAD, rest, origin);
+    caller->instrs[value].q = mapSlot(base, 0);
+    caller->instrs[value].hasResult = 1;
+    appendInstr(caller, rest, value);
+    caller->instrs[call].forward = value;
+  }
+  block = caller->blocks + site;
+  for (i = position + 1; i < block->instrCount; i ++) {
+    caller->instrs[block->instrs[i]].block = rest;
+    appendInstr(caller, rest, block->instrs[i]);
+  }
+  block->instrCount = position;
+  tail = caller->blocks + rest;
+  for (i = 0; i < block->succCount; i ++) {
+    succ = block->succs[i];
+    tail->succs[i] = succ;
+    for (k = 0; k < caller->blocks[succ].predCount; k ++)
+      if (caller->blocks[succ].preds[k] == site) caller->blocks[succ].preds[k] = rest;
+  }
+  tail->succCount = block->succCount;
+  block->succCount = 0;
+
+  // Parameters the callee only reads are the arguments themselves, the
+  // others go to their slots
+  argCount = caller->instrs[call].argCount;
+  args = (int*) malloc((argCount + 1) * sizeof(int));
+  for (i = 0; i < argCount; i ++)
+    args[i] = isReadOnly(callee, 4 + i) ? resolveValue(caller, caller->instrs[call].args[i]) : NO_VALUE;
+  copyBody(caller, callee, level, base, args, argCount, first, rest);
+
+  for (i = 0; i < argCount; i ++) {
+    if (args[i] != NO_VALUE) continue;
+    address = newInstr(caller, IR_ADDR, site, origin);
+    caller->instrs[address].q = mapSlot(base, 4 + i);
+    caller->instrs[address].hasResult = 1;
+    appendInstr(caller, site, address);
+    value = newInstr(caller, IR_STORE, site, origin);
+    addArg(caller, value, address);
+    addArg(caller, value, caller->instrs[call].args[i]);
+    appendInstr(caller, site, value);
+  }
+  jump = newInstr(caller, IR_JUMP, site, origin);
+  appendInstr(caller, site, jump);
+  block = caller->blocks + site;
+  block->succs[block->succCount ++] = first;
+  addPred(caller->blocks + first, site);
+  caller->instrs[call].dead = 1;
+  free(args);
+
+  if (mapSlot(base, callee->frameSize - 1) >= caller->frameSize)
+    caller->frameSize = mapSlot(base, callee->frameSize - 1) + 1;
+  moveBlocks(caller, site, first, rest);
+}
+
+/* Joins a block to the only successor it jumps to when it is the only
+ * predecessor of that block, then drops the emptied blocks
+ */
+static void mergeBlocks(IrFunction* function) {
+  int* newIndex = (int*) malloc(function->blockCount * sizeof(int));
+  IrBlock* block;
+  IrBlock* next;
+  IrInstr* jump;
+  int b, i, k, succ, count;
+
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    // Blocks emptied into an earlier one are skipped
+    while (block->instrCount > 0) {
+      jump = function->instrs + block->instrs[block->instrCount - 1];
+      if ((jump->op != IR_JUMP) || (block->succCount != 1)) break;
+      succ = block->succs[0];
+      next = function->blocks + succ;
+      if ((succ == b) || (succ == 0) || (next->predCount != 1)) break;
+
+      // A phi with a single predecessor is its argument
+      for (i = 0; i < next->phiCount; i ++) {
+	function->instrs[next->phis[i]].forward = function->instrs[next->phis[i]].args[0];
+	function->instrs[next->phis[i]].dead = 1;
+	function->instrs[next->phis[i]].block = b;
+      }
+      jump->dead = 1;
+      block->instrCount --;
+      for (i = 0; i < next->instrCount; i ++) {
+	function->instrs[next->instrs[i]].block = b;
+	appendInstr(function, b, next->instrs[i]);
+	block = function->blocks + b;
+      }
+      block->succCount = next->succCount;
+      for (i = 0; i < next->succCount; i ++) {
+	block->succs[i] = next->succs[i];
+	for (k = 0; k < function->blocks[next->succs[i]].predCount; k ++)
+	  if (function->blocks[next->succs[i]].preds[k] == succ) function->blocks[next->succs[i]].preds[k] = b;
+      }
+      next->instrCount = next->phiCount = next->predCount = next->succCount = 0;
+      next->start = -1;
+    }
+  }
+
+  // Emptied blocks have lost their only predecessor
+  count = 0;
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    if ((b > 0) && (block->predCount == 0) && (block->start < 0)) {
+      free(block->phis);
+      free(block->instrs);
+      free(block->preds);
+      newIndex[b] = -1;
+    } else {
+      newIndex[b] = count;
+      function->blocks[count ++] = *block;
+    }
+  }
+  for (b = 0; b < count; b ++) {
+    block = function->blocks + b;
+    for (i = 0; i < block->predCount; i ++) block->preds[i] = newIndex[block->preds[i]];
+    for (i = 0; i < block->succCount; i ++) block->succs[i] = newIndex[block->succs[i]];
+  }
+  for (i = 0; i < function->instrCount; i ++)
+    if (newIndex[function->instrs[i].block] >= 0)
+      function->instrs[i].block = newIndex[function->instrs[i].block];
+  function->blockCount = count;
+  free(newIndex);
+}
+
+static void inlineInto(int f) {
+  IrFunction* function = program->functions + f;
+  int* calls = (int*) malloc((function->instrCount + 1) * sizeof(int));
+  int callCount = 0, inlined = 0;
+  int i, c;
+
+  for (i = 0; i < function->instrCount; i ++)
+    if (!function->instrs[i].dead && (function->instrs[i].op == IR_CALL)) calls[callCount ++] = i;
+  for (i = 0; i < callCount; i ++) {
+    c = calleeOf(function->instrs + calls[i]);
+    if (!canInline(function, function->instrs + calls[i], c)) continue;
+    inlineCall(function, calls[i], program->functions + c);
+    inlined = 1;
+  }
+  if (inlined) {
+    mergeBlocks(function);
+    free(function->order);
+    computeOrder(function);
+  }
+  free(calls);
+}
+
+void inlineCalls(IrProgram* p) {
+  char* colors;
+  int* order;
+  int count = 0, f;
+
+  program = p;
+  recursive = (char*) calloc(program->functionCount + 1, 1);
+  colors = (char*) calloc(program->functionCount + 1, 1);
+  order = (int*) malloc((program->functionCount + 1) * sizeof(int));
+  for (f = 0; f < program->functionCount; f ++)
+    program->functions[f].inlineBase = program->functions[f].frameSize;
+
+  findRecursiveFunctions();
+  for (f = 0; f < program->functionCount; f ++)
+    if (colors[f] == WHITE) orderBottomUp(f, colors, order, &count);
+  for (f = 0; f < count; f ++) inlineInto(order[f]);
+
+  free(recursive);
+  free(colors);
+  free(order);
+}
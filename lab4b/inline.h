@@ -0,0 +1,21 @@
+/* Inlining of small subprograms in the IR */
+
+#ifndef __INLINE_H__
+#define __INLINE_H__
+
+#include "ir.h"
+
+/* Substitutes the body of small subprograms at their calls. A callee is
+ * inlined when it is not recursive, does not call the subprograms it
+ * declares and is at most MAX_INLINE_SIZE instructions once its own
+ * calls have been inlined. With a profile, calls that never ran are not
+ * inlined and hot ones take callees of up to MAX_HOT_INLINE_SIZE.
+ *
+ * The parameters, locals and result of the callee take slots above the
+ * frame of the caller, shared by all the calls inlined into it. Levels
+ * of outer frames are counted from the caller instead. Runs before the
+ * slots are promoted, so most of them end up as SSA values.
+ */
+void inlineCalls(IrProgram* program);
+
+#endif
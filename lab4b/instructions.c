@@ -7,8 +7,6 @@
 #include <stdlib.h>
 #include "instructions.h"
 
-#define MAX_BLOCK 50
-
 CodeBlock* createCodeBlock(int maxSize) {
   CodeBlock* codeBlock = (CodeBlock*) malloc(sizeof(CodeBlock));
 
@@ -23,11 +21,26 @@ void freeCodeBlock(CodeBlock* codeBlock) {
   free(codeBlock);
 }
 
+/* Doubles the capacity of the block; amortized over the emitted
+ * instructions each one is copied a constant number of times.
+ */
+static int growCodeBlock(CodeBlock* codeBlock) {
+  int maxSize = (codeBlock->maxSize > 0) ? 2 * codeBlock->maxSize : 1;
+  Instruction* code = (Instruction*) realloc(codeBlock->code, maxSize * sizeof(Instruction));
+
+  if (code == NULL) return 0;
+  codeBlock->code = code;
+  codeBlock->maxSize = maxSize;
+  return 1;
+}
+
 int emitCode(CodeBlock* codeBlock, enum OpCode op, WORD p, WORD q) {
-  Instruction* bottom = codeBlock->code + codeBlock->codeSize;
+  Instruction* bottom;
 
-  if (codeBlock->codeSize >= codeBlock->maxSize) return 0;
+  if ((codeBlock->codeSize >= codeBlock->maxSize) && !growCodeBlock(codeBlock))
+    return 0;
 
+  bottom = codeBlock->code + codeBlock->codeSize;
   bottom->op = op;
   bottom->p = p;
   bottom->q = q;
@@ -65,6 +78,11 @@ int emitGT(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_GT, DC_VALUE, D
 int emitLT(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_LT, DC_VALUE, DC_VALUE); }
 int emitGE(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_GE, DC_VALUE, DC_VALUE); }
 int emitLE(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_LE, DC_VALUE, DC_VALUE); }
+int emitIX(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_IX, DC_VALUE, q); }
+int emitTC(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_TC, p, q); }
+int emitFORINIT(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_FORINIT, DC_VALUE, q); }
+int emitFORSTEP(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_FORSTEP, DC_VALUE, q); }
+int emitCALLN(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_CALLN, DC_VALUE, q); }
 
 int emitBP(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_BP, DC_VALUE, DC_VALUE); }
 
@@ -101,6 +119,11 @@ void printInstruction(Instruction* inst) {
   case OP_LT: printf("LT"); break;
   case OP_GE: printf("GE"); break;
   case OP_LE: printf("LE"); break;
+  case OP_IX: printf("IX %d", inst->q); break;
+  case OP_TC: printf("TC %d,%d", inst->p, inst->q); break;
+  case OP_FORINIT: printf("FORINIT %d", inst->q); break;
+  case OP_FORSTEP: printf("FORSTEP %d", inst->q); break;
+  case OP_CALLN: printf("CALLN %d", inst->q); break;
 
   case OP_BP: printf("BP"); break;
   default: break;
@@ -119,19 +142,133 @@ void printCodeBlock(CodeBlock* codeBlock) {
 }
 
 
-void loadCode(CodeBlock* codeBlock, FILE* f) {
-  Instruction* code = codeBlock->code;
+/* Compact encoding used in executables:
+ *   one opcode byte,
+ *   p as an unsigned varint for LA, LV, CALL and TC,
+ *   q as a zigzag varint for instructions that take an operand.
+ * Zero-operand instructions, the bulk of the stream, take a single byte.
+ */
+
+int hasLevelOperand(enum OpCode op) {
+  return (op == OP_LA) || (op == OP_LV) || (op == OP_CALL) || (op == OP_TC);
+}
+
+int hasOperand(enum OpCode op) {
+  switch (op) {
+  case OP_LA:
+  case OP_LV:
+  case OP_LC:
+  case OP_INT:
+  case OP_DCT:
+  case OP_J:
+  case OP_FJ:
+  case OP_CALL:
+  case OP_IX:
+  case OP_TC:
+  case OP_FORINIT:
+  case OP_FORSTEP:
+  case OP_CALLN:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int writeVarint(unsigned int v, unsigned char* buffer) {
+  int n = 0;
+
+  while (v >= 0x80) {
+    if (buffer != NULL) buffer[n] = (v & 0x7F) | 0x80;
+    v >>= 7;
+    n ++;
+  }
+  if (buffer != NULL) buffer[n] = v;
+  return n + 1;
+}
+
+static int readVarint(unsigned int* v, unsigned char* buffer, int size) {
+  int n = 0;
+  int shift = 0;
+
+  *v = 0;
+  do {
+    if ((n >= size) || (shift > 28)) return 0;
+    *v |= ((unsigned int) (buffer[n] & 0x7F)) << shift;
+    shift += 7;
+  } while (buffer[n ++] & 0x80);
+  return n;
+}
+
+static unsigned int zigzagEncode(WORD w) {
+  return (((unsigned int) w) << 1) ^ (unsigned int) (w >> 31);
+}
+
+static WORD zigzagDecode(unsigned int v) {
+  return (WORD) ((v >> 1) ^ (~(v & 1) + 1));
+}
+
+/* Encodes one instruction into buffer (which may be NULL to only measure it)
+ * and returns the number of bytes used.
+ */
+int encodeInstruction(Instruction* inst, unsigned char* buffer) {
+  int n = 1;
+
+  if (buffer != NULL) buffer[0] = inst->op;
+  if (hasLevelOperand(inst->op))
+    n += writeVarint(inst->p, (buffer != NULL) ? buffer + n : NULL);
+  if (hasOperand(inst->op))
+    n += writeVarint(zigzagEncode(inst->q), (buffer != NULL) ? buffer + n : NULL);
+  return n;
+}
+
+/* Decodes one instruction from at most size bytes of buffer.
+ * Returns the number of bytes consumed, 0 if the encoding is invalid.
+ */
+int decodeInstruction(Instruction* inst, unsigned char* buffer, int size) {
+  unsigned int v;
+  int n = 1;
+  int k;
+
+  if ((size < 1) || (buffer[0] > OP_BP)) return 0;
+
+  inst->op = buffer[0];
+  inst->p = DC_VALUE;
+  inst->q = DC_VALUE;
+  if (hasLevelOperand(inst->op)) {
+    k = readVarint(&v, buffer + n, size - n);
+    if (k == 0) return 0;
+    inst->p = v;
+    n += k;
+  }
+  if (hasOperand(inst->op)) {
+    k = readVarint(&v, buffer + n, size - n);
+    if (k == 0) return 0;
+    inst->q = zigzagDecode(v);
+    n += k;
+  }
+  return n;
+}
+
+int loadCode(CodeBlock* codeBlock, unsigned char* buffer, int size) {
   int n;
 
   codeBlock->codeSize = 0;
-  while (!feof(f)) {
-    n = fread(code, sizeof(Instruction), MAX_BLOCK, f);
-    code += n;
-    codeBlock->codeSize += n;
+  while (size > 0) {
+    if (codeBlock->codeSize >= codeBlock->maxSize) return 0;
+    n = decodeInstruction(codeBlock->code + codeBlock->codeSize, buffer, size);
+    if (n == 0) return 0;
+    buffer += n;
+    size -= n;
+    codeBlock->codeSize ++;
   }
+  return 1;
 }
 
+int saveCode(CodeBlock* codeBlock, unsigned char* buffer) {
+  int i;
+  int size = 0;
 
-void saveCode(CodeBlock* codeBlock, FILE* f) {
-  fwrite(codeBlock->code, sizeof(Instruction), codeBlock->codeSize, f);
+  for (i = 0; i < codeBlock->codeSize; i ++)
+    size += encodeInstruction(codeBlock->code + i, (buffer != NULL) ? buffer + size : NULL);
+  return size;
 }
@@ -31,8 +31,8 @@ enum OpCode {
   OP_CALL, // Call             s[t+2] := b; s[t+3] := pc; s[t+4]:= base(p); b:=t+1; pc:=q;
   OP_EP,   // Exit Procedure   t := b - 1;  pc := s[b+2];  b := s[b+1];
   OP_EF,   // Exit Function    t := b;  pc := s[b+2];  b := s[b+1];
-  OP_RC,   // Read Char        read one character into s[s[t]];  t := t - 1;
-  OP_RI,   // Read Integer     read integer to s[s[t]];  t := t-1;
+  OP_RC,   // Read Char        t := t + 1;  read one character into s[t];
+  OP_RI,   // Read Integer     t := t + 1;  read integer into s[t];
   OP_WRC,  // Write Char       write one character from s[t];  t := t-1;
   OP_WRI,  // Write Int        write integer from s[t];  t := t-1;
   OP_WLN,  // WriteLN          CR/LF
@@ -47,9 +47,14 @@ enum OpCode {
   OP_GT,   // Greater          t := t - 1;  if s[t] > s[t+1] then s[t] := 1 else s[t] := 0;
   OP_LT,   // Less             t := t - 1;  if s[t] < s[t+1] then s[t] := 1 else s[t] := 0;
   OP_GE,   // Greater or Equal t := t - 1;  if s[t] >= s[t+1] then s[t] := 1 else s[t] := 0;
-  OP_LE,   // Less or Equal    t := t - 1;  if s[t] >= s[t+1] then s[t] := 1 else s[t] := 0;
-
-  OP_BP    // Break point. Just for debugging
+  OP_LE,   // Less or Equal    t := t - 1;  if s[t] <= s[t+1] then s[t] := 1 else s[t] := 0;
+  OP_IX,   // Index            t := t - 1;  s[t] := s[t] + s[t+1] * q;
+  OP_TC,   // Tail Call        s[b+4..b+3+p] := s[t+1..t+p];  pc := q;
+  OP_FORINIT, // For Init      if s[s[t-1]] > s[t] then pc := q;  t := t - 1;
+  OP_FORSTEP, // For Step      s[s[t-1]] := s[s[t-1]] + 1;  if s[s[t-1]] <= s[t] then pc := q;  t := t - 1;
+  OP_CALLN, // Call No link    s[t+2] := b; s[t+3] := pc; b:=t+1; pc:=q;
+
+  OP_BP    // Break point      patched in by the debugger, stops the VM at pc
 };
 
 struct Instruction_ {
@@ -104,13 +109,23 @@ int emitGT(CodeBlock* codeBlock);
 int emitLT(CodeBlock* codeBlock);
 int emitGE(CodeBlock* codeBlock);
 int emitLE(CodeBlock* codeBlock);
+int emitIX(CodeBlock* codeBlock, WORD q);
+int emitTC(CodeBlock* codeBlock, WORD p, WORD q);
+int emitFORINIT(CodeBlock* codeBlock, WORD q);
+int emitFORSTEP(CodeBlock* codeBlock, WORD q);
+int emitCALLN(CodeBlock* codeBlock, WORD q);
 
 int emitBP(CodeBlock* codeBlock);
 
 void printInstruction(Instruction* instruction);
 void printCodeBlock(CodeBlock* codeBlock);
 
-void loadCode(CodeBlock* codeBlock, FILE* f);
-void saveCode(CodeBlock* codeBlock, FILE* f);
+int hasLevelOperand(enum OpCode op);
+int hasOperand(enum OpCode op);
+int encodeInstruction(Instruction* inst, unsigned char* buffer);
+int decodeInstruction(Instruction* inst, unsigned char* buffer, int size);
+
+int loadCode(CodeBlock* codeBlock, unsigned char* buffer, int size);
+int saveCode(CodeBlock* codeBlock, unsigned char* buffer);
 
 #endif
@@ -0,0 +1,1315 @@
+/* SSA form of the stack code */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "executable.h"
+#include "ir.h"
+#include "inline.h"
+
+// Larger subprograms are left as they are
+#define MAX_IR_BLOCKS 20000
+#define MAX_IR_DEFS (32 * 1024 * 1024)
+
+#define FRAME_WORD -2        // stack entry below the operand stack
+#define ADDR_UNKNOWN -2      // lattice of the slot a value is the address of
+#define ADDR_NONE -1
+
+struct Incomplete_ {
+  int var;
+  int phi;
+  int next;
+};
+
+typedef struct Incomplete_ Incomplete;
+
+/* State of the SSA construction for one set of variables: the operand
+ * stack positions while lifting, the promoted slots afterwards.
+ */
+struct SsaBuilder_ {
+  IrFunction* function;
+  int varCount;
+  int* defs;                 // blockCount * varCount
+  int* incompleteHead;       // per block
+  Incomplete* incompletes;
+  int incompleteCount;
+  int maxIncompleteCount;
+  int* initialValues;        // per variable, value on entry
+  enum IrOp initialOp;
+};
+
+typedef struct SsaBuilder_ SsaBuilder;
+
+static __thread Instruction* code;
+static __thread int codeSize;
+static __thread int* relocs;
+static __thread int* symbols;
+static __thread int* importResults;
+static __thread ArrayExtent* arrays;
+
+static __thread int* exitEffects;     // per address, -1 if not computed yet
+static __thread int* marks;
+static __thread int stamp;
+static __thread int* blockAt;
+static __thread char* isLeader;
+
+/******************************************************************/
+
+static int isValidAddress(CodeAddress address) {
+  return (address >= 0) && (address < codeSize);
+}
+
+static int isTerminator(enum OpCode op) {
+  return (op == OP_J) || (op == OP_FJ) || (op == OP_TC) || (op == OP_FORINIT) || (op == OP_FORSTEP) ||
+    (op == OP_EP) || (op == OP_EF) || (op == OP_HL);
+}
+
+int resolveValue(IrFunction* function, int value) {
+  int root = value;
+  int next;
+
+  if (value < 0) return value;
+  while (function->instrs[root].forward != NO_VALUE)
+    root = function->instrs[root].forward;
+  // Shorten the chain for the next lookups
+  while (function->instrs[value].forward != NO_VALUE) {
+    next = function->instrs[value].forward;
+    function->instrs[value].forward = root;
+    value = next;
+  }
+  return root;
+}
+
+int newInstr(IrFunction* function, enum IrOp op, int block, CodeAddress origin) {
+  IrInstr* instr;
+
+  if (function->instrCount >= function->maxInstrCount) {
+    function->maxInstrCount *= 2;
+    function->instrs = (IrInstr*) realloc(function->instrs, function->maxInstrCount * sizeof(IrInstr));
+  }
+  instr = function->instrs + function->instrCount;
+  memset(instr, 0, sizeof(IrInstr));
+  instr->op = op;
+  instr->block = block;
+  instr->forward = NO_VALUE;
+  instr->origin = origin;
+  instr->reloc = NO_RELOCATION;
+  return function->instrCount ++;
+}
+
+void addArg(IrFunction* function, int instr, int value) {
+  IrInstr* i = function->instrs + instr;
+
+  if (i->argCount >= i->maxArgCount) {
+    i->maxArgCount = (i->maxArgCount > 0) ? 2 * i->maxArgCount : 2;
+    i->args = (int*) realloc(i->args, i->maxArgCount * sizeof(int));
+  }
+  i->args[i->argCount ++] = value;
+}
+
+void appendInstr(IrFunction* function, int block, int instr) {
+  IrBlock* b = function->blocks + block;
+
+  if (b->instrCount >= b->maxInstrCount) {
+    b->maxInstrCount = (b->maxInstrCount > 0) ? 2 * b->maxInstrCount : 8;
+    b->instrs = (int*) realloc(b->instrs, b->maxInstrCount * sizeof(int));
+  }
+  b->instrs[b->instrCount ++] = instr;
+}
+
+/* Values created after the block was filled go before its first instruction */
+static void prependInstr(IrFunction* function, int block, int instr) {
+  IrBlock* b = function->blocks + block;
+
+  appendInstr(function, block, instr);
+  memmove(b->instrs + 1, b->instrs, (b->instrCount - 1) * sizeof(int));
+  b->instrs[0] = instr;
+}
+
+int newPhi(IrFunction* function, int block) {
+  int phi = newInstr(function, IR_PHI, block, function->blocks[block].start);
+  IrBlock* b = function->blocks + block;
+
+  function->instrs[phi].hasResult = 1;
+  if (b->phiCount >= b->maxPhiCount) {
+    b->maxPhiCount = (b->maxPhiCount > 0) ? 2 * b->maxPhiCount : 4;
+    b->phis = (int*) realloc(b->phis, b->maxPhiCount * sizeof(int));
+  }
+  b->phis[b->phiCount ++] = phi;
+  return phi;
+}
+
+static void addEdge(IrFunction* function, int from, int to) {
+  IrBlock* source = function->blocks + from;
+  IrBlock* target = function->blocks + to;
+
+  source->succs[source->succCount ++] = to;
+  if (target->predCount >= target->maxPredCount) {
+    target->maxPredCount = (target->maxPredCount > 0) ? 2 * target->maxPredCount : 2;
+    target->preds = (int*) realloc(target->preds, target->maxPredCount * sizeof(int));
+  }
+  target->preds[target->predCount ++] = from;
+}
+
+/******************************************************************/
+/* SSA construction after Braun et al., "Simple and Efficient Construction
+ * of Static Single Assignment Form". Blocks are filled in reverse
+ * postorder and sealed once all their predecessors are filled.
+ */
+
+static int readVariable(SsaBuilder* builder, int block, int var);
+
+static void initBuilder(SsaBuilder* builder, IrFunction* function, int varCount, enum IrOp initialOp) {
+  int i;
+
+  builder->function = function;
+  builder->varCount = varCount;
+  builder->defs = (int*) malloc(((size_t) function->blockCount * varCount + 1) * sizeof(int));
+  for (i = 0; i < function->blockCount * varCount; i ++) builder->defs[i] = NO_VALUE;
+  builder->incompleteHead = (int*) malloc(function->blockCount * sizeof(int));
+  for (i = 0; i < function->blockCount; i ++) builder->incompleteHead[i] = -1;
+  builder->incompletes = NULL;
+  builder->incompleteCount = builder->maxIncompleteCount = 0;
+  builder->initialValues = (int*) malloc((varCount + 1) * sizeof(int));
+  for (i = 0; i < varCount; i ++) builder->initialValues[i] = NO_VALUE;
+  builder->initialOp = initialOp;
+
+  for (i = 0; i < function->blockCount; i ++)
+    function->blocks[i].filled = function->blocks[i].sealed = 0;
+}
+
+static void cleanBuilder(SsaBuilder* builder) {
+  free(builder->defs);
+  free(builder->incompleteHead);
+  free(builder->incompletes);
+  free(builder->initialValues);
+}
+
+static void writeVariable(SsaBuilder* builder, int block, int var, int value) {
+  builder->defs[block * builder->varCount + var] = value;
+}
+
+/* Value of a variable on entry to the subprogram */
+static int initialValue(SsaBuilder* builder, int var) {
+  IrFunction* function = builder->function;
+  int value = builder->initialValues[var];
+
+  if (value != NO_VALUE) return value;
+  value = newInstr(function, builder->initialOp, 0, function->entry);
+  function->instrs[value].q = var;
+  function->instrs[value].hasResult = 1;
+  prependInstr(function, 0, value);
+  // Operand stack words all share a single undefined value
+  if (builder->initialOp == IR_UNDEF)
+    for (var = 0; var < builder->varCount; var ++) builder->initialValues[var] = value;
+  else builder->initialValues[var] = value;
+  return value;
+}
+
+static int tryRemoveTrivialPhi(IrFunction* function, int phi) {
+  IrInstr* instr = function->instrs + phi;
+  int same = NO_VALUE;
+  int arg, i;
+
+  for (i = 0; i < instr->argCount; i ++) {
+    arg = resolveValue(function, instr->args[i]);
+    if ((arg == same) || (arg == phi)) continue;
+    if (same != NO_VALUE) return phi;
+    same = arg;
+  }
+  // A phi that only refers to itself is never defined
+  if (same == NO_VALUE) return phi;
+  instr->forward = same;
+  instr->dead = 1;
+  return same;
+}
+
+static int addPhiOperands(SsaBuilder* builder, int var, int phi) {
+  IrFunction* function = builder->function;
+  IrBlock* block = function->blocks + function->instrs[phi].block;
+  int i;
+
+  for (i = 0; i < block->predCount; i ++)
+    addArg(function, phi, readVariable(builder, function->blocks[function->instrs[phi].block].preds[i], var));
+  return tryRemoveTrivialPhi(function, phi);
+}
+
+static int readVariable(SsaBuilder* builder, int block, int var) {
+  IrFunction* function = builder->function;
+  IrBlock* b = function->blocks + block;
+  Incomplete* incomplete;
+  int value = builder->defs[block * builder->varCount + var];
+
+  if (value != NO_VALUE) return resolveValue(function, value);
+
+  if (!b->sealed) {
+    value = newPhi(function, block);
+    if (builder->incompleteCount >= builder->maxIncompleteCount) {
+      builder->maxIncompleteCount = (builder->maxIncompleteCount > 0) ? 2 * builder->maxIncompleteCount : 16;
+      builder->incompletes = (Incomplete*) realloc(builder->incompletes,
+						   builder->maxIncompleteCount * sizeof(Incomplete));
+    }
+    incomplete = builder->incompletes + builder->incompleteCount;
+    incomplete->var = var;
+    incomplete->phi = value;
+    incomplete->next = builder->incompleteHead[block];
+    builder->incompleteHead[block] = builder->incompleteCount ++;
+  } else if (b->predCount == 0) {
+    value = initialValue(builder, var);
+  } else if (b->predCount == 1) {
+    value = readVariable(builder, b->preds[0], var);
+  } else {
+    // Break cycles through loops before reading the predecessors
+    value = newPhi(function, block);
+    writeVariable(builder, block, var, value);
+    value = addPhiOperands(builder, var, value);
+  }
+  writeVariable(builder, block, var, value);
+  return value;
+}
+
+static void sealBlock(SsaBuilder* builder, int block) {
+  int i;
+
+  for (i = builder->incompleteHead[block]; i >= 0; i = builder->incompletes[i].next)
+    addPhiOperands(builder, builder->incompletes[i].var, builder->incompletes[i].phi);
+  builder->incompleteHead[block] = -1;
+  builder->function->blocks[block].sealed = 1;
+}
+
+static int allPredsFilled(IrFunction* function, int block) {
+  IrBlock* b = function->blocks + block;
+  int i;
+
+  for (i = 0; i < b->predCount; i ++)
+    if (!function->blocks[b->preds[i]].filled) return 0;
+  return 1;
+}
+
+static void sealReadyBlocks(SsaBuilder* builder, int block) {
+  IrFunction* function = builder->function;
+  IrBlock* b = function->blocks + block;
+  int i, succ;
+
+  for (i = 0; i < b->succCount; i ++) {
+    succ = b->succs[i];
+    if (!function->blocks[succ].sealed && allPredsFilled(function, succ))
+      sealBlock(builder, succ);
+  }
+}
+
+/* Removes the phis made trivial by later replacements and merges the phis
+ * of a block that merge the same values.
+ */
+static void simplifyPhis(IrFunction* function) {
+  IrBlock* block;
+  IrInstr* a;
+  IrInstr* b;
+  int changed, i, j, k, n, same;
+
+  do {
+    changed = 0;
+    for (i = 0; i < function->blockCount; i ++) {
+      block = function->blocks + i;
+      for (j = 0; j < block->phiCount; j ++) {
+	if (function->instrs[block->phis[j]].dead) continue;
+	if (tryRemoveTrivialPhi(function, block->phis[j]) != block->phis[j]) {
+	  changed = 1;
+	  continue;
+	}
+	for (n = 0; n < j; n ++) {
+	  a = function->instrs + block->phis[n];
+	  b = function->instrs + block->phis[j];
+	  if (a->dead || (a->argCount != b->argCount)) continue;
+	  same = 1;
+	  for (k = 0; (k < a->argCount) && same; k ++)
+	    same = resolveValue(function, a->args[k]) == resolveValue(function, b->args[k]);
+	  if (same) {
+	    b->forward = block->phis[n];
+	    b->dead = 1;
+	    changed = 1;
+	    break;
+	  }
+	}
+      }
+    }
+  } while (changed);
+
+  for (i = 0; i < function->instrCount; i ++)
+    for (j = 0; j < function->instrs[i].argCount; j ++)
+      function->instrs[i].args[j] = resolveValue(function, function->instrs[i].args[j]);
+}
+
+/******************************************************************/
+/* Lifting */
+
+/* Words a subprogram leaves on its caller's stack: 1 if it exits by EF */
+static int exitEffectOf(CodeAddress entry) {
+  CodeAddress* scanList;
+  CodeAddress pc;
+  int scanCount = 0;
+  int effect = 0;
+
+  if (exitEffects[entry] >= 0) return exitEffects[entry];
+
+  scanList = (CodeAddress*) malloc(codeSize * sizeof(CodeAddress));
+  stamp ++;
+  scanList[scanCount ++] = entry;
+  marks[entry] = stamp;
+  while (scanCount > 0) {
+    pc = scanList[-- scanCount];
+
+#define VISIT(address) \
+    if (isValidAddress(address) && (marks[address] != stamp)) { \
+      marks[address] = stamp; \
+      scanList[scanCount ++] = (address); \
+    }
+
+    switch (code[pc].op) {
+    case OP_EF: effect = 1; break;
+    case OP_EP: case OP_HL: break;
+    case OP_J: case OP_TC: VISIT(code[pc].q); break;
+    case OP_FJ: case OP_FORINIT: case OP_FORSTEP: VISIT(code[pc].q); VISIT(pc + 1); break;
+    default: VISIT(pc + 1); break;
+    }
+#undef VISIT
+  }
+  free(scanList);
+  exitEffects[entry] = effect;
+  return effect;
+}
+
+static int compareAddresses(const void* a, const void* b) {
+  return *(const CodeAddress*) a - *(const CodeAddress*) b;
+}
+
+/* Splits the code reachable from the entry, without following calls,
+ * into basic blocks. blockEnds receives the last address of every block.
+ */
+static int discoverBlocks(IrFunction* function, CodeAddress** blockEnds) {
+  CodeAddress* reachable;
+  CodeAddress* workList;
+  CodeAddress pc, last;
+  int reachableCount = 0, workCount = 0;
+  int i, maxBlocks = 16;
+  IrBlock* block;
+
+  reachable = (CodeAddress*) malloc(codeSize * sizeof(CodeAddress));
+  workList = (CodeAddress*) malloc(codeSize * sizeof(CodeAddress));
+  stamp ++;
+
+#define VISIT(address) \
+  if (!isValidAddress(address)) goto fail; \
+  if (marks[address] != stamp) { \
+    marks[address] = stamp; \
+    workList[workCount ++] = (address); \
+  }
+
+  VISIT(function->entry);
+  isLeader[function->entry] = 1;
+  while (workCount > 0) {
+    pc = workList[-- workCount];
+    reachable[reachableCount ++] = pc;
+    if (((int) code[pc].op < OP_LA) || (code[pc].op > OP_CALLN)) goto fail;
+    switch (code[pc].op) {
+    case OP_J:
+    case OP_TC:
+      isLeader[code[pc].q] = 1;
+      VISIT(code[pc].q);
+      break;
+    case OP_FJ:
+    case OP_FORINIT:
+    case OP_FORSTEP:
+      if (!isValidAddress(code[pc].q) || !isValidAddress(pc + 1)) goto fail;
+      isLeader[code[pc].q] = 1;
+      isLeader[pc + 1] = 1;
+      VISIT(code[pc].q);
+      VISIT(pc + 1);
+      break;
+    case OP_EP:
+    case OP_EF:
+    case OP_HL:
+      break;
+    default:
+      VISIT(pc + 1);
+      break;
+    }
+  }
+#undef VISIT
+
+  qsort(reachable, reachableCount, sizeof(CodeAddress), compareAddresses);
+  function->blocks = (IrBlock*) calloc(maxBlocks, sizeof(IrBlock));
+  *blockEnds = (CodeAddress*) malloc(maxBlocks * sizeof(CodeAddress));
+  function->blockCount = 0;
+  last = -2;
+  for (i = 0; i < reachableCount; i ++) {
+    pc = reachable[i];
+    if (isLeader[pc] || (pc != last + 1) || isTerminator(code[last].op)) {
+      if (function->blockCount >= maxBlocks) {
+	maxBlocks *= 2;
+	function->blocks = (IrBlock*) realloc(function->blocks, maxBlocks * sizeof(IrBlock));
+	*blockEnds = (CodeAddress*) realloc(*blockEnds, maxBlocks * sizeof(CodeAddress));
+      }
+      block = function->blocks + function->blockCount;
+      memset(block, 0, sizeof(IrBlock));
+      block->start = pc;
+      block->depthIn = -1;
+      function->blockCount ++;
+    }
+    blockAt[pc] = function->blockCount - 1;
+    (*blockEnds)[function->blockCount - 1] = pc;
+    last = pc;
+  }
+
+  for (i = 0; i < reachableCount; i ++) isLeader[reachable[i]] = 0;
+  free(reachable);
+  free(workList);
+  if (function->blockCount > MAX_IR_BLOCKS) return 0;
+
+  // The entry is the lowest address of the subprogram
+  if (function->blocks[0].start != function->entry) return 0;
+
+  for (i = 0; i < function->blockCount; i ++) {
+    last = (*blockEnds)[i];
+    switch (code[last].op) {
+    case OP_J: case OP_TC: addEdge(function, i, blockAt[code[last].q]); break;
+    case OP_FJ: case OP_FORINIT: case OP_FORSTEP:
+      addEdge(function, i, blockAt[last + 1]);
+      addEdge(function, i, blockAt[code[last].q]);
+      break;
+    case OP_EP: case OP_EF: case OP_HL: break;
+    default: addEdge(function, i, blockAt[last + 1]); break;
+    }
+  }
+  return 1;
+
+ fail:
+  for (i = 0; i < reachableCount; i ++) isLeader[reachable[i]] = 0;
+  for (i = 0; i < workCount; i ++) isLeader[workList[i]] = 0;
+  isLeader[function->entry] = 0;
+  free(reachable);
+  free(workList);
+  return 0;
+}
+
+static int calleeResult(CodeAddress address) {
+  if (relocs[address] == RELOC_IMPORT) return importResults[symbols[address]];
+  if (!isValidAddress(code[address].q)) return -1;
+  return exitEffectOf(code[address].q);
+}
+
+/* Frame depth on entry to every block, as the verifier computes it */
+static int computeDepths(IrFunction* function, CodeAddress* blockEnds, int* maxDepth) {
+  int* workList = (int*) malloc(function->blockCount * sizeof(int));
+  int workCount = 0;
+  int block, depth, effect, i;
+  CodeAddress pc;
+
+  function->frameSize = -1;
+  *maxDepth = 0;
+  function->blocks[0].depthIn = 0;
+  workList[workCount ++] = 0;
+  while (workCount > 0) {
+    block = workList[-- workCount];
+    depth = function->blocks[block].depthIn;
+    for (pc = function->blocks[block].start; pc <= blockEnds[block]; pc ++) {
+      switch (code[pc].op) {
+      case OP_LA: case OP_LV: case OP_LC: case OP_RC: case OP_RI: case OP_CV:
+	depth ++;
+	break;
+      case OP_INT:
+	if (depth == 0) {
+	  if ((function->frameSize >= 0) && (function->frameSize != code[pc].q)) goto fail;
+	  function->frameSize = code[pc].q;
+	}
+	depth += code[pc].q;
+	break;
+      case OP_DCT: depth -= code[pc].q; break;
+      case OP_FJ: case OP_WRC: case OP_WRI: depth --; break;
+      case OP_ST: depth -= 2; break;
+      case OP_AD: case OP_SB: case OP_ML: case OP_DV:
+      case OP_EQ: case OP_NE: case OP_GT: case OP_LT: case OP_GE: case OP_LE: case OP_IX:
+      case OP_FORINIT: case OP_FORSTEP:
+	depth --;
+	break;
+      case OP_CALL: case OP_CALLN:
+	effect = calleeResult(pc);
+	if (effect < 0) goto fail;
+	depth += effect;
+	break;
+      default:
+	break;
+      }
+      if (depth < 0) goto fail;
+      if (depth > *maxDepth) *maxDepth = depth;
+    }
+    for (i = 0; i < function->blocks[block].succCount; i ++) {
+      IrBlock* succ = function->blocks + function->blocks[block].succs[i];
+      if (succ->depthIn < 0) {
+	succ->depthIn = depth;
+	workList[workCount ++] = function->blocks[block].succs[i];
+      } else if (succ->depthIn != depth) goto fail;
+    }
+  }
+  free(workList);
+  return function->frameSize >= 0;
+
+ fail:
+  free(workList);
+  return 0;
+}
+
+void computeOrder(IrFunction* function) {
+  int* stack = (int*) malloc(function->blockCount * sizeof(int));
+  int* nextSucc = (int*) calloc(function->blockCount, sizeof(int));
+  char* visited = (char*) calloc(function->blockCount, 1);
+  int top = 0, count = function->blockCount;
+  int block, succ;
+
+  function->order = (int*) malloc(function->blockCount * sizeof(int));
+  stack[top ++] = 0;
+  visited[0] = 1;
+  while (top > 0) {
+    block = stack[top - 1];
+    if (nextSucc[block] < function->blocks[block].succCount) {
+      succ = function->blocks[block].succs[nextSucc[block] ++];
+      if (!visited[succ]) {
+	visited[succ] = 1;
+	stack[top ++] = succ;
+      }
+    } else {
+      function->order[-- count] = block;
+      top --;
+    }
+  }
+  free(stack);
+  free(nextSucc);
+  free(visited);
+}
+
+static int newBinary(IrFunction* function, int block, CodeAddress origin, WORD op, int left, int right) {
+  int value = newInstr(function, IR_BINARY, block, origin);
+
+  function->instrs[value].p = op;
+  function->instrs[value].hasResult = 1;
+  addArg(function, value, left);
+  addArg(function, value, right);
+  appendInstr(function, block, value);
+  return value;
+}
+
+#define PUSH(value) (stack[depth ++] = (value))
+#define POP(value) \
+  if ((depth <= function->frameSize) || (stack[depth - 1] == FRAME_WORD)) return 0; \
+  value = stack[-- depth];
+
+/* Symbolic execution of the stack code of a block */
+static int liftBlock(SsaBuilder* builder, int block, CodeAddress end, int* stack, int* popped) {
+  IrFunction* function = builder->function;
+  IrBlock* b = function->blocks + block;
+  CodeAddress pc;
+  Instruction* inst;
+  int depth = b->depthIn;
+  int poppedCount = 0;
+  CodeAddress lastDct = -1;
+  int undef = NO_VALUE;
+  int value, a, v, x, i;
+
+  for (i = 0; i < depth; i ++)
+    stack[i] = (i < function->frameSize) ? FRAME_WORD : readVariable(builder, block, i);
+
+  for (pc = b->start; pc <= end; pc ++) {
+    inst = code + pc;
+
+#define NEW(irOp) \
+    value = newInstr(function, irOp, block, pc); \
+    function->instrs[value].p = inst->p; \
+    function->instrs[value].q = inst->q; \
+    function->instrs[value].reloc = relocs[pc]; \
+    function->instrs[value].symbol = symbols[pc]; \
+    appendInstr(function, block, value);
+
+    switch (inst->op) {
+    case OP_LA:
+      NEW(IR_ADDR);
+      function->instrs[value].hasResult = 1;
+      if (arrays != NULL) function->instrs[value].array = arrays[pc];
+      PUSH(value);
+      break;
+    case OP_LV:
+      NEW(IR_LOAD);
+      function->instrs[value].hasResult = 1;
+      PUSH(value);
+      break;
+    case OP_LC:
+      NEW(IR_CONST);
+      function->instrs[value].hasResult = 1;
+      PUSH(value);
+      break;
+    case OP_LI:
+      POP(a);
+      NEW(IR_LOADI);
+      function->instrs[value].hasResult = 1;
+      addArg(function, value, a);
+      PUSH(value);
+      break;
+    case OP_INT:
+      if (depth == 0) {
+	NEW(IR_FRAME);
+	for (i = 0; i < inst->q; i ++) PUSH(FRAME_WORD);
+      } else {
+	// Words reserved for the header of a callee's frame
+	if (undef == NO_VALUE) undef = initialValue(builder, 0);
+	for (i = 0; i < inst->q; i ++) PUSH(undef);
+      }
+      break;
+    case OP_DCT:
+      if (depth - inst->q < function->frameSize) return 0;
+      depth -= inst->q;
+      memcpy(popped, stack + depth, inst->q * sizeof(int));
+      poppedCount = inst->q;
+      lastDct = pc;
+      break;
+    case OP_CALL:
+    case OP_CALLN:
+      // The arguments are the words the preceding DCT released, the call
+      // overwrites the four below them. The peephole optimizer drops the
+      // INT 4 and DCT 4 around a call without arguments, and may merge the
+      // INT 4 with the release of an unused value.
+      if ((lastDct != pc - 1) || (poppedCount < 4)) poppedCount = 0;
+      NEW(IR_CALL);
+      if (inst->op == OP_CALLN) function->instrs[value].p = NO_STATIC_LINK;
+      for (i = 0; i < poppedCount; i ++) {
+	if (popped[i] == FRAME_WORD) return 0;
+	if (i >= 4) addArg(function, value, popped[i]);
+      }
+      function->instrs[value].hasResult = calleeResult(pc);
+      if (function->instrs[value].hasResult) PUSH(value);
+      break;
+    case OP_ST:
+      POP(v);
+      POP(a);
+      NEW(IR_STORE);
+      addArg(function, value, a);
+      addArg(function, value, v);
+      break;
+    case OP_RC:
+    case OP_RI:
+      NEW(IR_READ);
+      function->instrs[value].p = inst->op;
+      function->instrs[value].hasResult = 1;
+      PUSH(value);
+      break;
+    case OP_WRC:
+    case OP_WRI:
+      POP(v);
+      NEW(IR_WRITE);
+      function->instrs[value].p = inst->op;
+      addArg(function, value, v);
+      break;
+    case OP_WLN:
+      NEW(IR_WRITELN);
+      break;
+    case OP_AD: case OP_SB: case OP_ML: case OP_DV:
+    case OP_EQ: case OP_NE: case OP_GT: case OP_LT: case OP_GE: case OP_LE: case OP_IX:
+      POP(v);
+      POP(a);
+      NEW(IR_BINARY);
+      function->instrs[value].p = inst->op;
+      function->instrs[value].hasResult = 1;
+      addArg(function, value, a);
+      addArg(function, value, v);
+      PUSH(value);
+      break;
+    case OP_NEG:
+      POP(a);
+      NEW(IR_NEG);
+      function->instrs[value].hasResult = 1;
+      addArg(function, value, a);
+      PUSH(value);
+      break;
+    case OP_CV:
+      POP(a);
+      PUSH(a);
+      PUSH(a);
+      break;
+    case OP_J:
+      NEW(IR_JUMP);
+      break;
+    case OP_TC:
+      // The arguments the preceding DCT released are stored over the
+      // parameters before the body runs again
+      if ((inst->p > 0) && ((lastDct != pc - 1) || (poppedCount < inst->p))) return 0;
+      for (i = 0; i < inst->p; i ++) {
+	v = popped[poppedCount - inst->p + i];
+	if (v == FRAME_WORD) return 0;
+	a = newInstr(function, IR_ADDR, block, pc);
+	function->instrs[a].q = 4 + i;
+	function->instrs[a].hasResult = 1;
+	appendInstr(function, block, a);
+	value = newInstr(function, IR_STORE, block, pc);
+	addArg(function, value, a);
+	addArg(function, value, v);
+	appendInstr(function, block, value);
+      }
+      NEW(IR_JUMP);
+      break;
+    case OP_FJ:
+      POP(a);
+      NEW(IR_BRANCH);
+      addArg(function, value, a);
+      break;
+    case OP_FORINIT:
+    case OP_FORSTEP:
+      // The address of the variable stays, the bound goes. Both branch
+      // like FJ: FORINIT leaves when the variable is above the bound,
+      // FORSTEP loops while the incremented variable is not.
+      POP(v);
+      POP(a);
+      PUSH(a);
+      NEW(IR_LOADI);
+      function->instrs[value].hasResult = 1;
+      addArg(function, value, a);
+      x = value;
+      if (inst->op == OP_FORSTEP) {
+	NEW(IR_CONST);
+	function->instrs[value].q = 1;
+	function->instrs[value].hasResult = 1;
+	x = newBinary(function, block, pc, OP_AD, x, value);
+	NEW(IR_STORE);
+	addArg(function, value, a);
+	addArg(function, value, x);
+      }
+      x = newBinary(function, block, pc, (inst->op == OP_FORINIT) ? OP_LE : OP_GT, x, v);
+      NEW(IR_BRANCH);
+      addArg(function, value, x);
+      break;
+    case OP_EP:
+    case OP_EF:
+      NEW(IR_RETURN);
+      function->instrs[value].p = inst->op;
+      break;
+    case OP_HL:
+      NEW(IR_HALT);
+      break;
+    default:
+      return 0;
+    }
+#undef NEW
+  }
+
+  // Falling into the next block
+  if (!isTerminator(code[end].op)) {
+    value = newInstr(function, IR_JUMP, block, end);
+    appendInstr(function, block, value);
+  }
+
+  for (i = function->frameSize; i < depth; i ++)
+    writeVariable(builder, block, i, stack[i]);
+  return 1;
+}
+
+#undef PUSH
+#undef POP
+
+static int liftFunction(IrFunction* function) {
+  SsaBuilder builder;
+  CodeAddress* blockEnds = NULL;
+  int* stack;
+  int* popped;
+  int maxDepth, i, block, ok = 1;
+
+  function->maxInstrCount = 64;
+  function->instrs = (IrInstr*) malloc(function->maxInstrCount * sizeof(IrInstr));
+  function->instrCount = 0;
+
+  if (!discoverBlocks(function, &blockEnds) || !computeDepths(function, blockEnds, &maxDepth)) {
+    free(blockEnds);
+    return 0;
+  }
+  if ((size_t) function->blockCount * (maxDepth + 1) > MAX_IR_DEFS) {
+    free(blockEnds);
+    return 0;
+  }
+
+  computeOrder(function);
+  stack = (int*) malloc((maxDepth + 1) * sizeof(int));
+  popped = (int*) malloc((maxDepth + 1) * sizeof(int));
+  initBuilder(&builder, function, maxDepth + 1, IR_UNDEF);
+
+  for (i = 0; (i < function->blockCount) && ok; i ++) {
+    block = function->order[i];
+    if (!function->blocks[block].sealed && allPredsFilled(function, block))
+      sealBlock(&builder, block);
+    ok = liftBlock(&builder, block, blockEnds[block], stack, popped);
+    function->blocks[block].filled = 1;
+    sealReadyBlocks(&builder, block);
+  }
+
+  cleanBuilder(&builder);
+  free(stack);
+  free(popped);
+  free(blockEnds);
+  if (ok) simplifyPhis(function);
+  return ok;
+}
+
+/******************************************************************/
+/* Promotion of frame slots */
+
+/* Slot a value is the address of, in the frame of the function itself */
+static int* computeAddressSlots(IrFunction* function) {
+  int* slots = (int*) malloc(function->instrCount * sizeof(int));
+  IrInstr* instr;
+  int changed, i, j, slot, arg;
+
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = function->instrs + i;
+    if (instr->op == IR_PHI) slots[i] = ADDR_UNKNOWN;
+    else if ((instr->op == IR_ADDR) && (instr->p == 0) && (instr->q >= 4) && (instr->q < function->frameSize))
+      slots[i] = instr->q;
+    else slots[i] = ADDR_NONE;
+  }
+
+  do {
+    changed = 0;
+    for (i = 0; i < function->instrCount; i ++) {
+      instr = function->instrs + i;
+      if ((instr->op != IR_PHI) || instr->dead || (slots[i] == ADDR_NONE)) continue;
+      slot = ADDR_UNKNOWN;
+      for (j = 0; j < instr->argCount; j ++) {
+	arg = resolveValue(function, instr->args[j]);
+	if ((arg == i) || (slots[arg] == ADDR_UNKNOWN)) continue;
+	if ((slot == ADDR_UNKNOWN) || (slot == slots[arg])) slot = slots[arg];
+	else slot = ADDR_NONE;
+      }
+      if (slot != slots[i]) {
+	slots[i] = slot;
+	changed = 1;
+      }
+    }
+  } while (changed);
+  return slots;
+}
+
+/* Indexing from an address reaches the slots of its array, or any slot
+ * above when the array is not known. The frames of inlined callees are
+ * only reached from their own code.
+ */
+static void blockIndexedSlots(IrFunction* owner, IrInstr* address, int slot) {
+  int first = slot, last = (slot < owner->inlineBase) ? owner->inlineBase : owner->frameSize;
+
+  if ((address->op == IR_ADDR) && (address->array.size > 0)) {
+    first = address->array.first;
+    last = first + address->array.size;
+  }
+  if (first < 0) first = 0;
+  if (last > owner->frameSize) last = owner->frameSize;
+  if (last > first) memset(owner->promoted + first, 0, last - first);
+}
+
+/* A slot is promoted when its address is only used to load and store it */
+static void findPromotedSlots(IrFunction* function, int* slots) {
+  IrInstr* instr;
+  int i, j, arg, slot;
+
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = function->instrs + i;
+    if (instr->dead) continue;
+    for (j = 0; j < instr->argCount; j ++) {
+      arg = resolveValue(function, instr->args[j]);
+      slot = slots[arg];
+      if (slot < 0) continue;
+      if (((instr->op == IR_LOADI) || (instr->op == IR_STORE)) && (j == 0)) continue;
+      if ((instr->op == IR_PHI) && (slots[i] == slot)) continue;
+      // Only a call keeps the address as it is, any other use may step it
+      if (instr->op == IR_CALL) function->promoted[slot] = 0;
+      else blockIndexedSlots(function, function->instrs + arg, slot);
+    }
+  }
+}
+
+static int promotedSlot(IrFunction* function, int* slots, int slotCount, IrInstr* instr) {
+  int slot, address;
+
+  if ((instr->op == IR_LOAD) && (instr->p == 0) && (instr->q >= 4) && (instr->q < function->frameSize))
+    slot = instr->q;
+  else if ((instr->op == IR_LOADI) || (instr->op == IR_STORE)) {
+    // Values made during the promotion are never addresses of promoted slots
+    address = resolveValue(function, instr->args[0]);
+    slot = (address < slotCount) ? slots[address] : ADDR_NONE;
+  } else return -1;
+  return ((slot >= 0) && function->promoted[slot]) ? slot : -1;
+}
+
+static void promoteSlots(IrFunction* function) {
+  SsaBuilder builder;
+  IrBlock* block;
+  IrInstr* instr;
+  int* slots = computeAddressSlots(function);
+  int slotCount = function->instrCount;
+  int i, j, b, v, slot, value, any = 0;
+
+  findPromotedSlots(function, slots);
+  for (i = 0; i < function->frameSize; i ++) any |= function->promoted[i];
+  if (!any) {
+    free(slots);
+    return;
+  }
+
+  initBuilder(&builder, function, function->frameSize, IR_ENTRY);
+  for (i = 0; i < function->blockCount; i ++) {
+    b = function->order[i];
+    if (!function->blocks[b].sealed && allPredsFilled(function, b))
+      sealBlock(&builder, b);
+    block = function->blocks + b;
+    for (j = 0; j < block->instrCount; j ++) {
+      v = block->instrs[j];
+      instr = function->instrs + v;
+      if (instr->dead) continue;
+      slot = promotedSlot(function, slots, slotCount, instr);
+      if (slot < 0) continue;
+      if (instr->op == IR_STORE) {
+	writeVariable(&builder, b, slot, resolveValue(function, instr->args[1]));
+	instr->dead = 1;
+      } else {
+	value = readVariable(&builder, b, slot);
+	// readVariable may have grown the instruction array, and shifted the
+	// entry block when the code starts right there
+	instr = function->instrs + v;
+	instr->forward = value;
+	instr->dead = 1;
+      }
+    }
+    function->blocks[b].filled = 1;
+    sealReadyBlocks(&builder, b);
+  }
+  cleanBuilder(&builder);
+  free(slots);
+  simplifyPhis(function);
+}
+
+/******************************************************************/
+
+int isPureInstr(IrFunction* function, IrInstr* instr) {
+  IrInstr* arg;
+
+  switch (instr->op) {
+  case IR_CONST: case IR_ADDR: case IR_LOAD: case IR_NEG:
+  case IR_PHI: case IR_ENTRY: case IR_UNDEF:
+    return 1;
+  case IR_BINARY:
+    // A division may trap
+    if (instr->p != OP_DV) return 1;
+    arg = function->instrs + resolveValue(function, instr->args[1]);
+    return (arg->op == IR_CONST) && (arg->q != 0) && (arg->q != -1);
+  case IR_LOADI:
+    // Only a load from a known slot can not fault
+    arg = function->instrs + resolveValue(function, instr->args[0]);
+    return arg->op == IR_ADDR;
+  default:
+    return 0;
+  }
+}
+
+void removeDeadCode(IrFunction* function) {
+  int* uses = (int*) calloc(function->instrCount, sizeof(int));
+  int* workList = (int*) malloc(function->instrCount * sizeof(int));
+  int workCount = 0;
+  IrInstr* instr;
+  int i, j, arg;
+
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = function->instrs + i;
+    if (instr->dead) continue;
+    for (j = 0; j < instr->argCount; j ++)
+      uses[resolveValue(function, instr->args[j])] ++;
+  }
+  for (i = 0; i < function->instrCount; i ++)
+    if (!function->instrs[i].dead && (uses[i] == 0) && isPureInstr(function, function->instrs + i))
+      workList[workCount ++] = i;
+
+  while (workCount > 0) {
+    instr = function->instrs + workList[-- workCount];
+    if (instr->dead) continue;
+    instr->dead = 1;
+    for (j = 0; j < instr->argCount; j ++) {
+      arg = resolveValue(function, instr->args[j]);
+      if ((-- uses[arg] == 0) && !function->instrs[arg].dead && isPureInstr(function, function->instrs + arg))
+	workList[workCount ++] = arg;
+    }
+  }
+  free(uses);
+  free(workList);
+}
+
+/******************************************************************/
+
+static void freeFunction(IrFunction* function) {
+  int i;
+
+  for (i = 0; i < function->instrCount; i ++) free(function->instrs[i].args);
+  for (i = 0; i < function->blockCount; i ++) {
+    free(function->blocks[i].phis);
+    free(function->blocks[i].instrs);
+    free(function->blocks[i].preds);
+  }
+  free(function->instrs);
+  free(function->blocks);
+  free(function->order);
+  free(function->promoted);
+}
+
+void freeIr(IrProgram* program) {
+  int i;
+
+  for (i = 0; i < program->functionCount; i ++)
+    freeFunction(program->functions + i);
+  free(program->functions);
+  free(program);
+}
+
+/* The subprogram whose declarations contain the one at entry: its nested
+ * subprograms lie between its entry and the start of its body.
+ */
+static int enclosingFunction(IrProgram* program, int f) {
+  IrFunction* functions = program->functions;
+  CodeAddress entry = functions[f].entry;
+  CodeAddress body;
+  int parent = -1;
+  int i;
+
+  for (i = 0; i < program->functionCount; i ++) {
+    if (code[functions[i].entry].op != OP_J) continue;
+    body = code[functions[i].entry].q;
+    if ((functions[i].entry < entry) && (entry < body) &&
+	((parent < 0) || (functions[i].entry > functions[parent].entry)))
+      parent = i;
+  }
+  return parent;
+}
+
+/* Whether the address may be stepped to other slots: it is used for
+ * more than loads, stores and call arguments
+ */
+static int isIndexed(IrFunction* function, int value) {
+  IrInstr* instr;
+  int i, j;
+
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = function->instrs + i;
+    if (instr->dead || (instr->op == IR_CALL)) continue;
+    for (j = 0; j < instr->argCount; j ++) {
+      if (resolveValue(function, instr->args[j]) != value) continue;
+      if (((instr->op == IR_LOADI) || (instr->op == IR_STORE)) && (j == 0)) continue;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Slots that nested subprograms reach through static links stay in memory */
+static int findEscapingSlots(IrProgram* program) {
+  IrFunction* function;
+  IrInstr* instr;
+  int* parents = (int*) malloc(program->functionCount * sizeof(int));
+  int f, i, level, owner;
+
+  for (f = 0; f < program->functionCount; f ++) {
+    function = program->functions + f;
+    function->promoted = (char*) calloc(function->frameSize + 1, 1);
+    for (i = 4; i < function->frameSize; i ++) function->promoted[i] = 1;
+    parents[f] = enclosingFunction(program, f);
+  }
+
+  for (f = 0; f < program->functionCount; f ++) {
+    function = program->functions + f;
+    for (i = 0; i < function->instrCount; i ++) {
+      instr = function->instrs + i;
+      if (instr->dead || (instr->p <= 0) || ((instr->op != IR_ADDR) && (instr->op != IR_LOAD)))
+	continue;
+      owner = f;
+      for (level = 0; (level < instr->p) && (owner >= 0); level ++) owner = parents[owner];
+      if ((owner >= 0) && (instr->op == IR_ADDR) && isIndexed(function, i)) {
+	// An array indexed from an inner function
+	if ((instr->q >= 0) && (instr->q < program->functions[owner].frameSize))
+	  blockIndexedSlots(program->functions + owner, instr, instr->q);
+	continue;
+      }
+      if (owner < 0) {
+	// Nothing is known about the frame it refers to
+	for (f = 0; f < program->functionCount; f ++)
+	  memset(program->functions[f].promoted, 0, program->functions[f].frameSize + 1);
+	free(parents);
+	return 0;
+      }
+      if ((instr->q >= 0) && (instr->q < program->functions[owner].frameSize))
+	program->functions[owner].promoted[instr->q] = 0;
+    }
+  }
+  free(parents);
+  return 1;
+}
+
+IrProgram* buildIr(CodeBlock* codeBlock, CodeAddress* entries, int entryCount,
+		   int* relocTable, int* symbolTable, int* importTable, ArrayExtent* arrayTable, Profile* profile) {
+  IrProgram* program;
+  IrFunction* function;
+  int i, j, ok = 1;
+
+  code = codeBlock->code;
+  codeSize = codeBlock->codeSize;
+  relocs = relocTable;
+  symbols = symbolTable;
+  importResults = importTable;
+  arrays = arrayTable;
+
+  exitEffects = (int*) malloc(codeSize * sizeof(int));
+  for (i = 0; i < codeSize; i ++) exitEffects[i] = -1;
+  marks = (int*) calloc(codeSize, sizeof(int));
+  stamp = 0;
+  blockAt = (int*) malloc(codeSize * sizeof(int));
+  isLeader = (char*) calloc(codeSize + 1, 1);
+
+  program = (IrProgram*) malloc(sizeof(IrProgram));
+  program->functions = (IrFunction*) calloc(entryCount, sizeof(IrFunction));
+  program->functionCount = 0;
+  program->profile = profile;
+
+  for (i = 0; (i < entryCount) && ok; i ++) {
+    if (!isValidAddress(entries[i])) continue;
+    // Several symbols may share an entry
+    for (j = 0; j < program->functionCount; j ++)
+      if (program->functions[j].entry == entries[i]) break;
+    if (j < program->functionCount) continue;
+
+    function = program->functions + program->functionCount ++;
+    function->entry = entries[i];
+    function->isProgram = (i == 0);
+    function->exitEffect = exitEffectOf(entries[i]);
+    ok = liftFunction(function);
+  }
+
+  if (ok) inlineCalls(program);
+  if (ok && findEscapingSlots(program))
+    for (i = 0; i < program->functionCount; i ++)
+      promoteSlots(program->functions + i);
+  for (i = 0; (i < program->functionCount) && ok; i ++)
+    removeDeadCode(program->functions + i);
+
+  free(exitEffects);
+  free(marks);
+  free(blockAt);
+  free(isLeader);
+  if (!ok) {
+    freeIr(program);
+    return NULL;
+  }
+  return program;
+}
+
+/******************************************************************/
+
+static void printValue(IrFunction* function, int value) {
+  IrInstr* instr;
+
+  value = resolveValue(function, value);
+  instr = function->instrs + value;
+  if (instr->op == IR_CONST) printf("%d", instr->q);
+  else printf("v%d", value);
+}
+
+static char* opName(WORD op) {
+  switch (op) {
+  case OP_AD: return "add";
+  case OP_SB: return "sub";
+  case OP_ML: return "mul";
+  case OP_DV: return "div";
+  case OP_EQ: return "eq";
+  case OP_NE: return "ne";
+  case OP_GT: return "gt";
+  case OP_LT: return "lt";
+  case OP_GE: return "ge";
+  case OP_LE: return "le";
+  case OP_IX: return "index";
+  case OP_RC: return "readc";
+  case OP_RI: return "readi";
+  case OP_WRC: return "writec";
+  case OP_WRI: return "writei";
+  case OP_EP: return "ep";
+  case OP_EF: return "ef";
+  default: return "?";
+  }
+}
+
+static void printInstr(IrFunction* function, int value) {
+  IrInstr* instr = function->instrs + value;
+  int i;
+
+  if (instr->op == IR_CONST) return;
+  printf("    ");
+  if (instr->hasResult) printf("v%d = ", value);
+  switch (instr->op) {
+  case IR_ADDR: printf("addr %d,%d", instr->p, instr->q); break;
+  case IR_LOAD: printf("load %d,%d", instr->p, instr->q); break;
+  case IR_LOADI: printf("loadi "); printValue(function, instr->args[0]); break;
+  case IR_STORE:
+    printf("store ");
+    printValue(function, instr->args[0]);
+    printf(", ");
+    printValue(function, instr->args[1]);
+    break;
+  case IR_BINARY:
+    printf("%s ", opName(instr->p));
+    printValue(function, instr->args[0]);
+    printf(", ");
+    printValue(function, instr->args[1]);
+    if (instr->p == OP_IX) printf(", %d", instr->q);
+    break;
+  case IR_NEG: printf("neg "); printValue(function, instr->args[0]); break;
+  case IR_READ: printf("%s", opName(instr->p)); break;
+  case IR_WRITE: printf("%s ", opName(instr->p)); printValue(function, instr->args[0]); break;
+  case IR_WRITELN: printf("writeln"); break;
+  case IR_CALL: printf("call %d,%d", instr->p, instr->q); break;
+  case IR_FRAME: printf("frame %d", instr->q); break;
+  case IR_PHI: printf("phi"); break;
+  case IR_ENTRY: printf("entry %d", instr->q); break;
+  case IR_UNDEF: printf("undef"); break;
+  case IR_JUMP: printf("jump B%d", function->blocks[instr->block].succs[0]); break;
+  case IR_BRANCH:
+    printf("branch ");
+    printValue(function, instr->args[0]);
+    printf(", B%d, B%d", function->blocks[instr->block].succs[0], function->blocks[instr->block].succs[1]);
+    break;
+  case IR_RETURN: printf("%s", opName(instr->p)); break;
+  case IR_HALT: printf("halt"); break;
+  default: break;
+  }
+  if ((instr->op == IR_CALL) || (instr->op == IR_PHI))
+    for (i = 0; i < instr->argCount; i ++) {
+      printf(i == 0 ? " " : ", ");
+      printValue(function, instr->args[i]);
+    }
+  printf("\n");
+}
+
+void printIr(IrProgram* program) {
+  IrFunction* function;
+  IrBlock* block;
+  int f, i, j;
+
+  for (f = 0; f < program->functionCount; f ++) {
+    function = program->functions + f;
+    printf("function @%d, frame %d\n", function->entry, function->frameSize);
+    for (i = 0; i < function->blockCount; i ++) {
+      block = function->blocks + i;
+      printf("  B%d @%d:", i, block->start);
+      for (j = 0; j < block->predCount; j ++) printf(" B%d", block->preds[j]);
+      printf("\n");
+      for (j = 0; j < block->phiCount; j ++)
+	if (!function->instrs[block->phis[j]].dead) printInstr(function, block->phis[j]);
+      for (j = 0; j < block->instrCount; j ++)
+	if (!function->instrs[block->instrs[j]].dead) printInstr(function, block->instrs[j]);
+    }
+  }
+}
@@ -0,0 +1,151 @@
+/* SSA form of the stack code */
+
+#ifndef __IR_H__
+#define __IR_H__
+
+#include "instructions.h"
+#include "profile.h"
+
+/* SSA form of the stack code, one IrFunction per subprogram.
+ *
+ * The code emitted by the parser is lifted back into basic blocks of
+ * three-address instructions: the operand stack becomes SSA values, and
+ * frame slots that are only ever read and written directly are promoted
+ * to SSA values as well. Values are the indexes of the instructions
+ * that define them. lowerIr turns the functions back into stack code.
+ */
+
+#define NO_VALUE -1
+#define NO_RELOCATION -1
+#define NO_STATIC_LINK -1
+
+enum IrOp {
+  IR_CONST,     // q
+  IR_ADDR,      // address of slot q, p levels up
+  IR_LOAD,      // slot q, p levels up
+  IR_LOADI,     // memory at args[0]
+  IR_STORE,     // memory at args[0] := args[1]
+  IR_BINARY,    // args[0] p args[1], p is one of OP_AD .. OP_IX, OP_IX scales args[1] by q
+  IR_NEG,       // - args[0]
+  IR_READ,      // p is OP_RC or OP_RI
+  IR_WRITE,     // p is OP_WRC or OP_WRI, writes args[0]
+  IR_WRITELN,
+  IR_CALL,      // subprogram at q, static link p levels up or NO_STATIC_LINK, arguments in args
+  IR_FRAME,     // reserves the q words of the frame
+  IR_PHI,       // args[i] comes from preds[i]
+  IR_ENTRY,     // value a promoted slot q holds on entry
+  IR_UNDEF,     // words reserved for a frame header
+
+  // Terminators
+  IR_JUMP,      // to succs[0]
+  IR_BRANCH,    // to succs[0] if args[0] is true, to succs[1] otherwise
+  IR_RETURN,    // p is OP_EP or OP_EF
+  IR_HALT
+};
+
+/* Frame slots of the array an LA loads the address of, as recorded by
+ * the code generator. Indexing from that address only reaches them.
+ */
+struct ArrayExtent_ {
+  WORD first;
+  WORD size;               // 0 when not known
+};
+
+typedef struct ArrayExtent_ ArrayExtent;
+
+struct IrInstr_ {
+  enum IrOp op;
+  WORD p;
+  WORD q;
+  int block;
+
+  int* args;
+  int argCount;
+  int maxArgCount;
+
+  int hasResult;
+  int forward;             // value that replaced this one, or NO_VALUE
+  int dead;
+
+  CodeAddress origin;      // instruction of the source code it comes from
+  int reloc;               // relocation of the source instruction, or NO_RELOCATION
+  int symbol;
+  ArrayExtent array;       // of an IR_ADDR
+};
+
+struct IrBlock_ {
+  CodeAddress start;       // address of its first source instruction
+  int* phis;
+  int phiCount;
+  int maxPhiCount;
+  int* instrs;             // the last one is the terminator
+  int instrCount;
+  int maxInstrCount;
+
+  int* preds;
+  int predCount;
+  int maxPredCount;
+  int succs[2];
+  int succCount;
+
+  int depthIn;             // words in the frame on entry
+  int filled;
+  int sealed;
+};
+
+struct IrFunction_ {
+  CodeAddress entry;
+  int frameSize;           // words reserved by the IR_FRAME, header included
+  int inlineBase;          // first slot of the frames of inlined callees
+  int exitEffect;          // 1 if the subprogram leaves a result
+  int isProgram;
+
+  struct IrBlock_* blocks;
+  int blockCount;
+  struct IrInstr_* instrs;
+  int instrCount;
+  int maxInstrCount;
+  int* order;              // blocks in reverse postorder
+
+  char* promoted;          // frameSize flags, slots turned into SSA values
+};
+
+struct IrProgram_ {
+  struct IrFunction_* functions;
+  int functionCount;
+  Profile* profile;        // counts of the source instructions, or NULL
+};
+
+typedef struct IrInstr_ IrInstr;
+typedef struct IrBlock_ IrBlock;
+typedef struct IrFunction_ IrFunction;
+typedef struct IrProgram_ IrProgram;
+
+/* relocs and symbols give the relocation recorded for every source
+ * instruction, importResults tells which imported subprograms are
+ * functions, arrays the array every LA points into, if known. Small
+ * subprograms are inlined at their calls before the slots are promoted,
+ * the profile of the code, if any, decides which calls are worth it.
+ * Returns NULL when the code does not have the shape the code generator
+ * produces.
+ */
+IrProgram* buildIr(CodeBlock* codeBlock, CodeAddress* entries, int entryCount,
+		   int* relocs, int* symbols, int* importResults, ArrayExtent* arrays, Profile* profile);
+void freeIr(IrProgram* program);
+
+/* Building blocks of the passes over the IR. newInstr may move the
+ * instructions of the function.
+ */
+int newInstr(IrFunction* function, enum IrOp op, int block, CodeAddress origin);
+void addArg(IrFunction* function, int instr, int value);
+void appendInstr(IrFunction* function, int block, int instr);
+int newPhi(IrFunction* function, int block);
+void computeOrder(IrFunction* function);
+
+int resolveValue(IrFunction* function, int value);
+int isPureInstr(IrFunction* function, IrInstr* instr);
+void removeDeadCode(IrFunction* function);
+
+void printIr(IrProgram* program);
+
+#endif
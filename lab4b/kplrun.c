@@ -0,0 +1,232 @@
+/* kplrun: loads and runs KPL executables */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "instructions.h"
+#include "executable.h"
+#include "vm.h"
+#include "verifier.h"
+#include "debugger.h"
+#include "ir.h"
+#include "loopopt.h"
+#include "regcode.h"
+#include "regvm.h"
+#include "profile.h"
+
+#define MAX_INITIAL_BREAKPOINTS 64
+
+int vmStackSize = 0;
+int hugePages = 0;
+int debugMode = 0;
+int dumpCode = 0;
+int registerMode = 0;
+int printStats = 0;
+char* profileFile = NULL;
+CodeAddress initialBreakpoints[MAX_INITIAL_BREAKPOINTS];
+int initialBreakpointCount = 0;
+
+void printUsage(void) {
+  printf("Usage: kplrun executable [-s=stack-size] [-hugepages] [-b=address] [-debug] [-dump] [-reg] [-stats] [-profile=file]\n");
+  printf("   executable: kpl executable produced by kplc\n");
+  printf("   -s=stack-size: stack size in words, overrides the executable\n");
+  printf("   -hugepages: back the stack with huge pages\n");
+  printf("   -b=address: stop at a code address (may be repeated)\n");
+  printf("   -debug: stop before the first instruction\n");
+  printf("   -dump: code dump\n");
+  printf("   -reg: translate the code for the register VM and run it there\n");
+  printf("   -stats: print the number of instructions executed and the run time\n");
+  printf("   -profile=file: write the execution counts for kplc -fprofile-use\n");
+}
+
+int analyseParam(char* param) {
+  if (strncmp(param, "-s=", 3) == 0) {
+    vmStackSize = atoi(param + 3);
+    return vmStackSize > 0;
+  } else if (strncmp(param, "-b=", 3) == 0) {
+    if (initialBreakpointCount >= MAX_INITIAL_BREAKPOINTS) return 0;
+    initialBreakpoints[initialBreakpointCount ++] = atoi(param + 3);
+    return 1;
+  } else if (strcmp(param, "-hugepages") == 0) {
+    hugePages = 1;
+    return 1;
+  } else if (strcmp(param, "-debug") == 0) {
+    debugMode = 1;
+    return 1;
+  } else if (strcmp(param, "-dump") == 0) {
+    dumpCode = 1;
+    return 1;
+  } else if (strcmp(param, "-reg") == 0) {
+    registerMode = 1;
+    return 1;
+  } else if (strcmp(param, "-stats") == 0) {
+    printStats = 1;
+    return 1;
+  } else if (strncmp(param, "-profile=", 9) == 0) {
+    profileFile = param + 9;
+    return *profileFile != '\0';
+  }
+  return 0;
+}
+
+/******************************************************************/
+
+/* The code is lifted to SSA form and register code is generated from it,
+ * the way kplc -O2 rewrites the stack code. Returns NULL when the code
+ * can not be lifted.
+ */
+RegCode* translateCode(Executable* exe) {
+  CodeBlock* codeBlock = exe->codeBlock;
+  CodeAddress* entries = (CodeAddress*) malloc((exe->symbolCount + 1) * sizeof(CodeAddress));
+  int* relocs = (int*) malloc((codeBlock->codeSize + 1) * sizeof(int));
+  int* symbols = (int*) calloc(codeBlock->codeSize + 1, sizeof(int));
+  int entryCount = 0;
+  IrProgram* program;
+  RegCode* regCode = NULL;
+  int i;
+
+  for (i = 0; i < codeBlock->codeSize; i ++) relocs[i] = NO_RELOCATION;
+  entries[entryCount ++] = exe->entryPoint;
+  for (i = 0; i < exe->symbolCount; i ++)
+    entries[entryCount ++] = exe->symbols[i].address;
+
+  program = buildIr(codeBlock, entries, entryCount, relocs, symbols, NULL, NULL, NULL);
+  if (program != NULL) {
+    // Registers keep values at no cost
+    numberValues(program, 1);
+    optimizeLoops(program);
+    regCode = generateRegisterCode(program);
+    freeIr(program);
+  }
+  free(entries);
+  free(relocs);
+  free(symbols);
+  return regCode;
+}
+
+int runRegisters(Executable* exe, RegCode* regCode) {
+  long count = 0;
+  clock_t start;
+  int ps;
+
+  if (dumpCode) printRegisterCode(regCode);
+
+  // Register frames differ from stack frames, the verified bound does not apply
+  if (vmStackSize == 0)
+    vmStackSize = (exe->stackSize > DEFAULT_STACK_SIZE) ? exe->stackSize : DEFAULT_STACK_SIZE;
+  if (!initRegisterVM(regCode, vmStackSize)) {
+    printf("Can\'t allocate the stack!\n");
+    return -1;
+  }
+
+  start = clock();
+  ps = runRegisterCode(printStats ? &count : NULL);
+  printRegisterProgramState(ps);
+  if (printStats)
+    fprintf(stderr, "kplrun: %ld register instructions executed in %.3f s\n",
+	    count, (double) (clock() - start) / CLOCKS_PER_SEC);
+
+  cleanRegisterVM();
+  freeRegisterCode(regCode);
+  closeExecutable(exe);
+  return (ps == PS_DONE) ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  Executable* exe;
+  VerifyResult verifyResult;
+  Profile* profile = NULL;
+  long count = 0;
+  clock_t start;
+  int ps;
+  int i;
+
+  if (argc <= 1) {
+    printf("kplrun: no executable.\n");
+    printUsage();
+    return -1;
+  }
+
+  for (i = 2; i < argc; i ++)
+    if (!analyseParam(argv[i])) {
+      printf("kplrun: invalid option %s\n", argv[i]);
+      printUsage();
+      return -1;
+    }
+
+  exe = loadExecutable(argv[1]);
+  if (exe == NULL) {
+    printf("Can\'t read executable!\n");
+    return -1;
+  }
+
+  if ((profileFile != NULL) && (registerMode || debugMode || (initialBreakpointCount > 0))) {
+    printf("kplrun: -profile can not be combined with -reg, -debug or -b.\n");
+    return -1;
+  }
+
+  if (registerMode) {
+    RegCode* regCode;
+
+    if (debugMode || (initialBreakpointCount > 0)) {
+      printf("kplrun: -reg can not be combined with -debug or -b.\n");
+      return -1;
+    }
+    regCode = translateCode(exe);
+    if (regCode != NULL) return runRegisters(exe, regCode);
+    printf("kplrun: can\'t translate the code for the register VM, running it on the stack VM.\n");
+  }
+
+  if (dumpCode) printCodeBlock(exe->codeBlock);
+
+  if (!verifyCode(exe->codeBlock, exe->entryPoint, &verifyResult))
+    printf("Warning: unverified executable, %s at %d\n",
+	   verifyErrorToString(verifyResult.error), verifyResult.errorAddress);
+
+  // A verified program without recursion gets exactly the stack it needs
+  if (vmStackSize == 0) {
+    if ((verifyResult.error == VE_NONE) && (verifyResult.maxStackSize != UNBOUNDED_STACK))
+      vmStackSize = verifyResult.maxStackSize;
+    else if (exe->stackSize > 0)
+      vmStackSize = exe->stackSize;
+    else vmStackSize = DEFAULT_STACK_SIZE;
+  }
+
+  if (!initVM(exe->codeBlock, exe->entryPoint, vmStackSize, hugePages)) {
+    printf("Can\'t allocate the stack!\n");
+    return -1;
+  }
+
+  setVerified(verifyResult.error == VE_NONE);
+  freeVerifyResult(&verifyResult);
+
+  for (i = 0; i < initialBreakpointCount; i ++)
+    if (!setBreakpoint(initialBreakpoints[i]))
+      printf("Can\'t set breakpoint at %d!\n", initialBreakpoints[i]);
+
+  // Without breakpoints run() executes the loaded code as is
+  start = clock();
+  if (debugMode) ps = PS_BREAKPOINT;
+  else if (profileFile != NULL) {
+    profile = createProfile(exe->codeBlock);
+    ps = runProfiled(profile->counts, profile->taken);
+    for (i = 0; i < profile->codeSize; i ++) count += profile->counts[i];
+  } else if (printStats) ps = runCounted(&count);
+  else ps = run();
+  if (ps == PS_BREAKPOINT)
+    ps = debug(ps, exe);
+  printProgramState(ps);
+  if (printStats && !debugMode && (initialBreakpointCount == 0))
+    fprintf(stderr, "kplrun: %ld instructions executed in %.3f s\n",
+	    count, (double) (clock() - start) / CLOCKS_PER_SEC);
+
+  if ((profile != NULL) && !saveProfile(profile, profileFile))
+    printf("Can\'t write profile!\n");
+  freeProfile(profile);
+
+  cleanVM();
+  closeExecutable(exe);
+  return (ps == PS_DONE) ? 0 : -1;
+}
@@ -0,0 +1,284 @@
+/* kpl-ld: links object files into an executable */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instructions.h"
+#include "executable.h"
+#include "verifier.h"
+
+// Matches the frame header reserved by the compiler
+#define RESERVED_WORDS 4
+#define MAX_UNITS 64
+
+struct Unit_ {
+  char* fileName;
+  Executable* object;
+  CodeAddress codeBase;        // where the unit's code starts in the executable
+  int frameSize;               // program frame of the unit, header included
+  int globalDelta;             // added to the offset of the unit's globals
+};
+
+typedef struct Unit_ Unit;
+
+Unit units[MAX_UNITS];
+int unitCount = 0;
+enum CodeEncoding codeEncoding = CODE_COMPACT;
+char* outputFile = NULL;
+
+void printUsage(void) {
+  printf("Usage: kpl-ld output main.o [unit.o ...] [-raw]\n");
+  printf("   output: executable\n");
+  printf("   main.o: object whose program body is the entry point\n");
+  printf("   unit.o: objects defining the EXTERNAL subprograms\n");
+  printf("   -raw: store fixed-size instructions that kplrun executes in place\n");
+}
+
+int analyseParam(char* param) {
+  if (strcmp(param, "-raw") == 0) {
+    codeEncoding = CODE_RAW;
+    return 1;
+  } else if (param[0] == '-') return 0;
+
+  if (outputFile == NULL) outputFile = param;
+  else {
+    if (unitCount >= MAX_UNITS) return 0;
+    units[unitCount ++].fileName = param;
+  }
+  return 1;
+}
+
+static int findFrameSize(Unit* unit) {
+  Executable* obj = unit->object;
+  int i;
+
+  for (i = 0; i < obj->relocationCount; i ++)
+    if (obj->relocations[i].kind == RELOC_FRAME_SIZE)
+      return obj->codeBlock->code[obj->relocations[i].address].q;
+  return -1;
+}
+
+static LinkSymbol* findExport(char* name, CodeAddress* address) {
+  LinkSymbol* symbol;
+  int u, i;
+
+  for (u = 0; u < unitCount; u ++)
+    for (i = 0; i < units[u].object->exportCount; i ++) {
+      symbol = units[u].object->exports + i;
+      if (strncmp(symbol->name, name, MAX_SYMBOL_LEN) == 0) {
+	*address = units[u].codeBase + symbol->address;
+	return symbol;
+      }
+    }
+  return NULL;
+}
+
+static int checkExports(void) {
+  CodeAddress address;
+  LinkSymbol* symbol;
+  int u, i;
+
+  for (u = 0; u < unitCount; u ++)
+    for (i = 0; i < units[u].object->exportCount; i ++) {
+      symbol = units[u].object->exports + i;
+      if (findExport(symbol->name, &address) != symbol) {
+	printf("kpl-ld: %s: %s is already defined.\n", units[u].fileName, symbol->name);
+	return 0;
+      }
+    }
+  return 1;
+}
+
+static int relocate(Unit* unit, CodeBlock* codeBlock) {
+  Executable* obj = unit->object;
+  Relocation* reloc;
+  LinkSymbol* import;
+  LinkSymbol* symbol;
+  Instruction* inst;
+  CodeAddress address;
+  int i;
+
+  for (i = 0; i < obj->relocationCount; i ++) {
+    reloc = obj->relocations + i;
+    if ((reloc->address < 0) || (reloc->address >= obj->codeBlock->codeSize)) {
+      printf("kpl-ld: %s: invalid relocation.\n", unit->fileName);
+      return 0;
+    }
+    inst = codeBlock->code + unit->codeBase + reloc->address;
+
+    switch (reloc->kind) {
+    case RELOC_CODE:
+      inst->q += unit->codeBase;
+      break;
+    case RELOC_IMPORT:
+      if ((reloc->symbol < 0) || (reloc->symbol >= obj->importCount)) {
+	printf("kpl-ld: %s: invalid relocation.\n", unit->fileName);
+	return 0;
+      }
+      import = obj->imports + reloc->symbol;
+      symbol = findExport(import->name, &address);
+      if (symbol == NULL) {
+	printf("kpl-ld: %s: undefined reference to %s.\n", unit->fileName, import->name);
+	return 0;
+      }
+      if ((symbol->kind != import->kind) || (symbol->paramCount != import->paramCount)) {
+	printf("kpl-ld: %s: %s does not match its definition.\n", unit->fileName, import->name);
+	return 0;
+      }
+      inst->q = address;
+      break;
+    case RELOC_GLOBAL:
+      inst->q += unit->globalDelta;
+      break;
+    case RELOC_FRAME_SIZE:
+      // Only the program frame of the main unit is ever allocated
+      break;
+    default:
+      printf("kpl-ld: %s: invalid relocation.\n", unit->fileName);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void mergeTables(Executable* exe) {
+  Executable* obj;
+  int u, i;
+
+  exe->lineCount = exe->symbolCount = exe->constantCount = 0;
+  for (u = 0; u < unitCount; u ++) {
+    exe->lineCount += units[u].object->lineCount;
+    exe->symbolCount += units[u].object->symbolCount;
+    exe->constantCount += units[u].object->constantCount;
+  }
+  exe->lines = (LineEntry*) malloc((exe->lineCount + 1) * sizeof(LineEntry));
+  exe->symbols = (SymbolEntry*) malloc((exe->symbolCount + 1) * sizeof(SymbolEntry));
+  exe->constants = (ConstantEntry*) malloc((exe->constantCount + 1) * sizeof(ConstantEntry));
+
+  // Units are laid out in order, so the lines stay sorted by address
+  exe->lineCount = exe->symbolCount = exe->constantCount = 0;
+  for (u = 0; u < unitCount; u ++) {
+    obj = units[u].object;
+    for (i = 0; i < obj->lineCount; i ++) {
+      exe->lines[exe->lineCount] = obj->lines[i];
+      exe->lines[exe->lineCount ++].address += units[u].codeBase;
+    }
+    for (i = 0; i < obj->symbolCount; i ++) {
+      exe->symbols[exe->symbolCount] = obj->symbols[i];
+      exe->symbols[exe->symbolCount ++].address += units[u].codeBase;
+    }
+    for (i = 0; i < obj->constantCount; i ++)
+      exe->constants[exe->constantCount ++] = obj->constants[i];
+  }
+}
+
+/******************************************************************/
+
+int main(int argc, char *argv[]) {
+  Executable exe;
+  VerifyResult verifyResult;
+  CodeBlock* codeBlock;
+  Executable* obj;
+  int codeSize = 0;
+  int frameSize;
+  int status = 0;
+  FILE* f;
+  int u;
+
+  for (u = 1; u < argc; u ++)
+    if (!analyseParam(argv[u])) {
+      printf("kpl-ld: invalid option %s\n", argv[u]);
+      printUsage();
+      return -1;
+    }
+
+  if (unitCount == 0) {
+    printf("kpl-ld: no input file.\n");
+    printUsage();
+    return -1;
+  }
+
+  for (u = 0; u < unitCount; u ++) {
+    units[u].object = loadObject(units[u].fileName);
+    if (units[u].object == NULL) {
+      printf("kpl-ld: can\'t read object %s!\n", units[u].fileName);
+      unitCount = u;
+      status = -1;
+      goto done;
+    }
+  }
+
+  // The globals of the other units follow those of the main unit in the program frame
+  frameSize = 0;
+  for (u = 0; u < unitCount; u ++) {
+    units[u].codeBase = codeSize;
+    codeSize += units[u].object->codeBlock->codeSize;
+
+    units[u].frameSize = findFrameSize(units + u);
+    if (units[u].frameSize < RESERVED_WORDS) {
+      printf("kpl-ld: %s: no program frame.\n", units[u].fileName);
+      status = -1;
+      goto done;
+    }
+    if (u == 0) {
+      units[u].globalDelta = 0;
+      frameSize = units[u].frameSize;
+    } else {
+      units[u].globalDelta = frameSize - RESERVED_WORDS;
+      frameSize += units[u].frameSize - RESERVED_WORDS;
+    }
+  }
+
+  if (!checkExports()) {
+    status = -1;
+    goto done;
+  }
+
+  codeBlock = createCodeBlock(codeSize);
+  for (u = 0; u < unitCount; u ++) {
+    obj = units[u].object;
+    memcpy(codeBlock->code + units[u].codeBase, obj->codeBlock->code, obj->codeBlock->codeSize * sizeof(Instruction));
+  }
+  codeBlock->codeSize = codeSize;
+
+  for (u = 0; u < unitCount; u ++)
+    if (!relocate(units + u, codeBlock)) {
+      status = -1;
+      break;
+    }
+
+  if (status == 0) {
+    obj = units[0].object;
+    for (u = 0; u < obj->relocationCount; u ++)
+      if (obj->relocations[u].kind == RELOC_FRAME_SIZE)
+	codeBlock->code[obj->relocations[u].address].q = frameSize;
+
+    memset(&exe, 0, sizeof(Executable));
+    exe.codeBlock = codeBlock;
+    exe.entryPoint = obj->entryPoint;
+    mergeTables(&exe);
+
+    exe.stackSize = 0;
+    if (verifyCode(codeBlock, exe.entryPoint, &verifyResult) && (verifyResult.maxStackSize != UNBOUNDED_STACK))
+      exe.stackSize = verifyResult.maxStackSize;
+    freeVerifyResult(&verifyResult);
+
+    f = fopen(outputFile, "wb");
+    if ((f == NULL) || !saveExecutable(&exe, codeEncoding, f)) {
+      printf("Can\'t write output file!\n");
+      status = -1;
+    }
+    if ((f != NULL) && (fclose(f) != 0)) status = -1;
+
+    free(exe.lines);
+    free(exe.symbols);
+    free(exe.constants);
+  }
+  freeCodeBlock(codeBlock);
+
+ done:
+  for (u = 0; u < unitCount; u ++)
+    closeExecutable(units[u].object);
+  return status;
+}
@@ -0,0 +1,1035 @@
+/* Loop optimizations and value numbering in the IR */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "executable.h"
+#include "loopopt.h"
+
+struct Loop_ {
+  int header;
+  int preheader;           // the only block entering the loop, or -1
+  int latch;               // the only block jumping back to the header, or -1
+  char* body;              // per block
+  int size;
+};
+
+typedef struct Loop_ Loop;
+
+// Value base + (iv + offset) * scale, computed in a loop
+struct Derived_ {
+  int base;                // NO_VALUE when there is none
+  int iv;
+  WORD offset;
+  WORD scale;
+};
+
+typedef struct Derived_ Derived;
+
+// Slots first .. last - 1 of the frame level static links up
+struct Write_ {
+  int level;
+  WORD first;
+  WORD last;
+};
+
+typedef struct Write_ Write;
+
+struct Effects_ {
+  Write* writes;
+  int writeCount;
+  int maxWriteCount;
+  char* paramWrites;       // per slot, written through the address the parameter holds
+  char throughParams;      // of a loop, written through a reference parameter
+  char anywhere;           // through an address of unknown origin
+};
+
+typedef struct Effects_ Effects;
+
+#define MAX_LEVEL 64
+#define MAX_SLOT 0x7fffffff
+
+#define ROOT_NONE -1
+#define ROOT_UNKNOWN -2
+
+#define TARGET_SLOTS 0
+#define TARGET_PARAM 1
+#define TARGET_ANY 2
+
+static __thread IrProgram* program;
+static __thread Effects* summaries;   // per function
+static __thread int* rootMarks;
+static __thread int rootMarkCount, rootStamp;
+
+static __thread IrFunction* function;
+static __thread int* rpoIndex;        // per block, position in reverse postorder
+static __thread int* idom;            // per block, immediate dominator
+
+// Induction variables of the loop at hand, per value
+static __thread int* ivInit;
+static __thread WORD* ivStep;
+static __thread char* isInduction;
+static __thread char* usedOutside;
+static __thread int valueCount;
+
+static IrInstr* instrOf(int value) {
+  return function->instrs + value;
+}
+
+static int isConstant(int value) {
+  return instrOf(value)->op == IR_CONST;
+}
+
+/******************************************************************/
+/* Dominators after Cooper, Harvey and Kennedy, "A Simple, Fast
+ * Dominance Algorithm"
+ */
+
+static int intersect(int a, int b) {
+  while (a != b) {
+    while (rpoIndex[a] > rpoIndex[b]) a = idom[a];
+    while (rpoIndex[b] > rpoIndex[a]) b = idom[b];
+  }
+  return a;
+}
+
+static void computeDominators(void) {
+  int changed, i, j, block, pred, dom;
+
+  for (i = 0; i < function->blockCount; i ++) {
+    rpoIndex[function->order[i]] = i;
+    idom[i] = -1;
+  }
+  idom[function->order[0]] = function->order[0];
+  do {
+    changed = 0;
+    for (i = 1; i < function->blockCount; i ++) {
+      block = function->order[i];
+      dom = -1;
+      for (j = 0; j < function->blocks[block].predCount; j ++) {
+	pred = function->blocks[block].preds[j];
+	if (idom[pred] < 0) continue;
+	dom = (dom < 0) ? pred : intersect(pred, dom);
+      }
+      if (dom != idom[block]) {
+	idom[block] = dom;
+	changed = 1;
+      }
+    }
+  } while (changed);
+}
+
+static int dominates(int a, int b) {
+  while ((b != a) && (idom[b] != b)) b = idom[b];
+  return a == b;
+}
+
+/******************************************************************/
+/* Natural loops */
+
+static int compareLoops(const void* a, const void* b) {
+  return ((Loop*) a)->size - ((Loop*) b)->size;
+}
+
+/* The blocks that reach the latch without going through the header */
+static void addBody(Loop* loop, int latch, int* workList) {
+  int workCount = 0;
+  int block, i;
+
+  workList[workCount ++] = latch;
+  while (workCount > 0) {
+    block = workList[-- workCount];
+    if (loop->body[block]) continue;
+    loop->body[block] = 1;
+    loop->size ++;
+    for (i = 0; i < function->blocks[block].predCount; i ++)
+      workList[workCount ++] = function->blocks[block].preds[i];
+  }
+}
+
+/* Returns the loops of the function, inner loops first */
+static int findLoops(Loop** result) {
+  Loop* loops = NULL;
+  int* loopOf = (int*) malloc(function->blockCount * sizeof(int));
+  int* workList;
+  int loopCount = 0, workSize = 0;
+  int i, j, block, header, pred, entering;
+  Loop* loop;
+
+  for (i = 0; i < function->blockCount; i ++) {
+    loopOf[i] = -1;
+    workSize += function->blocks[i].predCount;
+  }
+  workList = (int*) malloc((workSize + 1) * sizeof(int));
+
+  for (i = 0; i < function->blockCount; i ++) {
+    block = function->order[i];
+    for (j = 0; j < function->blocks[block].succCount; j ++) {
+      header = function->blocks[block].succs[j];
+      if (!dominates(header, block)) continue;
+      if (loopOf[header] < 0) {
+	loops = (Loop*) realloc(loops, (loopCount + 1) * sizeof(Loop));
+	loop = loops + loopCount;
+	loop->header = header;
+	loop->latch = block;
+	loop->body = (char*) calloc(function->blockCount, 1);
+	loop->body[header] = 1;
+	loop->size = 1;
+	loopOf[header] = loopCount ++;
+      } else {
+	loop = loops + loopOf[header];
+	loop->latch = -1;
+      }
+      addBody(loop, block, workList);
+    }
+  }
+
+  for (i = 0; i < loopCount; i ++) {
+    loop = loops + i;
+    loop->preheader = -1;
+    entering = 0;
+    for (j = 0; j < function->blocks[loop->header].predCount; j ++) {
+      pred = function->blocks[loop->header].preds[j];
+      if (loop->body[pred]) continue;
+      entering ++;
+      if (function->blocks[pred].succCount == 1) loop->preheader = pred;
+    }
+    if (entering != 1) loop->preheader = -1;
+  }
+
+  // A loop nested in another one has fewer blocks
+  if (loopCount > 1) qsort(loops, loopCount, sizeof(Loop), compareLoops);
+  free(loopOf);
+  free(workList);
+  *result = loops;
+  return loopCount;
+}
+
+/******************************************************************/
+
+static void removeFromBlock(int value) {
+  IrBlock* block = function->blocks + instrOf(value)->block;
+  int i;
+
+  for (i = 0; i < block->instrCount; i ++)
+    if (block->instrs[i] == value) {
+      memmove(block->instrs + i, block->instrs + i + 1, (block->instrCount - i - 1) * sizeof(int));
+      block->instrCount --;
+      return;
+    }
+}
+
+/* Places the instruction right before the terminator of the block */
+static void insertAtEnd(int block, int value) {
+  IrBlock* b = function->blocks + block;
+
+  appendInstr(function, block, value);
+  b->instrs[b->instrCount - 1] = b->instrs[b->instrCount - 2];
+  b->instrs[b->instrCount - 2] = value;
+  instrOf(value)->block = block;
+}
+
+static int newConstant(int block, WORD constant, CodeAddress origin) {
+  int value = newInstr(function, IR_CONST, block, origin);
+
+  instrOf(value)->q = constant;
+  instrOf(value)->hasResult = 1;
+  insertAtEnd(block, value);
+  return value;
+}
+
+static int newBinary(int block, WORD op, int left, int right, WORD q, CodeAddress origin) {
+  int value = newInstr(function, IR_BINARY, block, origin);
+
+  instrOf(value)->p = op;
+  instrOf(value)->q = q;
+  instrOf(value)->hasResult = 1;
+  addArg(function, value, left);
+  addArg(function, value, right);
+  insertAtEnd(block, value);
+  return value;
+}
+
+/* Makes the value available in the preheader by moving its computation
+ * there, returns 0 when it changes in the loop
+ */
+static int hoist(Loop* loop, int value) {
+  IrInstr* instr = instrOf(value);
+  int i;
+
+  if (!loop->body[instr->block]) return 1;
+  switch (instr->op) {
+  case IR_CONST:
+  case IR_ADDR:
+    break;
+  case IR_BINARY:
+  case IR_NEG:
+    if (!isPureInstr(function, instr)) return 0;
+    for (i = 0; i < instr->argCount; i ++)
+      if (!hoist(loop, resolveValue(function, instr->args[i]))) return 0;
+    break;
+  default:
+    return 0;
+  }
+  removeFromBlock(value);
+  insertAtEnd(loop->preheader, value);
+  return 1;
+}
+
+/******************************************************************/
+/* Memory written by subprograms and loops. Levels count the frames up
+ * the static links: 0 is the frame of the function itself.
+ */
+
+static int isWritten(Effects* effects, int level, WORD slot) {
+  int i;
+
+  if (effects->anywhere) return 1;
+  // A reference parameter points out of the frame of the function
+  if ((level > 0) && effects->throughParams) return 1;
+  for (i = 0; i < effects->writeCount; i ++)
+    if ((effects->writes[i].level == level) &&
+	(effects->writes[i].first <= slot) && (slot < effects->writes[i].last))
+      return 1;
+  return 0;
+}
+
+static int addWrite(Effects* effects, int level, WORD first, WORD last) {
+  Write* write;
+  int i;
+
+  if (level > MAX_LEVEL) {
+    if (effects->anywhere) return 0;
+    effects->anywhere = 1;
+    return 1;
+  }
+  for (i = 0; i < effects->writeCount; i ++) {
+    write = effects->writes + i;
+    if ((write->level == level) && (write->first <= first) && (last <= write->last)) return 0;
+  }
+  if (effects->writeCount >= effects->maxWriteCount) {
+    effects->maxWriteCount = (effects->maxWriteCount > 0) ? 2 * effects->maxWriteCount : 8;
+    effects->writes = (Write*) realloc(effects->writes, effects->maxWriteCount * sizeof(Write));
+  }
+  write = effects->writes + effects->writeCount ++;
+  write->level = level;
+  write->first = first;
+  write->last = last;
+  return 1;
+}
+
+static int setFlag(char* flag) {
+  if (*flag) return 0;
+  *flag = 1;
+  return 1;
+}
+
+static int isSameArray(IrInstr* a, IrInstr* b) {
+  if (a->p != b->p) return 0;
+  if ((a->array.size > 0) && (b->array.size > 0))
+    return (a->array.first == b->array.first) && (a->array.size == b->array.size);
+  return a->q == b->q;
+}
+
+/* The IR_ADDR an address is computed from, ROOT_NONE for a plain number */
+static int rootAddress(IrFunction* f, int value, int* marks, int stamp) {
+  IrInstr* instr;
+  int left, right, root, i;
+
+  value = resolveValue(f, value);
+  instr = f->instrs + value;
+  switch (instr->op) {
+  case IR_ADDR:
+    return value;
+  case IR_CONST:
+    return ROOT_NONE;
+  case IR_BINARY:
+    if ((instr->p == OP_IX) || (instr->p == OP_SB))
+      return rootAddress(f, instr->args[0], marks, stamp);
+    if (instr->p != OP_AD) return ROOT_UNKNOWN;
+    // An index is added to one address
+    left = rootAddress(f, instr->args[0], marks, stamp);
+    right = rootAddress(f, instr->args[1], marks, stamp);
+    if ((left >= 0) && (right < 0)) return left;
+    if ((right >= 0) && (left < 0)) return right;
+    if ((left == ROOT_NONE) && (right == ROOT_NONE)) return ROOT_NONE;
+    return ROOT_UNKNOWN;
+  case IR_PHI:
+    // A phi met again is on a cycle, the other arguments decide
+    if (marks[value] == stamp) return ROOT_NONE;
+    marks[value] = stamp;
+    root = ROOT_NONE;
+    for (i = 0; i < instr->argCount; i ++) {
+      left = rootAddress(f, instr->args[i], marks, stamp);
+      if (left == ROOT_NONE) continue;
+      if (left == ROOT_UNKNOWN) return ROOT_UNKNOWN;
+      if (root == ROOT_NONE) root = left;
+      else if (!isSameArray(f->instrs + root, f->instrs + left)) return ROOT_UNKNOWN;
+    }
+    return root;
+  default:
+    return ROOT_UNKNOWN;
+  }
+}
+
+/* Slots written through an address: a variable, the elements of an
+ * array, what a reference parameter points to, or anything
+ */
+static int classifyTarget(IrFunction* f, int address, int* level, WORD* first, WORD* last) {
+  IrInstr* instr = f->instrs + resolveValue(f, address);
+  int root;
+
+  if (instr->op == IR_ADDR) {
+    *level = instr->p;
+    *first = instr->q;
+    *last = instr->q + 1;
+    return TARGET_SLOTS;
+  }
+  if ((instr->op == IR_ENTRY) && (instr->q >= 4) && (instr->q < f->frameSize)) {
+    *first = instr->q;
+    return TARGET_PARAM;
+  }
+
+  if (rootMarkCount < f->instrCount) {
+    rootMarkCount = f->instrCount;
+    rootMarks = (int*) realloc(rootMarks, rootMarkCount * sizeof(int));
+    memset(rootMarks, 0, rootMarkCount * sizeof(int));
+    rootStamp = 0;
+  }
+  root = rootAddress(f, address, rootMarks, ++ rootStamp);
+  if (root < 0) return TARGET_ANY;
+  instr = f->instrs + root;
+  *level = instr->p;
+  if (instr->array.size > 0) {
+    *first = instr->array.first;
+    *last = instr->array.first + instr->array.size;
+  } else {
+    // Any slot above when the array is not known
+    *first = instr->q;
+    *last = MAX_SLOT;
+  }
+  return TARGET_SLOTS;
+}
+
+/* Adds a write through an address of the function. Writes to its own
+ * frame only matter inside the function.
+ */
+static int addTarget(IrFunction* f, Effects* effects, int address, int ownFrame) {
+  int level;
+  WORD first, last;
+
+  switch (classifyTarget(f, address, &level, &first, &last)) {
+  case TARGET_SLOTS:
+    if ((level == 0) && !ownFrame) return 0;
+    return addWrite(effects, level, first, last);
+  case TARGET_PARAM:
+    if (ownFrame) return setFlag(&effects->throughParams);
+    return setFlag(effects->paramWrites + first);
+  default:
+    return setFlag(&effects->anywhere);
+  }
+}
+
+static int findFunction(CodeAddress entry) {
+  int i;
+
+  for (i = 0; i < program->functionCount; i ++)
+    if (program->functions[i].entry == entry) return i;
+  return -1;
+}
+
+/* The writes of the callee, seen from the caller: the frame l levels up
+ * from the callee is p + l - 1 levels up from the caller.
+ */
+static int addCallEffects(IrFunction* f, Effects* effects, IrInstr* call, int ownFrame) {
+  int callee = (call->reloc == RELOC_IMPORT) ? -1 : findFunction(call->q);
+  Effects* summary;
+  int changed = 0, level, i;
+
+  if (callee < 0) return setFlag(&effects->anywhere);
+  summary = summaries + callee;
+  if (summary->anywhere) return setFlag(&effects->anywhere);
+  // Without a static link the callee has no way out of its own frame
+  if ((call->p == NO_STATIC_LINK) && (summary->writeCount > 0)) return setFlag(&effects->anywhere);
+  for (i = 0; i < summary->writeCount; i ++) {
+    level = call->p + summary->writes[i].level - 1;
+    if ((level > 0) || ((level == 0) && ownFrame))
+      changed |= addWrite(effects, level, summary->writes[i].first, summary->writes[i].last);
+  }
+  for (i = 4; i < program->functions[callee].frameSize; i ++) {
+    if (!summary->paramWrites[i]) continue;
+    if (i - 4 >= call->argCount) changed |= setFlag(&effects->anywhere);
+    else changed |= addTarget(f, effects, call->args[i - 4], ownFrame);
+  }
+  return changed;
+}
+
+static int addEffects(IrFunction* f, Effects* effects, int value, int ownFrame) {
+  IrInstr* instr = f->instrs + value;
+
+  if (instr->dead) return 0;
+  if (instr->op == IR_STORE) return addTarget(f, effects, instr->args[0], ownFrame);
+  if (instr->op == IR_CALL) return addCallEffects(f, effects, instr, ownFrame);
+  return 0;
+}
+
+static void initEffects(Effects* effects, int frameSize) {
+  memset(effects, 0, sizeof(Effects));
+  effects->paramWrites = (char*) calloc(frameSize + 1, 1);
+}
+
+static void freeEffects(Effects* effects) {
+  free(effects->writes);
+  free(effects->paramWrites);
+}
+
+/* What every subprogram may write outside its own frame, up to a fixed
+ * point over the calls
+ */
+static void computeSummaries(void) {
+  IrFunction* f;
+  int changed, i, v;
+
+  summaries = (Effects*) malloc((program->functionCount + 1) * sizeof(Effects));
+  for (i = 0; i < program->functionCount; i ++)
+    initEffects(summaries + i, program->functions[i].frameSize);
+  do {
+    changed = 0;
+    for (i = 0; i < program->functionCount; i ++) {
+      f = program->functions + i;
+      for (v = 0; v < f->instrCount; v ++)
+	changed |= addEffects(f, summaries + i, v, 0);
+    }
+  } while (changed);
+}
+
+static void freeSummaries(void) {
+  int i;
+
+  for (i = 0; i < program->functionCount; i ++)
+    freeEffects(summaries + i);
+  free(summaries);
+  free(rootMarks);
+  rootMarks = NULL;
+  rootMarkCount = 0;
+}
+
+/******************************************************************/
+/* Local value numbering */
+
+static __thread int* valueNumbers;    // per value, the earliest value known equal to it
+static __thread int* useCounts;
+static __thread int* available;       // values of the block at hand, in order
+static __thread int availableCount;
+
+static int numberOf(int value) {
+  return valueNumbers[resolveValue(function, value)];
+}
+
+static int isCommutative(WORD op) {
+  return (op == OP_AD) || (op == OP_ML) || (op == OP_EQ) || (op == OP_NE);
+}
+
+static int isNumbered(IrInstr* instr) {
+  switch (instr->op) {
+  case IR_CONST: case IR_ADDR: case IR_LOAD: case IR_LOADI: case IR_NEG: case IR_BINARY:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int isSameValue(IrInstr* a, IrInstr* b) {
+  if ((a->op != b->op) || (a->p != b->p) || (a->q != b->q) || (a->argCount != b->argCount))
+    return 0;
+  if ((a->reloc != b->reloc) || (a->symbol != b->symbol)) return 0;
+  if (a->argCount == 0) return 1;
+  if ((a->argCount == 1) || (numberOf(a->args[0]) == numberOf(b->args[0])))
+    return numberOf(a->args[a->argCount - 1]) == numberOf(b->args[b->argCount - 1]);
+  return (a->op == IR_BINARY) && isCommutative(a->p) &&
+    (numberOf(a->args[0]) == numberOf(b->args[1])) && (numberOf(a->args[1]) == numberOf(b->args[0]));
+}
+
+/* Instructions the stack code takes to compute the value again, up to
+ * limit. Operands that stay in a slot anyway are loaded from there.
+ */
+static int recomputeCost(int value, int limit, int isRoot) {
+  IrInstr* instr = instrOf(value);
+  int cost = 1, i;
+
+  if ((instr->op == IR_CONST) || (instr->op == IR_ADDR)) return 1;
+  if (!isRoot && ((useCounts[value] > 1) || !isNumbered(instr))) return 1;
+  for (i = 0; (i < instr->argCount) && (cost < limit); i ++)
+    cost += recomputeCost(resolveValue(function, instr->args[i]), limit - cost, 0);
+  return cost;
+}
+
+/* Whether a write to the slots of a target may change a load from the
+ * slots of another
+ */
+static int mayOverlap(int kind, int level, WORD first, WORD last,
+		      int otherKind, int otherLevel, WORD otherFirst, WORD otherLast) {
+  if ((kind == TARGET_ANY) || (otherKind == TARGET_ANY)) return 1;
+  // A reference parameter points out of the frame of the function
+  if (kind == TARGET_PARAM) return (otherKind == TARGET_PARAM) || (otherLevel > 0);
+  if (otherKind == TARGET_PARAM) return level > 0;
+  return (level == otherLevel) && (first < otherLast) && (otherFirst < last);
+}
+
+static int isRangeWritten(Effects* effects, int kind, int level, WORD first, WORD last) {
+  int i;
+
+  if (effects->anywhere || (kind == TARGET_ANY)) return 1;
+  if (effects->throughParams && ((kind == TARGET_PARAM) || (level > 0))) return 1;
+  for (i = 0; i < effects->writeCount; i ++)
+    if ((kind == TARGET_PARAM) ? (effects->writes[i].level > 0) :
+	((effects->writes[i].level == level) &&
+	 (effects->writes[i].first < last) && (first < effects->writes[i].last)))
+      return 1;
+  return 0;
+}
+
+/* The slots a load reads */
+static int classifyLoad(IrInstr* instr, int* level, WORD* first, WORD* last) {
+  if (instr->op == IR_LOAD) {
+    *level = instr->p;
+    *first = instr->q;
+    *last = instr->q + 1;
+    return TARGET_SLOTS;
+  }
+  return classifyTarget(function, instr->args[0], level, first, last);
+}
+
+/* Forgets the loads that a store or a call may change */
+static void killLoads(IrInstr* writer) {
+  Effects effects;
+  IrInstr* instr;
+  int kind = TARGET_ANY, level = 0, otherKind, otherLevel, i, n;
+  WORD first = 0, last = 0, otherFirst, otherLast;
+
+  initEffects(&effects, function->frameSize);
+  if (writer->op == IR_STORE) kind = classifyTarget(function, writer->args[0], &level, &first, &last);
+  else addCallEffects(function, &effects, writer, 1);
+  for (i = 0, n = 0; i < availableCount; i ++) {
+    instr = instrOf(available[i]);
+    if ((instr->op == IR_LOAD) || (instr->op == IR_LOADI)) {
+      otherKind = classifyLoad(instr, &otherLevel, &otherFirst, &otherLast);
+      if ((writer->op == IR_STORE) ?
+	  mayOverlap(kind, level, first, last, otherKind, otherLevel, otherFirst, otherLast) :
+	  isRangeWritten(&effects, otherKind, otherLevel, otherFirst, otherLast))
+	continue;
+    }
+    available[n ++] = available[i];
+  }
+  availableCount = n;
+  freeEffects(&effects);
+}
+
+static int numberBlock(int block, int minCost) {
+  IrBlock* b = function->blocks + block;
+  IrInstr* instr;
+  int replaced = 0;
+  int i, j, v;
+
+  availableCount = 0;
+  for (i = 0; i < b->instrCount; i ++) {
+    v = b->instrs[i];
+    instr = instrOf(v);
+    if (instr->dead) continue;
+    if ((instr->op == IR_STORE) || (instr->op == IR_CALL)) killLoads(instr);
+    if (!isNumbered(instr)) continue;
+
+    for (j = 0; j < availableCount; j ++)
+      if (isSameValue(instrOf(available[j]), instr)) break;
+    if (j == availableCount) {
+      available[availableCount ++] = v;
+      continue;
+    }
+    valueNumbers[v] = valueNumbers[available[j]];
+    // Constants, addresses and slots of the frame are loaded again wherever they are used
+    if ((instr->op == IR_CONST) || (instr->op == IR_ADDR)) continue;
+    if ((instr->op == IR_LOAD) && (instr->p == 0)) continue;
+    if (recomputeCost(v, minCost, 1) < minCost) continue;
+    instr->forward = available[j];
+    instr->dead = 1;
+    replaced ++;
+  }
+  return replaced;
+}
+
+static void numberFunction(IrFunction* f, int minCost) {
+  IrInstr* instr;
+  int replaced = 0;
+  int b, i, j;
+
+  function = f;
+  valueNumbers = (int*) malloc((function->instrCount + 1) * sizeof(int));
+  useCounts = (int*) calloc(function->instrCount + 1, sizeof(int));
+  available = (int*) malloc((function->instrCount + 1) * sizeof(int));
+  for (i = 0; i < function->instrCount; i ++) {
+    valueNumbers[i] = i;
+    instr = instrOf(i);
+    if (instr->dead) continue;
+    for (j = 0; j < instr->argCount; j ++)
+      useCounts[resolveValue(function, instr->args[j])] ++;
+  }
+
+  for (b = 0; b < function->blockCount; b ++)
+    replaced += numberBlock(b, minCost);
+  if (replaced > 0) removeDeadCode(function);
+
+  free(valueNumbers);
+  free(useCounts);
+  free(available);
+}
+
+/******************************************************************/
+/* Loop-invariant code motion */
+
+static int isComparison(WORD op) {
+  return (op == OP_EQ) || (op == OP_NE) || (op == OP_LT) || (op == OP_GE) || (op == OP_GT) || (op == OP_LE);
+}
+
+static int isInvariantArg(Loop* loop, int value) {
+  return !loop->body[instrOf(resolveValue(function, value))->block];
+}
+
+static int isMovable(Loop* loop, Effects* effects, int value) {
+  IrInstr* instr = instrOf(value);
+  IrInstr* address;
+  int i;
+
+  if (instr->dead) return 0;
+  switch (instr->op) {
+  case IR_CONST:
+  case IR_ADDR:
+    return 1;
+  case IR_LOAD:
+    return !isWritten(effects, instr->p, instr->q);
+  case IR_LOADI:
+    address = instrOf(resolveValue(function, instr->args[0]));
+    if ((address->op != IR_ADDR) || isWritten(effects, address->p, address->q)) return 0;
+    break;
+  case IR_BINARY:
+    // A comparison only feeds a branch, next to it both compare and jump
+    // at once, FORINIT and FORSTEP among them
+    if (isComparison(instr->p)) return 0;
+  case IR_NEG:
+    if (!isPureInstr(function, instr)) return 0;
+    break;
+  default:
+    return 0;
+  }
+  for (i = 0; i < instr->argCount; i ++)
+    if (!isInvariantArg(loop, instr->args[i])) return 0;
+  return 1;
+}
+
+/* Values that are the same on every iteration move to the preheader.
+ * The blocks are visited in reverse postorder, so the arguments of an
+ * instruction have been moved before it is looked at.
+ */
+static void hoistInvariants(Loop* loop) {
+  Effects effects;
+  int* values = (int*) malloc((function->instrCount + 1) * sizeof(int));
+  int valueCount, block, i, v;
+
+  initEffects(&effects, function->frameSize);
+  for (block = 0; block < function->blockCount; block ++) {
+    if (!loop->body[block]) continue;
+    for (i = 0; i < function->blocks[block].instrCount; i ++)
+      addEffects(function, &effects, function->blocks[block].instrs[i], 1);
+  }
+
+  for (i = 0; i < function->blockCount; i ++) {
+    block = function->order[i];
+    if (!loop->body[block]) continue;
+    valueCount = function->blocks[block].instrCount;
+    memcpy(values, function->blocks[block].instrs, valueCount * sizeof(int));
+    for (v = 0; v < valueCount; v ++) {
+      if (!isMovable(loop, &effects, values[v])) continue;
+      removeFromBlock(values[v]);
+      insertAtEnd(loop->preheader, values[v]);
+    }
+  }
+
+  freeEffects(&effects);
+  free(values);
+}
+
+/******************************************************************/
+/* Strength reduction of induction variables */
+
+/* A phi of the header is an induction variable when the value coming
+ * back from the latch adds a constant to it
+ */
+static void findInductionVariables(Loop* loop) {
+  IrBlock* header = function->blocks + loop->header;
+  IrInstr* next;
+  int i, phi, init, back, left, right;
+
+  for (i = 0; i < header->phiCount; i ++) {
+    phi = header->phis[i];
+    if (instrOf(phi)->dead) continue;
+    if (header->preds[0] == loop->preheader) {
+      init = resolveValue(function, instrOf(phi)->args[0]);
+      back = resolveValue(function, instrOf(phi)->args[1]);
+    } else {
+      init = resolveValue(function, instrOf(phi)->args[1]);
+      back = resolveValue(function, instrOf(phi)->args[0]);
+    }
+    next = instrOf(back);
+    if (next->op != IR_BINARY) continue;
+    left = resolveValue(function, next->args[0]);
+    right = resolveValue(function, next->args[1]);
+    if ((next->p == OP_AD) && (left == phi) && isConstant(right))
+      ivStep[phi] = instrOf(right)->q;
+    else if ((next->p == OP_AD) && (right == phi) && isConstant(left))
+      ivStep[phi] = instrOf(left)->q;
+    else if ((next->p == OP_SB) && (left == phi) && isConstant(right))
+      ivStep[phi] = - instrOf(right)->q;
+    else continue;
+    ivInit[phi] = init;
+    isInduction[phi] = 1;
+  }
+}
+
+static int isInductionValue(int value) {
+  return (value < valueCount) && isInduction[value];
+}
+
+/* Recognizes iv + offset, with a constant offset */
+static int isShiftedInduction(int value, int* iv, WORD* offset) {
+  IrInstr* instr = instrOf(value);
+  int left, right;
+
+  *iv = value;
+  *offset = 0;
+  if (isInductionValue(value)) return 1;
+  if (instr->op != IR_BINARY) return 0;
+  left = resolveValue(function, instr->args[0]);
+  right = resolveValue(function, instr->args[1]);
+  if ((instr->p == OP_AD) && isInductionValue(left) && isConstant(right)) {
+    *iv = left;
+    *offset = instrOf(right)->q;
+  } else if ((instr->p == OP_AD) && isInductionValue(right) && isConstant(left)) {
+    *iv = right;
+    *offset = instrOf(left)->q;
+  } else if ((instr->p == OP_SB) && isInductionValue(left) && isConstant(right)) {
+    *iv = left;
+    *offset = - instrOf(right)->q;
+  } else return 0;
+  return 1;
+}
+
+/* Recognizes base + (iv + offset) * scale, the base may be missing */
+static int isDerived(int value, Derived* derived) {
+  IrInstr* instr = instrOf(value);
+  int left, right;
+
+  if (instr->dead || (instr->op != IR_BINARY) || usedOutside[value]) return 0;
+  left = resolveValue(function, instr->args[0]);
+  right = resolveValue(function, instr->args[1]);
+  switch (instr->p) {
+  case OP_IX:
+    if (!isShiftedInduction(right, &derived->iv, &derived->offset) || (left == derived->iv)) return 0;
+    derived->base = left;
+    derived->scale = instr->q;
+    return 1;
+  case OP_AD:
+    // iv + constant itself is left alone, it would only add a copy of iv
+    if (!isConstant(left) && isShiftedInduction(right, &derived->iv, &derived->offset))
+      derived->base = left;
+    else if (!isConstant(right) && isShiftedInduction(left, &derived->iv, &derived->offset))
+      derived->base = right;
+    else return 0;
+    if (derived->base == derived->iv) return 0;
+    derived->scale = 1;
+    return 1;
+  case OP_ML:
+    if (isConstant(right) && isShiftedInduction(left, &derived->iv, &derived->offset))
+      derived->scale = instrOf(right)->q;
+    else if (isConstant(left) && isShiftedInduction(right, &derived->iv, &derived->offset))
+      derived->scale = instrOf(left)->q;
+    else return 0;
+    derived->base = NO_VALUE;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* The value becomes a phi of the header that starts at
+ * base + (init + offset) * scale and grows by step * scale on every
+ * iteration
+ */
+static void reduce(Loop* loop, int value, Derived* derived) {
+  CodeAddress origin = instrOf(value)->origin;
+  int init = ivInit[derived->iv];
+  WORD step = ivStep[derived->iv];
+  WORD scale = derived->scale;
+  int base = derived->base;
+  int preheader = loop->preheader;
+  WORD offset;
+  int start, next, phi, i;
+
+  if (isConstant(init)) {
+    offset = (instrOf(init)->q + derived->offset) * scale;
+    if (base == NO_VALUE) start = newConstant(preheader, offset, origin);
+    else if (offset == 0) start = base;
+    else start = newBinary(preheader, OP_AD, base, newConstant(preheader, offset, origin), 0, origin);
+  } else {
+    if (derived->offset != 0)
+      init = newBinary(preheader, OP_AD, init, newConstant(preheader, derived->offset, origin), 0, origin);
+    if (base == NO_VALUE)
+      start = newBinary(preheader, OP_ML, init, newConstant(preheader, scale, origin), 0, origin);
+    else if (scale == 1) start = newBinary(preheader, OP_AD, base, init, 0, origin);
+    else start = newBinary(preheader, OP_IX, base, init, scale, origin);
+  }
+
+  phi = newPhi(function, loop->header);
+  next = newBinary(loop->latch, OP_AD, phi, newConstant(loop->latch, step * scale, origin), 0, origin);
+  for (i = 0; i < function->blocks[loop->header].predCount; i ++)
+    addArg(function, phi, (function->blocks[loop->header].preds[i] == preheader) ? start : next);
+
+  instrOf(value)->forward = phi;
+  instrOf(value)->dead = 1;
+}
+
+/* Values computed in the loop and used after it keep their computation:
+ * the last one made need not match the phi once the header runs again.
+ */
+static void findUsesOutside(Loop* loop) {
+  IrInstr* instr;
+  int i, j;
+
+  memset(usedOutside, 0, valueCount);
+  for (i = 0; i < valueCount; i ++) {
+    instr = instrOf(i);
+    if (instr->dead || loop->body[instr->block]) continue;
+    for (j = 0; j < instr->argCount; j ++)
+      usedOutside[resolveValue(function, instr->args[j])] = 1;
+  }
+}
+
+/* One round over the loop, returns the number of values reduced. The
+ * reduced values are induction variables of the next round.
+ */
+static int reduceRound(Loop* loop) {
+  int* candidates;
+  int candidateCount = 0, reduced = 0;
+  int block, i, value;
+  Derived derived;
+
+  valueCount = function->instrCount;
+  ivInit = (int*) malloc(valueCount * sizeof(int));
+  ivStep = (WORD*) malloc(valueCount * sizeof(WORD));
+  isInduction = (char*) calloc(valueCount, 1);
+  usedOutside = (char*) malloc(valueCount);
+  candidates = (int*) malloc(valueCount * sizeof(int));
+
+  findInductionVariables(loop);
+  findUsesOutside(loop);
+
+  // Hoisting moves instructions between blocks, so they are collected first
+  for (block = 0; block < function->blockCount; block ++) {
+    if (!loop->body[block]) continue;
+    for (i = 0; i < function->blocks[block].instrCount; i ++)
+      candidates[candidateCount ++] = function->blocks[block].instrs[i];
+  }
+  for (i = 0; i < candidateCount; i ++) {
+    value = candidates[i];
+    if (!isDerived(value, &derived)) continue;
+    if ((derived.base != NO_VALUE) && !hoist(loop, derived.base)) continue;
+    reduce(loop, value, &derived);
+    reduced ++;
+  }
+
+  free(ivInit);
+  free(ivStep);
+  free(isInduction);
+  free(usedOutside);
+  free(candidates);
+  return reduced;
+}
+
+/* An induction variable only kept alive by its own increment */
+static void removeDeadInductions(Loop* loop) {
+  IrBlock* header = function->blocks + loop->header;
+  int* uses = (int*) calloc(function->instrCount, sizeof(int));
+  IrInstr* instr;
+  int i, j, phi, next;
+
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = instrOf(i);
+    if (instr->dead) continue;
+    for (j = 0; j < instr->argCount; j ++)
+      uses[resolveValue(function, instr->args[j])] ++;
+  }
+  for (i = 0; i < header->phiCount; i ++) {
+    phi = header->phis[i];
+    if (instrOf(phi)->dead || (uses[phi] != 1)) continue;
+    j = (header->preds[0] == loop->preheader) ? 1 : 0;
+    next = resolveValue(function, instrOf(phi)->args[j]);
+    instr = instrOf(next);
+    if ((uses[next] != 1) || (instr->op != IR_BINARY) || (instr->p != OP_AD) ||
+	((resolveValue(function, instr->args[0]) != phi) && (resolveValue(function, instr->args[1]) != phi)))
+      continue;
+    instrOf(phi)->dead = 1;
+    instr->dead = 1;
+  }
+  free(uses);
+}
+
+static void reduceInductionVariables(Loop* loop) {
+  if (reduceRound(loop) == 0) return;
+  while (reduceRound(loop) > 0);
+  removeDeadInductions(loop);
+}
+
+/******************************************************************/
+
+static void optimizeFunction(IrFunction* f) {
+  Loop* loops;
+  int loopCount, i;
+
+  function = f;
+  rpoIndex = (int*) malloc(function->blockCount * sizeof(int));
+  idom = (int*) malloc(function->blockCount * sizeof(int));
+  computeDominators();
+  loopCount = findLoops(&loops);
+
+  for (i = 0; i < loopCount; i ++) {
+    if (loops[i].preheader >= 0) {
+      hoistInvariants(loops + i);
+      if ((loops[i].latch >= 0) && (function->blocks[loops[i].header].predCount == 2))
+	reduceInductionVariables(loops + i);
+    }
+    free(loops[i].body);
+  }
+  if (loopCount > 0) removeDeadCode(function);
+
+  free(loops);
+  free(rpoIndex);
+  free(idom);
+}
+
+void optimizeLoops(IrProgram* p) {
+  int i;
+
+  program = p;
+  computeSummaries();
+  for (i = 0; i < program->functionCount; i ++)
+    optimizeFunction(program->functions + i);
+  freeSummaries();
+}
+
+void numberValues(IrProgram* p, int minCost) {
+  int i;
+
+  program = p;
+  computeSummaries();
+  for (i = 0; i < program->functionCount; i ++)
+    numberFunction(program->functions + i, minCost);
+  freeSummaries();
+}
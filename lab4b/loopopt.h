@@ -0,0 +1,31 @@
+/* Loop optimizations and value numbering in the IR */
+
+#ifndef __LOOPOPT_H__
+#define __LOOPOPT_H__
+
+#include "ir.h"
+
+/* Optimizations of the natural loops of the IR. Only loops entered from
+ * a single preheader and closed by a single back edge are rewritten,
+ * which is the shape of the FOR and WHILE statements.
+ *
+ * Values that do not change in a loop move to its preheader: constants,
+ * addresses, pure arithmetic on them, and loads of variables that neither
+ * the loop nor a subprogram it calls may write.
+ *
+ * Addresses and products that grow with an induction variable, such as
+ * a(.i.)(.j.)(.k.) in a loop over k, are turned into values of their own
+ * that are stepped once per iteration; the part of their computation
+ * that does not change in the loop moves to the preheader.
+ */
+void optimizeLoops(IrProgram* program);
+
+/* Local value numbering: within a basic block, a value computed again
+ * from equal operands, or loaded again from slots that no store or call
+ * in between may write, is replaced by the earlier one. Only values that
+ * take at least minCost instructions to compute again are replaced, the
+ * others still number the values computed from them.
+ */
+void numberValues(IrProgram* program, int minCost);
+
+#endif
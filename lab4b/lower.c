@@ -0,0 +1,1065 @@
+/* Lowering of the IR back to stack code */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lower.h"
+#include "regalloc.h"
+
+struct Fixup_ {
+  CodeAddress address;
+  int block;
+};
+
+typedef struct Fixup_ Fixup;
+
+struct Edge_ {
+  int from;
+  int succ;                    // index in the successors of from
+  long count;
+};
+
+typedef struct Edge_ Edge;
+
+struct CountingLoop_ {
+  int header;
+  int entry;                   // the block entering it, with FORINIT when entryTest is set
+  int latch;                   // the block closing it with FORSTEP
+  int variable;                // phi of the header, its slot is stepped in memory, or NO_VALUE
+  int address;                 // address of a variable left in memory, or NO_VALUE
+  int step;                    // the variable plus one
+  int bound;
+  int entryTest;               // comparison of the initial value with the bound, or NO_VALUE
+  CodeAddress entryJump;       // FORINIT leaving through the DCT after FORSTEP, or -1
+  CodeAddress leaveAddress;    // that DCT
+};
+
+typedef struct CountingLoop_ CountingLoop;
+
+// Values computed by FORINIT and FORSTEP, none of them is emitted
+#define FOLDED_TEST 1
+#define FOLDED_STEP 2          // read only by the loop
+#define FOLDED_KEPT_STEP 3     // read after the loop as well, copied to its slot on the way out
+#define FOLDED_MEMORY 4        // load and store of a variable left in memory
+
+static __thread LoweredCode* out;
+static __thread Profile* profile;
+static __thread int originCapacity;
+static __thread IrFunction* function;
+
+static __thread UseInfo useInfo;
+static __thread int* uses;
+static __thread int* useStart;
+static __thread int* users;
+static __thread int* position;
+
+static __thread char* onStack;        // value consumed right from the operand stack
+static __thread int* stackArgs;       // leading arguments taken from the stack
+static __thread char* earlyArg;       // first argument loaded where the code of the second starts
+static __thread int* treeStart;       // first position of the code computing a value
+static __thread int* preHead;         // per position, values whose code starts there
+static __thread int* preNext;
+
+static __thread char* inSlot;
+static __thread SlotAllocation allocation;
+static __thread int* slot;
+static __thread int tempCount;
+
+static __thread CountingLoop* loops;
+static __thread int* loopAt;          // per block, the counting loop it enters or closes, or -1
+static __thread char* folded;
+
+static __thread int* layout;           // blocks in the order they are emitted
+static __thread CodeAddress* blockAddress;
+static __thread Fixup* fixups;
+static __thread int fixupCount, maxFixupCount;
+
+static __thread CodeBlock* source;     // the code the IR was lifted from
+static __thread int* sourceRelocs;     // per source address, the kind of its relocation or NO_RELOCATION
+static __thread int* sourceSymbols;
+static __thread double* sourceCost;    // per entry, the cost of its subprogram, or below 0
+
+/******************************************************************/
+
+static IrInstr* instrOf(int value) {
+  return function->instrs + value;
+}
+
+static int isRematerialized(int value) {
+  enum IrOp op = instrOf(value)->op;
+  return (op == IR_CONST) || (op == IR_ADDR) || (op == IR_UNDEF);
+}
+
+/* A value that lives in a frame slot between its definition and its uses */
+static int needsSlot(int value) {
+  IrInstr* instr = instrOf(value);
+
+  if (instr->dead || !instr->hasResult || (uses[value] == 0)) return 0;
+  if (onStack[value] || isRematerialized(value)) return 0;
+  if (folded[value] && (folded[value] != FOLDED_KEPT_STEP)) return 0;
+  return 1;
+}
+
+static int isStored(int value) {
+  enum IrOp op = instrOf(value)->op;
+  return needsSlot(value) && (op != IR_PHI) && (op != IR_ENTRY);
+}
+
+static void emit(enum OpCode op, WORD p, WORD q, CodeAddress origin) {
+  CodeBlock* codeBlock = out->codeBlock;
+
+  emitCode(codeBlock, op, p, q);
+  if (codeBlock->maxSize > originCapacity) {
+    originCapacity = codeBlock->maxSize;
+    out->origins = (CodeAddress*) realloc(out->origins, originCapacity * sizeof(CodeAddress));
+  }
+  out->origins[codeBlock->codeSize - 1] = origin;
+}
+
+static void addRelocation(CodeAddress address, int kind, int symbol) {
+  if (out->relocationCount >= out->maxRelocationCount) {
+    out->maxRelocationCount = (out->maxRelocationCount > 0) ? 2 * out->maxRelocationCount : 64;
+    out->relocations = (Relocation*) realloc(out->relocations, out->maxRelocationCount * sizeof(Relocation));
+  }
+  out->relocations[out->relocationCount].address = address;
+  out->relocations[out->relocationCount].kind = kind;
+  out->relocations[out->relocationCount].symbol = symbol;
+  out->relocationCount ++;
+}
+
+static void emitWithRelocation(IrInstr* instr, enum OpCode op, WORD q) {
+  emit(op, hasLevelOperand(op) ? instr->p : DC_VALUE, q, instr->origin);
+  if (instr->reloc != NO_RELOCATION)
+    addRelocation(out->codeBlock->codeSize - 1, instr->reloc, instr->symbol);
+}
+
+static void emitJump(enum OpCode op, int block, CodeAddress origin) {
+  if (fixupCount >= maxFixupCount) {
+    maxFixupCount = (maxFixupCount > 0) ? 2 * maxFixupCount : 64;
+    fixups = (Fixup*) realloc(fixups, maxFixupCount * sizeof(Fixup));
+  }
+  emit(op, DC_VALUE, 0, origin);
+  addRelocation(out->codeBlock->codeSize - 1, RELOC_CODE, 0);
+  fixups[fixupCount].address = out->codeBlock->codeSize - 1;
+  fixups[fixupCount].block = block;
+  fixupCount ++;
+}
+
+/******************************************************************/
+/* With a profile, the blocks are laid out so that the edges that would
+ * run the most J instructions fall through: chains of blocks are joined
+ * along the edges in the order of their counts. A branch that falls
+ * through to its taken successor, or takes it more often than not, has
+ * its comparison inverted. Without a profile the blocks keep their order.
+ */
+
+static int compareEdges(const void* a, const void* b) {
+  const Edge* x = (const Edge*) a;
+  const Edge* y = (const Edge*) b;
+  int xNext = function->blocks[x->from].succs[x->succ] == x->from + 1;
+  int yNext = function->blocks[y->from].succs[y->succ] == y->from + 1;
+
+  if (x->count != y->count) return (x->count > y->count) ? -1 : 1;
+  // Otherwise the blocks keep their order
+  if (xNext != yNext) return yNext - xNext;
+  if (x->from != y->from) return x->from - y->from;
+  return x->succ - y->succ;
+}
+
+static IrInstr* terminatorOf(int b) {
+  IrBlock* block = function->blocks + b;
+  return instrOf(block->instrs[block->instrCount - 1]);
+}
+
+static int predIndex(int block, int pred) {
+  IrBlock* b = function->blocks + block;
+  int i;
+
+  for (i = 0; i < b->predCount; i ++)
+    if (b->preds[i] == pred) return i;
+  return -1;
+}
+
+/* Comparison computing the condition of a branch only, or NULL */
+static IrInstr* invertibleCondition(IrInstr* branch) {
+  IrInstr* condition;
+
+  if ((branch->argCount != 1) || (uses[branch->args[0]] != 1)) return NULL;
+  condition = instrOf(branch->args[0]);
+  if (condition->op != IR_BINARY) return NULL;
+  switch (condition->p) {
+  case OP_EQ: case OP_NE: case OP_LT: case OP_GE: case OP_GT: case OP_LE: return condition;
+  default: return NULL;
+  }
+}
+
+static WORD invertedOperator(WORD op) {
+  switch (op) {
+  case OP_EQ: return OP_NE;
+  case OP_NE: return OP_EQ;
+  case OP_LT: return OP_GE;
+  case OP_GE: return OP_LT;
+  case OP_GT: return OP_LE;
+  default: return OP_GT;
+  }
+}
+
+static void invertBranch(int b) {
+  IrBlock* block = function->blocks + b;
+  IrInstr* condition = invertibleCondition(terminatorOf(b));
+  int succ = block->succs[0];
+
+  condition->p = invertedOperator(condition->p);
+  block->succs[0] = block->succs[1];
+  block->succs[1] = succ;
+}
+
+static void layoutBlocks(void) {
+  int blockCount = function->blockCount;
+  Edge* edges = (Edge*) malloc((2 * blockCount + 1) * sizeof(Edge));
+  int* next = (int*) malloc(blockCount * sizeof(int));
+  int* head = (int*) malloc(blockCount * sizeof(int));
+  long* fallCount = (long*) malloc(blockCount * sizeof(long));
+  long* takenCount = (long*) malloc(blockCount * sizeof(long));
+  IrBlock* block;
+  IrInstr* term;
+  int edgeCount = 0, b, k, to, n;
+
+  for (b = 0; b < blockCount; b ++) {
+    next[b] = -1;
+    head[b] = b;
+    term = terminatorOf(b);
+    takenCount[b] = (term->op == IR_BRANCH) ? profileTaken(profile, term->origin) : 0;
+    fallCount[b] = profileCount(profile, term->origin) - takenCount[b];
+  }
+
+  // Falling through saves the J to a successor; the FJ of a branch costs
+  // the same either way, so its J can always go to the colder successor
+  for (b = 0; b < blockCount; b ++) {
+    block = function->blocks + b;
+    term = terminatorOf(b);
+    if ((term->op != IR_JUMP) && (term->op != IR_BRANCH)) continue;
+    for (k = 0; k < block->succCount; k ++) {
+      to = block->succs[k];
+      if ((to == 0) || (to == b)) continue;
+      edges[edgeCount].from = b;
+      edges[edgeCount].succ = k;
+      if (term->op == IR_JUMP) edges[edgeCount].count = fallCount[b];
+      else if ((invertibleCondition(term) == NULL) || (block->succs[0] == block->succs[1]))
+	edges[edgeCount].count = (k == 0) ? fallCount[b] : 0;
+      else edges[edgeCount].count = (fallCount[b] < takenCount[b]) ? fallCount[b] : takenCount[b];
+      edgeCount ++;
+    }
+  }
+  qsort(edges, edgeCount, sizeof(Edge), compareEdges);
+
+  // Chains are joined from the tail of one to the head of another
+  for (k = 0; k < edgeCount; k ++) {
+    b = edges[k].from;
+    to = function->blocks[b].succs[edges[k].succ];
+    if ((next[b] >= 0) || (head[to] != to) || (head[b] == to)) continue;
+    next[b] = to;
+    for (n = to; n >= 0; n = next[n]) head[n] = head[b];
+  }
+
+  // No edge enters the entry block, so its chain comes first
+  n = 0;
+  for (b = 0; b < blockCount; b ++)
+    if (head[b] == b)
+      for (to = b; to >= 0; to = next[to]) layout[n ++] = to;
+
+  for (k = 0; k < blockCount; k ++) {
+    b = layout[k];
+    block = function->blocks + b;
+    if ((terminatorOf(b)->op != IR_BRANCH) || (invertibleCondition(terminatorOf(b)) == NULL)) continue;
+    to = (k + 1 < blockCount) ? layout[k + 1] : -1;
+    if ((block->succs[0] == to) || (block->succs[0] == block->succs[1])) continue;
+    if ((block->succs[1] == to) || (fallCount[b] > takenCount[b])) invertBranch(b);
+  }
+  free(edges); free(next); free(head); free(fallCount); free(takenCount);
+}
+
+/******************************************************************/
+/* The FOR loops the parser closes with FORSTEP are lifted into an add and
+ * a comparison of the variable with the bound. Those that keep that shape
+ * get their FORINIT and FORSTEP back: the address of the slot of the
+ * variable stays on the operand stack in the loop, as in the code of the
+ * parser, and leaving the loop drops it. A variable left in memory, which
+ * the latch loads, steps and stores back, is stepped there the same way.
+ * The loop has to be entered from a single block and left only from the
+ * latch.
+ */
+
+static int isConstant(int value, WORD q) {
+  return (instrOf(value)->op == IR_CONST) && (instrOf(value)->q == q);
+}
+
+/* Comparison of a value with a bound ending the block right before its
+ * branch, or NO_VALUE. stay is the successor taken when the value is not
+ * above the bound.
+ */
+static int boundTest(int b, int* stay) {
+  IrBlock* block = function->blocks + b;
+  IrInstr* branch = terminatorOf(b);
+  IrInstr* test;
+  int value;
+
+  if ((branch->op != IR_BRANCH) || (block->succs[0] == block->succs[1])) return NO_VALUE;
+  value = branch->args[0];
+  test = instrOf(value);
+  if ((test->op != IR_BINARY) || (test->block != b) || (uses[value] != 1)) return NO_VALUE;
+  if (position[value] != useInfo.blockLast[b] - 1) return NO_VALUE;
+  if (test->p == OP_LE) *stay = 0;
+  else if (test->p == OP_GT) *stay = 1;
+  else return NO_VALUE;
+  return value;
+}
+
+static int isStepOf(int step, int variable, int block) {
+  IrInstr* instr = instrOf(step);
+
+  if ((instr->op != IR_BINARY) || (instr->p != OP_AD) || (instr->block != block)) return 0;
+  return ((instr->args[0] == variable) && isConstant(instr->args[1], 1)) ||
+    ((instr->args[1] == variable) && isConstant(instr->args[0], 1));
+}
+
+/* Whether the instructions of the block between first and last, both
+ * excluded, are the given ones or only load constants and addresses.
+ */
+static int isOnlyBetween(int b, int first, int last, int step, int store) {
+  IrBlock* block = function->blocks + b;
+  int i, v;
+
+  for (i = 0; i < block->instrCount; i ++) {
+    v = block->instrs[i];
+    if (instrOf(v)->dead || (position[v] <= position[first]) || (position[v] >= position[last])) continue;
+    if ((v != step) && (v != store) && (instrOf(v)->op != IR_CONST) && (instrOf(v)->op != IR_ADDR)) return 0;
+  }
+  return 1;
+}
+
+/* A value loaded through an address right before its comparison */
+static int isLoadOf(int value, int address, int b, int test) {
+  IrInstr* instr = instrOf(value);
+
+  return (instr->op == IR_LOADI) && (instr->args[0] == address) && (instr->block == b) && (uses[value] == 1)
+    && isOnlyBetween(b, value, test, NO_VALUE, NO_VALUE);
+}
+
+/* Address of the variable in memory the step is loaded from and stored
+ * back to right before the test, or NO_VALUE.
+ */
+static int steppedAddress(int latch, int step, int test, int* load, int* store) {
+  IrInstr* instr = instrOf(step);
+  int u, address;
+
+  if ((instr->op != IR_BINARY) || (instr->p != OP_AD) || (instr->block != latch) || (uses[step] != 2))
+    return NO_VALUE;
+  *load = isConstant(instr->args[1], 1) ? instr->args[0] : (isConstant(instr->args[0], 1) ? instr->args[1] : NO_VALUE);
+  if ((*load == NO_VALUE) || (instrOf(*load)->op != IR_LOADI) || (uses[*load] != 1)) return NO_VALUE;
+  address = instrOf(*load)->args[0];
+  if (instrOf(address)->op != IR_ADDR) return NO_VALUE;
+  for (u = useStart[step]; u < useStart[step] + uses[step]; u ++)
+    if (users[u] != test) *store = users[u];
+  instr = instrOf(*store);
+  if ((instr->op != IR_STORE) || (instr->args[0] != address) || (instr->args[1] != step)) return NO_VALUE;
+  if ((instr->block != latch) || !isOnlyBetween(latch, *load, test, step, *store)) return NO_VALUE;
+  return address;
+}
+
+/* The blocks of the natural loop of the back edge from latch to header */
+static void markLoop(int header, int latch, char* body) {
+  int* workList = (int*) malloc((function->blockCount + 1) * sizeof(int));
+  int workCount = 0;
+  int b, i;
+
+  body[header] = 1;
+  if (!body[latch]) {
+    body[latch] = 1;
+    workList[workCount ++] = latch;
+  }
+  while (workCount > 0) {
+    b = workList[-- workCount];
+    for (i = 0; i < function->blocks[b].predCount; i ++)
+      if (!body[function->blocks[b].preds[i]]) {
+	body[function->blocks[b].preds[i]] = 1;
+	workList[workCount ++] = function->blocks[b].preds[i];
+      }
+  }
+  free(workList);
+}
+
+/* Whether the loop is only entered at its header and only left from its
+ * latch, and whether the variable is only read inside. A block reached
+ * from the entry of the function without going through the header would
+ * bring the entry into the loop.
+ */
+static int isClosedLoop(CountingLoop* loop, int exit, char* body) {
+  IrBlock* block;
+  IrInstr* user;
+  int b, i, u;
+
+  if (body[0] || body[loop->entry]) return 0;
+  for (b = 0; b < function->blockCount; b ++) {
+    if (!body[b]) continue;
+    block = function->blocks + b;
+    for (i = 0; i < block->succCount; i ++)
+      if (!body[block->succs[i]] && ((b != loop->latch) || (block->succs[i] != exit))) return 0;
+  }
+  // Once stepped, the slot of the variable holds the next value
+  if (loop->variable == NO_VALUE) return 1;
+  for (u = useStart[loop->variable]; u < useStart[loop->variable] + uses[loop->variable]; u ++) {
+    user = instrOf(users[u]);
+    if (!body[user->block]) return 0;
+  }
+  return 1;
+}
+
+static void findCountingLoop(int latch, int* loopCount) {
+  IrBlock* header;
+  IrInstr* user;
+  CountingLoop loop;
+  char* body;
+  int test, stay, enter, k, i, u, load, store, kept = 0, closed;
+
+  test = boundTest(latch, &stay);
+  if (test == NO_VALUE) return;
+  loop.latch = latch;
+  loop.header = function->blocks[latch].succs[stay];
+  loop.step = instrOf(test)->args[0];
+  loop.bound = instrOf(test)->args[1];
+  header = function->blocks + loop.header;
+  k = predIndex(loop.header, latch);
+  if ((header->predCount != 2) || (loop.bound == loop.step)) return;
+  loop.entry = header->preds[1 - k];
+  if ((loop.entry == latch) || (loopAt[loop.entry] >= 0) || (loopAt[latch] >= 0)) return;
+
+  // The step only goes back to the variable, or out of the loop
+  loop.variable = loop.address = NO_VALUE;
+  for (i = 0; i < header->phiCount; i ++) {
+    if (instrOf(header->phis[i])->args[k] != loop.step) continue;
+    if ((loop.variable != NO_VALUE) || !isStepOf(loop.step, header->phis[i], latch)) return;
+    loop.variable = header->phis[i];
+  }
+  if (loop.variable == NO_VALUE) {
+    loop.address = steppedAddress(latch, loop.step, test, &load, &store);
+    if (loop.address == NO_VALUE) return;
+  }
+  for (u = useStart[loop.step]; (u < useStart[loop.step] + uses[loop.step]) && (loop.variable != NO_VALUE); u ++) {
+    user = instrOf(users[u]);
+    if ((users[u] == test) || (users[u] == loop.variable)) continue;
+    if ((user->block == latch) || (user->block == loop.header)) return;
+    kept = 1;
+  }
+
+  loop.entryTest = NO_VALUE;
+  loop.entryJump = -1;
+  if (terminatorOf(loop.entry)->op == IR_BRANCH) {
+    loop.entryTest = boundTest(loop.entry, &enter);
+    if ((loop.entryTest == NO_VALUE) || (function->blocks[loop.entry].succs[enter] != loop.header)) return;
+    if (loop.address != NO_VALUE) {
+      if (!isLoadOf(instrOf(loop.entryTest)->args[0], loop.address, loop.entry, loop.entryTest)) return;
+    } else if (instrOf(loop.entryTest)->args[0] != instrOf(loop.variable)->args[1 - k]) return;
+    if (instrOf(instrOf(loop.entryTest)->args[0])->op == IR_UNDEF) return;
+  } else if (terminatorOf(loop.entry)->op != IR_JUMP) return;
+
+  body = (char*) calloc(function->blockCount, 1);
+  markLoop(loop.header, latch, body);
+  closed = isClosedLoop(&loop, function->blocks[latch].succs[1 - stay], body);
+  free(body);
+  if (!closed) return;
+
+  loops[*loopCount] = loop;
+  loopAt[loop.entry] = loopAt[latch] = (*loopCount) ++;
+  folded[test] = FOLDED_TEST;
+  folded[loop.step] = kept ? FOLDED_KEPT_STEP : FOLDED_STEP;
+  if (loop.entryTest != NO_VALUE) folded[loop.entryTest] = FOLDED_TEST;
+  if (loop.address != NO_VALUE) {
+    folded[load] = folded[store] = FOLDED_MEMORY;
+    if (loop.entryTest != NO_VALUE) folded[instrOf(loop.entryTest)->args[0]] = FOLDED_MEMORY;
+  }
+}
+
+static void findCountingLoops(void) {
+  int b, loopCount = 0;
+
+  loops = (CountingLoop*) malloc((function->blockCount + 1) * sizeof(CountingLoop));
+  loopAt = (int*) malloc(function->blockCount * sizeof(int));
+  folded = (char*) calloc(function->instrCount, 1);
+  for (b = 0; b < function->blockCount; b ++) loopAt[b] = -1;
+  for (b = 0; b < function->blockCount; b ++) findCountingLoop(b, &loopCount);
+}
+
+/******************************************************************/
+/* Values used once, by a later instruction of the same block, are left on
+ * the operand stack when they are the topmost operands of their user.
+ */
+
+/* Operator with its operands exchanged, or -1 */
+static int swappedOperator(WORD op) {
+  switch (op) {
+  case OP_AD: case OP_ML: case OP_EQ: case OP_NE: return op;
+  case OP_GT: return OP_LT;
+  case OP_LT: return OP_GT;
+  case OP_GE: return OP_LE;
+  case OP_LE: return OP_GE;
+  default: return -1;
+  }
+}
+
+static int isPending(int* pending, int count, int value) {
+  int i;
+
+  for (i = 0; i < count; i ++)
+    if (pending[i] == value) return 1;
+  return 0;
+}
+
+/* Length of the longest run of the arguments on top of the pending values */
+static int matchPending(int* pending, int count, int* args, int argCount) {
+  int m, k;
+
+  for (m = (argCount < count) ? argCount : count; m > 0; m --) {
+    for (k = 0; k < m; k ++)
+      if (pending[count - m + k] != args[k]) break;
+    if (k == m) break;
+  }
+  return m;
+}
+
+static void stackifyBlock(int b, int* pending) {
+  IrBlock* block = function->blocks + b;
+  IrInstr* instr;
+  int count = 0;
+  int i, j, k, m, first, v;
+
+  for (i = 0; i < block->instrCount; i ++) {
+    v = block->instrs[i];
+    instr = instrOf(v);
+    if (instr->dead) continue;
+
+    // FORINIT and FORSTEP load what they compare themselves, a bound
+    // computed right before FORSTEP is left on the stack for it
+    if (folded[v]) {
+      if ((folded[v] == FOLDED_TEST) && (loopAt[b] >= 0) && (loops[loopAt[b]].latch == b) &&
+	  (count > 0) && (pending[count - 1] == instr->args[1])) {
+	onStack[instr->args[1]] = 1;
+	count --;
+      }
+      for (k = 0; k < instr->argCount; k ++)
+	for (j = 0; j < count; j ++)
+	  if (pending[j] == instr->args[k]) {
+	    memmove(pending + j, pending + j + 1, (count - j - 1) * sizeof(int));
+	    count --;
+	    break;
+	  }
+      treeStart[v] = position[v];
+      continue;
+    }
+
+    // An operand loaded from its slot can as well come second
+    if ((instr->op == IR_BINARY) && (count > 0) && (pending[count - 1] == instr->args[1]) &&
+	!isPending(pending, count, instr->args[0]) && (swappedOperator(instr->p) >= 0)) {
+      instr->p = swappedOperator(instr->p);
+      instr->args[1] = instr->args[0];
+      instr->args[0] = pending[count - 1];
+    }
+
+    first = 0;
+    m = matchPending(pending, count, instr->args, instr->argCount);
+    // Otherwise it is loaded before the code of the operands on the stack
+    if ((m == 0) && (instr->argCount > 1) && !isPending(pending, count, instr->args[0])) {
+      m = matchPending(pending, count, instr->args + 1, instr->argCount - 1);
+      if ((m > 0) && (isRematerialized(instr->args[0]) || (position[instr->args[0]] < treeStart[instr->args[1]])))
+	first = earlyArg[v] = 1;
+      else m = 0;
+    }
+    // Operands deeper in the stack have to wait in a slot
+    for (k = first + m; k < instr->argCount; k ++)
+      for (j = 0; j < count - m; j ++)
+	if (pending[j] == instr->args[k]) {
+	  memmove(pending + j, pending + j + 1, (count - j - 1) * sizeof(int));
+	  count --;
+	  break;
+	}
+    for (k = first; k < first + m; k ++) onStack[instr->args[k]] = 1;
+    count -= m;
+    stackArgs[v] = m;
+
+    treeStart[v] = (m > 0) ? treeStart[instr->args[first]] : position[v];
+    preNext[v] = preHead[treeStart[v]];
+    preHead[treeStart[v]] = v;
+
+    // The value a promoted slot holds on entry is already in the slot
+    if (instr->hasResult && (uses[v] == 1) && (instr->op != IR_ENTRY)) {
+      j = users[useStart[v]];
+      if ((instrOf(j)->op != IR_PHI) && (instrOf(j)->block == b))
+	pending[count ++] = v;
+    }
+  }
+}
+
+/******************************************************************/
+
+static void loadValue(int value, CodeAddress origin) {
+  IrInstr* instr = instrOf(value);
+
+  switch (instr->op) {
+  case IR_CONST: emit(OP_LC, DC_VALUE, instr->q, origin); break;
+  case IR_UNDEF: emit(OP_LC, DC_VALUE, 0, origin); break;
+  case IR_ADDR:
+    emit(OP_LA, instr->p, instr->q, origin);
+    if (instr->reloc != NO_RELOCATION)
+      addRelocation(out->codeBlock->codeSize - 1, instr->reloc, instr->symbol);
+    break;
+  default: emit(OP_LV, 0, slot[value], origin); break;
+  }
+}
+
+static void loadLoopAddress(CountingLoop* loop, CodeAddress origin) {
+  if (loop->address != NO_VALUE) loadValue(loop->address, origin);
+  else emit(OP_LA, 0, slot[loop->variable], origin);
+}
+
+/* Copies into the phis of a successor, all sources are read first */
+static int emitCopies(int from, int to, CodeAddress origin, int countOnly) {
+  IrBlock* target = function->blocks + to;
+  int k = predIndex(to, from);
+  int phi, source, i, copies = 0;
+
+  for (i = 0; i < target->phiCount; i ++) {
+    phi = target->phis[i];
+    if (!needsSlot(phi)) continue;
+    // FORSTEP steps the variable in its slot
+    if ((loopAt[from] >= 0) && (loops[loopAt[from]].latch == from) && (loops[loopAt[from]].variable == phi))
+      continue;
+    source = instrOf(phi)->args[k];
+    if ((instrOf(source)->op == IR_UNDEF) || (needsSlot(source) && (slot[source] == slot[phi])))
+      continue;
+    copies ++;
+    if (countOnly) continue;
+    emit(OP_LA, 0, slot[phi], origin);
+    loadValue(source, origin);
+  }
+  if (!countOnly)
+    for (i = 0; i < copies; i ++) emit(OP_ST, DC_VALUE, DC_VALUE, origin);
+  return copies;
+}
+
+/* FORINIT leaves through the DCT after FORSTEP when neither edge out of
+ * the loop copies anything, the loop is then entered falling through.
+ */
+static int sharesLeave(CountingLoop* loop, int leave) {
+  IrBlock* latch = function->blocks + loop->latch;
+  int latchLeave = (latch->succs[0] == loop->header) ? latch->succs[1] : latch->succs[0];
+
+  return (latchLeave == leave) && (folded[loop->step] != FOLDED_KEPT_STEP)
+    && (emitCopies(loop->entry, leave, 0, 1) == 0) && (emitCopies(loop->latch, leave, 0, 1) == 0);
+}
+
+/* The bound is loaded on top of the address of the variable before the
+ * copies into the header, FORINIT then reads the initial value they store.
+ */
+static void emitCountingBranch(int b, IrInstr* instr) {
+  IrBlock* block = function->blocks + b;
+  CountingLoop* loop = loops + loopAt[b];
+  int leave = (block->succs[0] == loop->header) ? block->succs[1] : block->succs[0];
+  CodeAddress jump;
+
+  if (b == loop->entry) {
+    loadLoopAddress(loop, instr->origin);
+    loadValue(instrOf(loop->entryTest)->args[1], instr->origin);
+  } else if (!onStack[loop->bound]) loadValue(loop->bound, instr->origin);
+  emitCopies(b, loop->header, instr->origin, 0);
+  if (b == loop->latch) {
+    emitJump(OP_FORSTEP, loop->header, instr->origin);
+    loop->leaveAddress = out->codeBlock->codeSize;
+  } else {
+    emit(OP_FORINIT, DC_VALUE, 0, instr->origin);
+    jump = out->codeBlock->codeSize - 1;
+    addRelocation(jump, RELOC_CODE, 0);
+    emitJump(OP_J, loop->header, instr->origin);
+    if (sharesLeave(loop, leave)) {
+      loop->entryJump = jump;
+      return;
+    }
+    out->codeBlock->code[jump].q = out->codeBlock->codeSize;
+  }
+
+  emit(OP_DCT, DC_VALUE, 1, instr->origin);
+  if ((b == loop->latch) && (folded[loop->step] == FOLDED_KEPT_STEP) && (slot[loop->step] != slot[loop->variable])) {
+    emit(OP_LA, 0, slot[loop->step], instr->origin);
+    emit(OP_LV, 0, slot[loop->variable], instr->origin);
+    emit(OP_ST, DC_VALUE, DC_VALUE, instr->origin);
+  }
+  emitCopies(b, leave, instr->origin, 0);
+  emitJump(OP_J, leave, instr->origin);
+}
+
+static void emitTerminator(int b, IrInstr* instr) {
+  IrBlock* block = function->blocks + b;
+  CodeAddress falseJump;
+
+  switch (instr->op) {
+  case IR_JUMP:
+    emitCopies(b, block->succs[0], instr->origin, 0);
+    if (loopAt[b] >= 0) loadLoopAddress(loops + loopAt[b], instr->origin);
+    emitJump(OP_J, block->succs[0], instr->origin);
+    break;
+  case IR_BRANCH:
+    if (loopAt[b] >= 0) emitCountingBranch(b, instr);
+    else if (emitCopies(b, block->succs[1], instr->origin, 1) == 0) {
+      emitJump(OP_FJ, block->succs[1], instr->origin);
+      emitCopies(b, block->succs[0], instr->origin, 0);
+      emitJump(OP_J, block->succs[0], instr->origin);
+    } else {
+      emit(OP_FJ, DC_VALUE, 0, instr->origin);
+      falseJump = out->codeBlock->codeSize - 1;
+      addRelocation(falseJump, RELOC_CODE, 0);
+      emitCopies(b, block->succs[0], instr->origin, 0);
+      emitJump(OP_J, block->succs[0], instr->origin);
+      out->codeBlock->code[falseJump].q = out->codeBlock->codeSize;
+      emitCopies(b, block->succs[1], instr->origin, 0);
+      emitJump(OP_J, block->succs[1], instr->origin);
+    }
+    break;
+  case IR_RETURN: emit(instr->p, DC_VALUE, DC_VALUE, instr->origin); break;
+  case IR_HALT: emit(OP_HL, DC_VALUE, DC_VALUE, instr->origin); break;
+  default: break;
+  }
+}
+
+static void emitInstr(int b, int v) {
+  IrInstr* instr = instrOf(v);
+  int k;
+
+  if (folded[v]) return;
+  for (k = earlyArg[v] + stackArgs[v]; k < instr->argCount; k ++)
+    if (folded[instr->args[k]] != FOLDED_TEST) loadValue(instr->args[k], instr->origin);
+
+  switch (instr->op) {
+  case IR_CONST:
+  case IR_ADDR:
+  case IR_UNDEF:
+    if (onStack[v]) loadValue(v, instr->origin);
+    return;
+  case IR_LOAD: emitWithRelocation(instr, OP_LV, instr->q); break;
+  case IR_LOADI: emit(OP_LI, DC_VALUE, DC_VALUE, instr->origin); break;
+  case IR_STORE: emit(OP_ST, DC_VALUE, DC_VALUE, instr->origin); break;
+  case IR_BINARY: emit(instr->p, DC_VALUE, instr->q, instr->origin); break;
+  case IR_NEG: emit(OP_NEG, DC_VALUE, DC_VALUE, instr->origin); break;
+  case IR_READ: emit(instr->p, DC_VALUE, DC_VALUE, instr->origin); break;
+  case IR_WRITE: emit(instr->p, DC_VALUE, DC_VALUE, instr->origin); break;
+  case IR_WRITELN: emit(OP_WLN, DC_VALUE, DC_VALUE, instr->origin); break;
+  case IR_CALL:
+    emit(OP_DCT, DC_VALUE, 4 + instr->argCount, instr->origin);
+    emitWithRelocation(instr, (instr->p == NO_STATIC_LINK) ? OP_CALLN : OP_CALL, instr->q);
+    break;
+  case IR_FRAME: emitWithRelocation(instr, OP_INT, function->frameSize + tempCount); break;
+  case IR_JUMP:
+  case IR_BRANCH:
+  case IR_RETURN:
+  case IR_HALT:
+    emitTerminator(b, instr);
+    return;
+  default:
+    return;
+  }
+
+  if (!instr->hasResult || onStack[v]) return;
+  if (isStored(v)) emit(OP_ST, DC_VALUE, DC_VALUE, instr->origin);
+  else if (uses[v] == 0) emit(OP_DCT, DC_VALUE, 1, instr->origin);
+}
+
+static void emitFunction(void) {
+  IrBlock* block;
+  IrInstr* instr;
+  int b, k, i, v, pre, firstFixup = fixupCount;
+
+  for (k = 0; k < function->blockCount; k ++) {
+    b = layout[k];
+    block = function->blocks + b;
+    blockAddress[b] = out->codeBlock->codeSize;
+    for (i = 0; i < block->instrCount; i ++) {
+      v = block->instrs[i];
+      instr = instrOf(v);
+      if (instr->dead) continue;
+      // Outer trees first: their slot address and frame header go below
+      for (pre = preHead[position[v]]; pre != NO_VALUE; pre = preNext[pre]) {
+	if (isStored(pre)) emit(OP_LA, 0, slot[pre], instr->origin);
+	if (instrOf(pre)->op == IR_CALL) emit(OP_INT, DC_VALUE, 4, instr->origin);
+	if (earlyArg[pre]) loadValue(instrOf(pre)->args[0], instr->origin);
+      }
+      emitInstr(b, v);
+    }
+  }
+  for (i = firstFixup; i < fixupCount; i ++)
+    out->codeBlock->code[fixups[i].address].q = blockAddress[fixups[i].block];
+  fixupCount = firstFixup;
+  for (b = 0; b < function->blockCount; b ++)
+    if ((loopAt[b] >= 0) && (loops[loopAt[b]].latch == b) && (loops[loopAt[b]].entryJump >= 0))
+      out->codeBlock->code[loops[loopAt[b]].entryJump].q = loops[loopAt[b]].leaveAddress;
+}
+
+static void freeFunctionState(void) {
+  freeUseInfo(&useInfo);
+  free(onStack); free(stackArgs); free(earlyArg); free(treeStart); free(preHead); free(preNext);
+  free(loops); free(loopAt); free(folded);
+  free(inSlot);
+  freeSlotAllocation(&allocation);
+  free(layout); free(blockAddress);
+}
+
+static void lowerFunction(IrFunction* f) {
+  int* pending;
+  int b, i, positions;
+
+  function = f;
+  computeUseInfo(function, &useInfo);
+  uses = useInfo.uses;
+  useStart = useInfo.useStart;
+  users = useInfo.users;
+  position = useInfo.position;
+
+  layout = (int*) malloc(function->blockCount * sizeof(int));
+  for (b = 0; b < function->blockCount; b ++) layout[b] = b;
+  if (profile != NULL) layoutBlocks();
+  findCountingLoops();
+
+  positions = useInfo.blockLast[function->blockCount - 1] + 2;
+  onStack = (char*) calloc(function->instrCount, 1);
+  stackArgs = (int*) calloc(function->instrCount, sizeof(int));
+  earlyArg = (char*) calloc(function->instrCount, 1);
+  treeStart = (int*) malloc(function->instrCount * sizeof(int));
+  preNext = (int*) malloc(function->instrCount * sizeof(int));
+  preHead = (int*) malloc(positions * sizeof(int));
+  for (i = 0; i < positions; i ++) preHead[i] = NO_VALUE;
+  pending = (int*) malloc((function->instrCount + 1) * sizeof(int));
+  for (b = 0; b < function->blockCount; b ++) stackifyBlock(b, pending);
+  free(pending);
+
+  inSlot = (char*) malloc(function->instrCount + 1);
+  for (i = 0; i < function->instrCount; i ++) inSlot[i] = needsSlot(i);
+  allocateSlots(function, &useInfo, inSlot, &allocation);
+  slot = allocation.slots;
+  tempCount = allocation.tempCount;
+
+  // A branch with copies on its false edge only jumps on the other one,
+  // then the copies need no jump around them
+  for (b = 0; b < function->blockCount; b ++) {
+    IrBlock* block = function->blocks + b;
+    if ((terminatorOf(b)->op != IR_BRANCH) || (loopAt[b] >= 0) || (invertibleCondition(terminatorOf(b)) == NULL)
+	|| (block->succs[0] == block->succs[1]))
+      continue;
+    if ((emitCopies(b, block->succs[1], 0, 1) > 0) && (emitCopies(b, block->succs[0], 0, 1) == 0)) invertBranch(b);
+  }
+
+  blockAddress = (CodeAddress*) malloc(function->blockCount * sizeof(CodeAddress));
+  emitFunction();
+  freeFunctionState();
+}
+
+/******************************************************************/
+/* The lowered code of a subprogram is kept only when it costs less than
+ * its source code, which is copied back otherwise. Both are costed the
+ * same way, by the instructions they dispatch: an instruction inside n
+ * loops, the ranges closed by backward jumps, counts LOOP_WEIGHT^n, and a
+ * call adds the cost of the source code of its callee, so that inlining
+ * it is no loss. A J to the next instruction and an INT or a DCT of 0
+ * count nothing, the optimizer removes them.
+ */
+
+#define LOOP_WEIGHT 8
+#define MAX_LOOP_DEPTH 6
+#define IN_PROGRESS -2
+
+static int isJump(enum OpCode op) {
+  return (op == OP_J) || (op == OP_FJ) || (op == OP_TC) || (op == OP_FORINIT) || (op == OP_FORSTEP);
+}
+
+static int isRemoved(Instruction* inst, CodeAddress pc) {
+  return ((inst->op == OP_J) && (inst->q == pc + 1)) || (((inst->op == OP_INT) || (inst->op == OP_DCT)) && (inst->q == 0));
+}
+
+/* Marks the code reachable from the entry without following calls, at
+ * the addresses from start on.
+ */
+static void markReachable(CodeBlock* code, CodeAddress start, CodeAddress entry, char* reached) {
+  CodeAddress* workList = (CodeAddress*) malloc((code->codeSize - start + 1) * sizeof(CodeAddress));
+  int workCount = 0;
+  CodeAddress pc;
+
+#define VISIT(address) \
+  if (((address) >= start) && ((address) < code->codeSize) && !reached[(address) - start]) { \
+    reached[(address) - start] = 1; \
+    workList[workCount ++] = (address); \
+  }
+
+  VISIT(entry);
+  while (workCount > 0) {
+    pc = workList[-- workCount];
+    switch (code->code[pc].op) {
+    case OP_EP: case OP_EF: case OP_HL: break;
+    case OP_J: case OP_TC: VISIT(code->code[pc].q); break;
+    case OP_FJ: case OP_FORINIT: case OP_FORSTEP: VISIT(code->code[pc].q); VISIT(pc + 1); break;
+    default: VISIT(pc + 1); break;
+    }
+  }
+#undef VISIT
+  free(workList);
+}
+
+static double sourceCostOf(CodeAddress entry);
+
+/* relocs has the kind of relocation of every address from start on */
+static double codeCost(CodeBlock* code, CodeAddress start, CodeAddress entry, int* relocs) {
+  int size = code->codeSize - start;
+  char* reached = (char*) calloc(size + 1, 1);
+  int* depthChange = (int*) calloc(size + 1, sizeof(int));
+  Instruction* inst;
+  double cost = 0, weight;
+  int a, d, depth = 0;
+
+  markReachable(code, start, entry, reached);
+  for (a = 0; a < size; a ++) {
+    inst = code->code + start + a;
+    if (reached[a] && isJump(inst->op) && (inst->q >= start) && (inst->q - start <= a)) {
+      depthChange[inst->q - start] ++;
+      depthChange[a + 1] --;
+    }
+  }
+  for (a = 0; a < size; a ++) {
+    depth += depthChange[a];
+    inst = code->code + start + a;
+    if (!reached[a] || isRemoved(inst, start + a)) continue;
+    for (d = 0, weight = 1; (d < depth) && (d < MAX_LOOP_DEPTH); d ++) weight *= LOOP_WEIGHT;
+    cost += weight;
+    if (((inst->op == OP_CALL) || (inst->op == OP_CALLN)) && (relocs[a] == RELOC_CODE))
+      cost += weight * sourceCostOf(inst->q);
+  }
+  free(reached);
+  free(depthChange);
+  return cost;
+}
+
+// A recursive call adds nothing to the cost of its own subprogram
+static double sourceCostOf(CodeAddress entry) {
+  if ((entry < 0) || (entry >= source->codeSize) || (sourceCost[entry] == IN_PROGRESS)) return 0;
+  if (sourceCost[entry] < 0) {
+    sourceCost[entry] = IN_PROGRESS;
+    sourceCost[entry] = codeCost(source, 0, entry, sourceRelocs);
+  }
+  return sourceCost[entry];
+}
+
+static double loweredCost(CodeAddress start, int firstRelocation) {
+  int* relocs = (int*) malloc((out->codeBlock->codeSize - start + 1) * sizeof(int));
+  double cost;
+  int i;
+
+  for (i = 0; i < out->codeBlock->codeSize - start; i ++) relocs[i] = NO_RELOCATION;
+  for (i = firstRelocation; i < out->relocationCount; i ++)
+    relocs[out->relocations[i].address - start] = out->relocations[i].kind;
+  cost = codeCost(out->codeBlock, start, start, relocs);
+  free(relocs);
+  return cost;
+}
+
+/* Replaces the code lowered from start on by the source code of the
+ * subprogram, its jumps moved along; the calls are moved with the others.
+ */
+static void copySource(CodeAddress entry, CodeAddress start, int firstRelocation) {
+  char* reached = (char*) calloc(source->codeSize + 1, 1);
+  CodeAddress* map = (CodeAddress*) malloc((source->codeSize + 1) * sizeof(CodeAddress));
+  Instruction* inst;
+  CodeAddress pc, n = start;
+
+  markReachable(source, 0, entry, reached);
+  for (pc = 0; pc < source->codeSize; pc ++)
+    if (reached[pc]) map[pc] = n ++;
+
+  out->codeBlock->codeSize = start;
+  out->relocationCount = firstRelocation;
+  for (pc = 0; pc < source->codeSize; pc ++) {
+    if (!reached[pc]) continue;
+    inst = source->code + pc;
+    emit(inst->op, inst->p, isJump(inst->op) ? map[inst->q] : inst->q, pc);
+    if (sourceRelocs[pc] != NO_RELOCATION) addRelocation(out->codeBlock->codeSize - 1, sourceRelocs[pc], sourceSymbols[pc]);
+  }
+  free(reached);
+  free(map);
+}
+
+static int compareEntries(const void* a, const void* b) {
+  const IrFunction* x = *(IrFunction* const*) a;
+  const IrFunction* y = *(IrFunction* const*) b;
+  long xCount = profileCount(profile, x->entry);
+  long yCount = profileCount(profile, y->entry);
+
+  if (xCount != yCount) return (xCount > yCount) ? -1 : 1;
+  return x->entry - y->entry;
+}
+
+int lowerIr(IrProgram* program, CodeBlock* sourceCode, Relocation* relocations, int relocationCount,
+	    LoweredCode* lowered, CodeAddress* entryMap) {
+  IrFunction** functions = (IrFunction**) malloc((program->functionCount + 1) * sizeof(IrFunction*));
+  Instruction* inst;
+  int sourceSize = sourceCode->codeSize;
+  CodeAddress pc, start;
+  int i, firstRelocation;
+
+  memset(lowered, 0, sizeof(LoweredCode));
+  lowered->codeBlock = createCodeBlock(sourceSize + 16);
+  originCapacity = lowered->codeBlock->maxSize;
+  lowered->origins = (CodeAddress*) malloc(originCapacity * sizeof(CodeAddress));
+  out = lowered;
+  fixups = NULL;
+  fixupCount = maxFixupCount = 0;
+  profile = program->profile;
+  source = sourceCode;
+  sourceRelocs = (int*) malloc((sourceSize + 1) * sizeof(int));
+  sourceSymbols = (int*) malloc((sourceSize + 1) * sizeof(int));
+  sourceCost = (double*) malloc((sourceSize + 1) * sizeof(double));
+  for (pc = 0; pc < sourceSize; pc ++) {
+    entryMap[pc] = -1;
+    sourceRelocs[pc] = NO_RELOCATION;
+    sourceSymbols[pc] = 0;
+    sourceCost[pc] = -1;
+  }
+  for (i = 0; i < relocationCount; i ++) {
+    sourceRelocs[relocations[i].address] = relocations[i].kind;
+    sourceSymbols[relocations[i].address] = relocations[i].symbol;
+  }
+
+  // Subprograms keep their order in the code, the hottest first with a profile
+  for (i = 0; i < program->functionCount; i ++) functions[i] = program->functions + i;
+  qsort(functions, program->functionCount, sizeof(IrFunction*), compareEntries);
+  for (i = 0; i < program->functionCount; i ++) {
+    start = lowered->codeBlock->codeSize;
+    firstRelocation = lowered->relocationCount;
+    entryMap[functions[i]->entry] = start;
+    lowerFunction(functions[i]);
+    if (loweredCost(start, firstRelocation) >= sourceCostOf(functions[i]->entry))
+      copySource(functions[i]->entry, start, firstRelocation);
+  }
+  free(functions);
+  free(fixups);
+  free(sourceRelocs); free(sourceSymbols); free(sourceCost);
+
+  // Calls inside the unit move along with their callees
+  for (i = 0; i < lowered->relocationCount; i ++) {
+    inst = lowered->codeBlock->code + lowered->relocations[i].address;
+    if (((inst->op != OP_CALL) && (inst->op != OP_CALLN)) || (lowered->relocations[i].kind != RELOC_CODE))
+      continue;
+    if ((inst->q < 0) || (inst->q >= sourceSize) || (entryMap[inst->q] < 0)) return 0;
+    inst->q = entryMap[inst->q];
+  }
+  return 1;
+}
+
+void freeLoweredCode(LoweredCode* lowered) {
+  if (lowered->codeBlock != NULL) freeCodeBlock(lowered->codeBlock);
+  free(lowered->origins);
+  free(lowered->relocations);
+  memset(lowered, 0, sizeof(LoweredCode));
+}
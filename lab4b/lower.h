@@ -0,0 +1,34 @@
+/* Lowering of the IR back to stack code */
+
+#ifndef __LOWER_H__
+#define __LOWER_H__
+
+#include "ir.h"
+#include "executable.h"
+
+/* Stack code generated back from the IR. Values used once, right where
+ * they are computed, stay on the operand stack; the others live in frame
+ * slots: the promoted slots are reused and new ones are added on top of
+ * the frame. With a profile, the hottest subprograms come first and the
+ * hottest edges between blocks fall through.
+ */
+struct LoweredCode_ {
+  CodeBlock* codeBlock;
+  CodeAddress* origins;        // source instruction of every instruction
+  Relocation* relocations;
+  int relocationCount;
+  int maxRelocationCount;
+};
+
+typedef struct LoweredCode_ LoweredCode;
+
+/* sourceCode is the code the program was lifted from, with its
+ * relocations; a subprogram whose lowered code would cost more keeps it.
+ * entryMap has an entry for every source address; the entries of the
+ * functions receive their new address, the others -1.
+ */
+int lowerIr(IrProgram* program, CodeBlock* sourceCode, Relocation* relocations, int relocationCount,
+	    LoweredCode* lowered, CodeAddress* entryMap);
+void freeLoweredCode(LoweredCode* lowered);
+
+#endif
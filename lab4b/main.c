@@ -7,35 +7,352 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "reader.h"
 #include "parser.h"
+#include "error.h"
 #include "codegen.h"
+#include "cache.h"
 
 
 int dumpCode = 0;
+int dumpIr = 0;
+int dumpCallGraph = 0;
+int objectOnly = 0;
+int optimizationLevel = 0;
+char* cacheDirectory = NULL;
+long cacheSize = 0;
+char* profileFile = NULL;
+enum CodeEncoding codeEncoding = CODE_COMPACT;
+int batchMode = 0;
 
 void printUsage(void) {
-  printf("Usage: kplc input output [-dump]\n");
+  printf("Usage: kplc input output [-dump] [-ir] [-callgraph] [-raw] [-c] [-O1] [-O2] [-fprofile-use=file]\n");
   printf("   input: input kpl program\n");
   printf("   output: executable\n");
   printf("   -dump: code dump\n");
+  printf("   -ir: dump of the code in SSA form\n");
+  printf("   -callgraph: dump of the calls between subprograms, before unreachable ones are removed\n");
+  printf("   -raw: store fixed-size instructions that kplrun executes in place\n");
+  printf("   -c: write an object file to be linked by kpl-ld\n");
+  printf("   -O0, -O1, -O2: optimization level, -O0 keeps full frames for debugging,\n");
+  printf("      -O1 runs the peephole optimizer, reuses the frame of a recursive call made\n");
+  printf("      right before returning and passes no static link to subprograms that do\n");
+  printf("      not use it, -O2 also rewrites the code through its SSA form\n");
+  printf("   -fprofile-use=file: at -O2, inline, lay out and order the code by the counts\n");
+  printf("      kplrun -profile recorded on the -O0 code of the same input\n");
+  printf("   -cache=directory: reuse earlier outputs for identical sources (default $KPLC_CACHE)\n");
+  printf("   -cache-size=bytes: bound of the cache, least recently used outputs are evicted\n");
+  printf("Usage: kplc --batch input... [-j workers] [options]\n");
+  printf("   compiles every input.kpl into input in one process, on workers threads\n");
+  printf("Usage: kplc -cache-stats [-cache=directory]\n");
 }
 
 int analyseParam(char* param) {
   if (strcmp(param, "-dump") == 0) {
     dumpCode = 1;
     return 1;
-  } 
+  } else if (strcmp(param, "-ir") == 0) {
+    dumpIr = 1;
+    return 1;
+  } else if (strcmp(param, "-callgraph") == 0) {
+    dumpCallGraph = 1;
+    return 1;
+  } else if (strcmp(param, "-raw") == 0) {
+    codeEncoding = CODE_RAW;
+    return 1;
+  } else if (strcmp(param, "-c") == 0) {
+    objectOnly = 1;
+    return 1;
+  } else if (strcmp(param, "-O0") == 0) {
+    optimizationLevel = 0;
+    return 1;
+  } else if (strcmp(param, "-O1") == 0) {
+    optimizationLevel = 1;
+    return 1;
+  } else if (strcmp(param, "-O2") == 0) {
+    optimizationLevel = 2;
+    return 1;
+  } else if (strncmp(param, "-fprofile-use=", 14) == 0) {
+    profileFile = param + 14;
+    return 1;
+  } else if (strncmp(param, "-cache=", 7) == 0) {
+    cacheDirectory = param + 7;
+    return 1;
+  } else if (strncmp(param, "-cache-size=", 12) == 0) {
+    cacheSize = atol(param + 12);
+    return cacheSize > 0;
+  }
+  return 0;
+}
+
+
+int printCacheStats(int argc, char *argv[]) {
+  CacheStats stats;
+  int i;
+
+  for (i = 2; i < argc; i ++)
+    analyseParam(argv[i]);
+  if ((cacheDirectory == NULL) || (openCache(cacheDirectory, cacheSize) == IO_ERROR)) {
+    printf("kplc: no cache directory.\n");
+    return -1;
+  }
+  if (readCacheStats(&stats) == IO_ERROR) {
+    printf("Can\'t read cache statistics!\n");
+    return -1;
+  }
+  printf("hits: %ld\n", stats.hits);
+  printf("misses: %ld\n", stats.misses);
+  printf("evictions: %ld\n", stats.evictions);
   return 0;
 }
 
+/* Messages about one input. The files of a batch are compiled side by
+ * side, there each message names the input it is about.
+ */
+void inform(char* input, char* format, ...) {
+  va_list args;
+
+  flockfile(stdout);
+  if (batchMode) printf("%s: ", input);
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  funlockfile(stdout);
+}
+
+/* Compiles input into output with the options given, the cache is used
+ * when it is open. Returns 0, or -1 when no output is written.
+ */
+int compileFile(char* input, char* output, SymTab* predefined, int useCache) {
+  char cacheKey[CACHE_KEY_LEN];
+  char options[16];
+  CompilerContext* context;
+  Profile* profile = NULL;
+  int removed;
+  int errors;
+  int status = 0;
+
+  // Only the options that change the output are part of the key
+  snprintf(options, sizeof(options), "%d,%d,%d", codeEncoding, objectOnly, optimizationLevel);
+  // The profile is not part of the key, its outputs are not cached
+  useCache = useCache && (profileFile == NULL)
+    && (computeCacheKey(input, options, cacheKey) == IO_SUCCESS);
+
+  // A dump needs the generated code, so it always compiles
+  if (useCache && !dumpCode && !dumpIr && !dumpCallGraph && fetchCached(cacheKey, output))
+    return 0;
+
+  context = createCompilerContext();
+  context->predefined = predefined;
+  initCodeBuffer(context);
+
+  if (compile(context, input) == IO_ERROR) {
+    inform(input, "Can\'t read input file!\n");
+    status = -1;
+    goto done;
+  }
+
+  // No output is written for a source with errors
+  flockfile(stdout);
+  if (batchMode && (context->errorCount > 0)) printf("%s:\n", input);
+  errors = reportErrors(context);
+  funlockfile(stdout);
+  if (errors > 0) {
+    status = -1;
+    goto done;
+  }
+
+  if (dumpCallGraph) printCallGraph(context, objectOnly);
+
+  // Other units may call the exports of an object file
+  removed = removeUnreachableCode(context, objectOnly);
+  if (removed > 0) inform(input, "kplc: removed %d unreachable subprograms.\n", removed);
+  applyTailCalls(context);
+
+  // Counts are recorded on the code before it is optimized
+  if (profileFile != NULL) {
+    profile = loadProfile(profileFile);
+    if (profile == NULL)
+      inform(input, "kplc: can\'t read profile %s, it is not used.\n", profileFile);
+    else if (!useProfile(context, profile))
+      inform(input, "kplc: profile %s was recorded on other code, it is not used.\n", profileFile);
+  }
+
+  if (dumpIr) printCodeIr(context);
+
+  if (optimizationLevel > 0) {
+    removed = optimizeCodeBuffer(context, optimizationLevel);
+    // Inlining may leave more code than it started with
+    if (removed >= 0) inform(input, "kplc: optimizer removed %d instructions.\n", removed);
+    else inform(input, "kplc: optimizer added %d instructions.\n", -removed);
+  }
+
+  if (objectOnly) {
+    if (serializeObject(context, output, codeEncoding) == IO_ERROR) {
+      inform(input, "Can\'t write output file!\n");
+      status = -1;
+      goto done;
+    }
+  } else {
+    if (hasUnresolvedImports(context)) {
+      inform(input, "kplc: program calls EXTERNAL subprograms, compile with -c and link with kpl-ld.\n");
+      status = -1;
+      goto done;
+    }
+    if (serialize(context, output, codeEncoding) == IO_ERROR) {
+      inform(input, "Can\'t write output file!\n");
+      status = -1;
+      goto done;
+    }
+  }
+
+  if (useCache) storeCached(cacheKey, output);
+
+  if (dumpCode) printCodeBuffer(context);
+
+ done:
+  cleanCodeBuffer(context);
+  freeCompilerContext(context);
+  if (profile != NULL) freeProfile(profile);
+  return status;
+}
+
+/******************************************************************/
+
+struct Batch_ {
+  char** inputs;
+  char** outputs;
+  int fileCount;
+  int nextFile;
+  int failedCount;
+  pthread_mutex_t lock;
+  SymTab* predefined;
+  int useCache;
+};
+
+typedef struct Batch_ Batch;
+
+/* Each worker takes the next file of the batch until none is left */
+void* runWorker(void* arg) {
+  Batch* batch = (Batch*) arg;
+  int file;
+
+  while (1) {
+    pthread_mutex_lock(&(batch->lock));
+    file = batch->nextFile ++;
+    pthread_mutex_unlock(&(batch->lock));
+    if (file >= batch->fileCount) break;
+
+    if (compileFile(batch->inputs[file], batch->outputs[file], batch->predefined, batch->useCache) != 0) {
+      pthread_mutex_lock(&(batch->lock));
+      batch->failedCount ++;
+      pthread_mutex_unlock(&(batch->lock));
+    }
+  }
+  return NULL;
+}
+
+/* kplc --batch compiles many sources in one process, on workerCount
+ * threads. The output of file.kpl is file. The predefined subprograms
+ * are made once for the batch, every file has a context of its own.
+ */
+int compileBatch(int argc, char *argv[]) {
+  Batch batch;
+  pthread_t* workers;
+  struct timespec start, end;
+  double seconds;
+  int workerCount = 1;
+  int length;
+  int i;
+
+  batchMode = 1;
+  batch.inputs = (char**) malloc(argc * sizeof(char*));
+  batch.outputs = (char**) malloc(argc * sizeof(char*));
+  batch.fileCount = 0;
+  for (i = 2; i < argc; i ++) {
+    if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc))
+      workerCount = atoi(argv[++ i]);
+    else if (strncmp(argv[i], "-j", 2) == 0)
+      workerCount = atoi(argv[i] + 2);
+    else if (argv[i][0] == '-')
+      analyseParam(argv[i]);
+    else batch.inputs[batch.fileCount ++] = argv[i];
+  }
+
+  if (batch.fileCount == 0) {
+    printf("kplc: no input file.\n");
+    printUsage();
+    return -1;
+  }
+  if (workerCount < 1) {
+    printf("kplc: -j needs at least one worker.\n");
+    return -1;
+  }
+  // Their output would mix, and a profile is recorded on a single program
+  if (dumpCode || dumpIr || dumpCallGraph || (profileFile != NULL)) {
+    printf("kplc: -dump, -ir, -callgraph and -fprofile-use do not apply to a batch.\n");
+    return -1;
+  }
+
+  for (i = 0; i < batch.fileCount; i ++) {
+    length = strlen(batch.inputs[i]);
+    if ((length <= 4) || (strcmp(batch.inputs[i] + length - 4, ".kpl") != 0)) {
+      printf("kplc: %s is not a .kpl file.\n", batch.inputs[i]);
+      return -1;
+    }
+    batch.outputs[i] = (char*) malloc(length - 3);
+    strncpy(batch.outputs[i], batch.inputs[i], length - 4);
+    batch.outputs[i][length - 4] = '\0';
+  }
+
+  batch.nextFile = 0;
+  batch.failedCount = 0;
+  pthread_mutex_init(&(batch.lock), NULL);
+  batch.predefined = initSymTab();
+  batch.useCache = (cacheDirectory != NULL) && (*cacheDirectory != '\0')
+    && (openCache(cacheDirectory, cacheSize) == IO_SUCCESS);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  workers = (pthread_t*) malloc(workerCount * sizeof(pthread_t));
+  for (i = 0; i < workerCount; i ++)
+    pthread_create(workers + i, NULL, runWorker, &batch);
+  for (i = 0; i < workerCount; i ++)
+    pthread_join(workers[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("kplc: compiled %d of %d files in %.3f s, %.1f files/s.\n",
+	 batch.fileCount - batch.failedCount, batch.fileCount, seconds,
+	 (seconds > 0) ? batch.fileCount / seconds : 0);
+
+  cleanSymTab(batch.predefined);
+  pthread_mutex_destroy(&(batch.lock));
+  for (i = 0; i < batch.fileCount; i ++)
+    free(batch.outputs[i]);
+  free(batch.inputs);
+  free(batch.outputs);
+  free(workers);
+  return (batch.failedCount > 0) ? -1 : 0;
+}
 
 /******************************************************************/
 
 int main(int argc, char *argv[]) {
+  int useCache;
   int i; 
 
+  cacheDirectory = getenv("KPLC_CACHE");
+
+  if ((argc > 1) && (strcmp(argv[1], "-cache-stats") == 0))
+    return printCacheStats(argc, argv);
+
+  if ((argc > 1) && (strcmp(argv[1], "--batch") == 0))
+    return compileBatch(argc, argv);
+
   if (argc <= 1) {
     printf("kplc: no input file.\n");
     printUsage();
@@ -51,21 +368,7 @@ int main(int argc, char *argv[]) {
   for ( i = 3; i < argc; i ++) 
     analyseParam(argv[i]);
 
-  initCodeBuffer();
-
-  if (compile(argv[1]) == IO_ERROR) {
-    printf("Can\'t read input file!\n");
-    return -1;
-  }
-
-  if (serialize(argv[2]) == IO_ERROR) {
-    printf("Can\'t write output file!\n");
-    return -1;
-  }
-
-  if (dumpCode) printCodeBuffer();
-    
-  cleanCodeBuffer();
-
-  return 0;
+  useCache = (cacheDirectory != NULL) && (*cacheDirectory != '\0')
+    && (openCache(cacheDirectory, cacheSize) == IO_SUCCESS);
+  return compileFile(argv[1], argv[2], NULL, useCache);
 }
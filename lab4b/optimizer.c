@@ -0,0 +1,181 @@
+/* Peephole optimizer of the stack code */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "optimizer.h"
+
+static __thread Instruction* code;
+static __thread int codeSize;
+static __thread char* deleted;
+static __thread char* isLabel;
+
+static int isJump(enum OpCode op) {
+  return (op == OP_J) || (op == OP_FJ) || (op == OP_CALL) || (op == OP_TC) ||
+    (op == OP_FORINIT) || (op == OP_FORSTEP) || (op == OP_CALLN);
+}
+
+static int isValidAddress(CodeAddress address) {
+  return (address >= 0) && (address < codeSize);
+}
+
+static CodeAddress skipDeleted(CodeAddress address) {
+  while (isValidAddress(address) && deleted[address]) address ++;
+  return address;
+}
+
+static CodeAddress nextInstruction(CodeAddress address) {
+  return skipDeleted(address + 1);
+}
+
+/* Labels start basic blocks: a window that spans one would merge code
+ * from two different paths.
+ */
+static void findLabels(CodeAddress* entries, int entryCount) {
+  CodeAddress pc;
+  int i;
+
+  memset(isLabel, 0, codeSize);
+  for (i = 0; i < entryCount; i ++)
+    if (isValidAddress(entries[i])) isLabel[entries[i]] = 1;
+  for (pc = 0; pc < codeSize; pc ++)
+    if (!deleted[pc] && isJump(code[pc].op) && isValidAddress(code[pc].q))
+      isLabel[skipDeleted(code[pc].q)] = 1;
+}
+
+/* Where a jump really lands once chains of unconditional jumps are followed */
+static CodeAddress finalTarget(CodeAddress target) {
+  CodeAddress start = target;
+  int hops = 0;
+
+  target = skipDeleted(target);
+  while (isValidAddress(target) && (code[target].op == OP_J)) {
+    // A cycle of jumps is an endless loop, leave it alone
+    if (hops ++ >= codeSize) return start;
+    target = skipDeleted(code[target].q);
+  }
+  return target;
+}
+
+static int isConstant(CodeAddress pc, WORD value) {
+  return (code[pc].op == OP_LC) && (code[pc].q == value);
+}
+
+/* One pass of the window over the code, returns the number of rewrites */
+static int peephole(void) {
+  CodeAddress pc, next, target;
+  int changes = 0;
+
+  for (pc = skipDeleted(0); pc < codeSize; pc = nextInstruction(pc)) {
+    switch (code[pc].op) {
+    case OP_J:
+    case OP_FJ:
+    case OP_TC:
+    case OP_FORINIT:
+    case OP_FORSTEP:
+      target = finalTarget(code[pc].q);
+      if (isValidAddress(target) && (target != code[pc].q)) {
+	code[pc].q = target;
+	changes ++;
+      }
+      // A jump to the next instruction is a no-op
+      if ((code[pc].op == OP_J) && (skipDeleted(code[pc].q) == nextInstruction(pc))) {
+	deleted[pc] = 1;
+	changes ++;
+	continue;
+      }
+      break;
+    case OP_INT:
+    case OP_DCT:
+      if (code[pc].q == 0) {
+	deleted[pc] = 1;
+	changes ++;
+	continue;
+      }
+      break;
+    default:
+      break;
+    }
+
+    next = nextInstruction(pc);
+    if ((next >= codeSize) || isLabel[next]) continue;
+
+    if ((isConstant(pc, 0) && ((code[next].op == OP_AD) || (code[next].op == OP_SB))) ||
+	(isConstant(pc, 1) && ((code[next].op == OP_ML) || (code[next].op == OP_DV))) ||
+	((code[pc].op == OP_NEG) && (code[next].op == OP_NEG))) {
+      deleted[pc] = deleted[next] = 1;
+      changes ++;
+    } else if ((code[pc].op == OP_LA) && (code[next].op == OP_LI)) {
+      // An address loaded only to be read is a load of the value
+      code[pc].op = OP_LV;
+      deleted[next] = 1;
+      changes ++;
+    } else if ((code[pc].op == OP_INT) && (code[next].op == OP_DCT)) {
+      // The frame header of a call without arguments is reserved and released at once
+      if (code[pc].q > code[next].q) {
+	code[pc].q -= code[next].q;
+	deleted[next] = 1;
+      } else if (code[pc].q < code[next].q) {
+	code[next].q -= code[pc].q;
+	deleted[pc] = 1;
+      } else deleted[pc] = deleted[next] = 1;
+      changes ++;
+    }
+  }
+  return changes;
+}
+
+/* Squeezes out the removed instructions and moves every address that
+ * refers to the code along, returns how many instructions went away.
+ */
+static int compact(CodeAddress* addressMap, int mapSize, CodeAddress* entries, int entryCount) {
+  CodeAddress* map = (CodeAddress*) malloc((codeSize + 1) * sizeof(CodeAddress));
+  CodeAddress pc, newSize = 0;
+  int removed, i;
+
+  for (pc = 0; pc < codeSize; pc ++) {
+    map[pc] = newSize;
+    if (!deleted[pc]) code[newSize ++] = code[pc];
+  }
+  map[codeSize] = newSize;
+
+  for (pc = 0; pc < newSize; pc ++)
+    if (isJump(code[pc].op) && isValidAddress(code[pc].q))
+      code[pc].q = map[code[pc].q];
+  for (i = 0; i < mapSize; i ++)
+    addressMap[i] = map[addressMap[i]];
+  for (i = 0; i < entryCount; i ++)
+    if (isValidAddress(entries[i])) entries[i] = map[entries[i]];
+
+  free(map);
+  removed = codeSize - newSize;
+  codeSize = newSize;
+  memset(deleted, 0, codeSize);
+  return removed;
+}
+
+int optimizeCode(CodeBlock* codeBlock, CodeAddress* entries, int entryCount, int level, CodeAddress* addressMap) {
+  int mapSize = codeBlock->codeSize + 1;
+  int removed = 0;
+  int i;
+
+  code = codeBlock->code;
+  codeSize = codeBlock->codeSize;
+  deleted = (char*) calloc(codeSize + 1, 1);
+  isLabel = (char*) calloc(codeSize + 1, 1);
+  for (i = 0; i < mapSize; i ++) addressMap[i] = i;
+
+  if (level >= 1) {
+    // Every rewrite can expose another one, so iterate to a fixed point
+    findLabels(entries, entryCount);
+    while (peephole() > 0) {
+      removed += compact(addressMap, mapSize, entries, entryCount);
+      findLabels(entries, entryCount);
+    }
+  }
+
+  codeBlock->codeSize = codeSize;
+  free(deleted);
+  free(isLabel);
+  return removed;
+}
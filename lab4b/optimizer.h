@@ -0,0 +1,19 @@
+/* Peephole optimizer of the stack code */
+
+#ifndef __OPTIMIZER_H__
+#define __OPTIMIZER_H__
+
+#include "instructions.h"
+
+/* Optimizations rewrite the code block in place. Instructions they remove
+ * are squeezed out and addressMap, which has codeSize + 1 entries, tells
+ * the caller where every old address went: a removed instruction maps to
+ * the instruction that followed it.
+ *
+ * entries are addresses reached from outside the code (the entry point,
+ * exported subprograms) and must stay the start of a basic block.
+ */
+
+int optimizeCode(CodeBlock* codeBlock, CodeAddress* entries, int entryCount, int level, CodeAddress* addressMap);
+
+#endif
@@ -14,568 +14,698 @@
 #include "debug.h"
 #include "codegen.h"
 
-Token *currentToken;
-Token *lookAhead;
-
-extern Type* intType;
-extern Type* charType;
-extern SymTab* symtab;
-
-void scan(void) {
-  Token* tmp = currentToken;
-  currentToken = lookAhead;
-  lookAhead = getValidToken();
+// Tokens the parser resumes at after an error, up to TK_EOF
+TokenType statementFollow[] = {SB_SEMICOLON, KW_END, KW_ELSE, KW_FUNCTION, KW_PROCEDURE, SB_PERIOD, TK_EOF};
+TokenType declarationFollow[] = {SB_SEMICOLON, KW_BEGIN, KW_CONST, KW_TYPE, KW_VAR,
+				 KW_FUNCTION, KW_PROCEDURE, SB_PERIOD, TK_EOF};
+
+void scan(CompilerContext* context) {
+  Token* tmp = context->currentToken;
+  context->currentToken = context->lookAhead;
+  context->lookAhead = getValidToken(context);
   free(tmp);
 }
 
-void eat(TokenType tokenType) {
-  if (lookAhead->tokenType == tokenType) {
-    scan();
-  } else missingToken(tokenType, lookAhead->lineNo, lookAhead->colNo);
+/* A missing token is reported and taken as if it were there. Matching a
+ * token leaves panic mode, before the next one is scanned: an error in
+ * it causes the parser errors that follow.
+ */
+void eat(CompilerContext* context, TokenType tokenType) {
+  if (context->lookAhead->tokenType == tokenType) {
+    leavePanicMode(context);
+    scan(context);
+  } else missingToken(context, tokenType, context->lookAhead->lineNo, context->lookAhead->colNo);
+}
+
+/* In panic mode, skips the tokens up to one of follow */
+void synchronize(CompilerContext* context, TokenType* follow) {
+  int i;
+
+  if (!isPanicMode(context)) return;
+  while (context->lookAhead->tokenType != TK_EOF) {
+    for (i = 0; follow[i] != TK_EOF; i ++)
+      if (follow[i] == context->lookAhead->tokenType) return;
+    scan(context);
+  }
 }
 
-void compileProgram(void) {
+void compileProgram(CompilerContext* context) {
   Object* program;
 
-  eat(KW_PROGRAM);
-  eat(TK_IDENT);
+  eat(context, KW_PROGRAM);
+  eat(context, TK_IDENT);
 
-  program = createProgramObject(currentToken->string);
-  program->progAttrs->codeAddress = getCurrentCodeAddress();
-  enterBlock(program->progAttrs->scope);
+  program = createProgramObject(context->symtab, context->currentToken->string);
+  program->progAttrs->codeAddress = getCurrentCodeAddress(context);
+  addSymbol(context, program);
+  enterBlock(context->symtab, program->progAttrs->scope);
 
-  eat(SB_SEMICOLON);
+  eat(context, SB_SEMICOLON);
 
-  compileBlock();
-  eat(SB_PERIOD);
+  compileBlock(context);
+  eat(context, SB_PERIOD);
 
-  genHL();
+  genHL(context);
+  closeSymbol(context, program);
+  resolveStaticLinks(context);
 
-  exitBlock();
+  exitBlock(context->symtab);
 }
 
-void compileConstDecls(void) {
+void compileConstDecls(CompilerContext* context) {
   Object* constObj;
   ConstantValue* constValue;
 
-  if (lookAhead->tokenType == KW_CONST) {
-    eat(KW_CONST);
+  if (context->lookAhead->tokenType == KW_CONST) {
+    eat(context, KW_CONST);
     do {
-      eat(TK_IDENT);
-      checkFreshIdent(currentToken->string);
-      constObj = createConstantObject(currentToken->string);
-      declareObject(constObj);
+      eat(context, TK_IDENT);
+      checkFreshIdent(context, context->currentToken->string);
+      constObj = createConstantObject(context->currentToken->string);
+      declareObject(context->symtab, constObj);
       
-      eat(SB_EQ);
-      constValue = compileConstant();
+      eat(context, SB_EQ);
+      constValue = compileConstant(context);
       constObj->constAttrs->value = constValue;
+      addConstant(context, constObj);
       
-      eat(SB_SEMICOLON);
-    } while (lookAhead->tokenType == TK_IDENT);
+      synchronize(context, declarationFollow);
+      eat(context, SB_SEMICOLON);
+    } while (context->lookAhead->tokenType == TK_IDENT);
   }
 }
 
-void compileTypeDecls(void) {
+void compileTypeDecls(CompilerContext* context) {
   Object* typeObj;
   Type* actualType;
 
-  if (lookAhead->tokenType == KW_TYPE) {
-    eat(KW_TYPE);
+  if (context->lookAhead->tokenType == KW_TYPE) {
+    eat(context, KW_TYPE);
     do {
-      eat(TK_IDENT);
+      eat(context, TK_IDENT);
       
-      checkFreshIdent(currentToken->string);
-      typeObj = createTypeObject(currentToken->string);
-      declareObject(typeObj);
+      checkFreshIdent(context, context->currentToken->string);
+      typeObj = createTypeObject(context->currentToken->string);
+      declareObject(context->symtab, typeObj);
       
-      eat(SB_EQ);
-      actualType = compileType();
+      eat(context, SB_EQ);
+      actualType = compileType(context);
       typeObj->typeAttrs->actualType = actualType;
       
-      eat(SB_SEMICOLON);
-    } while (lookAhead->tokenType == TK_IDENT);
+      synchronize(context, declarationFollow);
+      eat(context, SB_SEMICOLON);
+    } while (context->lookAhead->tokenType == TK_IDENT);
   } 
 }
 
-void compileVarDecls(void) {
+void compileVarDecls(CompilerContext* context) {
   Object* varObj;
   Type* varType;
 
-  if (lookAhead->tokenType == KW_VAR) {
-    eat(KW_VAR);
+  if (context->lookAhead->tokenType == KW_VAR) {
+    eat(context, KW_VAR);
     do {
-      eat(TK_IDENT);
-      checkFreshIdent(currentToken->string);
-      varObj = createVariableObject(currentToken->string);
-      eat(SB_COLON);
-      varType = compileType();
+      eat(context, TK_IDENT);
+      checkFreshIdent(context, context->currentToken->string);
+      varObj = createVariableObject(context->currentToken->string);
+      eat(context, SB_COLON);
+      varType = compileType(context);
       varObj->varAttrs->type = varType;
-      declareObject(varObj);      
-      eat(SB_SEMICOLON);
-    } while (lookAhead->tokenType == TK_IDENT);
+      declareObject(context->symtab, varObj);      
+      synchronize(context, declarationFollow);
+      eat(context, SB_SEMICOLON);
+    } while (context->lookAhead->tokenType == TK_IDENT);
   } 
 }
 
-void compileBlock(void) {
-  Instruction* jmp;
-  jmp = genJ(DC_VALUE);
+void compileBlock(CompilerContext* context) {
+  CodeAddress jmp;
+  jmp = genJ(context, DC_VALUE);
 
-  compileConstDecls();
-  compileTypeDecls();
-  compileVarDecls();
-  compileSubDecls();
-  updateJ(jmp,getCurrentCodeAddress());
-  genINT(symtab->currentScope->frameSize);
+  compileConstDecls(context);
+  compileTypeDecls(context);
+  compileVarDecls(context);
+  compileSubDecls(context);
+  updateJ(context, jmp,getCurrentCodeAddress(context));
+  genScopeFrame(context, context->symtab->currentScope);
 
-  eat(KW_BEGIN);
-  compileStatements();
-  eat(KW_END);
+  eat(context, KW_BEGIN);
+  compileStatements(context);
+  eat(context, KW_END);
 }
 
-void compileSubDecls(void) {
-  while ((lookAhead->tokenType == KW_FUNCTION) || (lookAhead->tokenType == KW_PROCEDURE)) {
-    if (lookAhead->tokenType == KW_FUNCTION)
-      compileFuncDecl();
-    else compileProcDecl();
+void compileSubDecls(CompilerContext* context) {
+  while ((context->lookAhead->tokenType == KW_FUNCTION) || (context->lookAhead->tokenType == KW_PROCEDURE)) {
+    if (context->lookAhead->tokenType == KW_FUNCTION)
+      compileFuncDecl(context);
+    else compileProcDecl(context);
   }
 }
 
-void compileFuncDecl(void) {
+void compileFuncDecl(CompilerContext* context) {
   Object* funcObj;
   Type* returnType;
 
-  eat(KW_FUNCTION);
-  eat(TK_IDENT);
+  eat(context, KW_FUNCTION);
+  eat(context, TK_IDENT);
 
-  checkFreshIdent(currentToken->string);
-  funcObj = createFunctionObject(currentToken->string);
-  funcObj->funcAttrs->codeAddress = getCurrentCodeAddress();
-  declareObject(funcObj);
+  checkFreshIdent(context, context->currentToken->string);
+  funcObj = createFunctionObject(context->currentToken->string);
+  funcObj->funcAttrs->codeAddress = getCurrentCodeAddress(context);
+  declareObject(context->symtab, funcObj);
 
-  enterBlock(funcObj->funcAttrs->scope);
+  enterBlock(context->symtab, funcObj->funcAttrs->scope);
   
-  compileParams();
+  compileParams(context);
 
-  eat(SB_COLON);
-  returnType = compileBasicType();
+  eat(context, SB_COLON);
+  returnType = compileBasicType(context);
   funcObj->funcAttrs->returnType = returnType;
 
-  eat(SB_SEMICOLON);
+  synchronize(context, declarationFollow);
+  eat(context, SB_SEMICOLON);
 
-  compileBlock();
+  if (context->lookAhead->tokenType == KW_EXTERNAL) {
+    eat(context, KW_EXTERNAL);
+    checkProgramLevel(context, funcObj);
+    funcObj->funcAttrs->isExternal = 1;
+  } else {
+    addSymbol(context, funcObj);
+    compileBlock(context);
+    genEF(context);
+    genTailCalls(context);
+    closeSymbol(context, funcObj);
+  }
 
-  eat(SB_SEMICOLON);
+  synchronize(context, declarationFollow);
+  eat(context, SB_SEMICOLON);
 
-  exitBlock();
+  exitBlock(context->symtab);
 }
 
-void compileProcDecl(void) {
+void compileProcDecl(CompilerContext* context) {
   Object* procObj;
 
-  eat(KW_PROCEDURE);
-  eat(TK_IDENT);
+  eat(context, KW_PROCEDURE);
+  eat(context, TK_IDENT);
 
-  checkFreshIdent(currentToken->string);
-  procObj = createProcedureObject(currentToken->string);
-  procObj->procAttrs->codeAddress = getCurrentCodeAddress();
-  declareObject(procObj);
+  checkFreshIdent(context, context->currentToken->string);
+  procObj = createProcedureObject(context->currentToken->string);
+  procObj->procAttrs->codeAddress = getCurrentCodeAddress(context);
+  declareObject(context->symtab, procObj);
 
-  enterBlock(procObj->procAttrs->scope);
+  enterBlock(context->symtab, procObj->procAttrs->scope);
 
-  compileParams();
+  compileParams(context);
 
-  eat(SB_SEMICOLON);
-  compileBlock();
+  synchronize(context, declarationFollow);
+  eat(context, SB_SEMICOLON);
+  if (context->lookAhead->tokenType == KW_EXTERNAL) {
+    eat(context, KW_EXTERNAL);
+    checkProgramLevel(context, procObj);
+    procObj->procAttrs->isExternal = 1;
+  } else {
+    addSymbol(context, procObj);
+    compileBlock(context);
+    genEP(context);
+    genTailCalls(context);
+    closeSymbol(context, procObj);
+  }
 
-  eat(SB_SEMICOLON);
+  synchronize(context, declarationFollow);
+  eat(context, SB_SEMICOLON);
 
-  exitBlock();
+  exitBlock(context->symtab);
 }
 
-ConstantValue* compileUnsignedConstant(void) {
+ConstantValue* compileUnsignedConstant(CompilerContext* context) {
   ConstantValue* constValue;
   Object* obj;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case TK_NUMBER:
-    eat(TK_NUMBER);
-    constValue = makeIntConstant(currentToken->value);
+    eat(context, TK_NUMBER);
+    constValue = makeIntConstant(context->currentToken->value);
     break;
   case TK_IDENT:
-    eat(TK_IDENT);
+    eat(context, TK_IDENT);
 
-    obj = checkDeclaredConstant(currentToken->string);
-    constValue = duplicateConstantValue(obj->constAttrs->value);
+    obj = checkDeclaredConstant(context, context->currentToken->string);
+    if (obj != NULL)
+      constValue = duplicateConstantValue(obj->constAttrs->value);
+    else constValue = makePoisonConstant();
 
     break;
   case TK_CHAR:
-    eat(TK_CHAR);
-    constValue = makeCharConstant(currentToken->string[0]);
+    eat(context, TK_CHAR);
+    constValue = makeCharConstant(context->currentToken->string[0]);
     break;
   default:
-    error(ERR_INVALID_CONSTANT, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_CONSTANT, context->lookAhead->lineNo, context->lookAhead->colNo);
+    constValue = makePoisonConstant();
     break;
   }
   return constValue;
 }
 
-ConstantValue* compileConstant(void) {
+ConstantValue* compileConstant(CompilerContext* context) {
   ConstantValue* constValue;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case SB_PLUS:
-    eat(SB_PLUS);
-    constValue = compileConstant2();
+    eat(context, SB_PLUS);
+    constValue = compileConstant2(context);
     break;
   case SB_MINUS:
-    eat(SB_MINUS);
-    constValue = compileConstant2();
+    eat(context, SB_MINUS);
+    constValue = compileConstant2(context);
     constValue->intValue = - constValue->intValue;
     break;
   case TK_CHAR:
-    eat(TK_CHAR);
-    constValue = makeCharConstant(currentToken->string[0]);
+    eat(context, TK_CHAR);
+    constValue = makeCharConstant(context->currentToken->string[0]);
     break;
   default:
-    constValue = compileConstant2();
+    constValue = compileConstant2(context);
     break;
   }
   return constValue;
 }
 
-ConstantValue* compileConstant2(void) {
+ConstantValue* compileConstant2(CompilerContext* context) {
   ConstantValue* constValue;
   Object* obj;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case TK_NUMBER:
-    eat(TK_NUMBER);
-    constValue = makeIntConstant(currentToken->value);
+    eat(context, TK_NUMBER);
+    constValue = makeIntConstant(context->currentToken->value);
     break;
   case TK_IDENT:
-    eat(TK_IDENT);
-    obj = checkDeclaredConstant(currentToken->string);
-    if (obj->constAttrs->value->type == TP_INT)
+    eat(context, TK_IDENT);
+    obj = checkDeclaredConstant(context, context->currentToken->string);
+    if ((obj != NULL) && ((obj->constAttrs->value->type == TP_INT) || (obj->constAttrs->value->type == TP_POISON)))
       constValue = duplicateConstantValue(obj->constAttrs->value);
-    else
-      error(ERR_UNDECLARED_INT_CONSTANT,currentToken->lineNo, currentToken->colNo);
+    else {
+      if (obj != NULL)
+	error(context, ERR_UNDECLARED_INT_CONSTANT,context->currentToken->lineNo, context->currentToken->colNo);
+      constValue = makePoisonConstant();
+    }
     break;
   default:
-    error(ERR_INVALID_CONSTANT, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_CONSTANT, context->lookAhead->lineNo, context->lookAhead->colNo);
+    constValue = makePoisonConstant();
     break;
   }
   return constValue;
 }
 
-Type* compileType(void) {
+Type* compileType(CompilerContext* context) {
   Type* type;
   Type* elementType;
   int arraySize;
   Object* obj;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case KW_INTEGER: 
-    eat(KW_INTEGER);
+    eat(context, KW_INTEGER);
     type =  makeIntType();
     break;
   case KW_CHAR: 
-    eat(KW_CHAR); 
+    eat(context, KW_CHAR); 
     type = makeCharType();
     break;
   case KW_ARRAY:
-    eat(KW_ARRAY);
-    eat(SB_LSEL);
-    eat(TK_NUMBER);
+    eat(context, KW_ARRAY);
+    eat(context, SB_LSEL);
+    eat(context, TK_NUMBER);
 
-    arraySize = currentToken->value;
+    arraySize = context->currentToken->value;
 
-    eat(SB_RSEL);
-    eat(KW_OF);
-    elementType = compileType();
+    eat(context, SB_RSEL);
+    eat(context, KW_OF);
+    elementType = compileType(context);
     type = makeArrayType(arraySize, elementType);
     break;
   case TK_IDENT:
-    eat(TK_IDENT);
-    obj = checkDeclaredType(currentToken->string);
-    type = duplicateType(obj->typeAttrs->actualType);
+    eat(context, TK_IDENT);
+    obj = checkDeclaredType(context, context->currentToken->string);
+    if (obj != NULL)
+      type = duplicateType(obj->typeAttrs->actualType);
+    else type = makePoisonType();
     break;
   default:
-    error(ERR_INVALID_TYPE, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_TYPE, context->lookAhead->lineNo, context->lookAhead->colNo);
+    type = makePoisonType();
     break;
   }
   return type;
 }
 
-Type* compileBasicType(void) {
+Type* compileBasicType(CompilerContext* context) {
   Type* type;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case KW_INTEGER: 
-    eat(KW_INTEGER); 
+    eat(context, KW_INTEGER); 
     type = makeIntType();
     break;
   case KW_CHAR: 
-    eat(KW_CHAR); 
+    eat(context, KW_CHAR); 
     type = makeCharType();
     break;
   default:
-    error(ERR_INVALID_BASICTYPE, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_BASICTYPE, context->lookAhead->lineNo, context->lookAhead->colNo);
+    // Most likely a misspelled or user-defined type, that the error is about
+    if (context->lookAhead->tokenType == TK_IDENT) scan(context);
+    type = makePoisonType();
     break;
   }
   return type;
 }
 
-void compileParams(void) {
-  if (lookAhead->tokenType == SB_LPAR) {
-    eat(SB_LPAR);
-    compileParam();
-    while (lookAhead->tokenType == SB_SEMICOLON) {
-      eat(SB_SEMICOLON);
-      compileParam();
+void compileParams(CompilerContext* context) {
+  if (context->lookAhead->tokenType == SB_LPAR) {
+    eat(context, SB_LPAR);
+    compileParam(context);
+    while (context->lookAhead->tokenType == SB_SEMICOLON) {
+      eat(context, SB_SEMICOLON);
+      compileParam(context);
     }
-    eat(SB_RPAR);
+    eat(context, SB_RPAR);
   }
 }
 
-void compileParam(void) {
+void compileParam(CompilerContext* context) {
   Object* param;
   Type* type;
   enum ParamKind paramKind = PARAM_VALUE;
 
-  if (lookAhead->tokenType == KW_VAR) {
+  if (context->lookAhead->tokenType == KW_VAR) {
     paramKind = PARAM_REFERENCE;
-    eat(KW_VAR);
+    eat(context, KW_VAR);
   }
 
-  eat(TK_IDENT);
-  checkFreshIdent(currentToken->string);
-  param = createParameterObject(currentToken->string, paramKind);
-  eat(SB_COLON);
-  type = compileBasicType();
+  eat(context, TK_IDENT);
+  checkFreshIdent(context, context->currentToken->string);
+  param = createParameterObject(context->currentToken->string, paramKind);
+  eat(context, SB_COLON);
+  type = compileBasicType(context);
   param->paramAttrs->type = type;
-  declareObject(param);
+  declareObject(context->symtab, param);
 }
 
-void compileStatements(void) {
-  compileStatement();
-  while (lookAhead->tokenType == SB_SEMICOLON) {
-    eat(SB_SEMICOLON);
-    compileStatement();
+void compileStatements(CompilerContext* context) {
+  compileStatement(context);
+  while (context->lookAhead->tokenType == SB_SEMICOLON) {
+    eat(context, SB_SEMICOLON);
+    compileStatement(context);
   }
 }
 
-void compileStatement(void) {
-  switch (lookAhead->tokenType) {
+void compileStatement(CompilerContext* context) {
+  addLineNumber(context, context->lookAhead->lineNo);
+  switch (context->lookAhead->tokenType) {
   case TK_IDENT:
-    compileAssignSt();
+    compileAssignSt(context);
     break;
   case KW_CALL:
-    compileCallSt();
+    compileCallSt(context);
     break;
   case KW_BEGIN:
-    compileGroupSt();
+    compileGroupSt(context);
     break;
   case KW_IF:
-    compileIfSt();
+    compileIfSt(context);
     break;
   case KW_WHILE:
-    compileWhileSt();
+    compileWhileSt(context);
     break;
   case KW_FOR:
-    compileForSt();
+    compileForSt(context);
     break;
   case SB_SEMICOLON:
   case KW_END:
   case KW_ELSE:
     break;
   default:
-    error(ERR_INVALID_STATEMENT, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_STATEMENT, context->lookAhead->lineNo, context->lookAhead->colNo);
     break;
   }
+  synchronize(context, statementFollow);
+}
+
+/* Indexes may follow a variable of an array or a poison type */
+int isIndexed(Type* type) {
+  return (type->typeClass == TP_ARRAY) || (type->typeClass == TP_POISON);
 }
 
-Type* compileLValue(void) {
+Type* compileLValue(CompilerContext* context) {
   Object* var;
   Type* varType;
 
-  eat(TK_IDENT);
+  eat(context, TK_IDENT);
   
-  var = checkDeclaredLValueIdent(currentToken->string);
+  var = checkDeclaredLValueIdent(context, context->currentToken->string);
+  if (var == NULL) {
+    // Stands for the address, the code is not kept
+    genLC(context, 0);
+    return context->symtab->poisonType;
+  }
 
   switch (var->kind) {
   case OBJ_VARIABLE:
-    genVariableAddress(var);
-    if (var->varAttrs->type->typeClass == TP_ARRAY) {
-      varType = compileIndexes(var->varAttrs->type);
+    genVariableAddress(context, var);
+    if (isIndexed(var->varAttrs->type)) {
+      varType = compileIndexes(context, var->varAttrs->type);
     }
     else
       varType = var->varAttrs->type;
     break;
   case OBJ_PARAMETER:
-    genHL();
+    genParameterAddress(context, var);
     varType = var->paramAttrs->type;
     break;
   case OBJ_FUNCTION:
-    genHL();
+    genReturnValueAddress(context, var);
     varType = var->funcAttrs->returnType;
     break;
   default: 
-    error(ERR_INVALID_LVALUE,currentToken->lineNo, currentToken->colNo);
+    error(context, ERR_INVALID_LVALUE,context->currentToken->lineNo, context->currentToken->colNo);
+    varType = context->symtab->poisonType;
   }
 
   return varType;
 }
 
-void compileAssignSt(void) {
+void compileAssignSt(CompilerContext* context) {
   Type* varType;
   Type* expType;
+  CodeAddress lvalue;
+  int isResult;
 
-  varType = compileLValue();
+  // The result of the function being compiled, F := F(...) may be a tail call
+  isResult = (lookupObject(context, context->lookAhead->string) == context->symtab->currentScope->owner);
+  lvalue = getCurrentCodeAddress(context);
+  varType = compileLValue(context);
   
-  eat(SB_ASSIGN);
-  expType = compileExpression();
-  checkTypeEquality(varType, expType);
+  eat(context, SB_ASSIGN);
+  expType = compileExpression(context);
+  checkTypeEquality(context, varType, expType);
 
-  genST();
+  genST(context);
+  if (isResult) addResultStore(context, lvalue);
 }
 
-void compileCallSt(void) {
+void compileCallSt(CompilerContext* context) {
   Object* proc;
+  CodeAddress reserve;
+  int isFrameArgument;
 
-  eat(KW_CALL);
-  eat(TK_IDENT);
+  eat(context, KW_CALL);
+  eat(context, TK_IDENT);
 
-  proc = checkDeclaredProcedure(currentToken->string);
+  proc = checkDeclaredProcedure(context, context->currentToken->string);
+  // The arguments are skipped when the parser synchronizes
+  if (proc == NULL) return;
 
-  if (isPredefinedProcedure(proc)) {
-    compileArguments(proc->procAttrs->paramList);
-    genPredefinedProcedureCall(proc);
+  if (isPredefinedProcedure(context, proc)) {
+    compileArguments(context, proc->procAttrs->paramList);
+    genPredefinedProcedureCall(context, proc);
   } else {
-    compileArguments(proc->procAttrs->paramList);
-    genHL();
+    reserve = getCurrentCodeAddress(context);
+    genINT(context, RESERVED_WORDS);
+    isFrameArgument = compileArguments(context, proc->procAttrs->paramList);
+    genDCT(context, RESERVED_WORDS + proc->procAttrs->paramCount);
+    genProcedureCall(context, proc);
+    if ((proc == context->symtab->currentScope->owner) && !isFrameArgument) addSelfCall(context, reserve);
   }
 }
 
-void compileGroupSt(void) {
-  eat(KW_BEGIN);
-  compileStatements();
-  eat(KW_END);
+void compileGroupSt(CompilerContext* context) {
+  eat(context, KW_BEGIN);
+  compileStatements(context);
+  eat(context, KW_END);
 }
 
-void compileIfSt(void) {
-  Instruction* fjInstruction;
-  Instruction* jInstruction;
-
-  eat(KW_IF);
-  compileCondition();
-  eat(KW_THEN);
+void compileIfSt(CompilerContext* context) {
+  CodeAddress fjInstruction;
+  CodeAddress jInstruction;
+  CodeMark mark;
+  WORD value;
+
+  eat(context, KW_IF);
+  mark = markCode(context);
+  compileCondition(context);
+  eat(context, KW_THEN);
+
+  if (isConstantCode(context, mark.codeSize, &value)) {
+    // The condition is known, the arm that can not run is parsed but not kept
+    discardCode(context, mark);
+
+    mark = markCode(context);
+    compileStatement(context);
+    if (!value) discardCode(context, mark);
+    if (context->lookAhead->tokenType == KW_ELSE) {
+      eat(context, KW_ELSE);
+      mark = markCode(context);
+      compileStatement(context);
+      if (value) discardCode(context, mark);
+    }
+    return;
+  }
 
-  fjInstruction = genFJ(DC_VALUE);
-  compileStatement();
-  if (lookAhead->tokenType == KW_ELSE) {
-    jInstruction = genJ(DC_VALUE);
-    updateFJ(fjInstruction, getCurrentCodeAddress());
-    eat(KW_ELSE);
-    compileStatement();
-    updateJ(jInstruction, getCurrentCodeAddress());
+  fjInstruction = genFJ(context, DC_VALUE);
+  compileStatement(context);
+  if (context->lookAhead->tokenType == KW_ELSE) {
+    jInstruction = genJ(context, DC_VALUE);
+    updateFJ(context, fjInstruction, getCurrentCodeAddress(context));
+    eat(context, KW_ELSE);
+    compileStatement(context);
+    updateJ(context, jInstruction, getCurrentCodeAddress(context));
   } else {
-    updateFJ(fjInstruction, getCurrentCodeAddress());
+    updateFJ(context, fjInstruction, getCurrentCodeAddress(context));
   }
 }
 
-void compileWhileSt(void) {
+void compileWhileSt(CompilerContext* context) {
   CodeAddress beginWhile;
-  Instruction* fjInstruction;
-
-  beginWhile = getCurrentCodeAddress();
-  eat(KW_WHILE);
-  compileCondition();
-  fjInstruction = genFJ(DC_VALUE);
-  eat(KW_DO);
-  compileStatement();
-  genJ(beginWhile);
-  updateFJ(fjInstruction, getCurrentCodeAddress());
+  CodeAddress fjInstruction;
+
+  beginWhile = getCurrentCodeAddress(context);
+  eat(context, KW_WHILE);
+  compileCondition(context);
+  fjInstruction = genFJ(context, DC_VALUE);
+  eat(context, KW_DO);
+  compileStatement(context);
+  genJ(context, beginWhile);
+  updateFJ(context, fjInstruction, getCurrentCodeAddress(context));
 }
 
-void compileForSt(void) {
+/* The address of the variable stays on the stack during the loop and
+ * the bound is computed again on every iteration. When the bound does
+ * not depend on the variable, the loop is tested at the bottom with
+ * FORSTEP, otherwise the variable is incremented before jumping back
+ * to the bound.
+ */
+void compileForSt(CompilerContext* context) {
+  CodeAddress variable;
+  CodeAddress beginBound;
+  CodeAddress endBound;
   CodeAddress beginLoop;
-  Instruction* fjInstruction;
+  CodeAddress forInit;
+  int isIndependent;
   Type* varType;
   Type *type;
 
-  eat(KW_FOR);
-
-  varType = compileLValue();
-  eat(SB_ASSIGN);
-
-  genCV();
-  type = compileExpression();
-  checkTypeEquality(varType, type);
-  genST();
-  genCV();
-  genLI();
-  beginLoop = getCurrentCodeAddress();
-  eat(KW_TO);
-
-  type = compileExpression();
-  checkTypeEquality(varType, type);
-  genLE();
-  fjInstruction = genFJ(DC_VALUE);
+  eat(context, KW_FOR);
 
-  eat(KW_DO);
-  compileStatement();
+  variable = getCurrentCodeAddress(context);
+  varType = compileLValue(context);
+  eat(context, SB_ASSIGN);
 
-  genCV();  
-  genCV();
-  genLI();
-  genLC(1);
-  genAD();
-  genST();
+  genCV(context);
+  type = compileExpression(context);
+  checkTypeEquality(context, varType, type);
+  genST(context);
+  beginBound = getCurrentCodeAddress(context);
+  eat(context, KW_TO);
 
-  genCV();
-  genLI();
+  type = compileExpression(context);
+  checkTypeEquality(context, varType, type);
+  endBound = getCurrentCodeAddress(context);
+  isIndependent = isIndependentCode(context, variable, beginBound);
+  forInit = genFORINIT(context, DC_VALUE);
+  beginLoop = getCurrentCodeAddress(context);
 
-  genJ(beginLoop);
-  updateFJ(fjInstruction, getCurrentCodeAddress());
-  genDCT(1);
+  eat(context, KW_DO);
+  compileStatement(context);
 
+  if (isIndependent) {
+    genCopy(context, beginBound, endBound);
+    genFORSTEP(context, beginLoop);
+  } else {
+    genCV(context);
+    genCV(context);
+    genLI(context);
+    genLC(context, 1);
+    genAD(context);
+    genST(context);
+    genJ(context, beginBound);
+  }
+  updateFORINIT(context, forInit, getCurrentCodeAddress(context));
+  genDCT(context, 1);
 }
 
-void compileArgument(Object* param) {
+/* Returns whether a reference argument is a word of the current frame */
+int compileArgument(CompilerContext* context, Object* param) {
   Type* type;
+  CodeAddress start;
 
   if (param->paramAttrs->kind == PARAM_VALUE) {
-    type = compileExpression();
-    checkTypeEquality(type, param->paramAttrs->type);
+    type = compileExpression(context);
+    checkTypeEquality(context, type, param->paramAttrs->type);
+    return 0;
   } else {
-    type = compileLValue();
-    checkTypeEquality(type, param->paramAttrs->type);
+    start = getCurrentCodeAddress(context);
+    type = compileLValue(context);
+    checkTypeEquality(context, type, param->paramAttrs->type);
+    return isFrameAddress(context, start);
+  }
+}
+
+/* An argument without a parameter is still compiled, as an expression */
+int compileNextArgument(CompilerContext* context, ObjectNode** node) {
+  int isFrameArgument;
+
+  if (*node == NULL) {
+    error(context, ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY, context->currentToken->lineNo, context->currentToken->colNo);
+    compileExpression(context);
+    return 0;
   }
+  isFrameArgument = compileArgument(context, (*node)->object);
+  *node = (*node)->next;
+  return isFrameArgument;
 }
 
-void compileArguments(ObjectNode* paramList) {
+int compileArguments(CompilerContext* context, ObjectNode* paramList) {
   ObjectNode* node = paramList;
+  int isFrameArgument = 0;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case SB_LPAR:
-    eat(SB_LPAR);
-    if (node == NULL)
-      error(ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
-    compileArgument(node->object);
-    node = node->next;
-
-    while (lookAhead->tokenType == SB_COMMA) {
-      eat(SB_COMMA);
-      if (node == NULL)
-	error(ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
-      compileArgument(node->object);
-      node = node->next;
+    eat(context, SB_LPAR);
+    isFrameArgument |= compileNextArgument(context, &node);
+
+    while (context->lookAhead->tokenType == SB_COMMA) {
+      eat(context, SB_COMMA);
+      isFrameArgument |= compileNextArgument(context, &node);
     }
 
     if (node != NULL)
-      error(ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
+      error(context, ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY, context->currentToken->lineNo, context->currentToken->colNo);
     
-    eat(SB_RPAR);
+    eat(context, SB_RPAR);
     break;
   case SB_TIMES:
   case SB_SLASH:
@@ -598,63 +728,64 @@ void compileArguments(ObjectNode* paramList) {
   case KW_THEN:
     break;
   default:
-    error(ERR_INVALID_ARGUMENTS, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_ARGUMENTS, context->lookAhead->lineNo, context->lookAhead->colNo);
   }
+  return isFrameArgument;
 }
 
-void compileCondition(void) {
+void compileCondition(CompilerContext* context) {
   Type* type1;
   Type* type2;
   TokenType op;
 
-  type1 = compileExpression();
-  checkBasicType(type1);
+  type1 = compileExpression(context);
+  checkBasicType(context, type1);
 
-  op = lookAhead->tokenType;
+  op = context->lookAhead->tokenType;
   switch (op) {
   case SB_EQ:
-    eat(SB_EQ);
+    eat(context, SB_EQ);
     break;
   case SB_NEQ:
-    eat(SB_NEQ);
+    eat(context, SB_NEQ);
     break;
   case SB_LE:
-    eat(SB_LE);
+    eat(context, SB_LE);
     break;
   case SB_LT:
-    eat(SB_LT);
+    eat(context, SB_LT);
     break;
   case SB_GE:
-    eat(SB_GE);
+    eat(context, SB_GE);
     break;
   case SB_GT:
-    eat(SB_GT);
+    eat(context, SB_GT);
     break;
   default:
-    error(ERR_INVALID_COMPARATOR, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_COMPARATOR, context->lookAhead->lineNo, context->lookAhead->colNo);
   }
 
-  type2 = compileExpression();
-  checkTypeEquality(type1,type2);
+  type2 = compileExpression(context);
+  checkTypeEquality(context, type1,type2);
 
   switch (op) {
   case SB_EQ:
-    genEQ();
+    genEQ(context);
     break;
   case SB_NEQ:
-    genNE();
+    genNE(context);
     break;
   case SB_LE:
-    genLE();
+    genLE(context);
     break;
   case SB_LT:
-    genLT();
+    genLT(context);
     break;
   case SB_GE:
-    genGE();
+    genGE(context);
     break;
   case SB_GT:
-    genGT();
+    genGT(context);
     break;
   default:
     break;
@@ -662,61 +793,61 @@ void compileCondition(void) {
 
 }
 
-Type* compileExpression(void) {
+Type* compileExpression(CompilerContext* context) {
   Type* type;
   
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case SB_PLUS:
-    eat(SB_PLUS);
-    type = compileExpression2();
-    checkIntType(type);
+    eat(context, SB_PLUS);
+    type = compileExpression2(context);
+    checkIntType(context, type);
     break;
   case SB_MINUS:
-    eat(SB_MINUS);
-    type = compileExpression2();
-    checkIntType(type);
-    genNEG();
+    eat(context, SB_MINUS);
+    type = compileExpression2(context);
+    checkIntType(context, type);
+    genNEG(context);
     break;
   default:
-    type = compileExpression2();
+    type = compileExpression2(context);
   }
   return type;
 }
 
-Type* compileExpression2(void) {
+Type* compileExpression2(CompilerContext* context) {
   Type* type;
 
-  type = compileTerm();
-  type = compileExpression3(type);
+  type = compileTerm(context);
+  type = compileExpression3(context, type);
 
   return type;
 }
 
 
-Type* compileExpression3(Type* argType1) {
+Type* compileExpression3(CompilerContext* context, Type* argType1) {
   Type* argType2;
   Type* resultType;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case SB_PLUS:
-    eat(SB_PLUS);
-    checkIntType(argType1);
-    argType2 = compileTerm();
-    checkIntType(argType2);
+    eat(context, SB_PLUS);
+    checkIntType(context, argType1);
+    argType2 = compileTerm(context);
+    checkIntType(context, argType2);
 
-    genAD();
+    genAD(context);
 
-    resultType = compileExpression3(argType1);
+    resultType = compileExpression3(context, context->symtab->intType);
     break;
   case SB_MINUS:
-    eat(SB_MINUS);
-    checkIntType(argType1);
-    argType2 = compileTerm();
-    checkIntType(argType2);
+    eat(context, SB_MINUS);
+    checkIntType(context, argType1);
+    argType2 = compileTerm(context);
+    checkIntType(context, argType2);
 
-    genSB();
+    genSB(context);
 
-    resultType = compileExpression3(argType1);
+    resultType = compileExpression3(context, context->symtab->intType);
     break;
   case KW_TO:
   case KW_DO:
@@ -736,43 +867,44 @@ Type* compileExpression3(Type* argType1) {
     resultType = argType1;
     break;
   default:
-    error(ERR_INVALID_EXPRESSION, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_EXPRESSION, context->lookAhead->lineNo, context->lookAhead->colNo);
+    resultType = argType1;
   }
   return resultType;
 }
 
-Type* compileTerm(void) {
+Type* compileTerm(CompilerContext* context) {
   Type* type;
-  type = compileFactor();
-  type = compileTerm2(type);
+  type = compileFactor(context);
+  type = compileTerm2(context, type);
 
   return type;
 }
 
-Type* compileTerm2(Type* argType1) {
+Type* compileTerm2(CompilerContext* context, Type* argType1) {
   Type* argType2;
   Type* resultType;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case SB_TIMES:
-    eat(SB_TIMES);
-    checkIntType(argType1);
-    argType2 = compileFactor();
-    checkIntType(argType2);
+    eat(context, SB_TIMES);
+    checkIntType(context, argType1);
+    argType2 = compileFactor(context);
+    checkIntType(context, argType2);
 
-    genML();
+    genML(context);
 
-    resultType = compileTerm2(argType1);
+    resultType = compileTerm2(context, context->symtab->intType);
     break;
   case SB_SLASH:
-    eat(SB_SLASH);
-    checkIntType(argType1);
-    argType2 = compileFactor();
-    checkIntType(argType2);
+    eat(context, SB_SLASH);
+    checkIntType(context, argType1);
+    argType2 = compileFactor(context);
+    checkIntType(context, argType2);
 
-    genDV();
+    genDV(context);
 
-    resultType = compileTerm2(argType1);
+    resultType = compileTerm2(context, context->symtab->intType);
     break;
   case SB_PLUS:
   case SB_MINUS:
@@ -794,124 +926,153 @@ Type* compileTerm2(Type* argType1) {
     resultType = argType1;
     break;
   default:
-    error(ERR_INVALID_TERM, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_TERM, context->lookAhead->lineNo, context->lookAhead->colNo);
+    resultType = argType1;
   }
   return resultType;
 }
 
-Type* compileFactor(void) {
+Type* compileFactor(CompilerContext* context) {
   Type* type;
   Object* obj;
+  CodeAddress reserve;
+  int isFrameArgument;
 
-  switch (lookAhead->tokenType) {
+  switch (context->lookAhead->tokenType) {
   case TK_NUMBER:
-    eat(TK_NUMBER);
-    type = intType;
-    genLC(currentToken->value);
+    eat(context, TK_NUMBER);
+    type = context->symtab->intType;
+    genLC(context, context->currentToken->value);
     break;
   case TK_CHAR:
-    eat(TK_CHAR);
-    type = charType;
-    genLC(currentToken->value);
+    eat(context, TK_CHAR);
+    type = context->symtab->charType;
+    genLC(context, context->currentToken->value);
     break;
   case TK_IDENT:
-    eat(TK_IDENT);
-    obj = checkDeclaredIdent(currentToken->string);
+    eat(context, TK_IDENT);
+    obj = checkDeclaredIdent(context, context->currentToken->string);
 
     switch (obj->kind) {
     case OBJ_CONSTANT:
       switch (obj->constAttrs->value->type) {
       case TP_INT:
-	type = intType;
-	genLC(obj->constAttrs->value->intValue);
+	type = context->symtab->intType;
+	genLC(context, obj->constAttrs->value->intValue);
 	break;
       case TP_CHAR:
-	type = charType;
-	genLC(obj->constAttrs->value->charValue);
+	type = context->symtab->charType;
+	genLC(context, obj->constAttrs->value->charValue);
 	break;
       default:
+	type = context->symtab->poisonType;
+	genLC(context, 0);
 	break;
       }
       break;
     case OBJ_VARIABLE:
-      if (obj->varAttrs->type->typeClass == TP_ARRAY) {
-	genVariableAddress(obj);
-	type = compileIndexes(obj->varAttrs->type);
-	genLI();
+      if (isIndexed(obj->varAttrs->type)) {
+	genVariableAddress(context, obj);
+	type = compileIndexes(context, obj->varAttrs->type);
+	genLI(context);
       } else {
 	type = obj->varAttrs->type;
-	genVariableValue(obj);
+	genVariableValue(context, obj);
       }
       break;
     case OBJ_PARAMETER:
       type = obj->paramAttrs->type;
-      genParameterValue(obj);
+      genParameterValue(context, obj);
       if (obj->paramAttrs->kind == PARAM_REFERENCE)
-	genLI();
+	genLI(context);
       break;
     case OBJ_FUNCTION:
-      if (isPredefinedFunction(obj)) {
-	compileArguments(obj->funcAttrs->paramList);
-	genPredefinedFunctionCall(obj);
+      if (isPredefinedFunction(context, obj)) {
+	compileArguments(context, obj->funcAttrs->paramList);
+	genPredefinedFunctionCall(context, obj);
       } else {
-	genINT(4);
-	compileArguments(obj->funcAttrs->paramList);
-	genDCT(4+obj->funcAttrs->paramCount);
-	genFunctionCall(obj);
+	reserve = getCurrentCodeAddress(context);
+	genINT(context, RESERVED_WORDS);
+	isFrameArgument = compileArguments(context, obj->funcAttrs->paramList);
+	genDCT(context, RESERVED_WORDS + obj->funcAttrs->paramCount);
+	genFunctionCall(context, obj);
+	if ((obj == context->symtab->currentScope->owner) && !isFrameArgument) addSelfCall(context, reserve);
       }
       type = obj->funcAttrs->returnType;
       break;
     default: 
-      error(ERR_INVALID_FACTOR,currentToken->lineNo, currentToken->colNo);
+      error(context, ERR_INVALID_FACTOR,context->currentToken->lineNo, context->currentToken->colNo);
+      type = context->symtab->poisonType;
+      genLC(context, 0);
       break;
     }
     break;
   case SB_LPAR:
-    eat(SB_LPAR);
-    type = compileExpression();
-    eat(SB_RPAR);
+    eat(context, SB_LPAR);
+    type = compileExpression(context);
+    eat(context, SB_RPAR);
     break;
   default:
-    error(ERR_INVALID_FACTOR, lookAhead->lineNo, lookAhead->colNo);
+    error(context, ERR_INVALID_FACTOR, context->lookAhead->lineNo, context->lookAhead->colNo);
+    type = context->symtab->poisonType;
+    genLC(context, 0);
   }
   
   return type;
 }
 
-Type* compileIndexes(Type* arrayType) {
+/* The address of the array is on top of the stack. Constant indices
+ * are summed into one offset, the others are scaled by the size of the
+ * element they select.
+ */
+Type* compileIndexes(CompilerContext* context, Type* arrayType) {
   Type* type;
-
-  
-  while (lookAhead->tokenType == SB_LSEL) {
-    eat(SB_LSEL);
-    type = compileExpression();
-    checkIntType(type);
-    checkArrayType(arrayType);
-
-    genHL();
-
-    arrayType = arrayType->elementType;
-    eat(SB_RSEL);
+  CodeAddress base = getCurrentCodeAddress(context) - 1;
+  CodeMark mark;
+  WORD index;
+  int offset = 0;
+
+  addArrayAccess(context, base, sizeOfType(arrayType));
+  while (context->lookAhead->tokenType == SB_LSEL) {
+    eat(context, SB_LSEL);
+    mark = markCode(context);
+    type = compileExpression(context);
+    checkIntType(context, type);
+    checkArrayType(context, arrayType);
+
+    // Past an error the indexes only select more poison
+    if (arrayType->typeClass != TP_ARRAY) arrayType = context->symtab->poisonType;
+    else {
+      if (isConstantCode(context, mark.codeSize, &index)) {
+	discardCode(context, mark);
+	offset += index * sizeOfType(arrayType->elementType);
+      } else genIX(context, sizeOfType(arrayType->elementType));
+      arrayType = arrayType->elementType;
+    }
+    eat(context, SB_RSEL);
   }
-  checkBasicType(arrayType);
+  genAddressOffset(context, base, offset);
+  checkBasicType(context, arrayType);
   return arrayType;
 }
 
-int compile(char *fileName) {
-  if (openInputStream(fileName) == IO_ERROR)
+int compile(CompilerContext* context, char *fileName) {
+  if (openInputStream(context, fileName) == IO_ERROR)
     return IO_ERROR;
 
-  currentToken = NULL;
-  lookAhead = getValidToken();
+  // Stands for the token before the first one, which the parser may miss
+  context->currentToken = makeToken(TK_NONE, 1, 1);
+  context->lookAhead = getValidToken(context);
 
-  initSymTab();
+  context->symtab = (context->predefined != NULL) ? shareSymTab(context->predefined) : initSymTab();
 
-  compileProgram();
+  compileProgram(context);
 
-  cleanSymTab();
-  free(currentToken);
-  free(lookAhead);
-  closeInputStream();
+  cleanSymTab(context->symtab);
+  context->symtab = NULL;
+  free(context->currentToken);
+  free(context->lookAhead);
+  closeInputStream(context);
   return IO_SUCCESS;
 
 }
\ No newline at end of file
@@ -7,53 +7,57 @@
 #define __PARSER_H__
 #include "token.h"
 #include "symtab.h"
+#include "context.h"
 
-void scan(void);
-void eat(TokenType tokenType);
+void scan(CompilerContext* context);
+void eat(CompilerContext* context, TokenType tokenType);
+void synchronize(CompilerContext* context, TokenType* follow);
 
-void compileProgram(void);
-void compileBlock(void);
+void compileProgram(CompilerContext* context);
+void compileBlock(CompilerContext* context);
 void compileBlock2(void);
 void compileBlock3(void);
 void compileBlock4(void);
 void compileBlock5(void);
-void compileConstDecls(void);
+void compileConstDecls(CompilerContext* context);
 void compileConstDecl(void);
-void compileTypeDecls(void);
+void compileTypeDecls(CompilerContext* context);
 void compileTypeDecl(void);
-void compileVarDecls(void);
+void compileVarDecls(CompilerContext* context);
 void compileVarDecl(void);
-void compileSubDecls(void);
-void compileFuncDecl(void);
-void compileProcDecl(void);
-ConstantValue* compileUnsignedConstant(void);
-ConstantValue* compileConstant(void);
-ConstantValue* compileConstant2(void);
-Type* compileType(void);
-Type* compileBasicType(void);
-void compileParams(void);
-void compileParam(void);
-void compileStatements(void);
-void compileStatement(void);
-Type* compileLValue(void);
-void compileAssignSt(void);
-void compileCallSt(void);
-void compileGroupSt(void);
-void compileIfSt(void);
+void compileSubDecls(CompilerContext* context);
+void compileFuncDecl(CompilerContext* context);
+void compileProcDecl(CompilerContext* context);
+ConstantValue* compileUnsignedConstant(CompilerContext* context);
+ConstantValue* compileConstant(CompilerContext* context);
+ConstantValue* compileConstant2(CompilerContext* context);
+Type* compileType(CompilerContext* context);
+Type* compileBasicType(CompilerContext* context);
+void compileParams(CompilerContext* context);
+void compileParam(CompilerContext* context);
+void compileStatements(CompilerContext* context);
+void compileStatement(CompilerContext* context);
+int isIndexed(Type* type);
+Type* compileLValue(CompilerContext* context);
+void compileAssignSt(CompilerContext* context);
+void compileCallSt(CompilerContext* context);
+void compileGroupSt(CompilerContext* context);
+void compileIfSt(CompilerContext* context);
 void compileElseSt(void);
-void compileWhileSt(void);
-void compileForSt(void);
-void compileArgument(Object* param);
-void compileArguments(ObjectNode* paramList);
-void compileCondition(void);
-Type* compileExpression(void);
-Type* compileExpression2(void);
-Type* compileExpression3(Type* argType1);
-Type* compileTerm(void);
-Type* compileTerm2(Type* argType2);
-Type* compileFactor(void);
-Type* compileIndexes(Type* arrayType);
+void compileWhileSt(CompilerContext* context);
+void compileForSt(CompilerContext* context);
+int compileArgument(CompilerContext* context, Object* param);
+int compileNextArgument(CompilerContext* context, ObjectNode** node);
+int compileArguments(CompilerContext* context, ObjectNode* paramList);
+void compileCondition(CompilerContext* context);
+Type* compileExpression(CompilerContext* context);
+Type* compileExpression2(CompilerContext* context);
+Type* compileExpression3(CompilerContext* context, Type* argType1);
+Type* compileTerm(CompilerContext* context);
+Type* compileTerm2(CompilerContext* context, Type* argType2);
+Type* compileFactor(CompilerContext* context);
+Type* compileIndexes(CompilerContext* context, Type* arrayType);
 
-int compile(char *fileName);
+int compile(CompilerContext* context, char *fileName);
 
 #endif
@@ -0,0 +1,107 @@
+/* Execution counts recorded by kplrun and used by kplc */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+
+#define PROFILE_MAGIC "kpl-profile"
+
+Profile* createProfile(CodeBlock* codeBlock) {
+  Profile* profile = (Profile*) malloc(sizeof(Profile));
+
+  profile->codeSize = codeBlock->codeSize;
+  profile->checksum = checksumCode(codeBlock);
+  profile->counts = (long*) calloc(codeBlock->codeSize + 1, sizeof(long));
+  profile->taken = (long*) calloc(codeBlock->codeSize + 1, sizeof(long));
+  profile->hotCount = 1;
+  return profile;
+}
+
+void freeProfile(Profile* profile) {
+  if (profile == NULL) return;
+  free(profile->counts);
+  free(profile->taken);
+  free(profile);
+}
+
+/* FNV-1a over the fields of the instructions */
+unsigned long checksumCode(CodeBlock* codeBlock) {
+  unsigned long hash = 2166136261UL;
+  Instruction* inst;
+  int i;
+
+  for (i = 0; i < codeBlock->codeSize; i ++) {
+    inst = codeBlock->code + i;
+    hash = ((hash ^ (unsigned long) inst->op) * 16777619UL) & 0xffffffffUL;
+    hash = ((hash ^ (unsigned long) inst->p) * 16777619UL) & 0xffffffffUL;
+    hash = ((hash ^ (unsigned long) inst->q) * 16777619UL) & 0xffffffffUL;
+  }
+  return hash;
+}
+
+int saveProfile(Profile* profile, char* fileName) {
+  FILE* f = fopen(fileName, "w");
+  int ok, i;
+
+  if (f == NULL) return 0;
+  ok = fprintf(f, "%s %d %lu\n", PROFILE_MAGIC, profile->codeSize, profile->checksum) > 0;
+  for (i = 0; (i < profile->codeSize) && ok; i ++)
+    if (profile->counts[i] > 0)
+      ok = fprintf(f, "%d %ld %ld\n", i, profile->counts[i], profile->taken[i]) > 0;
+  if (fclose(f) != 0) ok = 0;
+  return ok;
+}
+
+Profile* loadProfile(char* fileName) {
+  FILE* f = fopen(fileName, "r");
+  Profile* profile;
+  char magic[16];
+  long count, taken, maxCount = 0;
+  int codeSize, address, n;
+  unsigned long checksum;
+
+  if (f == NULL) return NULL;
+  if ((fscanf(f, "%15s %d %lu", magic, &codeSize, &checksum) != 3) || (codeSize < 0) ||
+      (strcmp(magic, PROFILE_MAGIC) != 0)) {
+    fclose(f);
+    return NULL;
+  }
+  profile = (Profile*) malloc(sizeof(Profile));
+  profile->codeSize = codeSize;
+  profile->checksum = checksum;
+  profile->counts = (long*) calloc(codeSize + 1, sizeof(long));
+  profile->taken = (long*) calloc(codeSize + 1, sizeof(long));
+  while ((n = fscanf(f, "%d %ld %ld", &address, &count, &taken)) == 3) {
+    if ((address < 0) || (address >= codeSize) || (count < 0) || (taken < 0) || (taken > count)) break;
+    profile->counts[address] = count;
+    profile->taken[address] = taken;
+    if (count > maxCount) maxCount = count;
+  }
+  fclose(f);
+  if (n != EOF) {
+    freeProfile(profile);
+    return NULL;
+  }
+  profile->hotCount = (maxCount + HOT_FRACTION - 1) / HOT_FRACTION;
+  if (profile->hotCount < 1) profile->hotCount = 1;
+  return profile;
+}
+
+int isProfileOf(Profile* profile, CodeBlock* codeBlock) {
+  return (profile->codeSize == codeBlock->codeSize) && (profile->checksum == checksumCode(codeBlock));
+}
+
+long profileCount(Profile* profile, CodeAddress address) {
+  if ((profile == NULL) || (address < 0) || (address >= profile->codeSize)) return 0;
+  return profile->counts[address];
+}
+
+long profileTaken(Profile* profile, CodeAddress address) {
+  if ((profile == NULL) || (address < 0) || (address >= profile->codeSize)) return 0;
+  return profile->taken[address];
+}
+
+int isHot(Profile* profile, CodeAddress address) {
+  return (profile != NULL) && (profileCount(profile, address) >= profile->hotCount);
+}
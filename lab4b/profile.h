@@ -0,0 +1,49 @@
+/* Execution counts recorded by kplrun and used by kplc */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "instructions.h"
+
+/* Execution counts of a program, recorded by kplrun -profile and read
+ * back by kplc -fprofile-use. Every instruction counts the times it ran,
+ * FJ, FORINIT and FORSTEP also the times they jumped: a call site is
+ * counted at its CALL, and the trip count of a loop is what its FORSTEP
+ * or J jumped back over what entered it.
+ *
+ * A profile is tied to the code it was recorded on, which its size and
+ * checksum identify, so kplc has to compile the same source to the same
+ * unoptimized code again. The file is text, one line per instruction
+ * that ran:
+ *
+ *   kpl-profile <code size> <checksum>
+ *   <address> <count> <taken>
+ */
+struct Profile_ {
+  int codeSize;
+  unsigned long checksum;
+  long* counts;
+  long* taken;
+  long hotCount;           // counts from which an instruction is hot
+};
+
+typedef struct Profile_ Profile;
+
+Profile* createProfile(CodeBlock* codeBlock);
+void freeProfile(Profile* profile);
+unsigned long checksumCode(CodeBlock* codeBlock);
+
+int saveProfile(Profile* profile, char* fileName);
+Profile* loadProfile(char* fileName);
+int isProfileOf(Profile* profile, CodeBlock* codeBlock);
+
+/* An instruction is hot when it ran at least 1/HOT_FRACTION as often as
+ * the most frequent one
+ */
+#define HOT_FRACTION 64
+
+long profileCount(Profile* profile, CodeAddress address);
+long profileTaken(Profile* profile, CodeAddress address);
+int isHot(Profile* profile, CodeAddress address);
+
+#endif
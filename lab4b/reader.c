@@ -7,31 +7,27 @@
 #include <stdio.h>
 #include "reader.h"
 
-FILE *inputStream;
-int lineNo, colNo;
-int currentChar;
-
-int readChar(void) {
-  currentChar = getc(inputStream);
-  colNo ++;
-  if (currentChar == '\n') {
-    lineNo ++;
-    colNo = 0;
+int readChar(CompilerContext* context) {
+  context->currentChar = getc(context->inputStream);
+  context->colNo ++;
+  if (context->currentChar == '\n') {
+    context->lineNo ++;
+    context->colNo = 0;
   }
-  return currentChar;
+  return context->currentChar;
 }
 
-int openInputStream(char *fileName) {
-  inputStream = fopen(fileName, "rt");
-  if (inputStream == NULL)
+int openInputStream(CompilerContext* context, char *fileName) {
+  context->inputStream = fopen(fileName, "rt");
+  if (context->inputStream == NULL)
     return IO_ERROR;
-  lineNo = 1;
-  colNo = 0;
-  readChar();
+  context->lineNo = 1;
+  context->colNo = 0;
+  readChar(context);
   return IO_SUCCESS;
 }
 
-void closeInputStream() {
-  fclose(inputStream);
+void closeInputStream(CompilerContext* context) {
+  fclose(context->inputStream);
 }
 
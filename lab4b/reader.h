@@ -7,11 +7,13 @@
 #ifndef __READER_H__
 #define __READER_H__
 
+#include "context.h"
+
 #define IO_ERROR 0
 #define IO_SUCCESS 1
 
-int readChar(void);
-int openInputStream(char *fileName);
-void closeInputStream(void);
+int readChar(CompilerContext* context);
+int openInputStream(CompilerContext* context, char *fileName);
+void closeInputStream(CompilerContext* context);
 
 #endif
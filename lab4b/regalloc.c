@@ -0,0 +1,350 @@
+/* Liveness and slot allocation of the values of the IR */
+
+#include <stdlib.h>
+#include <string.h>
+#include "regalloc.h"
+
+static __thread IrFunction* function;
+static __thread UseInfo* info;
+static __thread char* inSlot;
+
+static __thread int* group;           // values sharing one slot
+static __thread int* nextMember;      // the values of a group, in a ring
+static __thread int* low;
+static __thread int* high;
+static __thread int** liveIn;         // per value, blocks it is live on entry to
+static __thread int* liveInCount;
+
+/******************************************************************/
+
+static IrInstr* instrOf(int value) {
+  return function->instrs + value;
+}
+
+static void countUses(void) {
+  IrInstr* instr;
+  int i, j, v, total = 0;
+  int* uses;
+
+  uses = info->uses = (int*) calloc(function->instrCount, sizeof(int));
+  info->useStart = (int*) calloc(function->instrCount + 1, sizeof(int));
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = instrOf(i);
+    if (instr->dead) continue;
+    for (j = 0; j < instr->argCount; j ++) {
+      instr->args[j] = resolveValue(function, instr->args[j]);
+      uses[instr->args[j]] ++;
+      total ++;
+    }
+  }
+  for (i = 0; i < function->instrCount; i ++) info->useStart[i + 1] = info->useStart[i] + uses[i];
+
+  info->users = (int*) malloc((total + 1) * sizeof(int));
+  info->useArgs = (int*) malloc((total + 1) * sizeof(int));
+  memset(uses, 0, function->instrCount * sizeof(int));
+  for (i = 0; i < function->instrCount; i ++) {
+    instr = instrOf(i);
+    if (instr->dead) continue;
+    for (j = 0; j < instr->argCount; j ++) {
+      v = instr->args[j];
+      info->users[info->useStart[v] + uses[v]] = i;
+      info->useArgs[info->useStart[v] + uses[v]] = j;
+      uses[v] ++;
+    }
+  }
+}
+
+static void numberInstructions(void) {
+  IrBlock* block;
+  int pos = 0;
+  int b, i;
+
+  info->position = (int*) malloc(function->instrCount * sizeof(int));
+  info->blockFirst = (int*) malloc(function->blockCount * sizeof(int));
+  info->blockLast = (int*) malloc(function->blockCount * sizeof(int));
+
+  for (i = 0; i < function->instrCount; i ++) info->position[i] = -1;
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    info->blockFirst[b] = pos ++;
+    for (i = 0; i < block->phiCount; i ++) info->position[block->phis[i]] = info->blockFirst[b];
+    for (i = 0; i < block->instrCount; i ++) {
+      if (instrOf(block->instrs[i])->dead) continue;
+      info->position[block->instrs[i]] = pos ++;
+    }
+    info->blockLast[b] = pos - 1;
+  }
+}
+
+void computeUseInfo(IrFunction* f, UseInfo* useInfo) {
+  function = f;
+  info = useInfo;
+  countUses();
+  numberInstructions();
+}
+
+void freeUseInfo(UseInfo* useInfo) {
+  free(useInfo->uses); free(useInfo->useStart); free(useInfo->users); free(useInfo->useArgs);
+  free(useInfo->position); free(useInfo->blockFirst); free(useInfo->blockLast);
+  memset(useInfo, 0, sizeof(UseInfo));
+}
+
+/******************************************************************/
+/* Live intervals over the linear positions, loops included */
+
+static int definingBlock(int value) {
+  return (instrOf(value)->op == IR_ENTRY) ? -1 : instrOf(value)->block;
+}
+
+static void extend(int value, int pos) {
+  if (pos < low[value]) low[value] = pos;
+  if (pos > high[value]) high[value] = pos;
+}
+
+static void markLive(int value, int block, int pos, int* workList, int* marks) {
+  int workCount = 0;
+  int b, i;
+
+  extend(value, pos);
+  if (block == definingBlock(value)) return;
+  workList[workCount ++] = block;
+  while (workCount > 0) {
+    b = workList[-- workCount];
+    extend(value, info->blockFirst[b]);
+    if (marks[b] == value + 1) continue;
+    marks[b] = value + 1;
+    liveIn[value] = (int*) realloc(liveIn[value], (liveInCount[value] + 1) * sizeof(int));
+    liveIn[value][liveInCount[value] ++] = b;
+    for (i = 0; i < function->blocks[b].predCount; i ++) {
+      int pred = function->blocks[b].preds[i];
+      extend(value, info->blockLast[pred]);
+      if (pred != definingBlock(value)) workList[workCount ++] = pred;
+    }
+  }
+}
+
+static void computeIntervals(void) {
+  int* workList;
+  int* marks = (int*) calloc(function->blockCount, sizeof(int));
+  int v, u, k, edges = 1;
+  IrInstr* user;
+
+  // Every block is marked once and then pushes its predecessors
+  for (k = 0; k < function->blockCount; k ++) edges += function->blocks[k].predCount;
+  workList = (int*) malloc(edges * sizeof(int));
+  low = (int*) malloc(function->instrCount * sizeof(int));
+  high = (int*) malloc(function->instrCount * sizeof(int));
+  liveIn = (int**) calloc(function->instrCount, sizeof(int*));
+  liveInCount = (int*) calloc(function->instrCount, sizeof(int));
+
+  for (v = 0; v < function->instrCount; v ++) {
+    if (!inSlot[v]) continue;
+    low[v] = high[v] = (instrOf(v)->op == IR_ENTRY) ? -1 : info->position[v];
+    for (u = info->useStart[v]; u < info->useStart[v] + info->uses[v]; u ++) {
+      user = instrOf(info->users[u]);
+      k = info->useArgs[u];
+      if (user->op == IR_PHI) {
+	int pred = function->blocks[user->block].preds[k];
+	markLive(v, pred, info->blockLast[pred], workList, marks);
+      } else markLive(v, user->block, info->position[info->users[u]], workList, marks);
+    }
+    // A phi is written at the end of every predecessor
+    if (instrOf(v)->op == IR_PHI) {
+      IrBlock* block = function->blocks + instrOf(v)->block;
+      for (k = 0; k < block->predCount; k ++) extend(v, info->blockLast[block->preds[k]]);
+    }
+  }
+  free(workList);
+  free(marks);
+}
+
+/******************************************************************/
+/* Coalescing: a phi and an operand of it share a slot, saving the copy on
+ * the edge, unless one of them is still needed where the other is
+ * defined. Operands that are phis themselves are merged the same way, so
+ * a variable assigned on one path of a loop keeps a single slot. A phi is
+ * also written at the end of every predecessor, before the branch may be
+ * taken, where no other value still needed may share its slot. Back edges
+ * go first, as their copies run on every iteration.
+ */
+
+static int isLiveIn(int value, int block) {
+  int i;
+
+  for (i = 0; i < liveInCount[value]; i ++)
+    if (liveIn[value][i] == block) return 1;
+  return 0;
+}
+
+static int isLiveOut(int value, int block) {
+  IrBlock* b = function->blocks + block;
+  IrInstr* user;
+  int u, i;
+
+  for (i = 0; i < b->succCount; i ++)
+    if (isLiveIn(value, b->succs[i])) return 1;
+  for (u = info->useStart[value]; u < info->useStart[value] + info->uses[value]; u ++) {
+    user = instrOf(info->users[u]);
+    if ((user->op == IR_PHI) && (function->blocks[user->block].preds[info->useArgs[u]] == block)) return 1;
+  }
+  return 0;
+}
+
+// Whether the value is needed after the given position of the block
+static int isLiveAfter(int value, int block, int pos) {
+  IrInstr* user;
+  int u;
+
+  if (definingBlock(value) == block) {
+    if (info->position[value] > pos) return 0;
+  } else if (!isLiveIn(value, block)) return 0;
+  for (u = info->useStart[value]; u < info->useStart[value] + info->uses[value]; u ++) {
+    user = instrOf(info->users[u]);
+    if ((user->op != IR_PHI) && (user->block == block) && (info->position[info->users[u]] > pos)) return 1;
+  }
+  return isLiveOut(value, block);
+}
+
+static int isWrittenOver(int phi, int value) {
+  IrInstr* instr = instrOf(phi);
+  IrBlock* block = function->blocks + instr->block;
+  int k;
+
+  if (instr->op != IR_PHI) return 0;
+  for (k = 0; k < block->predCount; k ++)
+    if ((instr->args[k] != value) && isLiveOut(value, block->preds[k])) return 1;
+  return 0;
+}
+
+static int interfere(int x, int y) {
+  return isLiveAfter(x, definingBlock(y), info->position[y]) || isLiveAfter(y, definingBlock(x), info->position[x])
+    || isWrittenOver(x, y) || isWrittenOver(y, x);
+}
+
+static int groupsInterfere(int x, int y) {
+  int a = x, b;
+
+  do {
+    b = y;
+    do {
+      if (interfere(a, b)) return 1;
+      b = nextMember[b];
+    } while (b != y);
+    a = nextMember[a];
+  } while (a != x);
+  return 0;
+}
+
+static int findGroup(int value) {
+  while (group[value] != value) value = group[value];
+  return value;
+}
+
+static void coalesceEdges(int backEdges) {
+  IrBlock* block;
+  IrInstr* phi;
+  int b, i, k, j, x, y, pred, swap, clash;
+
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    for (i = 0; i < block->phiCount; i ++) {
+      if (!inSlot[block->phis[i]]) continue;
+      phi = instrOf(block->phis[i]);
+      for (k = 0; k < phi->argCount; k ++) {
+	pred = block->preds[k];
+	if ((pred >= b) != backEdges) continue;
+	if (!inSlot[phi->args[k]] || (instrOf(phi->args[k])->op == IR_ENTRY)) continue;
+	clash = 0;
+	for (j = 0; j < phi->argCount; j ++)
+	  if ((j != k) && (block->preds[j] == pred)) clash = 1;
+	x = findGroup(phi->args[k]);
+	y = findGroup(block->phis[i]);
+	if (clash || (x == y) || groupsInterfere(x, y)) continue;
+	group[x] = y;
+	extend(y, low[x]);
+	extend(y, high[x]);
+	swap = nextMember[x]; nextMember[x] = nextMember[y]; nextMember[y] = swap;
+      }
+    }
+  }
+}
+
+static void coalescePhis(void) {
+  int v;
+
+  group = (int*) malloc(function->instrCount * sizeof(int));
+  nextMember = (int*) malloc(function->instrCount * sizeof(int));
+  for (v = 0; v < function->instrCount; v ++) group[v] = nextMember[v] = v;
+
+  coalesceEdges(1);
+  coalesceEdges(0);
+}
+
+/******************************************************************/
+
+static int compareIntervals(const void* a, const void* b) {
+  int x = *(const int*) a;
+  int y = *(const int*) b;
+
+  if (low[x] != low[y]) return (low[x] < low[y]) ? -1 : 1;
+  return x - y;
+}
+
+/* Linear scan over the groups, first fit in the promoted slots and then
+ * in the slots added above the frame.
+ */
+static void linearScan(SlotAllocation* allocation) {
+  int* units = (int*) malloc(function->instrCount * sizeof(int));
+  int* slot;
+  int* lastEnd;
+  int unitCount = 0;
+  int maxSlots = function->frameSize + function->instrCount + 1;
+  int v, i, s, chosen, tempCount = 0;
+
+  slot = allocation->slots = (int*) malloc(function->instrCount * sizeof(int));
+  lastEnd = (int*) malloc(maxSlots * sizeof(int));
+  for (s = 0; s < maxSlots; s ++) lastEnd[s] = -2;
+  for (v = 0; v < function->instrCount; v ++) {
+    slot[v] = NO_SLOT;
+    if (inSlot[v] && (group[v] == v)) units[unitCount ++] = v;
+  }
+  qsort(units, unitCount, sizeof(int), compareIntervals);
+
+  for (i = 0; i < unitCount; i ++) {
+    v = units[i];
+    chosen = NO_SLOT;
+    if (instrOf(v)->op == IR_ENTRY) chosen = instrOf(v)->q;
+    for (s = 4; (s < function->frameSize) && (chosen == NO_SLOT); s ++)
+      if (function->promoted[s] && (lastEnd[s] < low[v])) chosen = s;
+    for (s = 0; (s < tempCount) && (chosen == NO_SLOT); s ++)
+      if (lastEnd[function->frameSize + s] < low[v]) chosen = function->frameSize + s;
+    if (chosen == NO_SLOT) chosen = function->frameSize + tempCount ++;
+    slot[v] = chosen;
+    lastEnd[chosen] = high[v];
+  }
+  for (v = 0; v < function->instrCount; v ++)
+    if (inSlot[v]) slot[v] = slot[findGroup(v)];
+  allocation->tempCount = tempCount;
+
+  free(units);
+  free(lastEnd);
+}
+
+void allocateSlots(IrFunction* f, UseInfo* useInfo, char* valueInSlot, SlotAllocation* allocation) {
+  int v;
+
+  function = f;
+  info = useInfo;
+  inSlot = valueInSlot;
+  computeIntervals();
+  coalescePhis();
+  linearScan(allocation);
+
+  for (v = 0; v < function->instrCount; v ++) free(liveIn[v]);
+  free(group); free(nextMember); free(low); free(high); free(liveIn); free(liveInCount);
+}
+
+void freeSlotAllocation(SlotAllocation* allocation) {
+  free(allocation->slots);
+  memset(allocation, 0, sizeof(SlotAllocation));
+}
@@ -0,0 +1,48 @@
+/* Liveness and slot allocation of the values of the IR */
+
+#ifndef __REGALLOC_H__
+#define __REGALLOC_H__
+
+#include "ir.h"
+
+#define NO_SLOT -1
+
+/* Def-use chains and a linear numbering of the instructions of a
+ * function. The phis of a block share the position before its first
+ * instruction; the copies into them happen at the terminator of each
+ * predecessor.
+ */
+struct UseInfo_ {
+  int* uses;             // per value
+  int* useStart;         // users of value v are users[useStart[v] .. useStart[v + 1] - 1]
+  int* users;
+  int* useArgs;          // which argument the use is
+  int* position;         // per instruction, -1 for dead ones
+  int* blockFirst;       // position of the phis of a block
+  int* blockLast;        // position of the terminator of a block
+};
+
+/* Frame words given to the values of a function, shared by the stack and
+ * the register back ends. Promoted slots are reused first, then new slots
+ * are added on top of the frame.
+ */
+struct SlotAllocation_ {
+  int* slots;            // per value, or NO_SLOT
+  int tempCount;         // slots added above the frame
+};
+
+typedef struct UseInfo_ UseInfo;
+typedef struct SlotAllocation_ SlotAllocation;
+
+/* Also resolves the arguments of the instructions to their final values */
+void computeUseInfo(IrFunction* function, UseInfo* info);
+void freeUseInfo(UseInfo* info);
+
+/* inSlot flags the values that need a slot. An operand of a phi computed
+ * in the predecessor it comes from shares the slot of the phi when that
+ * saves the copy.
+ */
+void allocateSlots(IrFunction* function, UseInfo* info, char* inSlot, SlotAllocation* allocation);
+void freeSlotAllocation(SlotAllocation* allocation);
+
+#endif
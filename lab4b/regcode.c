@@ -0,0 +1,590 @@
+/* Register code generated from the IR */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "regcode.h"
+#include "regalloc.h"
+
+struct Fixup_ {
+  CodeAddress address;
+  int target;                  // a block, or the entry of the callee for calls
+};
+
+typedef struct Fixup_ Fixup;
+
+static RegCode* out;
+static IrFunction* function;
+
+static UseInfo useInfo;
+static SlotAllocation allocation;
+static char* inSlot;
+static int* aliasOf;         // load read right from the register of its slot
+static int* storeInto;       // value computed right into the register it is stored to
+static char* absorbed;       // instruction done by another one
+
+static int frameRegisters;   // registers of the frame, the two scratch ones on top
+static int scratch0, scratch1;
+static int outgoing;         // words of the largest frame header and arguments of a call
+
+static CodeAddress* blockAddress;
+static Fixup* fixups;
+static int fixupCount, maxFixupCount;
+static Fixup* calls;
+static int callCount, maxCallCount;
+
+/******************************************************************/
+
+static IrInstr* instrOf(int value) {
+  return function->instrs + value;
+}
+
+static int isConstant(int value) {
+  enum IrOp op = instrOf(value)->op;
+  return (op == IR_CONST) || (op == IR_UNDEF);
+}
+
+static WORD constantOf(int value) {
+  return (instrOf(value)->op == IR_CONST) ? instrOf(value)->q : 0;
+}
+
+static int isRematerialized(int value) {
+  return isConstant(value) || (instrOf(value)->op == IR_ADDR);
+}
+
+static int isComparison(WORD op) {
+  return (op >= OP_EQ) && (op <= OP_LE);
+}
+
+static int emitsCode(int value) {
+  IrInstr* instr = instrOf(value);
+  return !instr->dead && !isRematerialized(value) && !absorbed[value];
+}
+
+static void emit(enum RegOpCode op, WORD a, WORD b, WORD c, CodeAddress origin) {
+  RegInstr* inst;
+
+  if (out->codeSize >= out->maxSize) {
+    out->maxSize = 2 * out->maxSize;
+    out->code = (RegInstr*) realloc(out->code, out->maxSize * sizeof(RegInstr));
+    out->origins = (CodeAddress*) realloc(out->origins, out->maxSize * sizeof(CodeAddress));
+  }
+  inst = out->code + out->codeSize;
+  inst->op = op;
+  inst->a = a;
+  inst->b = b;
+  inst->c = c;
+  out->origins[out->codeSize ++] = origin;
+}
+
+static void addFixup(Fixup** list, int* count, int* maxCount, int target) {
+  if (*count >= *maxCount) {
+    *maxCount = (*maxCount > 0) ? 2 * (*maxCount) : 64;
+    *list = (Fixup*) realloc(*list, (*maxCount) * sizeof(Fixup));
+  }
+  (*list)[*count].address = out->codeSize - 1;
+  (*list)[*count].target = target;
+  (*count) ++;
+}
+
+/* The jump target is the last operand of every jump */
+static void setTarget(RegInstr* inst, CodeAddress address) {
+  switch (inst->op) {
+  case ROP_J: inst->a = address; break;
+  case ROP_FJ: case ROP_TJ: case ROP_CALL: case ROP_CALLN: inst->b = address; break;
+  default: inst->c = address; break;
+  }
+}
+
+/******************************************************************/
+/* Operands that need no code of their own: loads of frame slots read the
+ * register of the slot itself, comparisons feeding a branch become part
+ * of the jump, and a value stored to a frame slot is computed right into
+ * the register of the slot.
+ */
+
+static int lastUse(int value) {
+  int u, last = -1;
+
+  for (u = useInfo.useStart[value]; u < useInfo.useStart[value] + useInfo.uses[value]; u ++) {
+    int user = useInfo.users[u];
+    if ((instrOf(user)->op == IR_PHI) || (instrOf(user)->block != instrOf(value)->block)) return -1;
+    if (useInfo.position[user] > last) last = useInfo.position[user];
+  }
+  return last;
+}
+
+/* Nothing between the instruction i of block b and its position last
+ * writes memory
+ */
+static int noStoreUntil(IrBlock* block, int i, int last) {
+  IrInstr* instr;
+
+  for (i ++; i < block->instrCount; i ++) {
+    instr = instrOf(block->instrs[i]);
+    if (instr->dead) continue;
+    if (useInfo.position[block->instrs[i]] >= last) return 1;
+    if ((instr->op == IR_STORE) || (instr->op == IR_CALL)) return 0;
+  }
+  return 1;
+}
+
+/* Nothing between the instruction i of block b and the instruction last
+ * emits code
+ */
+static int adjacent(IrBlock* block, int i, int last) {
+  for (i ++; (i < block->instrCount) && (block->instrs[i] != last); i ++)
+    if (emitsCode(block->instrs[i])) return 0;
+  return i < block->instrCount;
+}
+
+static void findAbsorbedOperands(void) {
+  IrBlock* block;
+  IrInstr* instr;
+  int b, i, j, v, last;
+
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    for (i = 0; i < block->instrCount; i ++) {
+      v = block->instrs[i];
+      instr = instrOf(v);
+      if (instr->dead || (instr->op != IR_LOAD) || (instr->p != 0) || (useInfo.uses[v] == 0)) continue;
+      last = lastUse(v);
+      if ((last >= 0) && noStoreUntil(block, i, last)) {
+	aliasOf[v] = instr->q;
+	absorbed[v] = 1;
+      }
+    }
+  }
+
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    if (block->instrCount == 0) continue;
+    instr = instrOf(block->instrs[block->instrCount - 1]);
+    if (instr->op != IR_BRANCH) continue;
+    v = instr->args[0];
+    if ((instrOf(v)->op != IR_BINARY) || !isComparison(instrOf(v)->p) ||
+	(useInfo.uses[v] != 1) || (instrOf(v)->block != b)) continue;
+    for (i = 0; block->instrs[i] != v; i ++) ;
+    if (adjacent(block, i, block->instrs[block->instrCount - 1])) absorbed[v] = 1;
+  }
+
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    for (i = 0; i < block->instrCount; i ++) {
+      v = block->instrs[i];
+      instr = instrOf(v);
+      if (instr->dead || absorbed[v] || !instr->hasResult || (useInfo.uses[v] != 1)) continue;
+      switch (instr->op) {
+      case IR_LOAD: case IR_LOADI: case IR_BINARY: case IR_NEG: case IR_READ: case IR_CALL: break;
+      default: continue;
+      }
+      j = useInfo.users[useInfo.useStart[v]];
+      if ((instrOf(j)->op != IR_STORE) || (instrOf(j)->args[1] != v) || (instrOf(j)->block != b)) continue;
+      instr = instrOf(instrOf(j)->args[0]);
+      if ((instr->op != IR_ADDR) || (instr->p != 0)) continue;
+      if (adjacent(block, i, j)) {
+	storeInto[v] = instr->q;
+	absorbed[j] = 1;
+      }
+    }
+  }
+}
+
+static int registerOf(int value) {
+  if (aliasOf[value] != NO_SLOT) return aliasOf[value];
+  if (storeInto[value] != NO_SLOT) return storeInto[value];
+  return allocation.slots[value];
+}
+
+static int destinationOf(int value) {
+  if (storeInto[value] != NO_SLOT) return storeInto[value];
+  if (inSlot[value]) return allocation.slots[value];
+  return scratch0;
+}
+
+/******************************************************************/
+
+static void moveTo(int reg, int value, CodeAddress origin) {
+  IrInstr* instr = instrOf(value);
+
+  if (isConstant(value)) emit(ROP_LDC, reg, constantOf(value), 0, origin);
+  else if (instr->op == IR_ADDR) emit(ROP_LDA, reg, instr->p, instr->q, origin);
+  else if (registerOf(value) != reg) emit(ROP_MOV, reg, registerOf(value), 0, origin);
+}
+
+/* Register holding the value, the scratch one for constants and addresses */
+static int operand(int value, int scratch, CodeAddress origin) {
+  if (!isRematerialized(value)) return registerOf(value);
+  moveTo(scratch, value, origin);
+  return scratch;
+}
+
+static enum RegOpCode binaryOp(WORD op) {
+  switch (op) {
+  case OP_AD: return ROP_AD;
+  case OP_SB: return ROP_SB;
+  case OP_ML: return ROP_ML;
+  case OP_DV: return ROP_DV;
+  default: return ROP_EQ + (op - OP_EQ);
+  }
+}
+
+/* Operator with its operands exchanged, or -1 */
+static int swappedOperator(WORD op) {
+  switch (op) {
+  case OP_AD: case OP_ML: case OP_EQ: case OP_NE: return op;
+  case OP_GT: return OP_LT;
+  case OP_LT: return OP_GT;
+  case OP_GE: return OP_LE;
+  case OP_LE: return OP_GE;
+  default: return -1;
+  }
+}
+
+static WORD negatedComparison(WORD op) {
+  switch (op) {
+  case OP_EQ: return OP_NE;
+  case OP_NE: return OP_EQ;
+  case OP_GT: return OP_LE;
+  case OP_LT: return OP_GE;
+  case OP_GE: return OP_LT;
+  default: return OP_GT;
+  }
+}
+
+static void emitBinary(int dest, IrInstr* instr) {
+  int x = instr->args[0], y = instr->args[1];
+  WORD op = instr->p;
+
+  // A constant index is scaled into the immediate, others into a scratch register
+  if ((op == OP_IX) && isConstant(y)) {
+    emit(ROP_ADK, dest, operand(x, scratch0, instr->origin), constantOf(y) * instr->q, instr->origin);
+    return;
+  }
+  if (op == OP_IX) {
+    emit(ROP_MLK, scratch1, operand(y, scratch1, instr->origin), instr->q, instr->origin);
+    emit(ROP_AD, dest, operand(x, scratch0, instr->origin), scratch1, instr->origin);
+    return;
+  }
+
+  // An immediate divisor of 0 still goes through the register form and traps
+  if (isConstant(y) && ((op != OP_DV) || (constantOf(y) != 0)))
+    emit(binaryOp(op) + (ROP_ADK - ROP_AD), dest, operand(x, scratch0, instr->origin), constantOf(y), instr->origin);
+  else if (isConstant(x) && !isRematerialized(y) && (swappedOperator(op) >= 0))
+    emit(binaryOp(swappedOperator(op)) + (ROP_ADK - ROP_AD), dest, registerOf(y), constantOf(x), instr->origin);
+  else emit(binaryOp(op), dest, operand(x, scratch0, instr->origin),
+	    operand(y, scratch1, instr->origin), instr->origin);
+}
+
+static void emitJump(int block, CodeAddress origin) {
+  emit(ROP_J, 0, 0, 0, origin);
+  addFixup(&fixups, &fixupCount, &maxFixupCount, block);
+}
+
+/* Jumps when the condition is as wanted, the target is set by the caller */
+static void emitConditionalJump(int condition, int wanted, CodeAddress origin) {
+  IrInstr* instr = instrOf(condition);
+  int x, y;
+  WORD op;
+
+  // An absorbed load reads its slot in place, only a comparison becomes the jump
+  if (!absorbed[condition] || (instr->op != IR_BINARY)) {
+    emit(wanted ? ROP_TJ : ROP_FJ, operand(condition, scratch0, origin), 0, 0, origin);
+    return;
+  }
+  x = instr->args[0];
+  y = instr->args[1];
+  op = wanted ? instr->p : negatedComparison(instr->p);
+  if (isConstant(y))
+    emit(ROP_JEQK + (op - OP_EQ), operand(x, scratch0, origin), constantOf(y), 0, origin);
+  else if (isConstant(x) && !isRematerialized(y))
+    emit(ROP_JEQK + (swappedOperator(op) - OP_EQ), registerOf(y), constantOf(x), 0, origin);
+  else emit(ROP_JEQ + (op - OP_EQ), operand(x, scratch0, origin),
+	    operand(y, scratch1, origin), 0, origin);
+}
+
+static int predIndex(int block, int pred) {
+  IrBlock* b = function->blocks + block;
+  int i;
+
+  for (i = 0; i < b->predCount; i ++)
+    if (b->preds[i] == pred) return i;
+  return -1;
+}
+
+/* Copies into the phis of a successor as a parallel move: a copy waits
+ * until no other one still reads its destination, and a cycle of copies
+ * is broken through the scratch register.
+ */
+static int emitCopies(int from, int to, CodeAddress origin, int countOnly) {
+  IrBlock* target = function->blocks + to;
+  int k = predIndex(to, from);
+  int* dests = (int*) malloc((target->phiCount + 1) * sizeof(int));
+  int* sources = (int*) malloc((target->phiCount + 1) * sizeof(int));
+  int* values = (int*) malloc((target->phiCount + 1) * sizeof(int));
+  int count = 0, copies, i, j, blocked, progress;
+
+  for (i = 0; i < target->phiCount; i ++) {
+    int phi = target->phis[i];
+    int source = instrOf(phi)->args[k];
+    if (!inSlot[phi] || (instrOf(source)->op == IR_UNDEF)) continue;
+    if (!isRematerialized(source) && (registerOf(source) == allocation.slots[phi])) continue;
+    dests[count] = allocation.slots[phi];
+    sources[count] = isRematerialized(source) ? NO_SLOT : registerOf(source);
+    values[count ++] = source;
+  }
+  copies = count;
+
+  while (!countOnly && (count > 0)) {
+    progress = 0;
+    for (i = 0; i < count; i ++) {
+      blocked = 0;
+      for (j = 0; j < count; j ++)
+	if ((j != i) && (sources[j] == dests[i])) blocked = 1;
+      if (blocked) continue;
+      if (sources[i] == NO_SLOT) moveTo(dests[i], values[i], origin);
+      else if (sources[i] != dests[i]) emit(ROP_MOV, dests[i], sources[i], 0, origin);
+      count --;
+      dests[i] = dests[count];
+      sources[i] = sources[count];
+      values[i] = values[count];
+      progress = 1;
+      break;
+    }
+    if (progress) continue;
+    // Only cycles are left: the destination of the first copy moves aside
+    emit(ROP_MOV, scratch0, dests[0], 0, origin);
+    for (j = 0; j < count; j ++)
+      if (sources[j] == dests[0]) sources[j] = scratch0;
+  }
+
+  free(dests);
+  free(sources);
+  free(values);
+  return copies;
+}
+
+static void emitTerminator(int b, IrInstr* instr) {
+  IrBlock* block = function->blocks + b;
+  int onTrue = block->succs[0], onFalse = block->succs[1];
+  CodeAddress falseJump;
+
+  switch (instr->op) {
+  case IR_JUMP:
+    emitCopies(b, onTrue, instr->origin, 0);
+    if (onTrue != b + 1) emitJump(onTrue, instr->origin);
+    break;
+  case IR_BRANCH:
+    if (emitCopies(b, onFalse, instr->origin, 1) == 0) {
+      emitConditionalJump(instr->args[0], 0, instr->origin);
+      addFixup(&fixups, &fixupCount, &maxFixupCount, onFalse);
+      emitCopies(b, onTrue, instr->origin, 0);
+      if (onTrue != b + 1) emitJump(onTrue, instr->origin);
+    } else if (emitCopies(b, onTrue, instr->origin, 1) == 0) {
+      emitConditionalJump(instr->args[0], 1, instr->origin);
+      addFixup(&fixups, &fixupCount, &maxFixupCount, onTrue);
+      emitCopies(b, onFalse, instr->origin, 0);
+      if (onFalse != b + 1) emitJump(onFalse, instr->origin);
+    } else {
+      emitConditionalJump(instr->args[0], 0, instr->origin);
+      falseJump = out->codeSize - 1;
+      emitCopies(b, onTrue, instr->origin, 0);
+      emitJump(onTrue, instr->origin);
+      setTarget(out->code + falseJump, out->codeSize);
+      emitCopies(b, onFalse, instr->origin, 0);
+      if (onFalse != b + 1) emitJump(onFalse, instr->origin);
+    }
+    break;
+  case IR_RETURN: emit(ROP_RET, 0, 0, 0, instr->origin); break;
+  case IR_HALT: emit(ROP_HL, 0, 0, 0, instr->origin); break;
+  default: break;
+  }
+}
+
+static void emitInstr(int b, int v) {
+  IrInstr* instr = instrOf(v);
+  IrInstr* address;
+  int i;
+
+  if (absorbed[v]) return;
+  switch (instr->op) {
+  case IR_LOAD:
+    if (instr->p == 0) emit(ROP_MOV, destinationOf(v), instr->q, 0, instr->origin);
+    else emit(ROP_LDV, destinationOf(v), instr->p, instr->q, instr->origin);
+    break;
+  case IR_LOADI:
+    address = instrOf(instr->args[0]);
+    if (address->op == IR_ADDR)
+      emit(ROP_LDV, destinationOf(v), address->p, address->q, instr->origin);
+    else emit(ROP_LDI, destinationOf(v), operand(instr->args[0], scratch0, instr->origin), 0, instr->origin);
+    break;
+  case IR_STORE:
+    address = instrOf(instr->args[0]);
+    if ((address->op == IR_ADDR) && (address->p == 0))
+      moveTo(address->q, instr->args[1], instr->origin);
+    else if (address->op == IR_ADDR)
+      emit(ROP_STV, address->p, address->q, operand(instr->args[1], scratch0, instr->origin), instr->origin);
+    else emit(ROP_STI, operand(instr->args[0], scratch0, instr->origin),
+	      operand(instr->args[1], scratch1, instr->origin), 0, instr->origin);
+    break;
+  case IR_BINARY: emitBinary(destinationOf(v), instr); break;
+  case IR_NEG:
+    emit(ROP_NEG, destinationOf(v), operand(instr->args[0], scratch0, instr->origin), 0, instr->origin);
+    break;
+  case IR_READ:
+    emit((instr->p == OP_RC) ? ROP_RC : ROP_RI, destinationOf(v), 0, 0, instr->origin);
+    break;
+  case IR_WRITE:
+    emit((instr->p == OP_WRC) ? ROP_WRC : ROP_WRI, operand(instr->args[0], scratch0, instr->origin),
+	 0, 0, instr->origin);
+    break;
+  case IR_WRITELN: emit(ROP_WLN, 0, 0, 0, instr->origin); break;
+  case IR_CALL:
+    for (i = 0; i < instr->argCount; i ++)
+      moveTo(frameRegisters + 4 + i, instr->args[i], instr->origin);
+    if (instr->p == NO_STATIC_LINK) emit(ROP_CALLN, 0, 0, frameRegisters, instr->origin);
+    else emit(ROP_CALL, instr->p, 0, frameRegisters, instr->origin);
+    addFixup(&calls, &callCount, &maxCallCount, instr->q);
+    if (instr->hasResult && (useInfo.uses[v] > 0))
+      emit(ROP_MOV, destinationOf(v), frameRegisters, 0, instr->origin);
+    break;
+  case IR_FRAME: emit(ROP_ENTER, frameRegisters + outgoing, 0, 0, instr->origin); break;
+  case IR_JUMP:
+  case IR_BRANCH:
+  case IR_RETURN:
+  case IR_HALT:
+    emitTerminator(b, instr);
+    break;
+  default:
+    break;
+  }
+}
+
+static void generateFunction(IrFunction* f) {
+  IrBlock* block;
+  IrInstr* instr;
+  int b, i, v, firstFixup = fixupCount;
+
+  function = f;
+  computeUseInfo(function, &useInfo);
+  aliasOf = (int*) malloc((function->instrCount + 1) * sizeof(int));
+  storeInto = (int*) malloc((function->instrCount + 1) * sizeof(int));
+  absorbed = (char*) calloc(function->instrCount + 1, 1);
+  inSlot = (char*) calloc(function->instrCount + 1, 1);
+  for (v = 0; v < function->instrCount; v ++) aliasOf[v] = storeInto[v] = NO_SLOT;
+  findAbsorbedOperands();
+
+  outgoing = 4;
+  for (v = 0; v < function->instrCount; v ++) {
+    instr = instrOf(v);
+    if (instr->dead) continue;
+    if ((instr->op == IR_CALL) && (4 + instr->argCount > outgoing)) outgoing = 4 + instr->argCount;
+    inSlot[v] = instr->hasResult && (useInfo.uses[v] > 0) && !isRematerialized(v) &&
+      !absorbed[v] && (storeInto[v] == NO_SLOT);
+  }
+  allocateSlots(function, &useInfo, inSlot, &allocation);
+  frameRegisters = function->frameSize + allocation.tempCount + 2;
+  scratch0 = frameRegisters - 2;
+  scratch1 = frameRegisters - 1;
+
+  blockAddress = (CodeAddress*) malloc(function->blockCount * sizeof(CodeAddress));
+  for (b = 0; b < function->blockCount; b ++) {
+    block = function->blocks + b;
+    blockAddress[b] = out->codeSize;
+    for (i = 0; i < block->instrCount; i ++)
+      if (!instrOf(block->instrs[i])->dead) emitInstr(b, block->instrs[i]);
+  }
+  for (i = firstFixup; i < fixupCount; i ++)
+    setTarget(out->code + fixups[i].address, blockAddress[fixups[i].target]);
+  fixupCount = firstFixup;
+
+  freeUseInfo(&useInfo);
+  freeSlotAllocation(&allocation);
+  free(aliasOf); free(storeInto); free(absorbed); free(inSlot);
+  free(blockAddress);
+}
+
+static int findFunction(IrProgram* program, CodeAddress entry) {
+  int i;
+
+  for (i = 0; i < program->functionCount; i ++)
+    if (program->functions[i].entry == entry) return i;
+  return -1;
+}
+
+RegCode* generateRegisterCode(IrProgram* program) {
+  CodeAddress* entries = (CodeAddress*) malloc((program->functionCount + 1) * sizeof(CodeAddress));
+  int i, f, ok = 1;
+
+  out = (RegCode*) calloc(1, sizeof(RegCode));
+  out->maxSize = 256;
+  out->code = (RegInstr*) malloc(out->maxSize * sizeof(RegInstr));
+  out->origins = (CodeAddress*) malloc(out->maxSize * sizeof(CodeAddress));
+  fixups = calls = NULL;
+  fixupCount = maxFixupCount = callCount = maxCallCount = 0;
+
+  out->entryPoint = -1;
+  for (i = 0; i < program->functionCount; i ++) {
+    entries[i] = out->codeSize;
+    if (program->functions[i].isProgram) out->entryPoint = out->codeSize;
+    generateFunction(program->functions + i);
+  }
+
+  for (i = 0; i < callCount; i ++) {
+    f = findFunction(program, calls[i].target);
+    if (f < 0) ok = 0;
+    else setTarget(out->code + calls[i].address, entries[f]);
+  }
+  free(entries);
+  free(fixups);
+  free(calls);
+
+  if (!ok || (out->entryPoint < 0)) {
+    freeRegisterCode(out);
+    return NULL;
+  }
+  return out;
+}
+
+void freeRegisterCode(RegCode* regCode) {
+  free(regCode->code);
+  free(regCode->origins);
+  free(regCode);
+}
+
+/******************************************************************/
+
+static const char* registerOpNames[] = {
+  "MOV", "LDC", "LDA", "LDV", "STV", "LDI", "STI",
+  "AD", "SB", "ML", "DV", "EQ", "NE", "GT", "LT", "GE", "LE",
+  "ADK", "SBK", "MLK", "DVK", "EQK", "NEK", "GTK", "LTK", "GEK", "LEK", "NEG",
+  "RC", "RI", "WRC", "WRI", "WLN",
+  "J", "FJ", "TJ", "JEQ", "JNE", "JGT", "JLT", "JGE", "JLE",
+  "JEQK", "JNEK", "JGTK", "JLTK", "JGEK", "JLEK",
+  "ENTER", "CALL", "CALLN", "RET", "HL"
+};
+
+static int operandCount(enum RegOpCode op) {
+  switch (op) {
+  case ROP_WLN: case ROP_RET: case ROP_HL: return 0;
+  case ROP_RC: case ROP_RI: case ROP_WRC: case ROP_WRI: case ROP_J: case ROP_ENTER: return 1;
+  case ROP_MOV: case ROP_LDC: case ROP_LDI: case ROP_STI: case ROP_NEG: case ROP_FJ: case ROP_TJ: return 2;
+  default: return 3;
+  }
+}
+
+void printRegisterCode(RegCode* regCode) {
+  RegInstr* inst;
+  int i, n;
+
+  for (i = 0; i < regCode->codeSize; i ++) {
+    inst = regCode->code + i;
+    n = operandCount(inst->op);
+    printf("%d:  %s", i, registerOpNames[inst->op]);
+    if (n >= 1) printf(" %d", inst->a);
+    if (n >= 2) printf(",%d", inst->b);
+    if (n >= 3) printf(",%d", inst->c);
+    printf("\n");
+  }
+}
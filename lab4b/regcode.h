@@ -0,0 +1,101 @@
+/* Register code generated from the IR */
+
+#ifndef __REGCODE_H__
+#define __REGCODE_H__
+
+#include "ir.h"
+
+/* Three-address code run by the register VM, generated from the IR.
+ *
+ * The registers are the words of the current frame: r[i] is s[b + i].
+ * The frame header and the variables keep their offsets, so registers
+ * 0 .. 3 hold the header, the parameters and locals follow, and the
+ * temporaries of the register allocator come on top. A call places the
+ * frame of the callee c words above its own: its arguments are written
+ * to r[c + 4] and on, and a function leaves its result in r[c].
+ */
+enum RegOpCode {
+  ROP_MOV,   // r[a] := r[b]
+  ROP_LDC,   // r[a] := b
+  ROP_LDA,   // r[a] := base(b) + c
+  ROP_LDV,   // r[a] := s[base(b) + c]
+  ROP_STV,   // s[base(a) + b] := r[c]
+  ROP_LDI,   // r[a] := s[r[b]]
+  ROP_STI,   // s[r[a]] := r[b]
+
+  ROP_AD,    // r[a] := r[b] + r[c], and so on up to ROP_LE
+  ROP_SB,
+  ROP_ML,
+  ROP_DV,
+  ROP_EQ,
+  ROP_NE,
+  ROP_GT,
+  ROP_LT,
+  ROP_GE,
+  ROP_LE,
+  ROP_ADK,   // r[a] := r[b] + c, and so on up to ROP_LEK
+  ROP_SBK,
+  ROP_MLK,
+  ROP_DVK,   // never with c = 0
+  ROP_EQK,
+  ROP_NEK,
+  ROP_GTK,
+  ROP_LTK,
+  ROP_GEK,
+  ROP_LEK,
+  ROP_NEG,   // r[a] := - r[b]
+
+  ROP_RC,    // read one character into r[a]
+  ROP_RI,    // read integer into r[a]
+  ROP_WRC,   // write one character from r[a]
+  ROP_WRI,   // write integer from r[a]
+  ROP_WLN,
+
+  ROP_J,     // pc := a
+  ROP_FJ,    // if r[a] = 0 then pc := b
+  ROP_TJ,    // if r[a] != 0 then pc := b
+  ROP_JEQ,   // if r[a] = r[b] then pc := c, and so on up to ROP_JLE
+  ROP_JNE,
+  ROP_JGT,
+  ROP_JLT,
+  ROP_JGE,
+  ROP_JLE,
+  ROP_JEQK,  // if r[a] = b then pc := c, and so on up to ROP_JLEK
+  ROP_JNEK,
+  ROP_JGTK,
+  ROP_JLTK,
+  ROP_JGEK,
+  ROP_JLEK,
+
+  ROP_ENTER, // stack overflow unless the a words from b fit in the stack
+  ROP_CALL,  // s[b+c+1] := b; s[b+c+2] := pc; s[b+c+3] := base(a); b := b + c; pc := b
+  ROP_CALLN, // s[b+c+1] := b; s[b+c+2] := pc; b := b + c; pc := b
+  ROP_RET,   // pc := s[b+2]; b := s[b+1]
+  ROP_HL
+};
+
+struct RegInstr_ {
+  enum RegOpCode op;
+  WORD a;
+  WORD b;
+  WORD c;
+};
+
+struct RegCode_ {
+  struct RegInstr_* code;
+  CodeAddress* origins;        // stack code instruction of every instruction
+  int codeSize;
+  int maxSize;
+  CodeAddress entryPoint;
+};
+
+typedef struct RegInstr_ RegInstr;
+typedef struct RegCode_ RegCode;
+
+/* Returns NULL when the program uses a form the register code lacks */
+RegCode* generateRegisterCode(IrProgram* program);
+void freeRegisterCode(RegCode* regCode);
+
+void printRegisterCode(RegCode* regCode);
+
+#endif
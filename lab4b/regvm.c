@@ -0,0 +1,187 @@
+/* Register machine of kplrun */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm.h"
+#include "regvm.h"
+
+static RegCode* regCode;
+static WORD* stack;
+static int stackSize;
+static CodeAddress pc;
+
+int initRegisterVM(RegCode* code, int size) {
+  regCode = code;
+  stackSize = size;
+  stack = (WORD*) calloc(stackSize, sizeof(WORD));
+  if (stack == NULL) return 0;
+  pc = regCode->entryPoint;
+  return 1;
+}
+
+void cleanRegisterVM(void) {
+  free(stack);
+  stack = NULL;
+}
+
+/* Frames are checked when they are entered, only indirect accesses can
+ * leave the stack
+ */
+static inline int base(int b, int p) {
+  while (p > 0) {
+    b = stack[b + 3];
+    p --;
+  }
+  return b;
+}
+
+static inline int checkAddress(WORD address) {
+  if (address < 0) return PS_STACK_UNDERFLOW;
+  if (address >= stackSize) return PS_STACK_OVERFLOW;
+  return PS_ACTIVE;
+}
+
+/* pc is only written back when the program stops */
+static inline int execute(int counting, long* count) {
+  RegInstr* code = regCode->code;
+  RegInstr* inst;
+  RegInstr* ip = code + pc;
+  int b = 0;
+  WORD* r = stack;
+  int ps = PS_ACTIVE;
+  long executed = 0;
+
+  while (ps == PS_ACTIVE) {
+    inst = ip ++;
+    if (counting) executed ++;
+    switch (inst->op) {
+    case ROP_MOV: r[inst->a] = r[inst->b]; break;
+    case ROP_LDC: r[inst->a] = inst->b; break;
+    case ROP_LDA: r[inst->a] = base(b, inst->b) + inst->c; break;
+    case ROP_LDV: r[inst->a] = stack[base(b, inst->b) + inst->c]; break;
+    case ROP_STV: stack[base(b, inst->a) + inst->b] = r[inst->c]; break;
+    case ROP_LDI:
+      ps = checkAddress(r[inst->b]);
+      if (ps == PS_ACTIVE) r[inst->a] = stack[r[inst->b]];
+      break;
+    case ROP_STI:
+      ps = checkAddress(r[inst->a]);
+      if (ps == PS_ACTIVE) stack[r[inst->a]] = r[inst->b];
+      break;
+
+    case ROP_AD: r[inst->a] = r[inst->b] + r[inst->c]; break;
+    case ROP_SB: r[inst->a] = r[inst->b] - r[inst->c]; break;
+    case ROP_ML: r[inst->a] = r[inst->b] * r[inst->c]; break;
+    case ROP_DV:
+      if (r[inst->c] == 0) ps = PS_DIVIDE_BY_ZERO;
+      // Wraps like OP_DV
+      else if (r[inst->c] == -1) r[inst->a] = (WORD) (0u - (unsigned int) r[inst->b]);
+      else r[inst->a] = r[inst->b] / r[inst->c];
+      break;
+    case ROP_EQ: r[inst->a] = (r[inst->b] == r[inst->c]); break;
+    case ROP_NE: r[inst->a] = (r[inst->b] != r[inst->c]); break;
+    case ROP_GT: r[inst->a] = (r[inst->b] > r[inst->c]); break;
+    case ROP_LT: r[inst->a] = (r[inst->b] < r[inst->c]); break;
+    case ROP_GE: r[inst->a] = (r[inst->b] >= r[inst->c]); break;
+    case ROP_LE: r[inst->a] = (r[inst->b] <= r[inst->c]); break;
+    case ROP_ADK: r[inst->a] = r[inst->b] + inst->c; break;
+    case ROP_SBK: r[inst->a] = r[inst->b] - inst->c; break;
+    case ROP_MLK: r[inst->a] = r[inst->b] * inst->c; break;
+    case ROP_DVK:
+      if (inst->c == -1) r[inst->a] = (WORD) (0u - (unsigned int) r[inst->b]);
+      else r[inst->a] = r[inst->b] / inst->c;
+      break;
+    case ROP_EQK: r[inst->a] = (r[inst->b] == inst->c); break;
+    case ROP_NEK: r[inst->a] = (r[inst->b] != inst->c); break;
+    case ROP_GTK: r[inst->a] = (r[inst->b] > inst->c); break;
+    case ROP_LTK: r[inst->a] = (r[inst->b] < inst->c); break;
+    case ROP_GEK: r[inst->a] = (r[inst->b] >= inst->c); break;
+    case ROP_LEK: r[inst->a] = (r[inst->b] <= inst->c); break;
+    case ROP_NEG: r[inst->a] = - r[inst->b]; break;
+
+    case ROP_RC:
+      r[inst->a] = getchar();
+      if (r[inst->a] == EOF) ps = PS_IO_ERROR;
+      break;
+    case ROP_RI:
+      if (scanf("%d", &r[inst->a]) != 1) ps = PS_IO_ERROR;
+      break;
+    case ROP_WRC: putchar(r[inst->a]); break;
+    case ROP_WRI: printf("%d", r[inst->a]); break;
+    case ROP_WLN: putchar('\n'); break;
+
+    case ROP_J: ip = code + inst->a; break;
+    case ROP_FJ: if (r[inst->a] == FALSE) ip = code + inst->b; break;
+    case ROP_TJ: if (r[inst->a] != FALSE) ip = code + inst->b; break;
+    case ROP_JEQ: if (r[inst->a] == r[inst->b]) ip = code + inst->c; break;
+    case ROP_JNE: if (r[inst->a] != r[inst->b]) ip = code + inst->c; break;
+    case ROP_JGT: if (r[inst->a] > r[inst->b]) ip = code + inst->c; break;
+    case ROP_JLT: if (r[inst->a] < r[inst->b]) ip = code + inst->c; break;
+    case ROP_JGE: if (r[inst->a] >= r[inst->b]) ip = code + inst->c; break;
+    case ROP_JLE: if (r[inst->a] <= r[inst->b]) ip = code + inst->c; break;
+    case ROP_JEQK: if (r[inst->a] == inst->b) ip = code + inst->c; break;
+    case ROP_JNEK: if (r[inst->a] != inst->b) ip = code + inst->c; break;
+    case ROP_JGTK: if (r[inst->a] > inst->b) ip = code + inst->c; break;
+    case ROP_JLTK: if (r[inst->a] < inst->b) ip = code + inst->c; break;
+    case ROP_JGEK: if (r[inst->a] >= inst->b) ip = code + inst->c; break;
+    case ROP_JLEK: if (r[inst->a] <= inst->b) ip = code + inst->c; break;
+
+    case ROP_ENTER:
+      if (b + inst->a > stackSize) ps = PS_STACK_OVERFLOW;
+      break;
+    case ROP_CALL:
+      r[inst->c + 1] = b;
+      r[inst->c + 2] = ip - code;
+      r[inst->c + 3] = base(b, inst->a);
+      b += inst->c;
+      r = stack + b;
+      ip = code + inst->b;
+      break;
+    case ROP_CALLN:
+      r[inst->c + 1] = b;
+      r[inst->c + 2] = ip - code;
+      b += inst->c;
+      r = stack + b;
+      ip = code + inst->b;
+      break;
+    case ROP_RET:
+      // A stray store may have overwritten the return address
+      if ((r[2] < 0) || (r[2] >= regCode->codeSize)) {
+	ps = PS_INVALID_ADDRESS;
+	break;
+      }
+      ip = code + r[2];
+      b = r[1];
+      r = stack + b;
+      break;
+    case ROP_HL:
+      ps = PS_DONE;
+      break;
+    default:
+      ps = PS_INVALID_ADDRESS;
+      break;
+    }
+  }
+
+  pc = ip - code - 1;
+  if (counting) *count += executed;
+  return ps;
+}
+
+int runRegisterCode(long* count) {
+  if (count != NULL) return execute(1, count);
+  return execute(0, NULL);
+}
+
+void printRegisterProgramState(int ps) {
+  CodeAddress origin = regCode->origins[pc];
+
+  switch (ps) {
+  case PS_DIVIDE_BY_ZERO: printf("Divide by zero at %d!\n", origin); break;
+  case PS_STACK_OVERFLOW: printf("Stack overflow at %d!\n", origin); break;
+  case PS_STACK_UNDERFLOW: printf("Stack underflow at %d!\n", origin); break;
+  case PS_IO_ERROR: printf("IO error at %d!\n", origin); break;
+  case PS_INVALID_ADDRESS: printf("Invalid code address %d!\n", origin); break;
+  default: break;
+  }
+}
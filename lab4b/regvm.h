@@ -0,0 +1,21 @@
+/* Register machine of kplrun */
+
+#ifndef __REGVM_H__
+#define __REGVM_H__
+
+#include "regcode.h"
+
+/* Interpreter of the register code. It reports the same program states
+ * as the stack VM, at the address of the stack code instruction the
+ * faulting register instruction comes from.
+ */
+
+int initRegisterVM(RegCode* regCode, int stackSize);
+void cleanRegisterVM(void);
+
+/* Counts the instructions executed in *count unless count is NULL */
+int runRegisterCode(long* count);
+
+void printRegisterProgramState(int ps);
+
+#endif
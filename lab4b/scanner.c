@@ -15,23 +15,19 @@
 #include "scanner.h"
 
 
-extern int lineNo;
-extern int colNo;
-extern int currentChar;
-
 extern CharCode charCodes[];
 
 /***************************************************************/
 
-void skipBlank() {
-  while ((currentChar != EOF) && (charCodes[currentChar] == CHAR_SPACE))
-    readChar();
+void skipBlank(CompilerContext* context) {
+  while ((context->currentChar != EOF) && (charCodes[context->currentChar] == CHAR_SPACE))
+    readChar(context);
 }
 
-void skipComment() {
+void skipComment(CompilerContext* context) {
   int state = 0;
-  while ((currentChar != EOF) && (state < 2)) {
-    switch (charCodes[currentChar]) {
+  while ((context->currentChar != EOF) && (state < 2)) {
+    switch (charCodes[context->currentChar]) {
     case CHAR_TIMES:
       state = 1;
       break;
@@ -42,27 +38,27 @@ void skipComment() {
     default:
       state = 0;
     }
-    readChar();
+    readChar(context);
   }
   if (state != 2) 
-    error(ERR_END_OF_COMMENT, lineNo, colNo);
+    error(context, ERR_END_OF_COMMENT, context->lineNo, context->colNo);
 }
 
-Token* readIdentKeyword(void) {
-  Token *token = makeToken(TK_NONE, lineNo, colNo);
+Token* readIdentKeyword(CompilerContext* context) {
+  Token *token = makeToken(TK_NONE, context->lineNo, context->colNo);
   int count = 1;
 
-  token->string[0] = toupper((char)currentChar);
-  readChar();
+  token->string[0] = toupper((char)context->currentChar);
+  readChar(context);
 
-  while ((currentChar != EOF) && 
-	 ((charCodes[currentChar] == CHAR_LETTER) || (charCodes[currentChar] == CHAR_DIGIT))) {
-    if (count <= MAX_IDENT_LEN) token->string[count++] = toupper((char)currentChar);
-    readChar();
+  while ((context->currentChar != EOF) && 
+	 ((charCodes[context->currentChar] == CHAR_LETTER) || (charCodes[context->currentChar] == CHAR_DIGIT))) {
+    if (count <= MAX_IDENT_LEN) token->string[count++] = toupper((char)context->currentChar);
+    readChar(context);
   }
 
   if (count > MAX_IDENT_LEN) {
-    error(ERR_IDENT_TOO_LONG, token->lineNo, token->colNo);
+    error(context, ERR_IDENT_TOO_LONG, token->lineNo, token->colNo);
     return token;
   }
 
@@ -75,13 +71,13 @@ Token* readIdentKeyword(void) {
   return token;
 }
 
-Token* readNumber(void) {
-  Token *token = makeToken(TK_NUMBER, lineNo, colNo);
+Token* readNumber(CompilerContext* context) {
+  Token *token = makeToken(TK_NUMBER, context->lineNo, context->colNo);
   int count = 0;
 
-  while ((currentChar != EOF) && (charCodes[currentChar] == CHAR_DIGIT)) {
-    token->string[count++] = (char)currentChar;
-    readChar();
+  while ((context->currentChar != EOF) && (charCodes[context->currentChar] == CHAR_DIGIT)) {
+    token->string[count++] = (char)context->currentChar;
+    readChar(context);
   }
 
   token->string[count] = '\0';
@@ -89,157 +85,157 @@ Token* readNumber(void) {
   return token;
 }
 
-Token* readConstChar(void) {
-  Token *token = makeToken(TK_CHAR, lineNo, colNo);
+Token* readConstChar(CompilerContext* context) {
+  Token *token = makeToken(TK_CHAR, context->lineNo, context->colNo);
 
-  readChar();
-  if (currentChar == EOF) {
+  readChar(context);
+  if (context->currentChar == EOF) {
     token->tokenType = TK_NONE;
-    error(ERR_INVALID_CONSTANT_CHAR, token->lineNo, token->colNo);
+    error(context, ERR_INVALID_CONSTANT_CHAR, token->lineNo, token->colNo);
     return token;
   }
     
-  token->string[0] = currentChar;
+  token->string[0] = context->currentChar;
   token->string[1] = '\0';
-  token->value = currentChar;
+  token->value = context->currentChar;
 
-  readChar();
-  if (currentChar == EOF) {
+  readChar(context);
+  if (context->currentChar == EOF) {
     token->tokenType = TK_NONE;
-    error(ERR_INVALID_CONSTANT_CHAR, token->lineNo, token->colNo);
+    error(context, ERR_INVALID_CONSTANT_CHAR, token->lineNo, token->colNo);
     return token;
   }
 
-  if (charCodes[currentChar] == CHAR_SINGLEQUOTE) {
-    readChar();
+  if (charCodes[context->currentChar] == CHAR_SINGLEQUOTE) {
+    readChar(context);
     return token;
   } else {
     token->tokenType = TK_NONE;
-    error(ERR_INVALID_CONSTANT_CHAR, token->lineNo, token->colNo);
+    error(context, ERR_INVALID_CONSTANT_CHAR, token->lineNo, token->colNo);
     return token;
   }
 }
 
-Token* getToken(void) {
+Token* getToken(CompilerContext* context) {
   Token *token;
   int ln, cn;
 
-  if (currentChar == EOF) 
-    return makeToken(TK_EOF, lineNo, colNo);
+  if (context->currentChar == EOF) 
+    return makeToken(TK_EOF, context->lineNo, context->colNo);
 
-  switch (charCodes[currentChar]) {
-  case CHAR_SPACE: skipBlank(); return getToken();
-  case CHAR_LETTER: return readIdentKeyword();
-  case CHAR_DIGIT: return readNumber();
+  switch (charCodes[context->currentChar]) {
+  case CHAR_SPACE: skipBlank(context); return getToken(context);
+  case CHAR_LETTER: return readIdentKeyword(context);
+  case CHAR_DIGIT: return readNumber(context);
   case CHAR_PLUS: 
-    token = makeToken(SB_PLUS, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_PLUS, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   case CHAR_MINUS:
-    token = makeToken(SB_MINUS, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_MINUS, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   case CHAR_TIMES:
-    token = makeToken(SB_TIMES, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_TIMES, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   case CHAR_SLASH:
-    token = makeToken(SB_SLASH, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_SLASH, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   case CHAR_LT:
-    ln = lineNo;
-    cn = colNo;
-    readChar();
-    if ((currentChar != EOF) && (charCodes[currentChar] == CHAR_EQ)) {
-      readChar();
+    ln = context->lineNo;
+    cn = context->colNo;
+    readChar(context);
+    if ((context->currentChar != EOF) && (charCodes[context->currentChar] == CHAR_EQ)) {
+      readChar(context);
       return makeToken(SB_LE, ln, cn);
     } else return makeToken(SB_LT, ln, cn);
   case CHAR_GT:
-    ln = lineNo;
-    cn = colNo;
-    readChar();
-    if ((currentChar != EOF) && (charCodes[currentChar] == CHAR_EQ)) {
-      readChar();
+    ln = context->lineNo;
+    cn = context->colNo;
+    readChar(context);
+    if ((context->currentChar != EOF) && (charCodes[context->currentChar] == CHAR_EQ)) {
+      readChar(context);
       return makeToken(SB_GE, ln, cn);
     } else return makeToken(SB_GT, ln, cn);
   case CHAR_EQ: 
-    token = makeToken(SB_EQ, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_EQ, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   case CHAR_EXCLAIMATION:
-    ln = lineNo;
-    cn = colNo;
-    readChar();
-    if ((currentChar != EOF) && (charCodes[currentChar] == CHAR_EQ)) {
-      readChar();
+    ln = context->lineNo;
+    cn = context->colNo;
+    readChar(context);
+    if ((context->currentChar != EOF) && (charCodes[context->currentChar] == CHAR_EQ)) {
+      readChar(context);
       return makeToken(SB_NEQ, ln, cn);
     } else {
       token = makeToken(TK_NONE, ln, cn);
-      error(ERR_INVALID_SYMBOL, ln, cn);
+      error(context, ERR_INVALID_SYMBOL, ln, cn);
       return token;
     }
   case CHAR_COMMA:
-    token = makeToken(SB_COMMA, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_COMMA, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   case CHAR_PERIOD:
-    ln = lineNo;
-    cn = colNo;
-    readChar();
-    if ((currentChar != EOF) && (charCodes[currentChar] == CHAR_RPAR)) {
-      readChar();
+    ln = context->lineNo;
+    cn = context->colNo;
+    readChar(context);
+    if ((context->currentChar != EOF) && (charCodes[context->currentChar] == CHAR_RPAR)) {
+      readChar(context);
       return makeToken(SB_RSEL, ln, cn);
     } else return makeToken(SB_PERIOD, ln, cn);
   case CHAR_SEMICOLON:
-    token = makeToken(SB_SEMICOLON, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_SEMICOLON, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   case CHAR_COLON:
-    ln = lineNo;
-    cn = colNo;
-    readChar();
-    if ((currentChar != EOF) && (charCodes[currentChar] == CHAR_EQ)) {
-      readChar();
+    ln = context->lineNo;
+    cn = context->colNo;
+    readChar(context);
+    if ((context->currentChar != EOF) && (charCodes[context->currentChar] == CHAR_EQ)) {
+      readChar(context);
       return makeToken(SB_ASSIGN, ln, cn);
     } else return makeToken(SB_COLON, ln, cn);
-  case CHAR_SINGLEQUOTE: return readConstChar();
+  case CHAR_SINGLEQUOTE: return readConstChar(context);
   case CHAR_LPAR:
-    ln = lineNo;
-    cn = colNo;
-    readChar();
+    ln = context->lineNo;
+    cn = context->colNo;
+    readChar(context);
 
-    if (currentChar == EOF) 
+    if (context->currentChar == EOF) 
       return makeToken(SB_LPAR, ln, cn);
 
-    switch (charCodes[currentChar]) {
+    switch (charCodes[context->currentChar]) {
     case CHAR_PERIOD:
-      readChar();
+      readChar(context);
       return makeToken(SB_LSEL, ln, cn);
     case CHAR_TIMES:
-      readChar();
-      skipComment();
-      return getToken();
+      readChar(context);
+      skipComment(context);
+      return getToken(context);
     default:
       return makeToken(SB_LPAR, ln, cn);
     }
   case CHAR_RPAR:
-    token = makeToken(SB_RPAR, lineNo, colNo);
-    readChar(); 
+    token = makeToken(SB_RPAR, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   default:
-    token = makeToken(TK_NONE, lineNo, colNo);
-    error(ERR_INVALID_SYMBOL, lineNo, colNo);
-    readChar(); 
+    token = makeToken(TK_NONE, context->lineNo, context->colNo);
+    error(context, ERR_INVALID_SYMBOL, context->lineNo, context->colNo);
+    readChar(context); 
     return token;
   }
 }
 
-Token* getValidToken(void) {
-  Token *token = getToken();
+Token* getValidToken(CompilerContext* context) {
+  Token *token = getToken(context);
   while (token->tokenType == TK_NONE) {
     free(token);
-    token = getToken();
+    token = getToken(context);
   }
   return token;
 }
@@ -278,6 +274,7 @@ void printToken(Token *token) {
   case KW_DO: printf("KW_DO\n"); break;
   case KW_FOR: printf("KW_FOR\n"); break;
   case KW_TO: printf("KW_TO\n"); break;
+  case KW_EXTERNAL: printf("KW_EXTERNAL\n"); break;
 
   case SB_SEMICOLON: printf("SB_SEMICOLON\n"); break;
   case SB_COLON: printf("SB_COLON\n"); break;
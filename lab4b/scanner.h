@@ -8,9 +8,10 @@
 #define __SCANNER_H__
 
 #include "token.h"
+#include "context.h"
 
-Token* getToken(void);
-Token* getValidToken(void);
+Token* getToken(CompilerContext* context);
+Token* getValidToken(CompilerContext* context);
 void printToken(Token *token);
 
 #endif
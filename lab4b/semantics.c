@@ -10,11 +10,8 @@
 #include "semantics.h"
 #include "error.h"
 
-extern SymTab* symtab;
-extern Token* currentToken;
-
-Object* lookupObject(char *name) {
-  Scope* scope = symtab->currentScope;
+Object* lookupObject(CompilerContext* context, char *name) {
+  Scope* scope = context->symtab->currentScope;
   Object* obj;
 
   while (scope != NULL) {
@@ -22,128 +19,201 @@ Object* lookupObject(char *name) {
     if (obj != NULL) return obj;
     scope = scope->outer;
   }
-  obj = findObject(symtab->globalObjectList, name);
+  obj = findObject(context->symtab->globalObjectList, name);
   if (obj != NULL) return obj;
   return NULL;
 }
 
-void checkFreshIdent(char *name) {
-  if (findObject(symtab->currentScope->objList, name) != NULL)
-    error(ERR_DUPLICATE_IDENT, currentToken->lineNo, currentToken->colNo);
+void checkFreshIdent(CompilerContext* context, char *name) {
+  if (findObject(context->symtab->currentScope->objList, name) != NULL)
+    error(context, ERR_DUPLICATE_IDENT, context->currentToken->lineNo, context->currentToken->colNo);
 }
 
-Object* checkDeclaredIdent(char* name) {
-  Object* obj = lookupObject(name);
-  if (obj == NULL) {
-    error(ERR_UNDECLARED_IDENT,currentToken->lineNo, currentToken->colNo);
+/* An undeclared identifier is declared as a poison object once reported,
+ * so that its other uses in the scope are not reported again. The checks
+ * of an identifier of another kind return NULL, the parser goes on with
+ * poison types in its place.
+ */
+static Object* declarePoisonObject(CompilerContext* context, char* name, enum ObjectKind kind) {
+  Object* obj;
+
+  switch (kind) {
+  case OBJ_CONSTANT:
+    obj = createConstantObject(name);
+    obj->constAttrs->value = makePoisonConstant();
+    break;
+  case OBJ_TYPE:
+    obj = createTypeObject(name);
+    obj->typeAttrs->actualType = makePoisonType();
+    break;
+  default:
+    obj = createVariableObject(name);
+    obj->varAttrs->type = makePoisonType();
+    break;
   }
+  declareObject(context->symtab, obj);
   return obj;
 }
 
-Object* checkDeclaredConstant(char* name) {
-  Object* obj = lookupObject(name);
-  if (obj == NULL)
-    error(ERR_UNDECLARED_CONSTANT,currentToken->lineNo, currentToken->colNo);
-  if (obj->kind != OBJ_CONSTANT)
-    error(ERR_INVALID_CONSTANT,currentToken->lineNo, currentToken->colNo);
-
+Object* checkDeclaredIdent(CompilerContext* context, char* name) {
+  Object* obj = lookupObject(context, name);
+  if (obj == NULL) {
+    error(context, ERR_UNDECLARED_IDENT,context->currentToken->lineNo, context->currentToken->colNo);
+    obj = declarePoisonObject(context, name, OBJ_VARIABLE);
+  }
   return obj;
 }
 
-Object* checkDeclaredType(char* name) {
-  Object* obj = lookupObject(name);
-  if (obj == NULL)
-    error(ERR_UNDECLARED_TYPE,currentToken->lineNo, currentToken->colNo);
-  if (obj->kind != OBJ_TYPE)
-    error(ERR_INVALID_TYPE,currentToken->lineNo, currentToken->colNo);
-
+Object* checkDeclaredConstant(CompilerContext* context, char* name) {
+  Object* obj = lookupObject(context, name);
+  if (obj == NULL) {
+    error(context, ERR_UNDECLARED_CONSTANT,context->currentToken->lineNo, context->currentToken->colNo);
+    return declarePoisonObject(context, name, OBJ_CONSTANT);
+  }
+  if (obj->kind != OBJ_CONSTANT) {
+    error(context, ERR_INVALID_CONSTANT,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
+  }
   return obj;
 }
 
-Object* checkDeclaredVariable(char* name) {
-  Object* obj = lookupObject(name);
-  if (obj == NULL)
-    error(ERR_UNDECLARED_VARIABLE,currentToken->lineNo, currentToken->colNo);
-  if (obj->kind != OBJ_VARIABLE)
-    error(ERR_INVALID_VARIABLE,currentToken->lineNo, currentToken->colNo);
-
+Object* checkDeclaredType(CompilerContext* context, char* name) {
+  Object* obj = lookupObject(context, name);
+  if (obj == NULL) {
+    error(context, ERR_UNDECLARED_TYPE,context->currentToken->lineNo, context->currentToken->colNo);
+    return declarePoisonObject(context, name, OBJ_TYPE);
+  }
+  if (obj->kind != OBJ_TYPE) {
+    error(context, ERR_INVALID_TYPE,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
+  }
   return obj;
 }
 
-Object* checkDeclaredFunction(char* name) {
-  Object* obj = lookupObject(name);
-  if (obj == NULL)
-    error(ERR_UNDECLARED_FUNCTION,currentToken->lineNo, currentToken->colNo);
-  if (obj->kind != OBJ_FUNCTION)
-    error(ERR_INVALID_FUNCTION,currentToken->lineNo, currentToken->colNo);
-
+Object* checkDeclaredVariable(CompilerContext* context, char* name) {
+  Object* obj = lookupObject(context, name);
+  if (obj == NULL) {
+    error(context, ERR_UNDECLARED_VARIABLE,context->currentToken->lineNo, context->currentToken->colNo);
+    return declarePoisonObject(context, name, OBJ_VARIABLE);
+  }
+  if (obj->kind != OBJ_VARIABLE) {
+    error(context, ERR_INVALID_VARIABLE,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
+  }
   return obj;
 }
 
-Object* checkDeclaredProcedure(char* name) {
-  Object* obj = lookupObject(name);
-  if (obj == NULL) 
-    error(ERR_UNDECLARED_PROCEDURE,currentToken->lineNo, currentToken->colNo);
-  if (obj->kind != OBJ_PROCEDURE)
-    error(ERR_INVALID_PROCEDURE,currentToken->lineNo, currentToken->colNo);
+Object* checkDeclaredFunction(CompilerContext* context, char* name) {
+  Object* obj = lookupObject(context, name);
+  if (obj == NULL) {
+    error(context, ERR_UNDECLARED_FUNCTION,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
+  }
+  if (obj->kind != OBJ_FUNCTION) {
+    error(context, ERR_INVALID_FUNCTION,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
+  }
+  return obj;
+}
 
+Object* checkDeclaredProcedure(CompilerContext* context, char* name) {
+  Object* obj = lookupObject(context, name);
+  if (obj == NULL) {
+    error(context, ERR_UNDECLARED_PROCEDURE,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
+  }
+  if (obj->kind != OBJ_PROCEDURE) {
+    error(context, ERR_INVALID_PROCEDURE,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
+  }
   return obj;
 }
 
-Object* checkDeclaredLValueIdent(char* name) {
-  Object* obj = lookupObject(name);
+Object* checkDeclaredLValueIdent(CompilerContext* context, char* name) {
+  Object* obj = lookupObject(context, name);
   Scope* scope;
 
-  if (obj == NULL)
-    error(ERR_UNDECLARED_IDENT,currentToken->lineNo, currentToken->colNo);
+  if (obj == NULL) {
+    error(context, ERR_UNDECLARED_IDENT,context->currentToken->lineNo, context->currentToken->colNo);
+    return declarePoisonObject(context, name, OBJ_VARIABLE);
+  }
 
   switch (obj->kind) {
   case OBJ_VARIABLE:
   case OBJ_PARAMETER:
     break;
   case OBJ_FUNCTION:
-    scope = symtab->currentScope;
+    scope = context->symtab->currentScope;
     while ((scope != NULL) && (scope != obj->funcAttrs->scope)) 
       scope = scope->outer;
 
-    if (scope == NULL)
-      error(ERR_INVALID_IDENT,currentToken->lineNo, currentToken->colNo);
+    if (scope == NULL) {
+      error(context, ERR_INVALID_IDENT,context->currentToken->lineNo, context->currentToken->colNo);
+      return NULL;
+    }
     break;
   default:
-    error(ERR_INVALID_IDENT,currentToken->lineNo, currentToken->colNo);
+    error(context, ERR_INVALID_IDENT,context->currentToken->lineNo, context->currentToken->colNo);
+    return NULL;
   }
 
   return obj;
 }
 
+void checkProgramLevel(CompilerContext* context, Object* obj) {
+  Scope* scope = (obj->kind == OBJ_FUNCTION) ? obj->funcAttrs->scope : obj->procAttrs->scope;
+
+  if (scope->outer != context->symtab->program->progAttrs->scope)
+    error(context, ERR_INVALID_EXTERNAL, context->currentToken->lineNo, context->currentToken->colNo);
+}
+
+/* Code of the scope from reaches the frame of the enclosing scope to,
+ * reading the static links of every frame on the way. A subprogram whose
+ * static link is never read needs none from its callers. Returns how
+ * many scopes were not marked yet.
+ */
+int markStaticLinks(Scope* from, Scope* to) {
+  int marked = 0;
+
+  for (; (from != NULL) && (from != to); from = from->outer) {
+    if (!from->usesStaticLink) marked ++;
+    from->usesStaticLink = 1;
+  }
+  return marked;
+}
+
+/* A poison type passes every check, its error is reported already */
+static int isPoisonType(Type* type) {
+  return (type != NULL) && (type->typeClass == TP_POISON);
+}
 
-void checkIntType(Type* type) {
-  if ((type != NULL) && (type->typeClass == TP_INT))
+void checkIntType(CompilerContext* context, Type* type) {
+  if (isPoisonType(type) || ((type != NULL) && (type->typeClass == TP_INT)))
     return;
-  else error(ERR_TYPE_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
+  else error(context, ERR_TYPE_INCONSISTENCY, context->currentToken->lineNo, context->currentToken->colNo);
 }
 
-void checkCharType(Type* type) {
-  if ((type != NULL) && (type->typeClass == TP_CHAR))
+void checkCharType(CompilerContext* context, Type* type) {
+  if (isPoisonType(type) || ((type != NULL) && (type->typeClass == TP_CHAR)))
     return;
-  else error(ERR_TYPE_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
+  else error(context, ERR_TYPE_INCONSISTENCY, context->currentToken->lineNo, context->currentToken->colNo);
 }
 
-void checkBasicType(Type* type) {
-  if ((type != NULL) && ((type->typeClass == TP_INT) || (type->typeClass == TP_CHAR)))
+void checkBasicType(CompilerContext* context, Type* type) {
+  if (isPoisonType(type) || ((type != NULL) && ((type->typeClass == TP_INT) || (type->typeClass == TP_CHAR))))
     return;
-  else error(ERR_TYPE_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
+  else error(context, ERR_TYPE_INCONSISTENCY, context->currentToken->lineNo, context->currentToken->colNo);
 }
 
-void checkArrayType(Type* type) {
-  if ((type != NULL) && (type->typeClass == TP_ARRAY))
+void checkArrayType(CompilerContext* context, Type* type) {
+  if (isPoisonType(type) || ((type != NULL) && (type->typeClass == TP_ARRAY)))
     return;
-  else error(ERR_TYPE_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
+  else error(context, ERR_TYPE_INCONSISTENCY, context->currentToken->lineNo, context->currentToken->colNo);
 }
 
-void checkTypeEquality(Type* type1, Type* type2) {
+void checkTypeEquality(CompilerContext* context, Type* type1, Type* type2) {
   if (compareType(type1, type2) == 0)
-    error(ERR_TYPE_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
+    error(context, ERR_TYPE_INCONSISTENCY, context->currentToken->lineNo, context->currentToken->colNo);
 }
 
 
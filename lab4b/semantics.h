@@ -8,20 +8,25 @@
 #define __SEMANTICS_H__
 
 #include "symtab.h"
+#include "context.h"
 
-void checkFreshIdent(char *name);
-Object* checkDeclaredIdent(char *name);
-Object* checkDeclaredConstant(char *name);
-Object* checkDeclaredType(char *name);
-Object* checkDeclaredVariable(char *name);
-Object* checkDeclaredFunction(char *name);
-Object* checkDeclaredProcedure(char *name);
-Object* checkDeclaredLValueIdent(char *name);
+Object* lookupObject(CompilerContext* context, char *name);
+void checkFreshIdent(CompilerContext* context, char *name);
+Object* checkDeclaredIdent(CompilerContext* context, char *name);
+Object* checkDeclaredConstant(CompilerContext* context, char *name);
+Object* checkDeclaredType(CompilerContext* context, char *name);
+Object* checkDeclaredVariable(CompilerContext* context, char *name);
+Object* checkDeclaredFunction(CompilerContext* context, char *name);
+Object* checkDeclaredProcedure(CompilerContext* context, char *name);
+Object* checkDeclaredLValueIdent(CompilerContext* context, char *name);
 
-void checkIntType(Type* type);
-void checkCharType(Type* type);
-void checkArrayType(Type* type);
-void checkBasicType(Type* type);
-void checkTypeEquality(Type* type1, Type* type2);
+void checkProgramLevel(CompilerContext* context, Object* obj);
+int markStaticLinks(Scope* from, Scope* to);
+
+void checkIntType(CompilerContext* context, Type* type);
+void checkCharType(CompilerContext* context, Type* type);
+void checkArrayType(CompilerContext* context, Type* type);
+void checkBasicType(CompilerContext* context, Type* type);
+void checkTypeEquality(CompilerContext* context, Type* type1, Type* type2);
 
 #endif
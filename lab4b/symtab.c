@@ -16,14 +16,6 @@ void freeScope(Scope* scope);
 void freeObjectList(ObjectNode *objList);
 void freeReferenceList(ObjectNode *objList);
 
-SymTab* symtab;
-Type* intType;
-Type* charType;
-Object* writeiProcedure;
-Object* writecProcedure;
-Object* writelnProcedure;
-Object* readiFunction;
-Object* readcFunction;
 
 /******************* Type utilities ******************************/
 
@@ -47,6 +39,12 @@ Type* makeArrayType(int arraySize, Type* elementType) {
   return type;
 }
 
+Type* makePoisonType(void) {
+  Type* type = (Type*) malloc(sizeof(Type));
+  type->typeClass = TP_POISON;
+  return type;
+}
+
 Type* duplicateType(Type* type) {
   Type* resultType = (Type*) malloc(sizeof(Type));
   resultType->typeClass = type->typeClass;
@@ -58,6 +56,8 @@ Type* duplicateType(Type* type) {
 }
 
 int compareType(Type* type1, Type* type2) {
+  // The error that made a poison type is reported already
+  if ((type1->typeClass == TP_POISON) || (type2->typeClass == TP_POISON)) return 1;
   if (type1->typeClass == type2->typeClass) {
     if (type1->typeClass == TP_ARRAY) {
       if (type1->arraySize == type2->arraySize)
@@ -71,6 +71,7 @@ void freeType(Type* type) {
   switch (type->typeClass) {
   case TP_INT:
   case TP_CHAR:
+  case TP_POISON:
     free(type);
     break;
   case TP_ARRAY:
@@ -88,6 +89,8 @@ int sizeOfType(Type* type) {
     return CHAR_SIZE;
   case TP_ARRAY:
     return (type->arraySize * sizeOfType(type->elementType));
+  case TP_POISON:
+    return INT_SIZE;
   }
   return 0;
 }
@@ -108,13 +111,20 @@ ConstantValue* makeCharConstant(char ch) {
   return value;
 }
 
+ConstantValue* makePoisonConstant(void) {
+  ConstantValue* value = (ConstantValue*) malloc(sizeof(ConstantValue));
+  value->type = TP_POISON;
+  value->intValue = 0;
+  return value;
+}
+
 ConstantValue* duplicateConstantValue(ConstantValue* v) {
   ConstantValue* value = (ConstantValue*) malloc(sizeof(ConstantValue));
   value->type = v->type;
-  if (v->type == TP_INT) 
-    value->intValue = v->intValue;
-  else
+  if (v->type == TP_CHAR) 
     value->charValue = v->charValue;
+  else
+    value->intValue = v->intValue;
   return value;
 }
 
@@ -126,10 +136,11 @@ Scope* createScope(Object* owner) {
   scope->owner = owner;
   scope->outer = NULL;
   scope->frameSize = RESERVED_WORDS;
+  scope->usesStaticLink = 0;
   return scope;
 }
 
-Object* createProgramObject(char *programName) {
+Object* createProgramObject(SymTab* symtab, char *programName) {
   Object* program = (Object*) malloc(sizeof(Object));
   strcpy(program->name, programName);
   program->kind = OBJ_PROGRAM;
@@ -177,6 +188,7 @@ Object* createFunctionObject(char *name) {
   obj->funcAttrs->paramList = NULL;
   obj->funcAttrs->paramCount = 0;
   obj->funcAttrs->codeAddress = DC_VALUE;
+  obj->funcAttrs->isExternal = 0;
   obj->funcAttrs->scope = createScope(obj);
   return obj;
 }
@@ -189,6 +201,7 @@ Object* createProcedureObject(char *name) {
   obj->procAttrs->paramList = NULL;
   obj->procAttrs->paramCount = 0;
   obj->procAttrs->codeAddress = DC_VALUE;
+  obj->procAttrs->isExternal = 0;
   obj->procAttrs->scope = createScope(obj);
   return obj;
 }
@@ -292,63 +305,84 @@ Object* findObject(ObjectNode *objList, char *name) {
 
 /******************* others ******************************/
 
-void initSymTab(void) {
+SymTab* initSymTab(void) {
+  SymTab* symtab;
   Object* param;
 
   symtab = (SymTab*) malloc(sizeof(SymTab));
   symtab->globalObjectList = NULL;
   symtab->program = NULL;
   symtab->currentScope = NULL;
+  symtab->sharesPredefined = 0;
   
-  readcFunction = createFunctionObject("READC");
-  declareObject(readcFunction);
-  readcFunction->funcAttrs->returnType = makeCharType();
+  symtab->readcFunction = createFunctionObject("READC");
+  declareObject(symtab, symtab->readcFunction);
+  symtab->readcFunction->funcAttrs->returnType = makeCharType();
 
-  readiFunction = createFunctionObject("READI");
-  declareObject(readiFunction);
-  readiFunction->funcAttrs->returnType = makeIntType();
+  symtab->readiFunction = createFunctionObject("READI");
+  declareObject(symtab, symtab->readiFunction);
+  symtab->readiFunction->funcAttrs->returnType = makeIntType();
 
 
-  writeiProcedure = createProcedureObject("WRITEI");
-  declareObject(writeiProcedure);
-  enterBlock(writeiProcedure->procAttrs->scope);
+  symtab->writeiProcedure = createProcedureObject("WRITEI");
+  declareObject(symtab, symtab->writeiProcedure);
+  enterBlock(symtab, symtab->writeiProcedure->procAttrs->scope);
     param = createParameterObject("i", PARAM_VALUE);
     param->paramAttrs->type = makeIntType();
-    declareObject(param);
-  exitBlock();
+    declareObject(symtab, param);
+  exitBlock(symtab);
 
-  writecProcedure = createProcedureObject("WRITEC");
-  declareObject(writecProcedure);
-  enterBlock(writecProcedure->procAttrs->scope);
+  symtab->writecProcedure = createProcedureObject("WRITEC");
+  declareObject(symtab, symtab->writecProcedure);
+  enterBlock(symtab, symtab->writecProcedure->procAttrs->scope);
     param = createParameterObject("ch", PARAM_VALUE);
     param->paramAttrs->type = makeCharType();
-    declareObject(param);
-  exitBlock();
+    declareObject(symtab, param);
+  exitBlock(symtab);
+
+  symtab->writelnProcedure = createProcedureObject("WRITELN");
+  declareObject(symtab, symtab->writelnProcedure);
+
+  symtab->intType = makeIntType();
+  symtab->charType = makeCharType();
+  symtab->poisonType = makePoisonType();
+  return symtab;
+}
 
-  writelnProcedure = createProcedureObject("WRITELN");
-  declareObject(writelnProcedure);
+/* A table with the predefined types and subprograms of another one. They
+ * are only read while a program is compiled, so the tables of programs
+ * compiled side by side share them. It is cleaned before predefined.
+ */
+SymTab* shareSymTab(SymTab* predefined) {
+  SymTab* symtab = (SymTab*) malloc(sizeof(SymTab));
 
-  intType = makeIntType();
-  charType = makeCharType();
+  *symtab = *predefined;
+  symtab->program = NULL;
+  symtab->currentScope = NULL;
+  symtab->sharesPredefined = 1;
+  return symtab;
 }
 
-void cleanSymTab(void) {
-  freeObject(symtab->program);
-  freeObjectList(symtab->globalObjectList);
+void cleanSymTab(SymTab* symtab) {
+  if (symtab->program != NULL) freeObject(symtab->program);
+  if (!symtab->sharesPredefined) {
+    freeObjectList(symtab->globalObjectList);
+    freeType(symtab->intType);
+    freeType(symtab->charType);
+    freeType(symtab->poisonType);
+  }
   free(symtab);
-  freeType(intType);
-  freeType(charType);
 }
 
-void enterBlock(Scope* scope) {
+void enterBlock(SymTab* symtab, Scope* scope) {
   symtab->currentScope = scope;
 }
 
-void exitBlock(void) {
+void exitBlock(SymTab* symtab) {
   symtab->currentScope = symtab->currentScope->outer;
 }
 
-void declareObject(Object* obj) {
+void declareObject(SymTab* symtab, Object* obj) {
   Object* owner;
 
   if (symtab->currentScope == NULL)  //  globalObject
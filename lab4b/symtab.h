@@ -13,7 +13,8 @@
 enum TypeClass {
   TP_INT,
   TP_CHAR,
-  TP_ARRAY
+  TP_ARRAY,
+  TP_POISON               // of an erroneous declaration or expression, matches any type
 };
 
 enum ObjectKind {
@@ -76,6 +77,7 @@ struct ProcedureAttributes_ {
 
   int paramCount;
   CodeAddress codeAddress;
+  int isExternal;         // declared EXTERNAL, defined in another unit
 };
 
 struct FunctionAttributes_ {
@@ -85,6 +87,7 @@ struct FunctionAttributes_ {
 
   int paramCount;
   CodeAddress codeAddress;
+  int isExternal;
 };
 
 struct ProgramAttributes_ {
@@ -136,6 +139,7 @@ struct Scope_ {
   Object *owner;
   struct Scope_ *outer;
   int frameSize;
+  int usesStaticLink;     // its code or the code nested in it reads the static link of its frame
 };
 
 typedef struct Scope_ Scope;
@@ -144,6 +148,17 @@ struct SymTab_ {
   Object* program;
   Scope* currentScope;
   ObjectNode *globalObjectList;
+
+  Type* intType;
+  Type* charType;
+  Type* poisonType;       // of the names an error left undeclared
+
+  Object* readiFunction;
+  Object* readcFunction;
+  Object* writeiProcedure;
+  Object* writecProcedure;
+  Object* writelnProcedure;
+  int sharesPredefined;   // the types and subprograms above belong to another table
 };
 
 typedef struct SymTab_ SymTab;
@@ -151,6 +166,7 @@ typedef struct SymTab_ SymTab;
 Type* makeIntType(void);
 Type* makeCharType(void);
 Type* makeArrayType(int arraySize, Type* elementType);
+Type* makePoisonType(void);
 Type* duplicateType(Type* type);
 int compareType(Type* type1, Type* type2);
 void freeType(Type* type);
@@ -158,11 +174,12 @@ int sizeOfType(Type* type);
 
 ConstantValue* makeIntConstant(int i);
 ConstantValue* makeCharConstant(char ch);
+ConstantValue* makePoisonConstant(void);
 ConstantValue* duplicateConstantValue(ConstantValue* v);
 
 Scope* createScope(Object* owner);
 
-Object* createProgramObject(char *programName);
+Object* createProgramObject(SymTab* symtab, char *programName);
 Object* createConstantObject(char *name);
 Object* createTypeObject(char *name);
 Object* createVariableObject(char *name);
@@ -172,10 +189,11 @@ Object* createParameterObject(char *name, enum ParamKind kind);
 
 Object* findObject(ObjectNode *objList, char *name);
 
-void initSymTab(void);
-void cleanSymTab(void);
-void enterBlock(Scope* scope);
-void exitBlock(void);
-void declareObject(Object* obj);
+SymTab* initSymTab(void);
+SymTab* shareSymTab(SymTab* predefined);
+void cleanSymTab(SymTab* symtab);
+void enterBlock(SymTab* symtab, Scope* scope);
+void exitBlock(SymTab* symtab);
+void declareObject(SymTab* symtab, Object* obj);
 
 #endif
@@ -31,7 +31,8 @@ struct {
   {"WHILE", KW_WHILE},
   {"DO", KW_DO},
   {"FOR", KW_FOR},
-  {"TO", KW_TO}
+  {"TO", KW_TO},
+  {"EXTERNAL", KW_EXTERNAL}
 };
 
 int keywordEq(char *kw, char *string) {
@@ -55,6 +56,9 @@ Token* makeToken(TokenType tokenType, int lineNo, int colNo) {
   token->tokenType = tokenType;
   token->lineNo = lineNo;
   token->colNo = colNo;
+  // A token the parser misses leaves the one before as the current token
+  token->string[0] = '\0';
+  token->value = 0;
   return token;
 }
 
@@ -86,6 +90,7 @@ char *tokenToString(TokenType tokenType) {
   case KW_DO: return "keyword DO";
   case KW_FOR: return "keyword FOR";
   case KW_TO: return "keyword TO";
+  case KW_EXTERNAL: return "keyword EXTERNAL";
 
   case SB_SEMICOLON: return "\';\'";
   case SB_COLON: return "\':\'";
@@ -0,0 +1,342 @@
+/* Verifier of the stack code */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "verifier.h"
+
+// Words written by CALL into the new frame: return value, dynamic link,
+// return address and static link
+#define FRAME_HEADER_WORDS 4
+
+#define NOT_VISITED 0
+#define IN_PROGRESS 1
+#define VISITED 2
+
+struct CallSite_ {
+  int depth;
+  int callee;
+};
+
+typedef struct CallSite_ CallSite;
+
+struct Procedure_ {
+  CodeAddress entry;
+  int exitEffect;          // 0 for EP, 1 for EF: the returned value stays on the stack
+  int maxDepth;
+  int total;
+  int state;
+
+  CallSite* calls;
+  int callCount;
+  int maxCallCount;
+};
+
+typedef struct Procedure_ Procedure;
+
+static __thread Instruction* code;
+static __thread int codeSize;
+static __thread VerifyResult* verifyResult;
+
+static __thread Procedure* procedures;
+static __thread int procedureCount;
+static __thread int maxProcedureCount;
+static __thread int* procedureIndex;    // procedure starting at each address, or -1
+
+static __thread CodeAddress* workList;
+static __thread int workCount;
+static __thread CodeAddress* scanList;
+static __thread int* marks;
+
+static int fail(VerifyError error, CodeAddress address) {
+  if (verifyResult->error == VE_NONE) {
+    verifyResult->error = error;
+    verifyResult->errorAddress = address;
+  }
+  return 0;
+}
+
+static int isValidAddress(CodeAddress address) {
+  return (address >= 0) && (address < codeSize);
+}
+
+/* Minimum depth an instruction needs and the change it makes to the depth.
+ * CALL is handled by the caller of this function.
+ */
+static int stackEffect(Instruction* inst, int* need) {
+  *need = 0;
+  switch (inst->op) {
+  case OP_LA:
+  case OP_LV:
+  case OP_LC:
+  case OP_RC:
+  case OP_RI:
+    return 1;
+  case OP_CV:
+    *need = 1;
+    return 1;
+  case OP_LI:
+  case OP_NEG:
+    *need = 1;
+    return 0;
+  case OP_INT:
+    return inst->q;
+  case OP_DCT:
+    *need = inst->q;
+    return - inst->q;
+  case OP_FJ:
+  case OP_WRC:
+  case OP_WRI:
+    *need = 1;
+    return -1;
+  case OP_ST:
+    *need = 2;
+    return -2;
+  case OP_AD:
+  case OP_SB:
+  case OP_ML:
+  case OP_DV:
+  case OP_EQ:
+  case OP_NE:
+  case OP_GT:
+  case OP_LT:
+  case OP_GE:
+  case OP_LE:
+  case OP_IX:
+  case OP_FORINIT:
+  case OP_FORSTEP:
+    *need = 2;
+    return -1;
+  default:
+    return 0;
+  }
+}
+
+/* Finds how a procedure returns by walking the code reachable from its entry
+ * without following calls. A procedure must not both EP and EF.
+ */
+static int computeExitEffect(int proc) {
+  CodeAddress entry = procedures[proc].entry;
+  CodeAddress pc;
+  int sawEP = 0;
+  int sawEF = 0;
+  int stamp = proc + 1;
+  int scanCount = 0;
+
+  scanList[scanCount ++] = entry;
+  marks[entry] = stamp;
+  while (scanCount > 0) {
+    pc = scanList[-- scanCount];
+
+#define VISIT(address) \
+    if (isValidAddress(address) && (marks[address] != stamp)) { \
+      marks[address] = stamp; \
+      scanList[scanCount ++] = (address); \
+    }
+
+    switch (code[pc].op) {
+    case OP_EP: sawEP = 1; break;
+    case OP_EF: sawEF = 1; break;
+    case OP_HL: break;
+    case OP_J: case OP_TC: VISIT(code[pc].q); break;
+    case OP_FJ: case OP_FORINIT: case OP_FORSTEP: VISIT(code[pc].q); VISIT(pc + 1); break;
+    default: VISIT(pc + 1); break;
+    }
+#undef VISIT
+  }
+
+  if (sawEP && sawEF) return fail(VE_UNBALANCED_FRAME, entry);
+  procedures[proc].exitEffect = sawEF;
+  return 1;
+}
+
+static int findProcedure(CodeAddress entry) {
+  Procedure* proc;
+
+  if (procedureIndex[entry] >= 0) return procedureIndex[entry];
+
+  if (procedureCount >= maxProcedureCount) {
+    maxProcedureCount *= 2;
+    procedures = (Procedure*) realloc(procedures, maxProcedureCount * sizeof(Procedure));
+  }
+  proc = procedures + procedureCount;
+  proc->entry = entry;
+  proc->exitEffect = 0;
+  proc->maxDepth = 0;
+  proc->total = 0;
+  proc->state = NOT_VISITED;
+  proc->calls = NULL;
+  proc->callCount = 0;
+  proc->maxCallCount = 0;
+  procedureIndex[entry] = procedureCount;
+
+  if (!computeExitEffect(procedureCount)) return -1;
+  return procedureCount ++;
+}
+
+static void addCallSite(int proc, int depth, int callee) {
+  Procedure* p = procedures + proc;
+
+  if (p->callCount >= p->maxCallCount) {
+    p->maxCallCount = (p->maxCallCount > 0) ? 2 * p->maxCallCount : 4;
+    p->calls = (CallSite*) realloc(p->calls, p->maxCallCount * sizeof(CallSite));
+  }
+  p->calls[p->callCount].depth = depth;
+  p->calls[p->callCount].callee = callee;
+  p->callCount ++;
+}
+
+static int visit(CodeAddress from, CodeAddress to, int depth, VerifyError error) {
+  int* depths = verifyResult->depths;
+
+  if (!isValidAddress(to)) return fail(error, from);
+  if (depths[to] == UNREACHABLE) {
+    depths[to] = depth;
+    workList[workCount ++] = to;
+  } else if (depths[to] != depth)
+    return fail(VE_INCONSISTENT_DEPTH, to);
+  return 1;
+}
+
+/* Abstract interpretation of one procedure body: depths are counted from
+ * the base of the procedure's frame, so every procedure starts at 0.
+ */
+static int analyseProcedure(int proc, int isProgram) {
+  int* depths = verifyResult->depths;
+  CodeAddress pc = procedures[proc].entry;
+  Instruction* inst;
+  int depth, next, need, callee;
+
+  if ((depths[pc] != UNREACHABLE) && (depths[pc] != 0))
+    return fail(VE_INCONSISTENT_DEPTH, pc);
+  depths[pc] = 0;
+
+  workCount = 0;
+  workList[workCount ++] = pc;
+  while (workCount > 0) {
+    pc = workList[-- workCount];
+    inst = code + pc;
+    depth = depths[pc];
+
+    if (((int) inst->op < OP_LA) || (inst->op > OP_CALLN)) return fail(VE_INVALID_OPCODE, pc);
+
+    switch (inst->op) {
+    case OP_HL:
+      break;
+    case OP_EP:
+    case OP_EF:
+      if (isProgram) return fail(VE_UNBALANCED_FRAME, pc);
+      break;
+    case OP_J:
+      if (!visit(pc, inst->q, depth, VE_INVALID_ADDRESS)) return 0;
+      break;
+    case OP_TC:
+      // The arguments go to the parameters of the current frame
+      if (depth < FRAME_HEADER_WORDS + inst->p) return fail(VE_STACK_UNDERFLOW, pc);
+      if (!visit(pc, inst->q, depth, VE_INVALID_ADDRESS)) return 0;
+      break;
+    case OP_CALL:
+    case OP_CALLN:
+      if (!isValidAddress(inst->q)) return fail(VE_INVALID_ADDRESS, pc);
+      callee = findProcedure(inst->q);
+      if (callee < 0) return 0;
+      addCallSite(proc, depth, callee);
+      next = depth + procedures[callee].exitEffect;
+      if (next > procedures[proc].maxDepth) procedures[proc].maxDepth = next;
+      if (!visit(pc, pc + 1, next, VE_FALL_OFF_END)) return 0;
+      break;
+    default:
+      next = depth + stackEffect(inst, &need);
+      if ((depth < need) || (next < 0)) return fail(VE_STACK_UNDERFLOW, pc);
+      if (next > procedures[proc].maxDepth) procedures[proc].maxDepth = next;
+      if ((inst->op == OP_FJ) || (inst->op == OP_FORINIT) || (inst->op == OP_FORSTEP))
+	if (!visit(pc, inst->q, next, VE_INVALID_ADDRESS)) return 0;
+      if (!visit(pc, pc + 1, next, VE_FALL_OFF_END)) return 0;
+      break;
+    }
+  }
+  return 1;
+}
+
+/* Words needed by a procedure and everything it may call,
+ * UNBOUNDED_STACK if it can reach itself.
+ */
+static int computeTotal(int proc) {
+  Procedure* p = procedures + proc;
+  int i, total;
+
+  if (p->state == VISITED) return p->total;
+  if (p->state == IN_PROGRESS) return UNBOUNDED_STACK;
+
+  p->state = IN_PROGRESS;
+  p->total = (p->maxDepth > FRAME_HEADER_WORDS) ? p->maxDepth : FRAME_HEADER_WORDS;
+  for (i = 0; i < p->callCount; i ++) {
+    total = computeTotal(p->calls[i].callee);
+    if (total == UNBOUNDED_STACK) {
+      p->total = UNBOUNDED_STACK;
+      break;
+    }
+    if (p->calls[i].depth + total > p->total)
+      p->total = p->calls[i].depth + total;
+  }
+  p->state = VISITED;
+  return p->total;
+}
+
+int verifyCode(CodeBlock* codeBlock, CodeAddress entryPoint, VerifyResult* result) {
+  int proc, i;
+
+  code = codeBlock->code;
+  codeSize = codeBlock->codeSize;
+  verifyResult = result;
+
+  result->error = VE_NONE;
+  result->errorAddress = 0;
+  result->maxStackSize = UNBOUNDED_STACK;
+  result->depths = (int*) malloc((codeSize + 1) * sizeof(int));
+  for (i = 0; i < codeSize; i ++) result->depths[i] = UNREACHABLE;
+  if (!isValidAddress(entryPoint)) return fail(VE_INVALID_ADDRESS, entryPoint);
+
+  procedureIndex = (int*) malloc(codeSize * sizeof(int));
+  marks = (int*) calloc(codeSize, sizeof(int));
+  workList = (CodeAddress*) malloc(codeSize * sizeof(CodeAddress));
+  scanList = (CodeAddress*) malloc(codeSize * sizeof(CodeAddress));
+  maxProcedureCount = 16;
+  procedureCount = 0;
+  procedures = (Procedure*) malloc(maxProcedureCount * sizeof(Procedure));
+  for (i = 0; i < codeSize; i ++) procedureIndex[i] = -1;
+
+  // Procedures are discovered through the CALLs of the ones analysed before
+  if (findProcedure(entryPoint) >= 0)
+    for (proc = 0; proc < procedureCount; proc ++)
+      if (!analyseProcedure(proc, proc == 0)) break;
+
+  if (result->error == VE_NONE)
+    result->maxStackSize = computeTotal(0);
+
+  for (i = 0; i < procedureCount; i ++)
+    free(procedures[i].calls);
+  free(procedures);
+  free(procedureIndex);
+  free(marks);
+  free(workList);
+  free(scanList);
+  return result->error == VE_NONE;
+}
+
+void freeVerifyResult(VerifyResult* result) {
+  free(result->depths);
+  result->depths = NULL;
+}
+
+char* verifyErrorToString(VerifyError error) {
+  switch (error) {
+  case VE_NONE: return "no error";
+  case VE_INVALID_OPCODE: return "invalid opcode";
+  case VE_INVALID_ADDRESS: return "jump or call target out of range";
+  case VE_FALL_OFF_END: return "execution falls off the end of the code";
+  case VE_STACK_UNDERFLOW: return "stack underflow";
+  case VE_INCONSISTENT_DEPTH: return "inconsistent stack depth";
+  case VE_UNBALANCED_FRAME: return "unbalanced frame";
+  default: return "unknown error";
+  }
+}
@@ -0,0 +1,35 @@
+/* Verifier of the stack code */
+
+#ifndef __VERIFIER_H__
+#define __VERIFIER_H__
+
+#include "instructions.h"
+
+#define UNBOUNDED_STACK -1
+#define UNREACHABLE -1
+
+typedef enum {
+  VE_NONE,
+  VE_INVALID_OPCODE,
+  VE_INVALID_ADDRESS,
+  VE_FALL_OFF_END,
+  VE_STACK_UNDERFLOW,
+  VE_INCONSISTENT_DEPTH,
+  VE_UNBALANCED_FRAME
+} VerifyError;
+
+struct VerifyResult_ {
+  VerifyError error;
+  CodeAddress errorAddress;
+
+  int* depths;            // words in the current frame before each instruction, or UNREACHABLE
+  int maxStackSize;       // words needed by the whole program, or UNBOUNDED_STACK if recursive
+};
+
+typedef struct VerifyResult_ VerifyResult;
+
+int verifyCode(CodeBlock* codeBlock, CodeAddress entryPoint, VerifyResult* result);
+void freeVerifyResult(VerifyResult* result);
+char* verifyErrorToString(VerifyError error);
+
+#endif
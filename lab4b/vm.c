@@ -0,0 +1,495 @@
+/* Stack machine of kplrun */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vm.h"
+
+#define MAX_BREAKPOINTS 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SIGNAL_STACK_SIZE 65536
+
+struct Breakpoint_ {
+  CodeAddress address;
+  Instruction original;
+};
+
+typedef struct Breakpoint_ Breakpoint;
+
+WORD* stack;
+int stackSize;
+int t;
+int b;
+CodeAddress pc;
+
+static CodeBlock* codeBlock;
+
+// The data stack lives between two PROT_NONE guard areas, so pushes need no
+// bounds check: running off either end faults and the SIGSEGV handler turns
+// the fault into PS_STACK_OVERFLOW or PS_STACK_UNDERFLOW.
+static char* stackRegion;
+static size_t stackRegionSize;
+static char* lowGuard;
+static char* highGuard;
+static size_t guardSize;
+static char* signalStack;
+static struct sigaction previousAction;
+static sigjmp_buf faultJump;
+static volatile sig_atomic_t faultState;
+
+// The stream being executed: the loaded code itself, or a patched copy of it
+// while at least one breakpoint is set. The original instructions under the
+// OP_BP patches are kept in the side table below.
+static Instruction* code;
+static Instruction* patchedCode;
+static Breakpoint breakpoints[MAX_BREAKPOINTS];
+static int breakpointCount;
+
+// Set for code accepted by the verifier: its jumps and calls stay in range,
+// so the main loop can skip the pc check
+static int verified;
+
+static size_t roundUp(size_t n, size_t unit) {
+  return ((n + unit - 1) / unit) * unit;
+}
+
+static void stackFaultHandler(int sig, siginfo_t* info, void* context) {
+  char* address = (char*) info->si_addr;
+
+  if ((address >= lowGuard) && (address < lowGuard + guardSize))
+    faultState = PS_STACK_UNDERFLOW;
+  else if ((address >= highGuard) && (address < highGuard + guardSize))
+    faultState = PS_STACK_OVERFLOW;
+  else {
+    // Not ours: let the fault happen again with the default action
+    sigaction(SIGSEGV, &previousAction, NULL);
+    return;
+  }
+  siglongjmp(faultJump, 1);
+}
+
+/* The guards must be wide enough that no single instruction can jump over
+ * them. Only INT and DCT move t by more than a few words, up and down by
+ * their operand, so the widest guard needed is the largest of these
+ * operands plus a frame header. The returns move t back into a frame
+ * already on the stack.
+ */
+static int computeGuardWords(void) {
+  int i;
+  int words = 8;
+
+  for (i = 0; i < codeBlock->codeSize; i ++)
+    if (((codeBlock->code[i].op == OP_INT) || (codeBlock->code[i].op == OP_DCT)) &&
+	(codeBlock->code[i].q + 8 > words))
+      words = codeBlock->code[i].q + 8;
+  return words;
+}
+
+static int allocateStack(int words, int hugePages) {
+  size_t pageSize = hugePages ? HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+  size_t stackBytes = roundUp(words * sizeof(WORD), pageSize);
+  char* stackStart;
+  void* mapped = MAP_FAILED;
+
+  guardSize = roundUp(computeGuardWords() * sizeof(WORD), pageSize);
+  stackRegionSize = guardSize + stackBytes + guardSize + (hugePages ? HUGE_PAGE_SIZE : 0);
+  stackRegion = mmap(NULL, stackRegionSize, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stackRegion == MAP_FAILED) return 0;
+
+  lowGuard = stackRegion;
+  if (hugePages)
+    lowGuard = (char*) roundUp((uintptr_t) stackRegion, HUGE_PAGE_SIZE);
+  stackStart = lowGuard + guardSize;
+  highGuard = stackStart + stackBytes;
+
+#ifdef MAP_HUGETLB
+  if (hugePages)
+    mapped = mmap(stackStart, stackBytes, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+#endif
+  if (mapped == MAP_FAILED) {
+    // No reserved huge pages: fall back to normal pages, transparently huge if possible
+    mapped = mmap(stackStart, stackBytes, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (mapped == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+    if (hugePages) madvise(stackStart, stackBytes, MADV_HUGEPAGE);
+#endif
+  }
+
+  stack = (WORD*) stackStart;
+  stackSize = stackBytes / sizeof(WORD);
+  return 1;
+}
+
+static int installFaultHandler(void) {
+  stack_t altStack;
+  struct sigaction action;
+
+  // The handler runs on its own stack so it works whatever state the C stack is in
+  signalStack = (char*) malloc(SIGNAL_STACK_SIZE);
+  if (signalStack == NULL) return 0;
+  altStack.ss_sp = signalStack;
+  altStack.ss_size = SIGNAL_STACK_SIZE;
+  altStack.ss_flags = 0;
+  if (sigaltstack(&altStack, NULL) != 0) return 0;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = stackFaultHandler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGSEGV, &action, &previousAction) == 0;
+}
+
+int initVM(CodeBlock* cb, CodeAddress entryPoint, int size, int hugePages) {
+  codeBlock = cb;
+  code = codeBlock->code;
+  patchedCode = NULL;
+  breakpointCount = 0;
+  verified = 0;
+
+  if (!allocateStack(size, hugePages)) return 0;
+  if (!installFaultHandler()) return 0;
+
+  t = -1;
+  b = 0;
+  pc = entryPoint;
+  return 1;
+}
+
+void cleanVM(void) {
+  sigaction(SIGSEGV, &previousAction, NULL);
+  munmap(stackRegion, stackRegionSize);
+  free(patchedCode);
+}
+
+static inline int base(int p) {
+  int currentBase = b;
+  while (p > 0) {
+    currentBase = stack[currentBase + 3];
+    p --;
+  }
+  return currentBase;
+}
+
+static inline int execute(Instruction* inst) {
+  int ch, i;
+
+  pc ++;
+  switch (inst->op) {
+  case OP_LA:
+    t ++;
+    stack[t] = base(inst->p) + inst->q;
+    break;
+  case OP_LV:
+    t ++;
+    stack[t] = stack[base(inst->p) + inst->q];
+    break;
+  case OP_LC:
+    t ++;
+    stack[t] = inst->q;
+    break;
+  case OP_LI:
+    stack[t] = stack[stack[t]];
+    break;
+  case OP_INT:
+    t += inst->q;
+    break;
+  case OP_DCT:
+    t -= inst->q;
+    break;
+  case OP_J:
+    pc = inst->q;
+    break;
+  case OP_FJ:
+    if (stack[t] == FALSE) pc = inst->q;
+    t --;
+    break;
+  case OP_HL:
+    return PS_DONE;
+  case OP_ST:
+    stack[stack[t-1]] = stack[t];
+    t -= 2;
+    break;
+  case OP_CALL:
+    stack[t+2] = b;
+    stack[t+3] = pc;
+    stack[t+4] = base(inst->p);
+    b = t + 1;
+    pc = inst->q;
+    break;
+  case OP_CALLN:
+    stack[t+2] = b;
+    stack[t+3] = pc;
+    b = t + 1;
+    pc = inst->q;
+    break;
+  // The return address is data that a stray store may overwrite, so it
+  // is checked even in verified code
+  case OP_EP:
+    t = b - 1;
+    pc = stack[b+2];
+    b = stack[b+1];
+    if ((pc < 0) || (pc >= codeBlock->codeSize)) return PS_INVALID_ADDRESS;
+    break;
+  case OP_EF:
+    t = b;
+    pc = stack[b+2];
+    b = stack[b+1];
+    if ((pc < 0) || (pc >= codeBlock->codeSize)) return PS_INVALID_ADDRESS;
+    break;
+  case OP_RC:
+    ch = getchar();
+    if (ch == EOF) return PS_IO_ERROR;
+    t ++;
+    stack[t] = ch;
+    break;
+  case OP_RI:
+    t ++;
+    if (scanf("%d", &stack[t]) != 1) return PS_IO_ERROR;
+    break;
+  case OP_WRC:
+    putchar(stack[t]);
+    t --;
+    break;
+  case OP_WRI:
+    printf("%d", stack[t]);
+    t --;
+    break;
+  case OP_WLN:
+    putchar('\n');
+    break;
+  case OP_AD:
+    t --;
+    stack[t] = stack[t] + stack[t+1];
+    break;
+  case OP_SB:
+    t --;
+    stack[t] = stack[t] - stack[t+1];
+    break;
+  case OP_ML:
+    t --;
+    stack[t] = stack[t] * stack[t+1];
+    break;
+  case OP_DV:
+    t --;
+    if (stack[t+1] == 0) return PS_DIVIDE_BY_ZERO;
+    // The quotient of the least integer by -1 wraps to itself, as in two's complement
+    if (stack[t+1] == -1) stack[t] = (WORD) (0u - (unsigned int) stack[t]);
+    else stack[t] = stack[t] / stack[t+1];
+    break;
+  case OP_NEG:
+    stack[t] = - stack[t];
+    break;
+  case OP_CV:
+    stack[t+1] = stack[t];
+    t ++;
+    break;
+  case OP_EQ:
+    t --;
+    stack[t] = (stack[t] == stack[t+1]);
+    break;
+  case OP_NE:
+    t --;
+    stack[t] = (stack[t] != stack[t+1]);
+    break;
+  case OP_GT:
+    t --;
+    stack[t] = (stack[t] > stack[t+1]);
+    break;
+  case OP_LT:
+    t --;
+    stack[t] = (stack[t] < stack[t+1]);
+    break;
+  case OP_GE:
+    t --;
+    stack[t] = (stack[t] >= stack[t+1]);
+    break;
+  case OP_LE:
+    t --;
+    stack[t] = (stack[t] <= stack[t+1]);
+    break;
+  case OP_IX:
+    t --;
+    stack[t] = stack[t] + stack[t+1] * inst->q;
+    break;
+  case OP_TC:
+    // The arguments replace the parameters, the rest of the frame is reused as is
+    for (i = 0; i < inst->p; i ++)
+      stack[b + 4 + i] = stack[t + 1 + i];
+    pc = inst->q;
+    break;
+  case OP_FORINIT:
+    if (stack[stack[t-1]] > stack[t]) pc = inst->q;
+    t --;
+    break;
+  case OP_FORSTEP:
+    stack[stack[t-1]] ++;
+    if (stack[stack[t-1]] <= stack[t]) pc = inst->q;
+    t --;
+    break;
+  case OP_BP:
+    pc --;
+    return PS_BREAKPOINT;
+  default:
+    pc --;
+    return PS_INVALID_ADDRESS;
+  }
+  return PS_ACTIVE;
+}
+
+void setVerified(int isVerified) {
+  verified = isVerified;
+}
+
+int run(void) {
+  int ps = PS_ACTIVE;
+  int codeSize = codeBlock->codeSize;
+
+  if (sigsetjmp(faultJump, 1)) return faultState;
+  if (verified) {
+    while (ps == PS_ACTIVE)
+      ps = execute(code + pc);
+  } else {
+    while (ps == PS_ACTIVE) {
+      if ((pc < 0) || (pc >= codeSize)) return PS_INVALID_ADDRESS;
+      ps = execute(code + pc);
+    }
+  }
+  return ps;
+}
+
+/* Same as run, counting the runs of every instruction in counts and the
+ * jumps of the conditional ones in taken
+ */
+int runProfiled(long* counts, long* taken) {
+  int ps = PS_ACTIVE;
+  int codeSize = codeBlock->codeSize;
+  CodeAddress at;
+
+  if (sigsetjmp(faultJump, 1)) return faultState;
+  while (ps == PS_ACTIVE) {
+    if (!verified && ((pc < 0) || (pc >= codeSize))) return PS_INVALID_ADDRESS;
+    at = pc;
+    ps = execute(code + at);
+    counts[at] ++;
+    switch (code[at].op) {
+    case OP_FJ: case OP_FORINIT: case OP_FORSTEP:
+      if ((pc == code[at].q) && (pc != at + 1)) taken[at] ++;
+      break;
+    default:
+      break;
+    }
+  }
+  return ps;
+}
+
+/* Same as run, counting the executed instructions in *count */
+int runCounted(long* count) {
+  volatile long executed = 0;
+  int ps = PS_ACTIVE;
+  int codeSize = codeBlock->codeSize;
+
+  if (sigsetjmp(faultJump, 1)) {
+    *count += executed;
+    return faultState;
+  }
+  while (ps == PS_ACTIVE) {
+    if (!verified && ((pc < 0) || (pc >= codeSize))) {
+      ps = PS_INVALID_ADDRESS;
+      break;
+    }
+    ps = execute(code + pc);
+    executed ++;
+  }
+  *count += executed;
+  return ps;
+}
+
+int step(void) {
+  if ((pc < 0) || (pc >= codeBlock->codeSize)) return PS_INVALID_ADDRESS;
+  if (sigsetjmp(faultJump, 1)) return faultState;
+  return execute(getInstruction(pc));
+}
+
+int resume(void) {
+  int ps = step();
+
+  if (ps == PS_ACTIVE) ps = run();
+  return ps;
+}
+
+/******************* Breakpoints ******************************/
+
+static int findBreakpoint(CodeAddress address) {
+  int i;
+  for (i = 0; i < breakpointCount; i ++)
+    if (breakpoints[i].address == address) return i;
+  return -1;
+}
+
+int isBreakpoint(CodeAddress address) {
+  return findBreakpoint(address) >= 0;
+}
+
+Instruction* getInstruction(CodeAddress address) {
+  int i = findBreakpoint(address);
+
+  if (i >= 0) return &(breakpoints[i].original);
+  return codeBlock->code + address;
+}
+
+int setBreakpoint(CodeAddress address) {
+  if ((address < 0) || (address >= codeBlock->codeSize)) return 0;
+  if (isBreakpoint(address)) return 1;
+  if (breakpointCount >= MAX_BREAKPOINTS) return 0;
+
+  if (patchedCode == NULL) {
+    patchedCode = (Instruction*) malloc(codeBlock->codeSize * sizeof(Instruction));
+    if (patchedCode == NULL) return 0;
+    memcpy(patchedCode, codeBlock->code, codeBlock->codeSize * sizeof(Instruction));
+    code = patchedCode;
+  }
+
+  breakpoints[breakpointCount].address = address;
+  breakpoints[breakpointCount].original = patchedCode[address];
+  breakpointCount ++;
+  patchedCode[address].op = OP_BP;
+  return 1;
+}
+
+int clearBreakpoint(CodeAddress address) {
+  int i = findBreakpoint(address);
+
+  if (i < 0) return 0;
+  patchedCode[address] = breakpoints[i].original;
+  breakpoints[i] = breakpoints[breakpointCount - 1];
+  breakpointCount --;
+
+  // Without breakpoints we go back to the unpatched stream
+  if (breakpointCount == 0) {
+    free(patchedCode);
+    patchedCode = NULL;
+    code = codeBlock->code;
+  }
+  return 1;
+}
+
+void printProgramState(int ps) {
+  switch (ps) {
+  // Runtime errors are raised after pc has moved past the faulting instruction
+  case PS_DIVIDE_BY_ZERO: printf("Divide by zero at %d!\n", pc - 1); break;
+  case PS_STACK_OVERFLOW: printf("Stack overflow at %d!\n", pc - 1); break;
+  case PS_STACK_UNDERFLOW: printf("Stack underflow at %d!\n", pc - 1); break;
+  case PS_IO_ERROR: printf("IO error at %d!\n", pc - 1); break;
+  case PS_INVALID_ADDRESS: printf("Invalid code address %d!\n", pc); break;
+  default: break;
+  }
+}
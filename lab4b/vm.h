@@ -0,0 +1,39 @@
+/* Stack machine of kplrun */
+
+#ifndef __VM_H__
+#define __VM_H__
+
+#include "instructions.h"
+
+#define DEFAULT_STACK_SIZE 65536
+
+enum ProgramState {
+  PS_INACTIVE,
+  PS_ACTIVE,
+  PS_DONE,
+  PS_BREAKPOINT,
+  PS_DIVIDE_BY_ZERO,
+  PS_STACK_OVERFLOW,
+  PS_STACK_UNDERFLOW,
+  PS_INVALID_ADDRESS,
+  PS_IO_ERROR
+};
+
+int initVM(CodeBlock* codeBlock, CodeAddress entryPoint, int stackSize, int hugePages);
+void cleanVM(void);
+void setVerified(int isVerified);
+
+int run(void);
+int runCounted(long* count);
+int runProfiled(long* counts, long* taken);
+int step(void);
+int resume(void);
+
+int setBreakpoint(CodeAddress address);
+int clearBreakpoint(CodeAddress address);
+int isBreakpoint(CodeAddress address);
+Instruction* getInstruction(CodeAddress address);
+
+void printProgramState(int ps);
+
+#endif